@@ -19,18 +19,21 @@
 #include "csv.hpp"
 #include "blocks.hpp"
 #include "hash_map.hpp"
+#include "string_pool.hpp"
+#include "block_sort.hpp"
+#include "ip6.hpp"
 
-struct ASN
+struct PackedASN
 {
-    unsigned start_ip;
-    unsigned end_ip;
     unsigned number;
-
-    std::string text;
+    unsigned text;
 };
 
-struct PackedASN
+// a line of the asn csv, whose text is an id in a ShardedStringTable.
+struct ASNRow
 {
+    unsigned start_ip;
+    unsigned end_ip;
     unsigned number;
     unsigned text;
 };
@@ -38,9 +41,10 @@ struct PackedASN
 class ASNTable
 {
   public:
-    void load(MemoryFile& file)
+    // pool is the str.pool section, if the file has one.
+    void load(MemoryFile& file, const char* pool = 0)
     {
-        file.load_mapped_string_vector(text);
+        file.load_mapped_string_vector(text, pool);
         file.load_mapped_vector(asns);
     }
 
@@ -48,114 +52,260 @@ class ASNTable
     MappedVector<PackedASN> asns;
 };
 
-class ASNParser : public Connector
+// accumulates the asn tables as the csv streams through. each asn number
+// gets one PackedASN, and each range becomes a block pointing at it.
+class ASNBuilder
 {
   public:
-    ASNParser()
-        :
-        line_(0)
+    ASNBuilder() {}
+
+    void add(unsigned start_ip,
+             unsigned end_ip,
+             unsigned number,
+             const char* text,
+             size_t n)
     {
+        Block block;
+
+        block.start_ip = start_ip;
+        block.end_ip = end_ip;
+        block.loc = add_asn(number, text, n);
+
+        blocks_.push_back(block);
+    }
+
+    // add a range whose loc is an index that add_asn returned.
+    void add(const Block &block)
+    {
+        blocks_.push_back(block);
+    }
+
+    // as add, for a v6 range.
+    void add(const Block6 &block)
+    {
+        blocks6_.push_back(block);
     }
 
-    void parse_text(char* str, unsigned &num, std::string &txt)
+    // the index of the asn with this number, added if it is new. the text
+    // of an asn is the text it was first seen with.
+    unsigned add_asn(unsigned number, const char* text, size_t n)
     {
-        scratch_ = str;
+        hash_map<unsigned, unsigned>::const_iterator iter = 
+            asn_to_idx_.find(number);
+
+        if (iter != asn_to_idx_.end())
+        {
+            return iter->second;
+        }
 
-        char* iter = &scratch_[0];
-        char* end = iter + scratch_.size();
+        unsigned idx = packed_.size();
+        asn_to_idx_[number] = idx;
 
-        char* sp = strchr(iter, ' ');
+        PackedASN pasn;
 
-        const char* tok0 = iter;
-        const char* tok1 = sp ? sp + 1 : end;
+        pasn.number = number;
+        pasn.text = text_.intern(text, n);
 
-        REL_ASSERT(strlen(tok0) > 2);
+        packed_.push_back(pasn);
 
-        num = to_u(tok0 + 2);
-        txt = tok1;
+        return idx;
     }
-    
-    void consume(const Buffer &b)
+
+    // load the asns of a database back, so that more can be added. asns
+    // keep their numbers, and there are no blocks.
+    void load(const ASNTable &table)
     {
-        ++line_;
+        load_string_table(table.text, text_);
+
+        for (size_t i = 0; i < table.asns.size(); ++i)
+        {
+            packed_.push_back(table.asns[i]);
+            asn_to_idx_[table.asns[i].number] = i;
+        }
+    }
+
+    // renumber the asns by how often a sample workload hit them, most first,
+    // and lay the text table out in the same order.
+    void reorder(const std::vector<unsigned> &sample)
+    {
+        hash_map<unsigned, size_t> hits;
+        count_hits(blocks_, sample, hits);
 
-        csv_split((const char*) b.data(), b.size(), scratch_, toks);
+        std::vector<size_t> asn_hits(packed_.size());
+        std::vector<unsigned> order(packed_.size());
 
-        if (toks.size() != 3)
+        for (size_t i = 0; i < packed_.size(); ++i)
         {
-            return;
+            hash_map<unsigned, size_t>::const_iterator iter = hits.find(i);
+
+            asn_hits[i] = iter == hits.end() ? 0 : iter->second;
+            order[i] = i;
         }
 
-        ASN asn;
+        std::stable_sort(order.begin(), order.end(), HitsGreater(asn_hits));
 
-        asn.start_ip = to_u(toks[0]);
-        asn.end_ip = to_u(toks[1]);
-        parse_text(toks[2], asn.number, asn.text);
+        StringTable text;
+        std::vector<PackedASN> packed(packed_.size());
+        std::vector<unsigned> remap(packed_.size());
 
-        emit(Buffer(&asn, sizeof(asn)));
+        for (size_t k = 0; k < order.size(); ++k)
+        {
+            const PackedASN &asn = packed_[order[k]];
+
+            packed[k].number = asn.number;
+            packed[k].text = text.intern(text_[asn.text],
+                                         text_.length(asn.text));
+
+            remap[order[k]] = k;
+        }
+
+        for (size_t i = 0; i < blocks_.size(); ++i)
+        {
+            blocks_[i].loc = remap[blocks_[i].loc];
+        }
+
+        for (size_t i = 0; i < blocks6_.size(); ++i)
+        {
+            blocks6_[i].loc = remap[blocks6_[i].loc];
+        }
+
+        for (size_t i = 0; i < packed_.size(); ++i)
+        {
+            asn_to_idx_[packed[i].number] = i;
+        }
+
+        text_.swap(text);
+        packed_.swap(packed);
+    }
+
+    // sort the ranges and resolve their overlaps, v4 and v6. returns the
+    // number of conflicting ranges.
+    size_t normalize(unsigned threads, FILE* out)
+    {
+        return normalize_blocks(blocks_, threads, "asn", out) +
+               normalize_blocks6(blocks6_);
+    }
+
+    // lay overlay blocks, which must be sorted and disjoint, over the
+    // blocks.
+    void overlay(const std::vector<Block> &over)
+    {
+        overlay_blocks(blocks_, over);
+    }
+
+    // returns the number of v4 blocks removed.
+    size_t coalesce()
+    {
+        coalesce_blocks6(blocks6_);
+
+        return coalesce_blocks(blocks_);
     }
 
+    const std::vector<Block> &blocks() const { return blocks_; }
+    const std::vector<Block6> &blocks6() const { return blocks6_; }
+    const std::vector<PackedASN> &asns() const { return packed_; }
+    const StringTable &text() const { return text_; }
+
   private:
+    DISALLOW_COPY_AND_ASSIGN(ASNBuilder);
 
-    std::string str_;
-    std::string scratch_;
-    std::vector<char*> toks;
+    hash_map<unsigned, unsigned> asn_to_idx_;
 
-    size_t line_;
+    std::vector<Block> blocks_;
+    std::vector<Block6> blocks6_;
+    std::vector<PackedASN> packed_;
+    StringTable text_;
 };
 
-// split the asn data into two tables
-// a block table and an info table
-inline void save_asns(BinaryFile &file, const std::vector<ASN> &asns)
+// turns CsvRecords into ASNRows. it only touches rows and the text table,
+// so several can run at once on chunks of one csv.
+class ASNParser : public Connector
 {
-    hash_map<unsigned, unsigned> asn_to_idx;
-    std::vector<PackedASN> packed_asns;
-
-    StringTable text;
+  public:
+    ASNParser(std::vector<ASNRow> &out, ShardedStringTable &text)
+        :
+        out_(out),
+        text_(text),
+        line_(0)
+    {
+    }
 
-    for (size_t i = 0; i < asns.size(); ++i)
+    void consume(const Buffer &b)
     {
-        const ASN &asn = asns[i];
+        ++line_;
+
+        const CsvRecord* record = (const CsvRecord*) b.data();
 
-        if (asn_to_idx.count(asn.number))
+        if (record->count != 3)
         {
-            continue;
+            return;
         }
 
-        asn_to_idx[asn.number] = packed_asns.size();
-        text.insert(asn.text);
+        const CsvField* toks = record->fields;
 
-        PackedASN pasn;
+        // the text field is "AS<number> <description>".
 
-        pasn.number = asn.number;
-        pasn.text = text.index_of(asn.text);
+        const CsvField &field = toks[2];
 
-        asn_to_idx[asn.number] = packed_asns.size();
-        packed_asns.push_back(pasn);
-    }
+        const char* iter = field.data;
+        const char* end = iter + field.size;
 
-    std::vector<Block> asn_blocks(asns.size());
+        const char* sp = (const char*) memchr(iter, ' ', field.size);
+        const char* txt = sp ? sp + 1 : end;
 
-    unsigned last = 0;
+        REL_ASSERT(field.size > 2);
 
-    for (size_t i = 0; i < asns.size(); ++i)
-    {
-        Block &block = asn_blocks[i];
-        const ASN &asn = asns[i];
+        unsigned num = to_u(iter + 2, (sp ? sp : end) - (iter + 2));
 
-        REL_ASSERT(asn.start_ip > last);
-        REL_ASSERT(asn.end_ip >= asn.start_ip);
+        ASNRow row;
 
-        block.start_ip = asn.start_ip;
-        block.end_ip = asn.end_ip;
-        block.loc = asn_to_idx[asn.number];
+        row.start_ip = to_u(toks[0]);
+        row.end_ip = to_u(toks[1]);
+        row.number = num;
+        row.text = text_.intern(txt, end - txt);
 
-        last = asn.end_ip;
+        out_.push_back(row);
     }
 
-    save_blocks(file, asn_blocks);
-    save_string_table(file, text);
-    file.save_pod_vector(packed_asns);
+  private:
+    std::vector<ASNRow> &out_;
+    ShardedStringTable &text_;
+    size_t line_;
+};
+
+inline void save_asn_blocks(BinaryFile &file,
+                            const ASNBuilder &asns,
+                            bool compress_blocks = false)
+{
+    file.begin_section("asn.blocks");
+    save_blocks(file, asns.blocks(), compress_blocks);
+}
+
+// v6 blocks are always saved as raw columns.
+inline void save_asn_blocks6(BinaryFile &file, const ASNBuilder &asns)
+{
+    file.begin_section("asn6.blocks");
+    save_blocks6(file, asns.blocks6());
+}
+
+// with a pool, the text table is saved as refs into it.
+inline void save_asn_data(BinaryFile &file,
+                          const ASNBuilder &asns,
+                          const StringPool* pool = 0)
+{
+    file.begin_section("asn.data");
+    save_strings(file, asns.text(), pool);
+    file.save_pod_vector(asns.asns());
+}
+
+// split the asn data into two tables
+// a block table and an info table
+inline void save_asns(BinaryFile &file,
+                      const ASNBuilder &asns,
+                      bool compress_blocks = false)
+{
+    save_asn_blocks(file, asns, compress_blocks);
+    save_asn_data(file, asns);
 }
 
 #endif
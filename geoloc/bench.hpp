@@ -0,0 +1,195 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module benchmarks a database against a sample workload, for
+ * geoloc --bench.
+ *
+ * Besides timing lookups, it replays the payload accesses of each result
+ * (the location record, its strings, the asn record and text) through a
+ * model of a set associative LRU cache. The miss counts show how well a
+ * layout keeps the hot payloads together, which is what --profile is for,
+ * and unlike hardware counters they are the same on every machine.
+*/
+
+#ifndef BENCH_HPP_7F3A2C51
+#define BENCH_HPP_7F3A2C51
+
+#include "query.hpp"
+
+#include <set>
+#include <stdint.h>
+
+class CacheModel
+{
+  public:
+    CacheModel(size_t bytes, size_t ways)
+        :
+        ways_(ways),
+        sets_(bytes / (64 * ways)),
+        tags_(sets_ * ways, 0),
+        accesses_(0),
+        misses_(0)
+    {
+    }
+
+    void touch(const void* p)
+    {
+        uint64_t line = ((uintptr_t) p >> 6) + 1;
+        uint64_t* set = &tags_[(line % sets_) * ways_];
+
+        accesses_++;
+
+        // the set is kept most recently used first.
+
+        size_t i = 0;
+
+        while (i < ways_ && set[i] != line)
+        {
+            ++i;
+        }
+
+        if (i == ways_)
+        {
+            misses_++;
+            i = ways_ - 1;
+        }
+
+        memmove(set + 1, set, i * sizeof(uint64_t));
+        set[0] = line;
+    }
+
+    size_t accesses() const { return accesses_; }
+    size_t misses() const { return misses_; }
+
+  private:
+    size_t ways_;
+    size_t sets_;
+
+    std::vector<uint64_t> tags_;
+
+    size_t accesses_;
+    size_t misses_;
+};
+
+class PayloadTrace
+{
+  public:
+    PayloadTrace()
+        :
+        l1_(32 << 10, 8),
+        l2_(256 << 10, 8),
+        lines_(),
+        pages_()
+    {
+    }
+
+    void touch(const void* p)
+    {
+        if (!p)
+        {
+            return;
+        }
+
+        l1_.touch(p);
+        l2_.touch(p);
+
+        lines_.insert((uintptr_t) p >> 6);
+        pages_.insert((uintptr_t) p >> 12);
+    }
+
+    void report(FILE* out, const char* name, const CacheModel &model) const
+    {
+        fprintf(out, "%-18s %10zu misses %6.2f%%\n", name, model.misses(),
+                100.0 * model.misses() / std::max(model.accesses(),
+                                                  (size_t) 1));
+    }
+
+    void report(FILE* out) const
+    {
+        fprintf(out, "payload accesses   %10zu\n", l1_.accesses());
+
+        report(out, "32KB 8 way model", l1_);
+        report(out, "256KB 8 way model", l2_);
+
+        fprintf(out, "lines touched      %10zu\n", lines_.size());
+        fprintf(out, "pages touched      %10zu\n", pages_.size());
+    }
+
+  private:
+    CacheModel l1_;
+    CacheModel l2_;
+
+    std::set<uintptr_t> lines_;
+    std::set<uintptr_t> pages_;
+};
+
+inline void bench(const char* data_file_name,
+                  const char* sample_file_name,
+                  const QueryOptions &options)
+{
+    LOG_CONTEXT("bench %s with %s", data_file_name, sample_file_name);
+
+    GeoData data;
+    open_data(data, data_file_name, options);
+
+    std::vector<unsigned> sample;
+
+    if (!read_quads(sample_file_name, sample))
+    {
+        FATAL_ERROR("could not read %s", sample_file_name);
+    }
+
+    // timed pass.
+
+    double start = now_msec();
+    size_t found = 0;
+
+    for (size_t i = 0; i < sample.size(); ++i)
+    {
+        IPResult result;
+        data.query(sample[i], result);
+
+        found += result.country != 0;
+    }
+
+    double msec = now_msec() - start;
+
+    // traced pass.
+
+    PayloadTrace trace;
+
+    for (size_t i = 0; i < sample.size(); ++i)
+    {
+        unsigned loc_idx;
+        unsigned asn_idx;
+
+        data.lookup(sample[i], loc_idx, asn_idx);
+
+        IPResult result;
+        data.resolve(sample[i], loc_idx, asn_idx, result);
+
+        if (loc_idx != -1U)
+        {
+            trace.touch(data.location_record(loc_idx));
+        }
+
+        trace.touch(result.country);
+        trace.touch(result.region);
+        trace.touch(result.city);
+        trace.touch(result.asn);
+        trace.touch(result.asn_text);
+    }
+
+    printf("bench %s with %zu ips, %zu found\n", data_file_name,
+           sample.size(), found);
+    printf("query              %10.1f ns/ip\n",
+           msec * 1e6 / std::max(sample.size(), (size_t) 1));
+
+    trace.report(stdout);
+}
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module bit packs groups of 128 unsigned values, for the compressed
+ * block tables.
+ *
+ * The layout is the 4 lane "vertical" one used by simdcomp. Value i lives in
+ * lane i % 4, and each lane packs its 32 values back to back into 32 bit
+ * words. Word k of the four lanes is stored together, so one 128 bit load
+ * feeds all four lanes, and SSE2 can unpack a whole group with shifts and
+ * masks. A group of width bits takes exactly bits * 16 bytes.
+ *
+ * Sorted columns are stored as deltas against the value four places back, so
+ * that decoding is a per lane running sum.
+*/
+
+#ifndef BITPACK_HPP_6E0D24A1
+#define BITPACK_HPP_6E0D24A1
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define PACK_GROUP 128U
+
+// number of bits needed to hold x.
+inline unsigned bit_width(unsigned x)
+{
+    return x ? 32 - __builtin_clz(x) : 0;
+}
+
+inline unsigned bit_mask(unsigned bits)
+{
+    return bits == 32 ? 0xFFFFFFFFU : (1U << bits) - 1;
+}
+
+// pack 128 values of the given width into out, which must hold bits * 4
+// zeroed words.
+inline void pack128(const unsigned* in, unsigned bits, unsigned* out)
+{
+    if (bits == 0)
+    {
+        return;
+    }
+
+    for (unsigned i = 0; i < PACK_GROUP; ++i)
+    {
+        unsigned lane = i & 3;
+        unsigned pos = (i >> 2) * bits;
+        unsigned word = pos >> 5;
+        unsigned shift = pos & 31;
+
+        out[word * 4 + lane] |= in[i] << shift;
+
+        if (shift + bits > 32)
+        {
+            out[(word + 1) * 4 + lane] |= in[i] >> (32 - shift);
+        }
+    }
+}
+
+// fetch a single value, without unpacking the group.
+inline unsigned extract128(const unsigned* in, unsigned bits, unsigned i)
+{
+    if (bits == 0)
+    {
+        return 0;
+    }
+
+    unsigned lane = i & 3;
+    unsigned pos = (i >> 2) * bits;
+    unsigned word = pos >> 5;
+    unsigned shift = pos & 31;
+
+    unsigned v = in[word * 4 + lane] >> shift;
+
+    if (shift + bits > 32)
+    {
+        v |= in[(word + 1) * 4 + lane] << (32 - shift);
+    }
+
+    return v & bit_mask(bits);
+}
+
+// turn a sorted group into deltas against the value four places back. the
+// first four are against base.
+inline void delta128(const unsigned* in, unsigned base, unsigned* out)
+{
+    for (unsigned i = 0; i < PACK_GROUP; ++i)
+    {
+        out[i] = in[i] - (i < 4 ? base : in[i - 4]);
+    }
+}
+
+#ifdef __SSE2__
+
+// unpack a group packed with delta128, adding the running sum back in.
+inline void unpack_delta128(const unsigned* in,
+                            unsigned bits,
+                            unsigned base,
+                            unsigned* out)
+{
+    __m128i acc = _mm_set1_epi32(base);
+    __m128i* dst = (__m128i*) out;
+
+    if (bits == 0)
+    {
+        for (unsigned j = 0; j < PACK_GROUP / 4; ++j)
+        {
+            _mm_storeu_si128(dst + j, acc);
+        }
+
+        return;
+    }
+
+    const __m128i* src = (const __m128i*) in;
+    const __m128i mask = _mm_set1_epi32(bit_mask(bits));
+
+    __m128i cur = _mm_loadu_si128(src++);
+    unsigned shift = 0;
+
+    for (unsigned j = 0; j < PACK_GROUP / 4; ++j)
+    {
+        __m128i v = _mm_srl_epi32(cur, _mm_cvtsi32_si128(shift));
+
+        shift += bits;
+
+        if (shift > 32)
+        {
+            shift -= 32;
+            cur = _mm_loadu_si128(src++);
+            v = _mm_or_si128(v, _mm_sll_epi32(cur,
+                                 _mm_cvtsi32_si128(bits - shift)));
+        }
+        else if (shift == 32 && j + 1 != PACK_GROUP / 4)
+        {
+            shift = 0;
+            cur = _mm_loadu_si128(src++);
+        }
+
+        acc = _mm_add_epi32(acc, _mm_and_si128(v, mask));
+        _mm_storeu_si128(dst + j, acc);
+    }
+}
+
+// count the values of a group that are <= x.
+inline unsigned count_le128(const unsigned* in, unsigned x)
+{
+    // sse2 only has signed compares, so flip the sign bits first.
+
+    const __m128i flip = _mm_set1_epi32(0x80000000);
+    const __m128i key = _mm_xor_si128(_mm_set1_epi32(x), flip);
+    const __m128i* src = (const __m128i*) in;
+
+    unsigned gt = 0;
+
+    for (unsigned j = 0; j < PACK_GROUP / 4; ++j)
+    {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128(src + j), flip);
+        __m128i cmp = _mm_cmpgt_epi32(v, key);
+
+        gt += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(cmp)));
+    }
+
+    return PACK_GROUP - gt;
+}
+
+#else
+
+inline void unpack_delta128(const unsigned* in,
+                            unsigned bits,
+                            unsigned base,
+                            unsigned* out)
+{
+    for (unsigned i = 0; i < PACK_GROUP; ++i)
+    {
+        unsigned prev = i < 4 ? base : out[i - 4];
+        out[i] = prev + extract128(in, bits, i);
+    }
+}
+
+inline unsigned count_le128(const unsigned* in, unsigned x)
+{
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < PACK_GROUP; ++i)
+    {
+        n += in[i] <= x;
+    }
+
+    return n;
+}
+
+#endif
+
+#endif
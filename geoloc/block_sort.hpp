@@ -0,0 +1,411 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module puts the ranges of a source in the order the block tables
+ * need, so that merged or hand made csvs can be imported without sorting
+ * them first.
+ *
+ * Ranges that are already sorted and disjoint, as in the MaxMind csvs, are
+ * left alone after one check. Otherwise they are radix sorted on start_ip,
+ * a byte at a time, with each pass split over several threads, then swept
+ * once to resolve overlaps.
+ *
+ * Where ranges overlap, the narrower one wins, as with a longest prefix
+ * match, and of two equally wide ones the later in the source wins. The
+ * losing range keeps whatever is left of it on either side.
+ *
+ * The same sweep lays an overlay (--overlay) over a table, with the overlay
+ * outranking the table everywhere.
+*/
+
+#ifndef BLOCK_SORT_HPP_E19C47A2
+#define BLOCK_SORT_HPP_E19C47A2
+
+#include "blocks.hpp"
+#include "thread.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <queue>
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1U << RADIX_BITS)
+
+// below this many ranges a sort is not worth splitting.
+#define MIN_PARALLEL_SORT (1U << 16)
+
+// a range, with its rank (overlay ranges outrank the source) and its
+// position in the source for breaking ties.
+struct RankedBlock
+{
+    Block block;
+    unsigned rank;
+    unsigned seq;
+};
+
+// true when the range a should lose to the range b.
+struct BlockPriorityLess
+{
+    bool operator()(const RankedBlock &a, const RankedBlock &b) const
+    {
+        if (a.rank != b.rank)
+        {
+            return a.rank < b.rank;
+        }
+
+        unsigned wa = a.block.end_ip - a.block.start_ip;
+        unsigned wb = b.block.end_ip - b.block.start_ip;
+
+        if (wa != wb)
+        {
+            return wa > wb;
+        }
+
+        return a.seq < b.seq;
+    }
+};
+
+// one thread's share of a radix pass. it first counts the digits of its
+// slice, then, once the counts have been turned into offsets, scatters the
+// slice to them. slices are in order, so the sort is stable.
+class RadixTask : public Thread
+{
+  public:
+    RadixTask(const RankedBlock* begin, const RankedBlock* end)
+        :
+        begin_(begin),
+        end_(end),
+        shift_(0),
+        out_(0)
+    {
+    }
+
+    void count(unsigned shift)
+    {
+        shift_ = shift;
+        out_ = 0;
+
+        start();
+    }
+
+    void scatter(RankedBlock* out)
+    {
+        out_ = out;
+
+        start();
+    }
+
+    // digit counts after count, the next output offset of each digit
+    // before scatter.
+    size_t counts[RADIX_BUCKETS];
+
+  protected:
+    void run()
+    {
+        if (!out_)
+        {
+            memset(counts, 0, sizeof(counts));
+
+            for (const RankedBlock* p = begin_; p != end_; ++p)
+            {
+                counts[digit(*p)]++;
+            }
+
+            return;
+        }
+
+        for (const RankedBlock* p = begin_; p != end_; ++p)
+        {
+            out_[counts[digit(*p)]++] = *p;
+        }
+    }
+
+  private:
+    unsigned digit(const RankedBlock &b) const
+    {
+        return (b.block.start_ip >> shift_) & (RADIX_BUCKETS - 1);
+    }
+
+    const RankedBlock* begin_;
+    const RankedBlock* end_;
+
+    unsigned shift_;
+    RankedBlock* out_;
+};
+
+// stable sort by start_ip.
+inline void radix_sort_blocks(std::vector<RankedBlock> &v, unsigned threads)
+{
+    if (v.size() < 2)
+    {
+        return;
+    }
+
+    if (v.size() < MIN_PARALLEL_SORT)
+    {
+        threads = 1;
+    }
+
+    threads = std::max(threads, 1U);
+
+    std::vector<RankedBlock> scratch(v.size());
+    std::vector<RadixTask*> tasks;
+
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        tasks.push_back(new RadixTask(&v[0] + v.size() * t / threads,
+                                      &v[0] + v.size() * (t + 1) / threads));
+    }
+
+    for (unsigned shift = 0; shift < 32; shift += RADIX_BITS)
+    {
+        for (unsigned t = 0; t < threads; ++t)
+        {
+            tasks[t]->count(shift);
+        }
+
+        for (unsigned t = 0; t < threads; ++t)
+        {
+            tasks[t]->join();
+        }
+
+        // a digit that every range shares leaves the order as it is.
+
+        bool trivial = false;
+
+        for (unsigned d = 0; d < RADIX_BUCKETS && !trivial; ++d)
+        {
+            size_t n = 0;
+
+            for (unsigned t = 0; t < threads; ++t)
+            {
+                n += tasks[t]->counts[d];
+            }
+
+            trivial = n == v.size();
+        }
+
+        if (trivial)
+        {
+            continue;
+        }
+
+        size_t offset = 0;
+
+        for (unsigned d = 0; d < RADIX_BUCKETS; ++d)
+        {
+            for (unsigned t = 0; t < threads; ++t)
+            {
+                size_t n = tasks[t]->counts[d];
+
+                tasks[t]->counts[d] = offset;
+                offset += n;
+            }
+        }
+
+        for (unsigned t = 0; t < threads; ++t)
+        {
+            tasks[t]->scatter(&scratch[0]);
+        }
+
+        for (unsigned t = 0; t < threads; ++t)
+        {
+            tasks[t]->join();
+        }
+
+        // the tasks read from v, so the result is copied back rather than
+        // swapped.
+
+        std::copy(scratch.begin(), scratch.end(), v.begin());
+    }
+
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        delete tasks[t];
+    }
+}
+
+// sweep sorted ranges into disjoint blocks. at each point, the highest
+// priority range that covers it wins.
+inline void resolve_overlaps(const std::vector<RankedBlock> &in,
+                             std::vector<Block> &out)
+{
+    std::priority_queue<RankedBlock,
+                        std::vector<RankedBlock>,
+                        BlockPriorityLess> active;
+
+    out.clear();
+
+    size_t i = 0;
+    uint64_t pos = 0;
+    unsigned last_seq = 0;
+
+    while (i < in.size() || !active.empty())
+    {
+        if (active.empty())
+        {
+            pos = in[i].block.start_ip;
+        }
+
+        while (i < in.size() && in[i].block.start_ip <= pos)
+        {
+            active.push(in[i++]);
+        }
+
+        // ranges that have ended are dropped once they reach the top.
+
+        while (!active.empty() && active.top().block.end_ip < pos)
+        {
+            active.pop();
+        }
+
+        if (active.empty())
+        {
+            continue;
+        }
+
+        const RankedBlock &top = active.top();
+        uint64_t next = (uint64_t) top.block.end_ip + 1;
+
+        if (i < in.size() && in[i].block.start_ip < next)
+        {
+            next = in[i].block.start_ip;
+        }
+
+        // a range that a narrower one interrupted comes back as a new block.
+
+        if (!out.empty() && last_seq == top.seq &&
+            (uint64_t) out.back().end_ip + 1 == pos)
+        {
+            out.back().end_ip = next - 1;
+        }
+        else
+        {
+            Block block = top.block;
+
+            block.start_ip = pos;
+            block.end_ip = next - 1;
+
+            out.push_back(block);
+            last_seq = top.seq;
+        }
+
+        pos = next;
+    }
+}
+
+// sort the blocks and resolve their overlaps. returns the number of ranges
+// that overlapped an earlier one, or ended before they started, and prints
+// the first few to out, if there is one. ranges that end before they start
+// are dropped.
+inline size_t normalize_blocks(std::vector<Block> &v,
+                               unsigned threads,
+                               const char* table,
+                               FILE* out)
+{
+    if (blocks_ordered(v))
+    {
+        return 0;
+    }
+
+    LOG_CONTEXT("normalize_blocks %s, %zu ranges", table, v.size());
+
+    std::vector<RankedBlock> ranked;
+    ranked.reserve(v.size());
+
+    size_t conflicts = 0;
+
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        if (v[i].end_ip < v[i].start_ip)
+        {
+            if (out && conflicts < 10)
+            {
+                fprintf(out, "%s range %u-%u ends before it starts\n",
+                        table, v[i].start_ip, v[i].end_ip);
+            }
+
+            conflicts++;
+            continue;
+        }
+
+        RankedBlock r;
+
+        r.block = v[i];
+        r.rank = 0;
+        r.seq = i;
+
+        ranked.push_back(r);
+    }
+
+    radix_sort_blocks(ranked, threads);
+
+    // count the ranges that start inside the span of those before them.
+
+    const RankedBlock* widest = 0;
+
+    for (size_t i = 0; i < ranked.size(); ++i)
+    {
+        const Block &b = ranked[i].block;
+
+        if (widest && b.start_ip <= widest->block.end_ip)
+        {
+            if (out && conflicts < 10)
+            {
+                fprintf(out, "%s ranges %u-%u and %u-%u overlap\n", table,
+                        widest->block.start_ip, widest->block.end_ip,
+                        b.start_ip, b.end_ip);
+            }
+
+            conflicts++;
+        }
+
+        if (!widest || b.end_ip > widest->block.end_ip)
+        {
+            widest = &ranked[i];
+        }
+    }
+
+    resolve_overlaps(ranked, v);
+
+    return conflicts;
+}
+
+// lay an overlay over the blocks v. both must be sorted and disjoint. the
+// overlay wins wherever they overlap, however wide its ranges are.
+inline void overlay_blocks(std::vector<Block> &v,
+                           const std::vector<Block> &overlay)
+{
+    if (overlay.empty())
+    {
+        return;
+    }
+
+    std::vector<RankedBlock> ranked;
+    ranked.reserve(v.size() + overlay.size());
+
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < v.size() || j < overlay.size())
+    {
+        bool over = j < overlay.size() &&
+                    (i == v.size() || overlay[j].start_ip < v[i].start_ip);
+
+        RankedBlock r;
+
+        r.block = over ? overlay[j++] : v[i++];
+        r.rank = over;
+        r.seq = ranked.size();
+
+        ranked.push_back(r);
+    }
+
+    resolve_overlaps(ranked, v);
+}
+
+#endif
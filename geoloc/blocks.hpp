@@ -18,6 +18,10 @@
 #include "serialization.hpp"
 #include "connector.hpp"
 #include "csv.hpp"
+#include "bitpack.hpp"
+#include "hash_map.hpp"
+
+#include <algorithm>
 
 struct Block
 {
@@ -26,65 +30,461 @@ struct Block
     unsigned loc;
 };
 
+// the header of one group of PACK_GROUP blocks in a compressed table. the
+// group's start_ip, length and loc columns are packed back to back from
+// words, start_ip as deltas from the group base, the others relative to
+// their minimum.
+struct BlockGroup
+{
+    unsigned words;
+    unsigned len_base;
+    unsigned loc_base;
+
+    unsigned char start_bits;
+    unsigned char len_bits;
+    unsigned char loc_bits;
+    unsigned char pad;
+};
+
+// a block table is stored either as three raw columns, or compressed into
+// groups with a skip index of group bases (ZBLK).
 class BlockTable
 {
   public:
+    BlockTable()
+        :
+        compressed_(false),
+        count_(0)
+    {
+    }
+
     void load(MemoryFile& file)
     {
         LOG_CONTEXT("BlockTable load");
 
+        const char* type = file.peek_type();
+
+        if (type && memcmp(type, "ZBLK", 4) == 0)
+        {
+            file.load_type();
+
+            compressed_ = true;
+            count_ = *file.load_unsigned();
+
+            file.load_mapped_vector(bases);
+            file.load_mapped_vector(groups);
+            file.load_mapped_vector(words);
+
+            return;
+        }
+
         file.load_mapped_vector(start_ip);
         file.load_mapped_vector(end_ip);
         file.load_mapped_vector(loc);
+
+        count_ = start_ip.size();
+    }
+
+    size_t size() const
+    {
+        return count_;
+    }
+
+    bool compressed() const
+    {
+        return compressed_;
+    }
+
+    // index of the block holding quad, or -1.
+    unsigned find(unsigned quad) const
+    {
+        if (compressed_)
+        {
+            return find_compressed(quad);
+        }
+
+        // find first pos compares gt quad
+        
+        const unsigned* iter = 
+            std::upper_bound(start_ip.begin(),
+                             start_ip.end(),
+                             quad);
+
+        if (iter == start_ip.begin())
+        {
+            return -1;
+        }
+
+        unsigned idx = iter - start_ip.begin();
+        unsigned ri = idx - 1;
+
+        if (quad >= start_ip[ri] &&
+            quad <= end_ip[ri])
+        {
+            return ri;
+        }
+
+        return -1;
+    }
+
+    // index of the first block that ends at or after quad, size() if there
+    // is none. a range query scans on from there.
+    size_t lower_bound(unsigned quad) const
+    {
+        if (!compressed_)
+        {
+            size_t i = std::upper_bound(start_ip.begin(), start_ip.end(),
+                                        quad) - start_ip.begin();
+
+            return i && end_ip[i - 1] >= quad ? i - 1 : i;
+        }
+
+        size_t g = std::upper_bound(bases.begin(), bases.end(), quad) -
+                   bases.begin();
+
+        if (g == 0)
+        {
+            return 0;
+        }
+
+        Block buf[PACK_GROUP];
+        size_t first = (g - 1) * PACK_GROUP;
+        size_t n = decode_group(g - 1, buf);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (buf[i].end_ip >= quad)
+            {
+                return first + i;
+            }
+        }
+
+        return first + n;
+    }
+
+    unsigned payload(size_t i) const
+    {
+        if (!compressed_)
+        {
+            return loc[i];
+        }
+
+        const BlockGroup &group = groups[i / PACK_GROUP];
+        const unsigned* data = &words[group.words] +
+                               (group.start_bits + group.len_bits) * 4;
+
+        return group.loc_base + 
+               extract128(data, group.loc_bits, i % PACK_GROUP);
+    }
+
+    // decode the blocks of group g (PACK_GROUP blocks per group) into out,
+    // returning how many there are.
+    size_t decode_group(size_t g, Block* out) const
+    {
+        size_t first = g * PACK_GROUP;
+        size_t n = std::min((size_t) PACK_GROUP, count_ - first);
+
+        if (!compressed_)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                out[i].start_ip = start_ip[first + i];
+                out[i].end_ip = end_ip[first + i];
+                out[i].loc = loc[first + i];
+            }
+
+            return n;
+        }
+
+        const BlockGroup &group = groups[g];
+        const unsigned* data = &words[group.words];
+
+        unsigned starts[PACK_GROUP];
+        unpack_delta128(data, group.start_bits, bases[g], starts);
+
+        const unsigned* lens = data + group.start_bits * 4;
+        const unsigned* locs = lens + group.len_bits * 4;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            out[i].start_ip = starts[i];
+            out[i].end_ip = starts[i] + group.len_base +
+                            extract128(lens, group.len_bits, i);
+            out[i].loc = group.loc_base +
+                         extract128(locs, group.loc_bits, i);
+        }
+
+        return n;
+    }
+
+    size_t group_count() const
+    {
+        return (count_ + PACK_GROUP - 1) / PACK_GROUP;
     }
 
     MappedVector<unsigned> start_ip; 
     MappedVector<unsigned> end_ip; 
     MappedVector<unsigned> loc; 
 
+    MappedVector<unsigned> bases;
+    MappedVector<BlockGroup> groups;
+    MappedVector<unsigned> words;
+
     // default copy/assign is fine
+
+  private:
+    unsigned find_compressed(unsigned quad) const
+    {
+        // the skip index picks the group, then the group is unpacked and
+        // searched whole.
+
+        const unsigned* iter = 
+            std::upper_bound(bases.begin(), bases.end(), quad);
+
+        if (iter == bases.begin())
+        {
+            return -1;
+        }
+
+        size_t g = iter - bases.begin() - 1;
+        size_t first = g * PACK_GROUP;
+        size_t n = std::min((size_t) PACK_GROUP, count_ - first);
+
+        const BlockGroup &group = groups[g];
+        const unsigned* data = &words[group.words];
+
+        unsigned starts[PACK_GROUP];
+        unpack_delta128(data, group.start_bits, *(iter - 1), starts);
+
+        // the padding at the end of the last group must never count.
+
+        for (size_t i = n; i < PACK_GROUP; ++i)
+        {
+            starts[i] = 0xFFFFFFFF;
+        }
+
+        unsigned pos = std::min((size_t) count_le128(starts, quad), n);
+        unsigned ri = pos - 1;
+
+        const unsigned* lens = data + group.start_bits * 4;
+        unsigned end = starts[ri] + group.len_base +
+                       extract128(lens, group.len_bits, ri);
+
+        if (quad <= end)
+        {
+            return first + ri;
+        }
+
+        return -1;
+    }
+
+    bool compressed_;
+    size_t count_;
 };
 
+// walks a block table in order, a group at a time, from block first on.
+class BlockIterator
+{
+  public:
+    explicit BlockIterator(const BlockTable &table, size_t first = 0)
+        :
+        table_(table),
+        group_(first / PACK_GROUP),
+        pos_(0),
+        n_(0),
+        skip_(first % PACK_GROUP)
+    {
+    }
+
+    bool next(Block &out)
+    {
+        if (pos_ == n_)
+        {
+            if (group_ >= table_.group_count())
+            {
+                return false;
+            }
+
+            n_ = table_.decode_group(group_++, buf_);
+            pos_ = skip_;
+            skip_ = 0;
+
+            if (pos_ >= n_)
+            {
+                return false;
+            }
+        }
+
+        out = buf_[pos_++];
+        return true;
+    }
+
+  private:
+    const BlockTable &table_;
+
+    size_t group_;
+    size_t pos_;
+    size_t n_;
+    size_t skip_;
+
+    Block buf_[PACK_GROUP];
+};
+
+// turns CsvRecords into Blocks, appended to out.
 class BlockParser : public Connector
 {
   public:
-    BlockParser()
+    // skip is the number of header lines, which only the first chunk of a
+    // split file has.
+    explicit BlockParser(std::vector<Block> &out, size_t skip = 2)
         :
-        scratch_(),
-        toks_(),
-        line_(0)
+        out_(out),
+        line_(0),
+        skip_(skip)
     {
     }
     
     void consume(const Buffer &b)
     {
         line_++;
-        if (line_ < 3) return;
+        if (line_ <= skip_) return;
 
-        csv_split((const char*) b.data(), b.size(), scratch_, toks_);
+        const CsvRecord* record = (const CsvRecord*) b.data();
 
-        if (toks_.size() != 3)
+        if (record->count != 3)
         {
             // we just silently drop bad lines
             return;
         }
 
+        const CsvField* toks = record->fields;
+
         Block block;
 
-        block.start_ip = to_u(toks_[0]);
-        block.end_ip = to_u(toks_[1]);
-        block.loc = to_u(toks_[2]);
+        block.start_ip = to_u(toks[0]);
+        block.end_ip = to_u(toks[1]);
+        block.loc = to_u(toks[2]);
 
-        emit(Buffer(&block, sizeof(block)));
+        out_.push_back(block);
     }
 
-    std::string scratch_;
-    std::vector<char*> toks_;
+  private:
+    std::vector<Block> &out_;
 
     size_t line_;
+    size_t skip_;
+};
+
+// index of the block of a sorted vector holding quad, or -1.
+inline size_t find_block(const std::vector<Block> &v, unsigned quad)
+{
+    size_t lo = 0;
+    size_t hi = v.size();
+
+    // find the first block that starts after quad.
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (v[mid].start_ip <= quad)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0 || v[lo - 1].end_ip < quad)
+    {
+        return -1;
+    }
+
+    return lo - 1;
+}
+
+// count how often the quads of a sample land on each payload.
+inline void count_hits(const std::vector<Block> &v,
+                       const std::vector<unsigned> &sample,
+                       hash_map<unsigned, size_t> &hits)
+{
+    for (size_t i = 0; i < sample.size(); ++i)
+    {
+        size_t idx = find_block(v, sample[i]);
+
+        if (idx != (size_t) -1)
+        {
+            hits[v[idx].loc]++;
+        }
+    }
+}
+
+// payloads ordered by hits, most first. ties keep their order.
+struct HitsGreater
+{
+    explicit HitsGreater(const std::vector<size_t> &hits) : hits_(&hits) {}
+
+    bool operator()(unsigned a, unsigned b) const
+    {
+        return (*hits_)[a] > (*hits_)[b];
+    }
+
+    const std::vector<size_t>* hits_;
 };
 
-inline bool save_blocks(BinaryFile &file, const std::vector<Block> &v)
+// true if the blocks are sorted and disjoint, as save_blocks needs.
+inline bool blocks_ordered(const std::vector<Block> &v)
+{
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        if (v[i].end_ip < v[i].start_ip)
+        {
+            return false;
+        }
+
+        if (i && v[i].start_ip <= v[i - 1].end_ip)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// merge runs of contiguous blocks (end_ip + 1 == next start_ip) that have
+// the same payload. returns the number of blocks removed.
+inline size_t coalesce_blocks(std::vector<Block> &v)
+{
+    if (v.empty())
+    {
+        return 0;
+    }
+
+    size_t kept = 0;
+
+    for (size_t i = 1; i < v.size(); ++i)
+    {
+        Block &last = v[kept];
+
+        if (v[i].loc == last.loc && last.end_ip != 0xFFFFFFFF &&
+            last.end_ip + 1 == v[i].start_ip)
+        {
+            last.end_ip = v[i].end_ip;
+            continue;
+        }
+
+        v[++kept] = v[i];
+    }
+
+    size_t removed = v.size() - (kept + 1);
+    v.resize(kept + 1);
+
+    return removed;
+}
+
+inline void save_raw_blocks(BinaryFile &file, const std::vector<Block> &v)
 {
     std::vector<unsigned> start_ip;
     std::vector<unsigned> end_ip;
@@ -94,25 +494,189 @@ inline bool save_blocks(BinaryFile &file, const std::vector<Block> &v)
     end_ip.resize(v.size());
     loc.resize(v.size());
 
-    unsigned last = 0;
-
-    // split into columns and check sortedness
-
     for (size_t i = 0; i < v.size(); ++i)
     {
-        assert(v[i].start_ip > last);
-        assert(v[i].end_ip >= v[i].start_ip);
-
         start_ip[i] = v[i].start_ip;
         end_ip[i] = v[i].end_ip;
         loc[i] = v[i].loc;
-
-        last = v[i].end_ip;
     }
 
     file.save_pod_vector(start_ip);
     file.save_pod_vector(end_ip);
     file.save_pod_vector(loc);
+}
+
+inline void save_compressed_blocks(BinaryFile &file,
+                                   const std::vector<Block> &v)
+{
+    std::vector<unsigned> bases;
+    std::vector<BlockGroup> groups;
+    std::vector<unsigned> words;
+
+    unsigned starts[PACK_GROUP];
+    unsigned lens[PACK_GROUP];
+    unsigned locs[PACK_GROUP];
+    unsigned deltas[PACK_GROUP];
+
+    for (size_t first = 0; first < v.size(); first += PACK_GROUP)
+    {
+        size_t n = std::min((size_t) PACK_GROUP, v.size() - first);
+
+        // the last group is padded out by repeating its last block.
+
+        for (size_t i = 0; i < PACK_GROUP; ++i)
+        {
+            const Block &b = v[first + std::min(i, n - 1)];
+
+            starts[i] = b.start_ip;
+            lens[i] = b.end_ip - b.start_ip;
+            locs[i] = b.loc;
+        }
+
+        BlockGroup group;
+        memset(&group, 0, sizeof(group));
+
+        unsigned base = starts[0];
+        delta128(starts, base, deltas);
+
+        group.len_base = *std::min_element(lens, lens + PACK_GROUP);
+        group.loc_base = *std::min_element(locs, locs + PACK_GROUP);
+
+        unsigned max_delta = 0;
+
+        for (size_t i = 0; i < PACK_GROUP; ++i)
+        {
+            max_delta = std::max(max_delta, deltas[i]);
+
+            lens[i] -= group.len_base;
+            locs[i] -= group.loc_base;
+        }
+
+        group.start_bits = bit_width(max_delta);
+        group.len_bits = bit_width(*std::max_element(lens, lens + PACK_GROUP));
+        group.loc_bits = bit_width(*std::max_element(locs, locs + PACK_GROUP));
+        group.words = words.size();
+
+        words.resize(words.size() + 
+                     (group.start_bits + group.len_bits + group.loc_bits) * 4);
+
+        unsigned* data = &words[group.words];
+
+        pack128(deltas, group.start_bits, data);
+        data += group.start_bits * 4;
+
+        pack128(lens, group.len_bits, data);
+        data += group.len_bits * 4;
+
+        pack128(locs, group.loc_bits, data);
+
+        bases.push_back(base);
+        groups.push_back(group);
+    }
+
+    file.save_type("ZBLK");
+    file.save_unsigned(v.size());
+
+    file.save_pod_vector(bases);
+    file.save_pod_vector(groups);
+    file.save_pod_vector(words);
+}
+
+// the blocks of each payload, as compressed sparse rows: the block indices
+// of payload p are rows[offsets[p]] up to rows[offsets[p + 1]], in order.
+// it answers "every range of p" without a scan of the block table.
+class ReverseIndex
+{
+  public:
+    ReverseIndex() {}
+
+    void load(MemoryFile &file)
+    {
+        LOG_CONTEXT("ReverseIndex load");
+
+        file.load_mapped_vector(offsets);
+        file.load_mapped_vector(rows);
+    }
+
+    // payloads past the end have no blocks.
+    size_t payloads() const
+    {
+        return offsets.size() ? offsets.size() - 1 : 0;
+    }
+
+    const unsigned* begin(size_t payload) const
+    {
+        return rows.begin() + offsets[payload];
+    }
+
+    const unsigned* end(size_t payload) const
+    {
+        return rows.begin() + offsets[payload + 1];
+    }
+
+    MappedVector<unsigned> offsets;
+    MappedVector<unsigned> rows;
+
+    // default copy/assign is fine
+};
+
+// works for any block type with a loc payload. v has to be the final
+// table, after coalescing and renumbering, since rows are its indices.
+template <typename BlockType>
+inline void save_reverse_index(BinaryFile &file,
+                               const std::vector<BlockType> &v)
+{
+    REL_ASSERT(!v.empty());
+
+    unsigned payloads = 0;
+
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        payloads = std::max(payloads, v[i].loc + 1);
+    }
+
+    // a counting sort of the block indices by payload.
+
+    std::vector<unsigned> offsets(payloads + 1, 0);
+
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        offsets[v[i].loc + 1]++;
+    }
+
+    for (size_t i = 1; i < offsets.size(); ++i)
+    {
+        offsets[i] += offsets[i - 1];
+    }
+
+    std::vector<unsigned> next(offsets.begin(), offsets.end() - 1);
+    std::vector<unsigned> rows(v.size());
+
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        rows[next[v[i].loc]++] = i;
+    }
+
+    file.save_pod_vector(offsets);
+    file.save_pod_vector(rows);
+}
+
+inline bool save_blocks(BinaryFile &file,
+                        const std::vector<Block> &v,
+                        bool compress = false)
+{
+    // sources are normalized on import, see block_sort.hpp.
+
+    REL_ASSERT(blocks_ordered(v));
+
+    if (compress)
+    {
+        save_compressed_blocks(file, v);
+    }
+    else
+    {
+        save_raw_blocks(file, v);
+    }
 
     return true;
 }
@@ -0,0 +1,785 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module counts queries by group, for geoloc --count-by, instead of
+ * printing a line per ip, as in
+ *
+ * geoloc -f access.log --count-by country,asn
+ *
+ * Each lookup is turned into an integer group key straight from its
+ * location and asn numbers, so nothing is formatted until the final table.
+ * Locations are first mapped to dense keys of the fields counted by, with
+ * strings compared by their interned ids, and keys whose fields are all
+ * empty fold into the key of ips with no location, so the groups are those
+ * that sort | uniq -c would give. Regions are counted within their country,
+ * and cities within their region, so those columns are added when they were
+ * not asked for. The counts live in a flat array when the key space is
+ * small, and a hash map otherwise.
+ *
+ * Files are mapped and split into line aligned chunks, which --threads
+ * workers count separately, and the counts are merged at the end. With
+ * --distinct, each group also gets an exact count of its distinct ips,
+ * from the sorted (key, ip) pairs of every worker.
+*/
+
+#ifndef COUNT_HPP_4B7E9D03
+#define COUNT_HPP_4B7E9D03
+
+#include "query.hpp"
+#include "pipeline.hpp"
+#include "thread.hpp"
+#include "hash_map.hpp"
+
+#include <map>
+#include <stdio.h>
+
+// key spaces up to this size are counted in flat arrays.
+#define COUNT_FLAT_MAX (1U << 20)
+
+// the smallest chunk of an input worth a thread of its own.
+#define MIN_CHUNKED_INPUT (1U << 20)
+
+enum
+{
+    COUNT_COUNTRY = 1,
+    COUNT_REGION = 2,
+    COUNT_CITY = 4,
+    COUNT_ASN = 8
+};
+
+struct CountOptions
+{
+    CountOptions()
+        :
+        fields(),
+        distinct(false),
+        threads(cpu_count())
+    {
+    }
+
+    // the fields to count by, in the order of the output columns.
+    std::vector<unsigned> fields;
+
+    // also count the distinct ips of each group.
+    bool distinct;
+
+    unsigned threads;
+};
+
+// parse a comma separated list of country, region, city and asn. false if
+// a field is unknown or repeated.
+inline bool parse_count_fields(const char* s, std::vector<unsigned> &out)
+{
+    std::vector<char*> toks;
+    std::string scratch;
+    csv_split(s, strlen(s), scratch, toks);
+
+    out.clear();
+
+    for (size_t i = 0; i < toks.size(); ++i)
+    {
+        unsigned field = 0;
+
+        if (strcmp(toks[i], "country") == 0) field = COUNT_COUNTRY;
+        else if (strcmp(toks[i], "region") == 0) field = COUNT_REGION;
+        else if (strcmp(toks[i], "city") == 0) field = COUNT_CITY;
+        else if (strcmp(toks[i], "asn") == 0) field = COUNT_ASN;
+
+        if (!field || std::find(out.begin(), out.end(), field) != out.end())
+        {
+            return false;
+        }
+
+        out.push_back(field);
+    }
+
+    return !out.empty();
+}
+
+// maps the location and asn numbers of a lookup to a group key, and a key
+// back to its columns.
+class CountKeys
+{
+  public:
+    CountKeys(const GeoData &data, const std::vector<unsigned> &fields)
+        :
+        data_(data),
+        fields_(qualify(fields)),
+        location_key_(),
+        location_rep_(1, -1U),
+        asn_keys_(1)
+    {
+        unsigned mask = 0;
+
+        for (size_t i = 0; i < fields_.size(); ++i)
+        {
+            mask |= fields_[i];
+        }
+
+        if ((mask & (COUNT_COUNTRY | COUNT_REGION | COUNT_CITY)) &&
+            (data.loaded() & GEO_LOCATIONS))
+        {
+            map_locations(mask);
+        }
+
+        if ((mask & COUNT_ASN) && (data.loaded() & GEO_ASNS))
+        {
+            asn_keys_ = data.asn_data().asns.size() + 1;
+        }
+    }
+
+    uint64_t size() const
+    {
+        return (uint64_t) location_rep_.size() * asn_keys_;
+    }
+
+    uint64_t key(unsigned loc_idx, unsigned asn_idx) const
+    {
+        uint64_t lk = loc_idx < location_key_.size() ?
+                      location_key_[loc_idx] : 0;
+        uint64_t ak = asn_keys_ > 1 && asn_idx != -1U ? asn_idx + 1 : 0;
+
+        return lk * asn_keys_ + ak;
+    }
+
+    // append the columns of key to out, space separated.
+    void print(uint64_t key, std::string &out) const
+    {
+        unsigned loc_idx = location_rep_[key / asn_keys_];
+        unsigned ak = key % asn_keys_;
+
+        IPResult result;
+        data_.resolve(0, loc_idx, ak ? ak - 1 : -1U, result);
+
+        for (size_t i = 0; i < fields_.size(); ++i)
+        {
+            if (i)
+            {
+                out += ' ';
+            }
+
+            switch (fields_[i])
+            {
+              case COUNT_COUNTRY: append(result.country, out); break;
+              case COUNT_REGION: append(result.region, out); break;
+              case COUNT_CITY: append(result.city, out); break;
+
+              case COUNT_ASN:
+                if (result.asn)
+                {
+                    char buf[32];
+                    sprintf(buf, "AS%u", *result.asn);
+                    out += buf;
+                }
+                else
+                {
+                    out += '%';
+                }
+
+                out += ' ';
+                append(result.asn_text, out);
+                break;
+            }
+        }
+    }
+
+    void print_headers(std::string &out) const
+    {
+        for (size_t i = 0; i < fields_.size(); ++i)
+        {
+            if (i)
+            {
+                out += ' ';
+            }
+
+            switch (fields_[i])
+            {
+              case COUNT_COUNTRY: out += "country"; break;
+              case COUNT_REGION: out += "region"; break;
+              case COUNT_CITY: out += "city"; break;
+              case COUNT_ASN: out += "as_num as_text"; break;
+            }
+        }
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(CountKeys);
+
+    // region codes are only unique within a country, and city names within
+    // a region, so the columns that qualify them are added ahead of them
+    // when they were not asked for. "07" is a region of many countries.
+    static std::vector<unsigned> qualify(const std::vector<unsigned> &fields)
+    {
+        std::vector<unsigned> out;
+
+        for (size_t i = 0; i < fields.size(); ++i)
+        {
+            if (fields[i] == COUNT_REGION || fields[i] == COUNT_CITY)
+            {
+                add_missing(fields, COUNT_COUNTRY, out);
+            }
+
+            if (fields[i] == COUNT_CITY)
+            {
+                add_missing(fields, COUNT_REGION, out);
+            }
+
+            out.push_back(fields[i]);
+        }
+
+        return out;
+    }
+
+    static void add_missing(const std::vector<unsigned> &fields,
+                            unsigned field,
+                            std::vector<unsigned> &out)
+    {
+        if (std::find(fields.begin(), fields.end(), field) == fields.end() &&
+            std::find(out.begin(), out.end(), field) == out.end())
+        {
+            out.push_back(field);
+        }
+    }
+
+    struct LocationFields
+    {
+        unsigned country;
+        unsigned region;
+        unsigned city;
+
+        bool operator<(const LocationFields &b) const
+        {
+            if (country != b.country) return country < b.country;
+            if (region != b.region) return region < b.region;
+
+            return city < b.city;
+        }
+    };
+
+    // give each distinct tuple of the counted fields a key from 1, and
+    // each location the key of its tuple. strings are interned, so equal
+    // ids are equal strings.
+    void map_locations(unsigned mask)
+    {
+        const LocationTable &table = data_.location_data();
+
+        location_key_.assign(table.size(), 0);
+
+        std::map<LocationFields, unsigned> keys;
+
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            PackedLocation loc;
+            table.unpack(i, loc);
+
+            LocationFields f;
+
+            f.country = mask & COUNT_COUNTRY ? loc.country : 0;
+            f.region = mask & COUNT_REGION ? loc.region : 0;
+            f.city = mask & COUNT_CITY ? loc.city : 0;
+
+            if (empty(table.country, f.country, mask & COUNT_COUNTRY) &&
+                empty(table.region, f.region, mask & COUNT_REGION) &&
+                empty(table.city, f.city, mask & COUNT_CITY))
+            {
+                continue;
+            }
+
+            std::map<LocationFields, unsigned>::iterator iter =
+                keys.find(f);
+
+            if (iter == keys.end())
+            {
+                iter = keys.insert(std::make_pair(f,
+                                   (unsigned) location_rep_.size())).first;
+                location_rep_.push_back(i);
+            }
+
+            location_key_[i] = iter->second;
+        }
+    }
+
+    static bool empty(const MappedStringVector &strings,
+                      unsigned id,
+                      bool counted)
+    {
+        return !counted || *strings[id] == 0;
+    }
+
+    static void append(const char* s, std::string &out)
+    {
+        std::string esc;
+        escape(esc, s);
+
+        out += esc;
+    }
+
+    const GeoData &data_;
+    std::vector<unsigned> fields_;
+
+    std::vector<unsigned> location_key_;
+
+    // a location of each key, -1 for key 0.
+    std::vector<unsigned> location_rep_;
+
+    unsigned asn_keys_;
+};
+
+// orders (count, key) pairs by count, largest first, then by key.
+struct CountOrder
+{
+    bool operator()(const std::pair<uint64_t, uint64_t> &a,
+                    const std::pair<uint64_t, uint64_t> &b) const
+    {
+        if (a.first != b.first) return a.first > b.first;
+
+        return a.second < b.second;
+    }
+};
+
+// a group key and an ip in it, for distinct counts. v4 ips are kept in
+// their v4-mapped form.
+struct CountSeen
+{
+    uint64_t key;
+    IP6 ip;
+
+    bool operator<(const CountSeen &b) const
+    {
+        return key < b.key || (key == b.key && ip < b.ip);
+    }
+
+    bool operator==(const CountSeen &b) const
+    {
+        return key == b.key && ip == b.ip;
+    }
+};
+
+// the counts of one worker.
+class GroupCounter : public Connector
+{
+  public:
+    GroupCounter(const GeoData &data,
+                 const CountKeys &keys,
+                 bool distinct,
+                 const WhereFilter* filter = 0)
+        :
+        data_(data),
+        keys_(keys),
+        distinct_(distinct),
+        filter_(filter),
+        flat_(),
+        sparse_(),
+        seen_(),
+        compact_at_(1 << 20)
+    {
+        if (keys.size() <= COUNT_FLAT_MAX)
+        {
+            flat_.resize(keys.size());
+        }
+    }
+
+    virtual ~GroupCounter()
+    {
+    }
+
+    void consume(const Buffer &b)
+    {
+        const IPAddress* address = (const IPAddress*)(b.data());
+
+        unsigned loc_idx;
+        unsigned asn_idx;
+
+        data_.lookup(*address, loc_idx, asn_idx);
+
+        if (filter_ && !filter_->pass(loc_idx, asn_idx))
+        {
+            return;
+        }
+
+        uint64_t key = keys_.key(loc_idx, asn_idx);
+
+        add(key, 1);
+
+        if (distinct_)
+        {
+            CountSeen seen;
+            seen.key = key;
+
+            if (address->family == IP_V4)
+            {
+                seen.ip.hi = 0;
+                seen.ip.lo = 0xFFFF00000000ULL | address->quad;
+            }
+            else
+            {
+                seen.ip = address->ip6;
+            }
+
+            seen_.push_back(seen);
+
+            // dedupe as we go, so memory follows the distinct ips rather
+            // than the lines.
+
+            if (seen_.size() >= compact_at_)
+            {
+                compact();
+                compact_at_ = std::max(compact_at_, seen_.size() * 2);
+            }
+        }
+    }
+
+    void add(uint64_t key, uint64_t n)
+    {
+        if (!flat_.empty())
+        {
+            flat_[key] += n;
+        }
+        else
+        {
+            sparse_[key] += n;
+        }
+    }
+
+    // add the counts of other, leaving it empty.
+    void merge(GroupCounter &other)
+    {
+        for (size_t i = 0; i < other.flat_.size(); ++i)
+        {
+            if (other.flat_[i])
+            {
+                add(i, other.flat_[i]);
+            }
+        }
+
+        for (Sparse::const_iterator iter = other.sparse_.begin();
+             iter != other.sparse_.end(); ++iter)
+        {
+            add(iter->first, iter->second);
+        }
+
+        seen_.insert(seen_.end(), other.seen_.begin(), other.seen_.end());
+
+        std::vector<uint64_t>().swap(other.flat_);
+        Sparse().swap(other.sparse_);
+        std::vector<CountSeen>().swap(other.seen_);
+    }
+
+    // the groups with their counts, largest first.
+    void results(std::vector<std::pair<uint64_t, uint64_t> > &counts,
+                 std::vector<uint64_t> &distinct)
+    {
+        counts.clear();
+
+        for (size_t i = 0; i < flat_.size(); ++i)
+        {
+            if (flat_[i])
+            {
+                counts.push_back(std::make_pair(flat_[i], (uint64_t) i));
+            }
+        }
+
+        for (Sparse::const_iterator iter = sparse_.begin();
+             iter != sparse_.end(); ++iter)
+        {
+            counts.push_back(std::make_pair(iter->second, iter->first));
+        }
+
+        std::sort(counts.begin(), counts.end(), CountOrder());
+
+        distinct.assign(counts.size(), 0);
+
+        if (!distinct_)
+        {
+            return;
+        }
+
+        compact();
+
+        // seen_ is sorted by key, so each group's ips are one run.
+
+        std::vector<std::pair<uint64_t, uint64_t> > by_key;
+
+        for (size_t i = 0; i < seen_.size(); )
+        {
+            size_t j = i;
+
+            while (j < seen_.size() && seen_[j].key == seen_[i].key)
+            {
+                ++j;
+            }
+
+            by_key.push_back(std::make_pair(seen_[i].key, (uint64_t)(j - i)));
+            i = j;
+        }
+
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            std::vector<std::pair<uint64_t, uint64_t> >::const_iterator iter =
+                std::lower_bound(by_key.begin(), by_key.end(),
+                                 std::make_pair(counts[i].second,
+                                                (uint64_t) 0));
+
+            if (iter != by_key.end() && iter->first == counts[i].second)
+            {
+                distinct[i] = iter->second;
+            }
+        }
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(GroupCounter);
+
+    typedef hash_map<uint64_t, uint64_t> Sparse;
+
+    void compact()
+    {
+        std::sort(seen_.begin(), seen_.end());
+        seen_.erase(std::unique(seen_.begin(), seen_.end()), seen_.end());
+    }
+
+    const GeoData &data_;
+    const CountKeys &keys_;
+    bool distinct_;
+    const WhereFilter* filter_;
+
+    std::vector<uint64_t> flat_;
+    Sparse sparse_;
+
+    std::vector<CountSeen> seen_;
+    size_t compact_at_;
+};
+
+// runs one line aligned chunk of a mapped input into a sink of factory.
+template <typename Factory>
+class ScanTask : public Thread
+{
+  public:
+    ScanTask(Factory &factory, const char* begin, const char* end)
+        :
+        sink(factory.make()),
+        begin_(begin),
+        end_(end)
+    {
+    }
+
+    typename Factory::Sink* sink;
+
+  protected:
+    void run()
+    {
+        MemoryReader reader(begin_, end_);
+        IPParser parser;
+
+        reader | parser | *sink;
+        reader.produce();
+    }
+
+  private:
+    const char* begin_;
+    const char* end_;
+};
+
+// run the addresses of a source into sinks made by factory, which are
+// connectors that take IPAddresses. mapped files are split over up to
+// threads sinks, others go through one. each sink is handed back to
+// factory.done when it has its share.
+template <typename Factory>
+inline void scan_source(Factory &factory,
+                        const std::string &source,
+                        unsigned threads)
+{
+    std::string protocol;
+    std::string path;
+    split_source(source, protocol, path);
+
+    IPParser parser;
+    MemoryMap input;
+
+    if (protocol == "file" && path != "-" && input.open(path.c_str()))
+    {
+        if (input.size() == 0)
+        {
+            return;
+        }
+
+        size_t chunks = chunk_count(input.size(), MIN_CHUNKED_INPUT, threads);
+
+        std::vector<const char*> bounds =
+            split_lines(input.begin(), input.begin() + input.size(), chunks);
+
+        std::vector<ScanTask<Factory>*> tasks;
+
+        for (size_t i = 0; i + 1 < bounds.size(); ++i)
+        {
+            tasks.push_back(new ScanTask<Factory>(factory, bounds[i],
+                                                  bounds[i+1]));
+            tasks.back()->start();
+        }
+
+        for (size_t i = 0; i < tasks.size(); ++i)
+        {
+            tasks[i]->join();
+            factory.done(tasks[i]->sink);
+
+            delete tasks[i];
+        }
+    }
+    else if (protocol == "file")
+    {
+        // stdin and pipes are read a line at a time, on this thread.
+
+        typename Factory::Sink* sink = factory.make();
+
+        FileReader reader(path);
+
+        reader | parser | *sink;
+        reader.produce();
+
+        factory.done(sink);
+    }
+    else if (protocol == "query")
+    {
+        std::vector<char*> toks;
+        std::string scratch;
+        csv_split(&path[0], path.size(), scratch, toks);
+
+        std::vector<std::string> ip_list;
+        ip_list.assign(toks.begin(), toks.end());
+
+        typename Factory::Sink* sink = factory.make();
+
+        StringInjector reader(ip_list);
+
+        reader | parser | *sink;
+        reader.produce();
+
+        factory.done(sink);
+    }
+    else
+    {
+        FATAL_ERROR("unknown source protocol %s", protocol.c_str());
+    }
+}
+
+// makes a GroupCounter per worker, and merges each into total.
+class CounterFactory
+{
+  public:
+    typedef GroupCounter Sink;
+
+    CounterFactory(const GeoData &data,
+                   const CountKeys &keys,
+                   bool distinct,
+                   const WhereFilter* filter,
+                   GroupCounter &total)
+        :
+        data_(data),
+        keys_(keys),
+        distinct_(distinct),
+        filter_(filter),
+        total_(total)
+    {
+    }
+
+    GroupCounter* make()
+    {
+        return new GroupCounter(data_, keys_, distinct_, filter_);
+    }
+
+    void done(GroupCounter* counter)
+    {
+        total_.merge(*counter);
+        delete counter;
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(CounterFactory);
+
+    const GeoData &data_;
+    const CountKeys &keys_;
+    bool distinct_;
+    const WhereFilter* filter_;
+    GroupCounter &total_;
+};
+
+// count the queries of every source, and print one line per group:
+// the count, the group's columns, then the distinct ips if asked for.
+// queries the filter, if any, rejects are not counted.
+inline void count(const GeoData &data,
+                  const std::vector<std::string> &sources,
+                  const CountOptions &options,
+                  bool show_headers,
+                  FILE* out,
+                  const WhereFilter* filter = 0)
+{
+    CountKeys keys(data, options.fields);
+    GroupCounter counter(data, keys, options.distinct);
+    CounterFactory factory(data, keys, options.distinct, filter, counter);
+
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        LOG_CONTEXT("count data with source %s", sources[i].c_str());
+
+        scan_source(factory, sources[i], options.threads);
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t> > counts;
+    std::vector<uint64_t> distinct;
+
+    counter.results(counts, distinct);
+
+    std::string line;
+
+    if (show_headers)
+    {
+        line = "count ";
+        keys.print_headers(line);
+        line += options.distinct ? " distinct_ips\n" : "\n";
+
+        fputs(line.c_str(), out);
+    }
+
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        char buf[32];
+        sprintf(buf, "%llu ", (unsigned long long) counts[i].first);
+
+        line = buf;
+        keys.print(counts[i].second, line);
+
+        if (options.distinct)
+        {
+            sprintf(buf, " %llu", (unsigned long long) distinct[i]);
+            line += buf;
+        }
+
+        line += '\n';
+
+        size_t n = fwrite(line.data(), line.size(), 1, out);
+        REL_ASSERT(n == 1);
+    }
+}
+
+inline void count(const char* data_file_name,
+                  const std::vector<std::string> &sources,
+                  const QueryOptions &query_options,
+                  const CountOptions &options)
+{
+    LOG_CONTEXT("count data %s with %zu sources", data_file_name,
+                sources.size());
+
+    GeoData data;
+    open_data(data, data_file_name, query_options);
+
+    WhereFilter where;
+    const WhereFilter* filter = open_filter(data, query_options, where);
+
+    count(data, sources, options, query_options.show_headers, stdout, filter);
+}
+
+#endif
@@ -11,13 +11,179 @@
 #ifndef CSV_HPP_BE8C5A6D
 #define CSV_HPP_BE8C5A6D
 
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
 #include <vector>
 
+// a field of a csv record, pointing into the source text. it is not nul
+// terminated.
+struct CsvField
+{
+    const char* data;
+    size_t size;
+};
+
+struct CsvRecord
+{
+    const CsvField* fields;
+    size_t count;
+};
+
 inline unsigned to_u(const char* s)
 {
     return strtoul(s, 0, 10);
 }
 
+// like to_u, for text that is not nul terminated.
+inline unsigned to_u(const char* s, size_t n)
+{
+    const char* end = s + n;
+
+    while (s != end && (*s == ' ' || *s == '\t'))
+    {
+        ++s;
+    }
+
+    unsigned x = 0;
+
+    for (; s != end && *s >= '0' && *s <= '9'; ++s)
+    {
+        x = x * 10 + (*s - '0');
+    }
+
+    return x;
+}
+
+inline unsigned to_u(const CsvField &f)
+{
+    return to_u(f.data, f.size);
+}
+
+inline std::string to_s(const CsvField &f)
+{
+    return std::string(f.data, f.size);
+}
+
+// parse a dotted quad, allowing trailing whitespace. false if it is not one.
+inline bool parse_quad(const char* s, size_t n, unsigned &out)
+{
+    const char* end = s + n;
+
+    while (end != s && (end[-1] == '\n' || end[-1] == '\r' ||
+                        end[-1] == ' ' || end[-1] == '\t'))
+    {
+        --end;
+    }
+
+    unsigned quad = 0;
+
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        if (i && (s == end || *s++ != '.'))
+        {
+            return false;
+        }
+
+        unsigned octet = 0;
+        unsigned digits = 0;
+
+        for (; s != end && *s >= '0' && *s <= '9' && digits < 4; ++s)
+        {
+            octet = octet * 10 + (*s - '0');
+            digits++;
+        }
+
+        if (digits == 0 || octet > 255)
+        {
+            return false;
+        }
+
+        quad = quad << 8 | octet;
+    }
+
+    out = quad;
+    return s == end;
+}
+
+// parse an ip given either as a number, as in the MaxMind csvs, or as a
+// dotted quad. false if it is neither.
+inline bool parse_ip(const char* s, size_t n, unsigned &out)
+{
+    if (memchr(s, '.', n))
+    {
+        return parse_quad(s, n, out);
+    }
+
+    const char* end = s + n;
+
+    while (end != s && (end[-1] == '\n' || end[-1] == '\r' ||
+                        end[-1] == ' ' || end[-1] == '\t'))
+    {
+        --end;
+    }
+
+    uint64_t x = 0;
+
+    if (s == end || end - s > 10)
+    {
+        return false;
+    }
+
+    for (; s != end; ++s)
+    {
+        if (*s < '0' || *s > '9')
+        {
+            return false;
+        }
+
+        x = x * 10 + (*s - '0');
+    }
+
+    if (x > 0xFFFFFFFF)
+    {
+        return false;
+    }
+
+    out = x;
+    return true;
+}
+
+// parse a range given as a CIDR block, like 10.0.0.0/8. host bits of the
+// address are ignored. false if it is not one.
+inline bool parse_cidr(const char* s, size_t n, unsigned &start, unsigned &end)
+{
+    const char* slash = (const char*) memchr(s, '/', n);
+
+    if (!slash)
+    {
+        return false;
+    }
+
+    unsigned quad;
+
+    if (!parse_quad(s, slash - s, quad))
+    {
+        return false;
+    }
+
+    unsigned bits;
+
+    if (!parse_ip(slash + 1, s + n - slash - 1, bits) || bits > 32 ||
+        memchr(slash + 1, '.', s + n - slash - 1))
+    {
+        return false;
+    }
+
+    unsigned mask = bits ? 0xFFFFFFFF << (32 - bits) : 0;
+
+    start = quad & mask;
+    end = start | ~mask;
+
+    return true;
+}
+
 inline void csv_split(const char* s,
                       size_t n,
                       std::string &scratch,
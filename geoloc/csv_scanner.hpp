@@ -0,0 +1,215 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module contains a fast csv tokenizer for the import path, in the style
+ * of simdcsv.
+ *
+ * The input is classified 64 bytes at a time into bitmasks of quotes, commas
+ * and newlines. A prefix xor of the quote mask gives the bytes that are inside
+ * quotes, and the separators outside of quotes give the field boundaries. The
+ * fields point straight into the input, so no line is ever copied.
+ *
+ * Quoting follows csv_split: a field that starts with a quote runs to the
+ * next quote, and may contain commas.
+*/
+
+#ifndef CSV_SCANNER_HPP_2B7E4F60
+#define CSV_SCANNER_HPP_2B7E4F60
+
+#include "connector.hpp"
+#include "csv.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// one 64 byte block, as bitmasks with bit i for byte i.
+struct CsvMasks
+{
+    uint64_t quotes;
+    uint64_t commas;
+    uint64_t newlines;
+};
+
+#ifdef __SSE2__
+
+inline uint64_t byte_mask16(__m128i v, char c)
+{
+    return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+inline void classify64(const char* p, CsvMasks &out)
+{
+    out.quotes = 0;
+    out.commas = 0;
+    out.newlines = 0;
+
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i * 16));
+
+        out.quotes |= byte_mask16(v, '"') << (i * 16);
+        out.commas |= byte_mask16(v, ',') << (i * 16);
+        out.newlines |= byte_mask16(v, '\n') << (i * 16);
+    }
+}
+
+#else
+
+inline void classify64(const char* p, CsvMasks &out)
+{
+    out.quotes = 0;
+    out.commas = 0;
+    out.newlines = 0;
+
+    for (unsigned i = 0; i < 64; ++i)
+    {
+        uint64_t bit = (uint64_t) 1 << i;
+
+        out.quotes |= p[i] == '"' ? bit : 0;
+        out.commas |= p[i] == ',' ? bit : 0;
+        out.newlines |= p[i] == '\n' ? bit : 0;
+    }
+}
+
+#endif
+
+// bit i of the result is the xor of bits 0..i of x. applied to the quote
+// mask, it is set from an opening quote up to (not including) its closing
+// quote.
+inline uint64_t prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+
+    return x;
+}
+
+// strip the quotes and any carriage return from a raw field.
+inline CsvField make_field(const char* begin, const char* end)
+{
+    if (end != begin && end[-1] == '\r')
+    {
+        --end;
+    }
+
+    if (end != begin && *begin == '"')
+    {
+        ++begin;
+
+        if (end != begin && end[-1] == '"')
+        {
+            --end;
+        }
+    }
+
+    CsvField f;
+
+    f.data = begin;
+    f.size = end - begin;
+
+    return f;
+}
+
+// emits one CsvRecord per line of [begin, end).
+class CsvScanner : public Connector
+{
+  public:
+    CsvScanner(const char* begin, const char* end)
+        :
+        begin_(begin),
+        end_(end),
+        fields_()
+    {
+    }
+
+    void consume(const Buffer &b) {}
+
+    void produce()
+    {
+        const char* field = begin_;
+        uint64_t inside = 0;
+
+        for (const char* block = begin_; block < end_; block += 64)
+        {
+            CsvMasks masks;
+
+            if (end_ - block >= 64)
+            {
+                classify64(block, masks);
+            }
+            else
+            {
+                // the tail is classified from a padded copy.
+
+                char tail[64];
+                memset(tail, 0, sizeof(tail));
+                memcpy(tail, block, end_ - block);
+
+                classify64(tail, masks);
+            }
+
+            uint64_t quoted = prefix_xor(masks.quotes) ^ inside;
+
+            // carry the quote state into the next block.
+            inside = (uint64_t) 0 - (quoted >> 63);
+
+            uint64_t seps = (masks.commas | masks.newlines) & ~quoted;
+
+            while (seps)
+            {
+                unsigned bit = __builtin_ctzll(seps);
+                const char* sep = block + bit;
+
+                fields_.push_back(make_field(field, sep));
+                field = sep + 1;
+
+                if (*sep == '\n')
+                {
+                    emit_record();
+                }
+
+                seps &= seps - 1;
+            }
+        }
+
+        if (field != end_ || !fields_.empty())
+        {
+            fields_.push_back(make_field(field, end_));
+            emit_record();
+        }
+
+        flush();
+    }
+
+  private:
+    void emit_record()
+    {
+        CsvRecord record;
+
+        record.fields = &fields_[0];
+        record.count = fields_.size();
+
+        emit(Buffer(&record, sizeof(record)));
+        fields_.clear();
+    }
+
+    const char* begin_;
+    const char* end_;
+
+    std::vector<CsvField> fields_;
+};
+
+#endif
@@ -0,0 +1,779 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module applies a csv of changes to an existing database, for
+ * geoloc --apply-delta, so that an update does not need a full import.
+ *
+ * Each line of a delta changes a range of one of the block tables:
+ *
+ * loc,insert,start_ip,end_ip,country,region,city,latitude,longitude
+ * loc,update,start_ip,end_ip,country,region,city,latitude,longitude
+ * loc,delete,start_ip,end_ip
+ * asn,insert,start_ip,end_ip,number,text
+ * asn,update,start_ip,end_ip,number,text
+ * asn,delete,start_ip,end_ip
+ *
+ * ips are numbers, as in the MaxMind csvs, or dotted quads. An insert must
+ * land where no block is, an update replaces whatever was in its range, and
+ * a delete clears its range. The lines of each table must be sorted by
+ * start_ip and must not overlap, so that they can be merge joined against
+ * the block table in one pass. Blank lines and lines starting with # are
+ * skipped.
+ *
+ * Payloads are given by value. They resolve to an existing location or asn
+ * when one matches, otherwise a record is appended, with its strings
+ * interned into the existing string tables. As on import, an asn number
+ * that is already known keeps its text. Existing records keep their
+ * numbers, so the data sections that do not grow are copied over as is.
+ *
+ * A database built with --overlay keeps its overlay csv, and the overlay is
+ * laid over each changed block table again, so it still wins over the
+ * changes.
+ *
+ * The new file is written beside the output, then renamed over it, so that
+ * readers never see it half written.
+*/
+
+#ifndef DELTA_HPP_6D2B8E14
+#define DELTA_HPP_6D2B8E14
+
+#include "etl.hpp"
+#include "overlay.hpp"
+#include "query.hpp"
+
+#include <map>
+#include <stdio.h>
+#include <unistd.h>
+
+enum
+{
+    DELTA_INSERT,
+    DELTA_UPDATE,
+    DELTA_DELETE
+};
+
+// one line of a delta. block.loc is the payload, unused by deletes.
+struct BlockChange
+{
+    unsigned op;
+    Block block;
+    size_t line;
+};
+
+struct DeltaStats
+{
+    DeltaStats()
+        :
+        loc_changes(0),
+        asn_changes(0),
+        loc_added(0),
+        asn_added(0),
+        sections_copied(0)
+    {
+    }
+
+    size_t loc_changes;
+    size_t asn_changes;
+
+    // records appended to the data tables.
+    size_t loc_added;
+    size_t asn_added;
+
+    size_t sections_copied;
+};
+
+// the changes of a delta, with their payloads resolved against a database.
+// the data tables are only loaded back into builders once a change needs
+// them.
+class Delta
+{
+  public:
+    explicit Delta(const GeoData &data)
+        :
+        location_changes(),
+        asn_changes(),
+        location_overlay(),
+        asn_overlay(),
+        locations(),
+        asns(),
+        data_(data),
+        locations_loaded_(false),
+        asns_loaded_(false),
+        next_location_(0),
+        asn_count_(0),
+        location_index_()
+    {
+    }
+
+    void add_location_change(unsigned op,
+                             unsigned start_ip,
+                             unsigned end_ip,
+                             const CsvField* payload,
+                             size_t line)
+    {
+        unsigned loc = op == DELTA_DELETE ? 0 : resolve_location(payload);
+
+        add_change(location_changes, op, start_ip, end_ip, loc, line);
+    }
+
+    void add_asn_change(unsigned op,
+                        unsigned start_ip,
+                        unsigned end_ip,
+                        const CsvField* payload,
+                        size_t line)
+    {
+        if (!(data_.loaded() & GEO_ASNS))
+        {
+            FATAL_ERROR("delta line %zu changes asns, but the database "
+                        "has none", line);
+        }
+
+        unsigned asn = op == DELTA_DELETE ? 0 :
+                       resolve_asn(payload[0], payload[1]);
+
+        add_change(asn_changes, op, start_ip, end_ip, asn, line);
+    }
+
+    // resolve the database's overlay for each table that has changes, so
+    // that it can be laid over them again.
+    void add_overlay(const Overlay &overlay)
+    {
+        for (size_t i = 0; i < overlay.ranges().size(); ++i)
+        {
+            const OverlayRange &range = overlay.ranges()[i];
+
+            Block block;
+
+            block.start_ip = range.start_ip;
+            block.end_ip = range.end_ip;
+
+            if (!location_changes.empty())
+            {
+                CsvField fields[5] = { range.country, range.region,
+                                       range.city, range.lat, range.lon };
+
+                block.loc = resolve_location(fields);
+                location_overlay.push_back(block);
+            }
+
+            if (!asn_changes.empty() && range.asn.size)
+            {
+                block.loc = resolve_asn(range.asn, range.asn_text);
+                asn_overlay.push_back(block);
+            }
+        }
+
+        normalize_blocks(location_overlay, 1, "overlay", 0);
+        normalize_blocks(asn_overlay, 1, "overlay", 0);
+    }
+
+    void load_locations()
+    {
+        if (locations_loaded_)
+        {
+            return;
+        }
+
+        LOG_CONTEXT("Delta load locations");
+
+        const LocationTable &table = data_.location_data();
+        locations.load(table);
+
+        for (size_t i = 0; i < locations.rows().size(); ++i)
+        {
+            location_index_.insert(std::make_pair(locations.rows()[i],
+                                                  locations.rows()[i].id));
+        }
+
+        next_location_ = table.size();
+        locations_loaded_ = true;
+    }
+
+    void load_asns()
+    {
+        if (asns_loaded_)
+        {
+            return;
+        }
+
+        LOG_CONTEXT("Delta load asns");
+
+        asns.load(data_.asn_data());
+
+        asn_count_ = asns.asns().size();
+        asns_loaded_ = true;
+    }
+
+    size_t locations_added() const
+    {
+        return locations_loaded_ ?
+               next_location_ - data_.location_data().size() : 0;
+    }
+
+    size_t asns_added() const
+    {
+        return asns_loaded_ ? asns.asns().size() - asn_count_ : 0;
+    }
+
+    std::vector<BlockChange> location_changes;
+    std::vector<BlockChange> asn_changes;
+
+    // overlay ranges, resolved, for the tables that have changes.
+    std::vector<Block> location_overlay;
+    std::vector<Block> asn_overlay;
+
+    LocationBuilder locations;
+    ASNBuilder asns;
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(Delta);
+
+    // the location of country, region, city, latitude, longitude fields,
+    // appended if no existing one matches.
+    unsigned resolve_location(const CsvField* fields)
+    {
+        load_locations();
+
+        LocationRow row = locations.make_row(next_location_, fields[0],
+                                             fields[1], fields[2],
+                                             fields[3], fields[4]);
+
+        std::map<LocationRow, unsigned, LocationRowLess>::iterator iter =
+            location_index_.find(row);
+
+        if (iter != location_index_.end())
+        {
+            return iter->second;
+        }
+
+        unsigned loc = next_location_++;
+
+        locations.add(row);
+        location_index_[row] = loc;
+
+        return loc;
+    }
+
+    unsigned resolve_asn(const CsvField &number, const CsvField &text)
+    {
+        load_asns();
+
+        return asns.add_asn(asn_number(number), text.data, text.size);
+    }
+
+    void add_change(std::vector<BlockChange> &changes,
+                    unsigned op,
+                    unsigned start_ip,
+                    unsigned end_ip,
+                    unsigned payload,
+                    size_t line)
+    {
+        if (end_ip < start_ip)
+        {
+            FATAL_ERROR("delta line %zu ends before it starts", line);
+        }
+
+        if (!changes.empty() &&
+            start_ip <= changes.back().block.end_ip)
+        {
+            FATAL_ERROR("delta line %zu is out of order, or overlaps "
+                        "line %zu", line, changes.back().line);
+        }
+
+        BlockChange change;
+
+        change.op = op;
+        change.block.start_ip = start_ip;
+        change.block.end_ip = end_ip;
+        change.block.loc = payload;
+        change.line = line;
+
+        changes.push_back(change);
+    }
+
+    const GeoData &data_;
+
+    bool locations_loaded_;
+    bool asns_loaded_;
+
+    unsigned next_location_;
+    size_t asn_count_;
+
+    std::map<LocationRow, unsigned, LocationRowLess> location_index_;
+};
+
+// feeds CsvRecords of a delta into a Delta.
+class DeltaParser : public Connector
+{
+  public:
+    explicit DeltaParser(Delta &out)
+        :
+        out_(out),
+        line_(0)
+    {
+    }
+
+    void consume(const Buffer &b)
+    {
+        line_++;
+
+        const CsvRecord* record = (const CsvRecord*) b.data();
+        const CsvField* toks = record->fields;
+
+        if (record->count == 0 || (record->count == 1 && toks[0].size == 0) ||
+            (toks[0].size && toks[0].data[0] == '#'))
+        {
+            return;
+        }
+
+        if (record->count < 4)
+        {
+            FATAL_ERROR("delta line %zu is too short", line_);
+        }
+
+        std::string table = to_s(toks[0]);
+        std::string op_name = to_s(toks[1]);
+
+        unsigned op;
+
+        if (op_name == "insert")
+        {
+            op = DELTA_INSERT;
+        }
+        else if (op_name == "update")
+        {
+            op = DELTA_UPDATE;
+        }
+        else if (op_name == "delete")
+        {
+            op = DELTA_DELETE;
+        }
+        else
+        {
+            FATAL_ERROR("delta line %zu has unknown op %s", line_,
+                        op_name.c_str());
+            return;
+        }
+
+        unsigned start_ip;
+        unsigned end_ip;
+
+        if (!parse_ip(toks[2].data, toks[2].size, start_ip) ||
+            !parse_ip(toks[3].data, toks[3].size, end_ip))
+        {
+            FATAL_ERROR("delta line %zu has a bad ip", line_);
+        }
+
+        size_t payload = op == DELTA_DELETE ? 0 : record->count - 4;
+
+        if (table == "loc" && record->count == 4 + payload &&
+            (payload == 0 || payload == 5))
+        {
+            out_.add_location_change(op, start_ip, end_ip, toks + 4, line_);
+        }
+        else if (table == "asn" && record->count == 4 + payload &&
+                 (payload == 0 || payload == 2))
+        {
+            out_.add_asn_change(op, start_ip, end_ip, toks + 4, line_);
+        }
+        else
+        {
+            FATAL_ERROR("delta line %zu is not a loc or asn change",
+                        line_);
+        }
+    }
+
+  private:
+    Delta &out_;
+    size_t line_;
+};
+
+inline void read_delta(const char* source, Delta &out)
+{
+    LOG_CONTEXT("read_delta from %s", source);
+
+    MemoryMap csv;
+    map_csv(csv, source);
+
+    CsvScanner reader(csv.begin(), csv.begin() + csv.size());
+    DeltaParser parser(out);
+
+    reader | parser;
+    reader.produce();
+}
+
+// merge sorted, non overlapping changes into a block table, in one pass
+// over both. blocks that a change overlaps keep only what lies outside it.
+inline void merge_blocks(const BlockTable &table,
+                         const std::vector<BlockChange> &changes,
+                         std::vector<Block> &out)
+{
+    out.reserve(table.size() + changes.size());
+
+    BlockIterator iter(table);
+    Block cur;
+
+    bool have = iter.next(cur);
+
+    for (size_t i = 0; i < changes.size(); ++i)
+    {
+        const BlockChange &change = changes[i];
+
+        unsigned start = change.block.start_ip;
+        unsigned end = change.block.end_ip;
+
+        while (have && cur.end_ip < start)
+        {
+            out.push_back(cur);
+            have = iter.next(cur);
+        }
+
+        while (have && cur.start_ip <= end)
+        {
+            if (change.op == DELTA_INSERT)
+            {
+                FATAL_ERROR("delta line %zu inserts over an existing block",
+                            change.line);
+            }
+
+            if (cur.start_ip < start)
+            {
+                Block head = cur;
+                head.end_ip = start - 1;
+
+                out.push_back(head);
+            }
+
+            // the tail is still to be checked against the next change.
+
+            if (cur.end_ip > end)
+            {
+                cur.start_ip = end + 1;
+                break;
+            }
+
+            have = iter.next(cur);
+        }
+
+        if (change.op != DELTA_DELETE)
+        {
+            out.push_back(change.block);
+        }
+    }
+
+    while (have)
+    {
+        out.push_back(cur);
+        have = iter.next(cur);
+    }
+}
+
+// copy a section of the old file over byte for byte. sections only hold
+// offsets relative to themselves, and always start on SECTION_ALIGN, so
+// they can move.
+inline void copy_section(BinaryFile &file,
+                         const char* fn,
+                         const SectionDirectory &dir,
+                         const char* name)
+{
+    const SectionEntry* entry = dir.find(name);
+
+    REL_ASSERT(entry);
+
+    MemoryFile section;
+
+    if (!section.open(fn, *entry))
+    {
+        FATAL_ERROR("could not map section %s of %s", name, fn);
+    }
+
+    file.begin_section(name);
+    file.save_bytes_raw(section.begin(), section.size());
+}
+
+// a reverse index is rebuilt when its block table changed, and copied
+// otherwise. databases without one do not get one.
+inline void write_delta_index(BinaryFile &file,
+                              const char* data_file_name,
+                              const SectionDirectory &dir,
+                              const char* name,
+                              bool changed,
+                              const std::vector<Block> &blocks,
+                              DeltaStats &stats)
+{
+    if (!dir.find(name))
+    {
+        return;
+    }
+
+    if (!changed)
+    {
+        copy_section(file, data_file_name, dir, name);
+        stats.sections_copied++;
+        return;
+    }
+
+    if (!blocks.empty())
+    {
+        file.begin_section(name);
+        save_reverse_index(file, blocks);
+    }
+}
+
+// write the updated database. block tables with changes are merged, data
+// sections are rewritten only if records were added to them, and
+// everything else is copied. sections keep their order and encodings.
+inline void write_delta(BinaryFile &file,
+                        const char* data_file_name,
+                        const SectionDirectory &dir,
+                        const GeoData &data,
+                        Delta &delta,
+                        DeltaStats &stats)
+{
+    bool has_asns = dir.find("asn.blocks");
+    bool has_pool = dir.find("str.pool");
+
+    bool added = delta.locations_added() || delta.asns_added();
+
+    // new strings mean a new pool, and so new refs in every table.
+
+    bool rewrite_locations = delta.locations_added() || (has_pool && added);
+    bool rewrite_asns = delta.asns_added() ||
+                        (has_pool && added && has_asns);
+
+    if (rewrite_locations)
+    {
+        delta.load_locations();
+    }
+
+    if (rewrite_asns)
+    {
+        delta.load_asns();
+    }
+
+    StringPool pool;
+
+    if (has_pool && added)
+    {
+        pool.add(delta.locations.country());
+        pool.add(delta.locations.region());
+        pool.add(delta.locations.city());
+
+        if (has_asns)
+        {
+            pool.add(delta.asns.text());
+        }
+
+        pool.build();
+    }
+
+    const StringPool* pool_ptr = has_pool ? &pool : 0;
+
+    // changed block tables, kept for their reverse indexes.
+
+    std::vector<Block> location_blocks;
+    std::vector<Block> asn_blocks;
+
+    if (!delta.location_changes.empty())
+    {
+        std::vector<Block> &blocks = location_blocks;
+        merge_blocks(data.location_blocks(), delta.location_changes, blocks);
+        overlay_blocks(blocks, delta.location_overlay);
+
+        file.begin_section("loc.blocks");
+        save_blocks(file, blocks, data.location_blocks().compressed());
+    }
+    else
+    {
+        copy_section(file, data_file_name, dir, "loc.blocks");
+        stats.sections_copied++;
+    }
+
+    if (rewrite_locations)
+    {
+        file.begin_section("loc.data");
+        save_locations(file, delta.locations,
+                       data.location_data().compact(), pool_ptr);
+    }
+    else
+    {
+        copy_section(file, data_file_name, dir, "loc.data");
+        stats.sections_copied++;
+    }
+
+    if (has_asns && !delta.asn_changes.empty())
+    {
+        std::vector<Block> &blocks = asn_blocks;
+        merge_blocks(data.asn_blocks(), delta.asn_changes, blocks);
+        overlay_blocks(blocks, delta.asn_overlay);
+
+        file.begin_section("asn.blocks");
+        save_blocks(file, blocks, data.asn_blocks().compressed());
+    }
+    else if (has_asns)
+    {
+        copy_section(file, data_file_name, dir, "asn.blocks");
+        stats.sections_copied++;
+    }
+
+    if (rewrite_asns)
+    {
+        save_asn_data(file, delta.asns, pool_ptr);
+    }
+    else if (has_asns)
+    {
+        copy_section(file, data_file_name, dir, "asn.data");
+        stats.sections_copied++;
+    }
+
+    // changes are v4 ranges, and records keep their indices, so the v6
+    // tables stay as they are.
+
+    if (dir.find("loc6.blocks"))
+    {
+        copy_section(file, data_file_name, dir, "loc6.blocks");
+        stats.sections_copied++;
+    }
+
+    if (dir.find("asn6.blocks"))
+    {
+        copy_section(file, data_file_name, dir, "asn6.blocks");
+        stats.sections_copied++;
+    }
+
+    if (has_pool && added)
+    {
+        save_string_pool(file, pool);
+    }
+    else if (has_pool)
+    {
+        copy_section(file, data_file_name, dir, "str.pool");
+        stats.sections_copied++;
+    }
+
+    if (dir.find("overlay"))
+    {
+        copy_section(file, data_file_name, dir, "overlay");
+        stats.sections_copied++;
+    }
+
+    write_delta_index(file, data_file_name, dir, "loc.index",
+                      !delta.location_changes.empty(), location_blocks,
+                      stats);
+    write_delta_index(file, data_file_name, dir, "asn.index",
+                      !delta.asn_changes.empty(), asn_blocks, stats);
+
+    if (dir.find("loc6.index"))
+    {
+        copy_section(file, data_file_name, dir, "loc6.index");
+        stats.sections_copied++;
+    }
+
+    if (dir.find("asn6.index"))
+    {
+        copy_section(file, data_file_name, dir, "asn6.index");
+        stats.sections_copied++;
+    }
+}
+
+inline void apply_delta(const char* data_file_name,
+                        const char* delta_file_name,
+                        const char* output,
+                        DeltaStats* stats = 0)
+{
+    LOG_CONTEXT("apply_delta %s to %s into file %s", delta_file_name,
+                data_file_name, output);
+
+    SectionDirectory dir;
+
+    if (!dir.open(data_file_name))
+    {
+        FATAL_ERROR("%s has no section directory, deltas need a v002 "
+                    "database", data_file_name);
+    }
+
+    // the older snapshots of a history file may share the latest one's
+    // tables, so a delta cannot change them in place. apply it to the
+    // latest source and rebuild the history instead.
+
+    if (dir.find("snapshots"))
+    {
+        FATAL_ERROR("%s is a history file, deltas need a plain database",
+                    data_file_name);
+    }
+
+    GeoData data;
+    data.open(data_file_name);
+
+    Delta delta(data);
+    read_delta(delta_file_name, delta);
+
+    // the overlay resolves after the changes, since it may need records
+    // that they appended.
+
+    if (const SectionEntry* entry = dir.find("overlay"))
+    {
+        MemoryFile section;
+
+        if (!section.open(data_file_name, *entry))
+        {
+            FATAL_ERROR("could not map section overlay of %s",
+                        data_file_name);
+        }
+
+        MappedVector<char> text;
+        section.load_mapped_vector(text);
+
+        Overlay overlay;
+        overlay.load(text.begin(), text.size());
+
+        delta.add_overlay(overlay);
+    }
+
+    DeltaStats local_stats;
+    DeltaStats &out_stats = stats ? *stats : local_stats;
+
+    std::string temp = output;
+    char suffix[32];
+
+    snprintf(suffix, sizeof(suffix), ".%u.tmp", (unsigned) getpid());
+    temp += suffix;
+
+    {
+        BinaryFile file;
+
+        if (!file.open(temp.c_str()))
+        {
+            FATAL_ERROR("could not open %s for writing", temp.c_str());
+        }
+
+        char buf[32]; get_header(buf, sizeof(buf));
+
+        file.save_bytes_raw(buf, sizeof(buf));
+        file.reserve_section_directory();
+
+        write_delta(file, data_file_name, dir, data, delta, out_stats);
+        file.finish();
+
+        if (!file.sync())
+        {
+            FATAL_ERROR("could not sync %s", temp.c_str());
+        }
+    }
+
+    if (rename(temp.c_str(), output) != 0)
+    {
+        FATAL_ERROR("could not rename %s to %s", temp.c_str(), output);
+    }
+
+    out_stats.loc_changes = delta.location_changes.size();
+    out_stats.asn_changes = delta.asn_changes.size();
+    out_stats.loc_added = delta.locations_added();
+    out_stats.asn_added = delta.asns_added();
+}
+
+#endif
@@ -0,0 +1,606 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module lists the ip ranges whose answer differs between two
+ * databases, for geoloc --diff old.bin new.bin, so that caches keyed on
+ * them can be invalidated after an update.
+ *
+ * The four block tables, the location and asn tables of each side, are
+ * merged in one sweep over the address space. The sweep steps from one
+ * block boundary to the next, so each step is a range where every table
+ * has one payload, and the payloads of the two sides are compared there.
+ * Then the v6 tables are swept the same way.
+ *
+ * Payloads are compared by their interned string ids when the string
+ * tables of one side start with those of the other, which is the usual case
+ * for a delta, and by the strings otherwise.
+ *
+ * Each changed range is printed as
+ *
+ * start_ip end_ip changed old_columns... new_columns...
+ *
+ * where changed is loc, asn or loc+asn, and the old and new columns are
+ * those of a query (country, region, city, latitude, longitude, as_num,
+ * as_text). Neighbouring ranges with the same old and new payloads are
+ * printed as one.
+*/
+
+#ifndef DIFF_HPP_8E4C1B27
+#define DIFF_HPP_8E4C1B27
+
+#include "query.hpp"
+
+#include <stdio.h>
+
+enum
+{
+    DIFF_LOCATION = 1,
+    DIFF_ASN = 2
+};
+
+struct DiffStats
+{
+    DiffStats()
+        :
+        ranges(0),
+        ranges6(0),
+        addresses(0),
+        location_ranges(0),
+        asn_ranges(0),
+        by_ids(false)
+    {
+    }
+
+    size_t ranges;
+    size_t ranges6;
+
+    // v4 addresses whose answer changed.
+    uint64_t addresses;
+
+    size_t location_ranges;
+    size_t asn_ranges;
+
+    // true when both string tables matched, so payloads were compared by id.
+    bool by_ids;
+};
+
+// true if ids below the size of the smaller table name the same string in
+// both. tables are interned, and updates only append to them, so then equal
+// ids are equal strings and others are not.
+inline bool same_string_ids(const MappedStringVector &a,
+                            const MappedStringVector &b)
+{
+    size_t n = std::min(a.size(), b.size());
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (strcmp(a[i], b[i]) != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// decides whether an old payload and a new one give the same answer.
+class PayloadMatch
+{
+  public:
+    PayloadMatch(const GeoData &a, const GeoData &b)
+        :
+        a_(a),
+        b_(b),
+        location_ids_(false),
+        asn_ids_(false)
+    {
+        unsigned both = a.loaded() & b.loaded();
+
+        if (both & GEO_LOCATIONS)
+        {
+            const LocationTable &la = a.location_data();
+            const LocationTable &lb = b.location_data();
+
+            location_ids_ = same_string_ids(la.country, lb.country) &&
+                            same_string_ids(la.region, lb.region) &&
+                            same_string_ids(la.city, lb.city);
+        }
+
+        if (both & GEO_ASNS)
+        {
+            asn_ids_ = same_string_ids(a.asn_data().text, b.asn_data().text);
+        }
+    }
+
+    bool by_ids() const
+    {
+        return location_ids_ && asn_ids_;
+    }
+
+    bool same_location(unsigned ia, unsigned ib) const
+    {
+        if (ia == -1U || ib == -1U)
+        {
+            return ia == ib;
+        }
+
+        const LocationTable &ta = a_.location_data();
+        const LocationTable &tb = b_.location_data();
+
+        PackedLocation la;
+        PackedLocation lb;
+
+        ta.unpack(ia, la);
+        tb.unpack(ib, lb);
+
+        if (la.lat != lb.lat || la.lon != lb.lon)
+        {
+            return false;
+        }
+
+        if (location_ids_)
+        {
+            return la.country == lb.country && la.region == lb.region &&
+                   la.city == lb.city;
+        }
+
+        return strcmp(ta.country[la.country], tb.country[lb.country]) == 0 &&
+               strcmp(ta.region[la.region], tb.region[lb.region]) == 0 &&
+               strcmp(ta.city[la.city], tb.city[lb.city]) == 0;
+    }
+
+    bool same_asn(unsigned ia, unsigned ib) const
+    {
+        if (ia == -1U || ib == -1U)
+        {
+            return ia == ib;
+        }
+
+        const ASNTable &ta = a_.asn_data();
+        const ASNTable &tb = b_.asn_data();
+
+        const PackedASN &na = ta.asns[ia];
+        const PackedASN &nb = tb.asns[ib];
+
+        if (na.number != nb.number)
+        {
+            return false;
+        }
+
+        if (asn_ids_)
+        {
+            return na.text == nb.text;
+        }
+
+        return strcmp(ta.text[na.text], tb.text[nb.text]) == 0;
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(PayloadMatch);
+
+    const GeoData &a_;
+    const GeoData &b_;
+
+    bool location_ids_;
+    bool asn_ids_;
+};
+
+// a block table read in order by the sweep.
+class DiffCursor
+{
+  public:
+    explicit DiffCursor(const BlockTable &table)
+        :
+        iter_(table),
+        valid_(false),
+        block_()
+    {
+        advance();
+    }
+
+    void advance()
+    {
+        valid_ = iter_.next(block_);
+    }
+
+    bool valid() const
+    {
+        return valid_;
+    }
+
+    unsigned start() const
+    {
+        return block_.start_ip;
+    }
+
+    unsigned end() const
+    {
+        return block_.end_ip;
+    }
+
+    unsigned payload() const
+    {
+        return block_.loc;
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(DiffCursor);
+
+    BlockIterator iter_;
+    bool valid_;
+    Block block_;
+};
+
+class DiffCursor6
+{
+  public:
+    explicit DiffCursor6(const Block6Table &table)
+        :
+        table_(table),
+        next_(0),
+        valid_(false),
+        block_()
+    {
+        advance();
+    }
+
+    void advance()
+    {
+        valid_ = next_ < table_.size();
+
+        if (valid_)
+        {
+            table_.get(next_++, block_);
+        }
+    }
+
+    bool valid() const
+    {
+        return valid_;
+    }
+
+    const IP6 &start() const
+    {
+        return block_.start;
+    }
+
+    const IP6 &end() const
+    {
+        return block_.end;
+    }
+
+    unsigned payload() const
+    {
+        return block_.loc;
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(DiffCursor6);
+
+    const Block6Table &table_;
+    size_t next_;
+    bool valid_;
+    Block6 block_;
+};
+
+// the addresses in a range. only v4 ones are counted.
+inline uint64_t diff_width(unsigned start, unsigned end)
+{
+    return (uint64_t) end - start + 1;
+}
+
+inline uint64_t diff_width(const IP6 &, const IP6 &)
+{
+    return 0;
+}
+
+// one changed range, being extended while the payloads stay the same.
+template <typename Address>
+struct DiffRange
+{
+    Address start;
+    Address end;
+    unsigned payloads[4];
+    unsigned changed;
+};
+
+template <typename Address>
+class DiffWriter
+{
+  public:
+    DiffWriter(const GeoData &a, const GeoData &b, FILE* out)
+        :
+        a_(a),
+        b_(b),
+        out_(out),
+        pending_(false),
+        range_(),
+        ranges_(0),
+        addresses_(0),
+        location_ranges_(0),
+        asn_ranges_(0)
+    {
+    }
+
+    // the range [start, end] changed, with the old and new location and
+    // asn payloads.
+    void add(const Address &start,
+             const Address &end,
+             const unsigned payloads[4],
+             unsigned changed)
+    {
+        addresses_ += diff_width(start, end);
+
+        if (pending_ && ip_next(range_.end) == start &&
+            memcmp(range_.payloads, payloads, sizeof(range_.payloads)) == 0)
+        {
+            range_.end = end;
+            return;
+        }
+
+        flush();
+
+        range_.start = start;
+        range_.end = end;
+        memcpy(range_.payloads, payloads, sizeof(range_.payloads));
+        range_.changed = changed;
+
+        pending_ = true;
+    }
+
+    void flush()
+    {
+        if (!pending_)
+        {
+            return;
+        }
+
+        pending_ = false;
+        ranges_++;
+
+        if (range_.changed & DIFF_LOCATION) location_ranges_++;
+        if (range_.changed & DIFF_ASN) asn_ranges_++;
+
+        if (!out_)
+        {
+            return;
+        }
+
+        char buf[64];
+
+        line_.clear();
+
+        line_.append(buf, ip_to_s(buf, range_.start));
+        line_ += ' ';
+        line_.append(buf, ip_to_s(buf, range_.end));
+        line_ += ' ';
+
+        line_ += range_.changed == DIFF_LOCATION ? "loc" :
+                 range_.changed == DIFF_ASN ? "asn" : "loc+asn";
+
+        IPResult old_result;
+        IPResult new_result;
+
+        a_.resolve(0, range_.payloads[0], range_.payloads[1], old_result);
+        b_.resolve(0, range_.payloads[2], range_.payloads[3], new_result);
+
+        append(old_result);
+        append(new_result);
+
+        line_ += '\n';
+
+        size_t n = fwrite(line_.data(), line_.size(), 1, out_);
+        REL_ASSERT(n == 1);
+    }
+
+    size_t ranges() const { return ranges_; }
+    uint64_t addresses() const { return addresses_; }
+    size_t location_ranges() const { return location_ranges_; }
+    size_t asn_ranges() const { return asn_ranges_; }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(DiffWriter);
+
+    void append(const char* s)
+    {
+        line_ += ' ';
+
+        escape(esc_buf_, s);
+        line_ += esc_buf_;
+    }
+
+    void append(const IPResult &result)
+    {
+        char buf[32];
+
+        append(result.country);
+        append(result.region);
+        append(result.city);
+
+        sprintf(buf, "%3.4f", result.lat);
+        append(buf);
+        sprintf(buf, "%3.4f", result.lon);
+        append(buf);
+
+        if (result.asn)
+        {
+            sprintf(buf, "AS%u", *result.asn);
+            append(buf);
+        }
+        else
+        {
+            append((const char*) 0);
+        }
+
+        append(result.asn_text);
+    }
+
+    const GeoData &a_;
+    const GeoData &b_;
+    FILE* out_;
+
+    bool pending_;
+    DiffRange<Address> range_;
+
+    size_t ranges_;
+    uint64_t addresses_;
+    size_t location_ranges_;
+    size_t asn_ranges_;
+
+    std::string line_;
+    std::string esc_buf_;
+};
+
+// merge the old location, old asn, new location and new asn tables, in
+// that order, comparing the payloads of each step.
+template <typename Address, typename Cursor>
+inline void diff_sweep(Cursor* cursors[4],
+                       const PayloadMatch &match,
+                       DiffWriter<Address> &writer)
+{
+    Address ip = Address();
+
+    while (true)
+    {
+        // the step ends where the first block ends, or before the next
+        // block starts.
+
+        Address end = Address();
+        end = ip_prev(end);
+
+        unsigned payloads[4];
+
+        for (size_t i = 0; i < 4; ++i)
+        {
+            const Cursor &c = *cursors[i];
+
+            payloads[i] = -1U;
+
+            if (!c.valid())
+            {
+                continue;
+            }
+
+            if (c.start() <= ip)
+            {
+                payloads[i] = c.payload();
+
+                if (c.end() < end)
+                {
+                    end = c.end();
+                }
+            }
+            else if (ip_prev(c.start()) < end)
+            {
+                end = ip_prev(c.start());
+            }
+        }
+
+        unsigned changed = 0;
+
+        if (!match.same_location(payloads[0], payloads[2]))
+        {
+            changed |= DIFF_LOCATION;
+        }
+
+        if (!match.same_asn(payloads[1], payloads[3]))
+        {
+            changed |= DIFF_ASN;
+        }
+
+        if (changed)
+        {
+            writer.add(ip, end, payloads, changed);
+        }
+
+        if (ip_is_max(end))
+        {
+            break;
+        }
+
+        for (size_t i = 0; i < 4; ++i)
+        {
+            Cursor &c = *cursors[i];
+
+            if (c.valid() && c.end() == end)
+            {
+                c.advance();
+            }
+        }
+
+        ip = ip_next(end);
+    }
+
+    writer.flush();
+}
+
+// write the ranges that differ between a and b to out, which may be 0.
+inline void diff_results(const GeoData &a,
+                         const GeoData &b,
+                         FILE* out,
+                         DiffStats &stats)
+{
+    PayloadMatch match(a, b);
+
+    stats.by_ids = match.by_ids();
+
+    {
+        DiffCursor old_location(a.location_blocks());
+        DiffCursor old_asn(a.asn_blocks());
+        DiffCursor new_location(b.location_blocks());
+        DiffCursor new_asn(b.asn_blocks());
+
+        DiffCursor* cursors[4] = { &old_location, &old_asn,
+                                   &new_location, &new_asn };
+
+        DiffWriter<unsigned> writer(a, b, out);
+        diff_sweep(cursors, match, writer);
+
+        stats.ranges = writer.ranges();
+        stats.addresses = writer.addresses();
+        stats.location_ranges = writer.location_ranges();
+        stats.asn_ranges = writer.asn_ranges();
+    }
+
+    DiffCursor6 old_location(a.location_blocks6());
+    DiffCursor6 old_asn(a.asn_blocks6());
+    DiffCursor6 new_location(b.location_blocks6());
+    DiffCursor6 new_asn(b.asn_blocks6());
+
+    DiffCursor6* cursors[4] = { &old_location, &old_asn,
+                                &new_location, &new_asn };
+
+    DiffWriter<IP6> writer(a, b, out);
+    diff_sweep(cursors, match, writer);
+
+    stats.ranges6 = writer.ranges();
+    stats.location_ranges += writer.location_ranges();
+    stats.asn_ranges += writer.asn_ranges();
+}
+
+inline void diff(const char* a_file_name, const char* b_file_name)
+{
+    LOG_CONTEXT("diff %s with %s", a_file_name, b_file_name);
+
+    GeoData a;
+    a.open(a_file_name);
+
+    GeoData b;
+    b.open(b_file_name);
+
+    DiffStats stats;
+    diff_results(a, b, stdout, stats);
+
+    fprintf(stderr, "%zu v4 and %zu v6 ranges changed, %llu v4 addresses, "
+            "%zu in location and %zu in asn, compared by %s\n",
+            stats.ranges, stats.ranges6,
+            (unsigned long long) stats.addresses,
+            stats.location_ranges, stats.asn_ranges,
+            stats.by_ids ? "ids" : "strings");
+}
+
+#endif
@@ -15,11 +15,13 @@
 #include "error.hpp"
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 static char error_buf_[8192] = {0};
 static size_t error_offset_ = 0;
 static size_t avail_ = 0;
 static char print_buf_[4096] = {0};
+static pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
 
 // note - log messages larger than 4095 bytes will get truncated to 4095.
 
@@ -28,6 +30,9 @@ void log_context(const char* file, unsigned line, const char* fmt, ...)
     va_list ap;
     int n = 0;
 
+    // the etl runs on several threads.
+    pthread_mutex_lock(&lock_);
+
     va_start(ap, fmt);
     n = vsnprintf(print_buf_, 4096, fmt, ap);
     va_end(ap);
@@ -50,6 +55,8 @@ void log_context(const char* file, unsigned line, const char* fmt, ...)
     {
         avail_ = 4096;
     }
+
+    pthread_mutex_unlock(&lock_);
 }
 
 static void log_dump()
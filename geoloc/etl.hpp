@@ -14,66 +14,769 @@
 
 #include "serialization.hpp"
 #include "pipeline.hpp"
+#include "csv_scanner.hpp"
 #include "locations.hpp"
 #include "blocks.hpp"
+#include "block_sort.hpp"
 #include "asns.hpp"
+#include "ip6.hpp"
+#include "overlay.hpp"
+#include "hash_map.hpp"
+#include "thread.hpp"
 
-inline void build_locations(BinaryFile &file, const char* source)
+#include <algorithm>
+
+// the smallest chunk of the blocks csv worth a thread of its own.
+#define MIN_CHUNKED_CSV (1U << 20)
+
+struct ImportOptions
 {
-    LOG_CONTEXT("build_locations from %s", source);
+    ImportOptions()
+        :
+        compress_blocks(false),
+        compact_locations(false),
+        string_pool(false),
+        coalesce(false),
+        ranges_index(false),
+        granularity(GRANULARITY_CITY),
+        no_asn(false),
+        profile(),
+        overlay(),
+        threads(cpu_count()),
+        report(0)
+    {
+    }
 
-    FileReader reader(source);
-    LocationParser parser;
+    // store block tables bit packed (ZBLK), rather than as raw columns.
+    bool compress_blocks;
 
-    std::vector<Location> locations;
-    Collector<Location> collector(locations);
+    // store locations as dense, bit packed records (CLOC).
+    bool compact_locations;
 
-    reader | parser | collector;
-    reader.produce();
+    // store all strings once, in a shared str.pool section.
+    bool string_pool;
+
+    // merge contiguous blocks that have the same payload.
+    bool coalesce;
+
+    // add a reverse index of each block table (*.index), from payloads to
+    // their blocks, for geoloc --ranges.
+    bool ranges_index;
+
+    // GRANULARITY_COUNTRY or _REGION build a slim database, with one
+    // location per country or region. its blocks are always coalesced.
+    unsigned granularity;
+
+    // leave out the asn sections.
+    bool no_asn;
+
+    // a file of sample ips. locations and asns are numbered by how often
+    // the sample hits them, so the hot records share lines and pages.
+    std::string profile;
+
+    // a csv of user ranges to lay over the source, see overlay.hpp.
+    std::string overlay;
+
+    // workers used to parse the blocks csv, and to sort unsorted ranges.
+    unsigned threads;
+
+    // where to print the first few conflicting ranges of a source, if
+    // anywhere.
+    FILE* report;
+};
+
+// block counts before and after coalescing, and the number of ranges that
+// overlapped others.
+struct ImportStats
+{
+    ImportStats()
+        :
+        loc_blocks(0),
+        loc_coalesced(0),
+        loc_conflicts(0),
+        asn_blocks(0),
+        asn_coalesced(0),
+        asn_conflicts(0),
+        overlay_ranges(0),
+        overlay_conflicts(0)
+    {
+    }
+
+    size_t loc_blocks;
+    size_t loc_coalesced;
+    size_t loc_conflicts;
+
+    size_t asn_blocks;
+    size_t asn_coalesced;
+    size_t asn_conflicts;
+
+    size_t overlay_ranges;
+    size_t overlay_conflicts;
+};
 
-    save_locations(file, locations);
+// csvs are mapped and tokenized in place, by CsvScanner.
+inline void map_csv(MemoryMap &csv, const char* source)
+{
+    if (!csv.open(source))
+    {
+        FATAL_ERROR("could not open %s", source);
+    }
 }
 
-inline void build_blocks(BinaryFile &file, const char* source)
+inline void read_locations(const char* source, LocationBuilder &out)
 {
-    LOG_CONTEXT("build_blocks from %s", source);
+    LOG_CONTEXT("read_locations from %s", source);
 
-    FileReader reader(source);
-    BlockParser parser;
+    MemoryMap csv;
+    map_csv(csv, source);
 
-    std::vector<Block> blocks;
-    Collector<Block> collector(blocks);
+    CsvScanner reader(csv.begin(), csv.begin() + csv.size());
+    LocationParser parser(out);
 
-    reader | parser | collector;
+    reader | parser;
     reader.produce();
+}
+
+// parses one line aligned chunk of the blocks csv.
+class BlockChunkTask : public Thread
+{
+  public:
+    BlockChunkTask(const char* begin, const char* end, size_t skip)
+        :
+        blocks(),
+        begin_(begin),
+        end_(end),
+        skip_(skip)
+    {
+    }
+
+    std::vector<Block> blocks;
 
-    save_blocks(file, blocks);
+  protected:
+    void run()
+    {
+        CsvScanner reader(begin_, end_);
+        BlockParser parser(blocks, skip_);
+
+        reader | parser;
+        reader.produce();
+    }
+
+  private:
+    const char* begin_;
+    const char* end_;
+    size_t skip_;
+};
+
+// the blocks csv is by far the largest, so it is split into chunks that are
+// parsed in parallel, then concatenated in order. each chunk is freed as soon
+// as it is copied, and a single chunk is moved rather than copied.
+inline void read_blocks(const char* source,
+                        std::vector<Block> &out,
+                        unsigned threads)
+{
+    LOG_CONTEXT("read_blocks from %s", source);
+
+    MemoryMap csv;
+    map_csv(csv, source);
+
+    if (csv.size() == 0)
+    {
+        return;
+    }
+
+    // chunks are at least MIN_CHUNKED_CSV, so the first one holds both
+    // header lines.
+
+    size_t chunks = chunk_count(csv.size(), MIN_CHUNKED_CSV, threads);
+
+    std::vector<const char*> bounds = 
+        split_lines(csv.begin(), csv.begin() + csv.size(), chunks);
+
+    std::vector<BlockChunkTask*> tasks;
+
+    for (size_t i = 0; i + 1 < bounds.size(); ++i)
+    {
+        tasks.push_back(new BlockChunkTask(bounds[i], bounds[i+1],
+                                           i == 0 ? 2 : 0));
+        tasks.back()->start();
+    }
+
+    size_t total = 0;
+
+    for (size_t i = 0; i < tasks.size(); ++i)
+    {
+        tasks[i]->join();
+        total += tasks[i]->blocks.size();
+    }
+
+    if (tasks.size() == 1)
+    {
+        out.swap(tasks[0]->blocks);
+    }
+    else
+    {
+        out.reserve(total);
+    }
+
+    for (size_t i = 0; i < tasks.size(); ++i)
+    {
+        out.insert(out.end(), tasks[i]->blocks.begin(),
+                   tasks[i]->blocks.end());
+        delete tasks[i];
+    }
 }
 
-inline void build_asns(BinaryFile &file, const char* source)
+// parses one line aligned chunk of the asn csv, interning its text into a
+// table shared with the other chunks.
+class ASNChunkTask : public Thread
 {
-    LOG_CONTEXT("build_asns from %s", source);
+  public:
+    ASNChunkTask(const char* begin, const char* end, ShardedStringTable &text)
+        :
+        rows(),
+        begin_(begin),
+        end_(end),
+        text_(text)
+    {
+    }
 
-    FileReader reader(source);
-    ASNParser parser;
+    std::vector<ASNRow> rows;
 
-    std::vector<ASN> asns;
-    Collector<ASN> collector(asns);
+  protected:
+    void run()
+    {
+        CsvScanner reader(begin_, end_);
+        ASNParser parser(rows, text_);
 
-    reader | parser | collector;
-    reader.produce();
+        reader | parser;
+        reader.produce();
+    }
+
+  private:
+    const char* begin_;
+    const char* end_;
+    ShardedStringTable &text_;
+};
+
+// the asn csv is split and parsed like the blocks csv. the chunks intern
+// their text into one sharded table, then the rows are added to out in csv
+// order, so the text ids are as if it were read on one thread, and each asn
+// keeps the text it was first seen with.
+inline void read_asns(const char* source, ASNBuilder &out, unsigned threads)
+{
+    LOG_CONTEXT("read_asns from %s", source);
+
+    MemoryMap csv;
+    map_csv(csv, source);
+
+    if (csv.size() == 0)
+    {
+        return;
+    }
+
+    size_t chunks = chunk_count(csv.size(), MIN_CHUNKED_CSV, threads);
+
+    std::vector<const char*> bounds = 
+        split_lines(csv.begin(), csv.begin() + csv.size(), chunks);
+
+    ShardedStringTable text;
+    std::vector<ASNChunkTask*> tasks;
+
+    for (size_t i = 0; i + 1 < bounds.size(); ++i)
+    {
+        tasks.push_back(new ASNChunkTask(bounds[i], bounds[i+1], text));
+        tasks.back()->start();
+    }
+
+    for (size_t i = 0; i < tasks.size(); ++i)
+    {
+        tasks[i]->join();
+    }
+
+    for (size_t i = 0; i < tasks.size(); ++i)
+    {
+        const std::vector<ASNRow> &rows = tasks[i]->rows;
+
+        for (size_t j = 0; j < rows.size(); ++j)
+        {
+            const ASNRow &row = rows[j];
+
+            out.add(row.start_ip, row.end_ip, row.number, text[row.text],
+                    text.length(row.text));
+        }
+
+        delete tasks[i];
+    }
+}
+
+// point the blocks at new location numbers. blocks that point at a missing
+// location are dropped, they could only ever resolve to an empty location.
+inline void remap_blocks(const hash_map<unsigned, unsigned> &id_map,
+                         std::vector<Block> &blocks)
+{
+    size_t kept = 0;
+
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        hash_map<unsigned, unsigned>::const_iterator iter = 
+            id_map.find(blocks[i].loc);
+
+        if (iter == id_map.end())
+        {
+            continue;
+        }
+
+        blocks[kept] = blocks[i];
+        blocks[kept].loc = iter->second;
+        kept++;
+    }
+
+    if (kept != blocks.size())
+    {
+        LOG_CONTEXT("dropped %zu blocks with missing locations",
+                    blocks.size() - kept);
+    }
+
+    blocks.resize(kept);
+}
+
+// number locations densely in id order, for CLOC.
+inline void renumber_locations(LocationBuilder &locations,
+                               std::vector<Block> &blocks,
+                               std::vector<Block6> &blocks6)
+{
+    LOG_CONTEXT("renumber_locations");
+
+    hash_map<unsigned, unsigned> id_to_dense;
+    locations.renumber(id_to_dense);
+
+    remap_blocks(id_to_dense, blocks);
+    remap_blocks6(id_to_dense, blocks6);
+}
+
+// number locations by how often the sample hits them. samples are v4, so
+// only v4 blocks count hits.
+inline void reorder_locations(LocationBuilder &locations,
+                              const std::vector<unsigned> &sample,
+                              std::vector<Block> &blocks,
+                              std::vector<Block6> &blocks6)
+{
+    LOG_CONTEXT("reorder_locations with %zu sample ips", sample.size());
+
+    hash_map<unsigned, size_t> hits;
+    count_hits(blocks, sample, hits);
+
+    hash_map<unsigned, unsigned> id_map;
+    locations.reorder(hits, id_map);
+
+    remap_blocks(id_map, blocks);
+    remap_blocks6(id_map, blocks6);
+}
+
+// merge locations down to the granularity of a slim database.
+inline void project_locations(LocationBuilder &locations,
+                              unsigned granularity,
+                              std::vector<Block> &blocks,
+                              std::vector<Block6> &blocks6)
+{
+    LOG_CONTEXT("project_locations to granularity %u", granularity);
+
+    hash_map<unsigned, unsigned> id_to_coarse;
+    locations.project(granularity, id_to_coarse);
+
+    remap_blocks(id_to_coarse, blocks);
+    remap_blocks6(id_to_coarse, blocks6);
+}
+
+class LocationTask : public Thread
+{
+  public:
+    explicit LocationTask(const char* source)
+        :
+        locations(),
+        source_(source)
+    {
+    }
+
+    LocationBuilder locations;
+
+  protected:
+    void run()
+    {
+        read_locations(source_, locations);
+    }
+
+  private:
+    const char* source_;
+};
 
-    save_asns(file, asns);
+// the asn tables do not depend on anything else, so they are read and
+// saved in one go, into memory. with a string pool, asn.data has to wait
+// for the pool, and is saved later. with no source, asns is filled in by
+// the caller before the task starts.
+class ASNTask : public Thread
+{
+  public:
+    ASNTask(const char* source,
+            const ImportOptions &options,
+            const std::vector<unsigned> &sample,
+            const Overlay &overlay)
+        :
+        out(),
+        asns(),
+        blocks(0),
+        coalesced(0),
+        conflicts(0),
+        source_(source),
+        options_(options),
+        sample_(sample),
+        overlay_(overlay)
+    {
+        out.open_memory();
+    }
+
+    BinaryFile out;
+    ASNBuilder asns;
+
+    size_t blocks;
+    size_t coalesced;
+    size_t conflicts;
+
+  protected:
+    void run()
+    {
+        if (source_)
+        {
+            read_asns(source_, asns, options_.threads);
+        }
+
+        conflicts = asns.normalize(options_.threads, options_.report);
+
+        if (!overlay_.empty())
+        {
+            overlay_asns(overlay_, asns, options_.threads);
+        }
+
+        blocks = asns.blocks().size();
+
+        if (!sample_.empty())
+        {
+            asns.reorder(sample_);
+        }
+
+        if (options_.coalesce)
+        {
+            coalesced = asns.coalesce();
+        }
+
+        save_asn_blocks(out, asns, options_.compress_blocks);
+
+        if (!asns.blocks6().empty())
+        {
+            save_asn_blocks6(out, asns);
+        }
+
+        if (!options_.string_pool)
+        {
+            save_asn_data(out, asns);
+        }
+    }
+
+  private:
+    const char* source_;
+    const ImportOptions &options_;
+    const std::vector<unsigned> &sample_;
+    const Overlay &overlay_;
+};
+
+class SaveBlocksTask : public Thread
+{
+  public:
+    SaveBlocksTask(const std::vector<Block> &blocks,
+                   const ImportOptions &options)
+        :
+        out(),
+        blocks_(blocks),
+        options_(options)
+    {
+        out.open_memory();
+    }
+
+    BinaryFile out;
+
+  protected:
+    void run()
+    {
+        out.begin_section("loc.blocks");
+        save_blocks(out, blocks_, options_.compress_blocks);
+    }
+
+  private:
+    const std::vector<Block> &blocks_;
+    const ImportOptions &options_;
+};
+
+class SaveLocationsTask : public Thread
+{
+  public:
+    SaveLocationsTask(const LocationBuilder &locations,
+                      const ImportOptions &options,
+                      const StringPool* pool)
+        :
+        out(),
+        locations_(locations),
+        options_(options),
+        pool_(pool)
+    {
+        out.open_memory();
+    }
+
+    BinaryFile out;
+
+  protected:
+    void run()
+    {
+        out.begin_section("loc.data");
+        save_locations(out, locations_, options_.compact_locations, pool_);
+    }
+
+  private:
+    const LocationBuilder &locations_;
+    const ImportOptions &options_;
+    const StringPool* pool_;
+};
+
+// the profile sample and the overlay, if the options name them.
+inline void read_import_inputs(const ImportOptions &options,
+                               std::vector<unsigned> &sample,
+                               Overlay &overlay)
+{
+    if (!options.profile.empty() &&
+        !read_quads(options.profile.c_str(), sample))
+    {
+        FATAL_ERROR("could not read profile %s", options.profile.c_str());
+    }
+
+    if (!options.overlay.empty() && !overlay.read(options.overlay.c_str()))
+    {
+        FATAL_ERROR("could not read overlay %s", options.overlay.c_str());
+    }
 }
 
+// the reverse index of each block table that was saved.
+inline void save_reverse_indexes(BinaryFile &file,
+                                 const std::vector<Block> &blocks,
+                                 const std::vector<Block6> &blocks6,
+                                 const ASNTask &asns,
+                                 const ImportOptions &options)
+{
+    LOG_CONTEXT("save_reverse_indexes");
+
+    if (!blocks.empty())
+    {
+        file.begin_section("loc.index");
+        save_reverse_index(file, blocks);
+    }
+
+    if (!blocks6.empty())
+    {
+        file.begin_section("loc6.index");
+        save_reverse_index(file, blocks6);
+    }
+
+    if (options.no_asn)
+    {
+        return;
+    }
+
+    if (!asns.asns.blocks().empty())
+    {
+        file.begin_section("asn.index");
+        save_reverse_index(file, asns.asns.blocks());
+    }
+
+    if (!asns.asns.blocks6().empty())
+    {
+        file.begin_section("asn6.index");
+        save_reverse_index(file, asns.asns.blocks6());
+    }
+}
+
+// each table goes into its own section, so readers can map just the
+// sections they need:
+//
+// loc.blocks - location block table
+// loc.data   - location strings and packed locations
+// asn.blocks - asn block table
+// asn.data   - asn strings and packed asns
+// loc6.blocks - ipv6 location block table, if there are v6 blocks
+// asn6.blocks - ipv6 asn block table, if there are v6 blocks
+// str.pool   - shared strings, with --string-pool
+// overlay    - the overlay csv, with --overlay
+// loc.index, asn.index, loc6.index, asn6.index - reverse indexes of the
+//              block tables, with --ranges-index
+//
+// --no-asn builds leave out the asn sections.
+//
+// each section is saved into a memory buffer on its own thread. the buffers
+// are then appended in order.
+//
+// save_geo_data transforms the tables of a source that has been read, and
+// saves them. the location blocks must be normalized, and asns must have
+// been started unless options.no_asn is set.
+inline void save_geo_data(BinaryFile &file,
+                          LocationBuilder &locations,
+                          std::vector<Block> &blocks,
+                          std::vector<Block6> &blocks6,
+                          ASNTask &asns,
+                          const std::vector<unsigned> &sample,
+                          const Overlay &overlay,
+                          const ImportOptions &options,
+                          ImportStats &stats)
+{
+    // the overlay's locations are numbered after the source's, before any
+    // renumbering.
+
+    if (!overlay.empty())
+    {
+        stats.overlay_ranges = overlay.ranges().size();
+        stats.overlay_conflicts = overlay_locations(overlay, locations,
+                                                    blocks, options.threads,
+                                                    options.report);
+    }
+
+    bool slim = options.granularity != GRANULARITY_CITY;
+
+    if (slim)
+    {
+        project_locations(locations, options.granularity, blocks, blocks6);
+    }
+    else if (options.compact_locations && sample.empty())
+    {
+        renumber_locations(locations, blocks, blocks6);
+    }
+
+    // reordering numbers the locations densely too.
+
+    if (!sample.empty())
+    {
+        reorder_locations(locations, sample, blocks, blocks6);
+    }
+
+    stats.loc_blocks = blocks.size();
+
+    if (options.coalesce || slim)
+    {
+        stats.loc_coalesced = coalesce_blocks(blocks);
+        coalesce_blocks6(blocks6);
+    }
+
+    StringPool pool;
+
+    if (options.string_pool)
+    {
+        asns.join();
+
+        pool.add(locations.country());
+        pool.add(locations.region());
+        pool.add(locations.city());
+        if (!options.no_asn)
+        {
+            pool.add(asns.asns.text());
+        }
+
+        pool.build();
+    }
+
+    const StringPool* pool_ptr = options.string_pool ? &pool : 0;
+
+    SaveBlocksTask save_blocks(blocks, options);
+    SaveLocationsTask save_locations(locations, options, pool_ptr);
+
+    save_blocks.start();
+    save_locations.start();
+
+    asns.join();
+
+    stats.asn_blocks = asns.blocks;
+    stats.asn_coalesced = asns.coalesced;
+    stats.asn_conflicts = asns.conflicts;
+
+    if (pool_ptr && !options.no_asn)
+    {
+        save_asn_data(asns.out, asns.asns, pool_ptr);
+    }
+
+    save_blocks.join();
+    save_locations.join();
+
+    file.append(save_blocks.out);
+    file.append(save_locations.out);
+
+    if (!blocks6.empty())
+    {
+        file.begin_section("loc6.blocks");
+        save_blocks6(file, blocks6);
+    }
+
+    if (!options.no_asn)
+    {
+        file.append(asns.out);
+    }
+
+    if (pool_ptr)
+    {
+        save_string_pool(file, pool);
+    }
+
+    if (!overlay.empty())
+    {
+        save_overlay(file, overlay);
+    }
+
+    if (options.ranges_index)
+    {
+        save_reverse_indexes(file, blocks, blocks6, asns, options);
+    }
+}
+
+// the three csvs are read concurrently.
 inline void build_geo_data(BinaryFile &file, 
                            const char* city_blocks, 
                            const char* city_locs,
-                           const char* geo_asns)
+                           const char* geo_asns,
+                           const ImportOptions &options,
+                           ImportStats &stats)
 {
-    build_blocks(file, city_blocks);
-    build_locations(file, city_locs);
-    build_asns(file, geo_asns);
+    std::vector<unsigned> sample;
+    Overlay overlay;
+
+    read_import_inputs(options, sample, overlay);
+
+    LocationTask locations(city_locs);
+    ASNTask asns(geo_asns, options, sample, overlay);
+
+    locations.start();
+
+    if (!options.no_asn)
+    {
+        asns.start();
+    }
+
+    std::vector<Block> blocks;
+    read_blocks(city_blocks, blocks, options.threads);
+
+    // the legacy csvs are v4 only.
+    std::vector<Block6> blocks6;
+
+    stats.loc_conflicts = normalize_blocks(blocks, options.threads,
+                                           "location", options.report);
+
+    locations.join();
+
+    save_geo_data(file, locations.locations, blocks, blocks6, asns, sample,
+                  overlay, options, stats);
 }
 
 inline void get_header(char* buf, size_t n)
@@ -82,7 +785,7 @@ inline void get_header(char* buf, size_t n)
 
     memset(buf, '-', n);
 
-    int np = snprintf(buf, n, "geoloc loadzero v001 %s ", get_endian());
+    int np = snprintf(buf, n, "geoloc loadzero v002 %s ", get_endian());
 
     REL_ASSERT(np >= 0);
 
@@ -98,7 +801,9 @@ inline void get_header(char* buf, size_t n)
 inline void etl(const char* city_blocks,
                 const char* city_locs,
                 const char* geo_asns,
-                const char* output)
+                const char* output,
+                const ImportOptions &options = ImportOptions(),
+                ImportStats* stats = 0)
 {
     LOG_CONTEXT("etl blocks %s locs %s asns %s into file %s", 
                  city_blocks,
@@ -117,7 +822,13 @@ inline void etl(const char* city_blocks,
     char buf[32]; get_header(buf, sizeof(buf));
 
     file.save_bytes_raw(buf, sizeof(buf));
-    build_geo_data(file, city_blocks, city_locs, geo_asns);
+    file.reserve_section_directory();
+
+    ImportStats local_stats;
+
+    build_geo_data(file, city_blocks, city_locs, geo_asns, options,
+                   stats ? *stats : local_stats);
+    file.finish();
 }
 
 #endif
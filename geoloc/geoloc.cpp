@@ -19,6 +19,15 @@
 
 #include "etl.hpp"
 #include "query.hpp"
+#include "shm_ring.hpp"
+#include "bench.hpp"
+#include "delta.hpp"
+#include "mmdb.hpp"
+#include "history.hpp"
+#include "diff.hpp"
+#include "count.hpp"
+#include "sketch.hpp"
+#include "ranges.hpp"
 #include "error.hpp"
 #include "args.hpp"
 
@@ -33,7 +42,42 @@ static void usage(const char* condition)
 
     fprintf(stderr, "usage:");
     fprintf(stderr, "\tgeoloc -f file ... [--headers]\n");
-    fprintf(stderr, "\tgeoloc -q ip ...\n");
+    fprintf(stderr, "\tgeoloc -f file ... --count-by "
+                    "country|region|city|asn[,...] [--distinct] "
+                    "[--threads n]\n");
+    fprintf(stderr, "\tgeoloc -f file ... --sketch [--top k] "
+                    "[--dump-every lines] [--threads n]\n");
+    fprintf(stderr, "\tgeoloc -q ip|ip/len|start-end ... [--summary]\n");
+    fprintf(stderr, "\tgeoloc (-f file ... | -q ip ...) "
+                    "--where country|region|city|asn=value[,...] ... "
+                    "[query options]\n");
+    fprintf(stderr, "\tgeoloc --import dir -o file [--compress-blocks] "
+                    "[--compact-locations] [--string-pool] [--coalesce] "
+                    "[--granularity country|region|city] [--no-asn] "
+                    "[--profile ips] [--overlay csv] [--ranges-index] "
+                    "[--threads n]\n");
+    fprintf(stderr, "\tgeoloc --import-mmdb file.mmdb ... -o file "
+                    "[import options]\n");
+    fprintf(stderr, "\tgeoloc --apply-delta old.bin changes.csv -o new.bin\n");
+    fprintf(stderr, "\tgeoloc --history YYYY-MM file.bin ... -o file "
+                    "[--compress-blocks] [--compact-locations] "
+                    "[--string-pool]\n");
+    fprintf(stderr, "\tgeoloc --verify\n");
+    fprintf(stderr, "\tgeoloc --compare a.bin b.bin\n");
+    fprintf(stderr, "\tgeoloc --diff old.bin new.bin\n");
+    fprintf(stderr, "\tgeoloc --ranges country|region|city|asn=value[,...] "
+                    "... [--cidr]\n");
+    fprintf(stderr, "\tgeoloc --bench ips\n");
+    fprintf(stderr, "\tgeoloc --shm-serve ring_file\n");
+    fprintf(stderr, "\tgeoloc --shm ring_file (-f file ... | -q ip ...)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "load options:\n");
+    fprintf(stderr, "\t--prefault\tfault the database in at startup\n");
+    fprintf(stderr, "\t--mlock\t\tlock the database into memory\n");
+    fprintf(stderr, "\t--hugepages\tcopy block tables into huge pages\n");
+    fprintf(stderr, "\t--load-report\treport load times to stderr\n");
+    fprintf(stderr, "\t--as-of YYYY-MM\tquery a history file as it was "
+                    "then\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "This software includes GeoLite data created by MaxMind\n");
     fprintf(stderr, "available from http://www.maxmind.com\n");
@@ -54,6 +98,31 @@ static std::string default_file()
     return home_dir + "/var/db/geoloc/geodata.bin";
 }
 
+static void report_import(const ImportOptions &options,
+                          const ImportStats &stats)
+{
+    if (options.coalesce || options.granularity != GRANULARITY_CITY)
+    {
+        fprintf(stderr, "coalesced %zu of %zu location blocks, "
+                        "%zu of %zu asn blocks\n",
+                stats.loc_coalesced, stats.loc_blocks,
+                stats.asn_coalesced, stats.asn_blocks);
+    }
+
+    if (stats.loc_conflicts || stats.asn_conflicts)
+    {
+        fprintf(stderr, "resolved %zu conflicting location ranges and "
+                        "%zu asn ranges, narrower ranges win\n",
+                stats.loc_conflicts, stats.asn_conflicts);
+    }
+
+    if (stats.overlay_ranges)
+    {
+        fprintf(stderr, "overlaid %zu ranges, %zu conflicting\n",
+                stats.overlay_ranges, stats.overlay_conflicts);
+    }
+}
+
 int main(int argc, char** argv)
 {
     if (argc < 2)
@@ -70,13 +139,59 @@ int main(int argc, char** argv)
     flags.insert("--headers");
     flags.insert("-q");
     flags.insert("-o");
+    flags.insert("--shm");
+    flags.insert("--shm-serve");
+    flags.insert("--verify");
+    flags.insert("--prefault");
+    flags.insert("--mlock");
+    flags.insert("--hugepages");
+    flags.insert("--load-report");
+    flags.insert("--compress-blocks");
+    flags.insert("--compact-locations");
+    flags.insert("--string-pool");
+    flags.insert("--coalesce");
+    flags.insert("--compare");
+    flags.insert("--diff");
+    flags.insert("--threads");
+    flags.insert("--granularity");
+    flags.insert("--no-asn");
+    flags.insert("--profile");
+    flags.insert("--bench");
+    flags.insert("--apply-delta");
+    flags.insert("--overlay");
+    flags.insert("--import-mmdb");
+    flags.insert("--history");
+    flags.insert("--as-of");
+    flags.insert("--count-by");
+    flags.insert("--distinct");
+    flags.insert("--sketch");
+    flags.insert("--top");
+    flags.insert("--dump-every");
+    flags.insert("--where");
+    flags.insert("--ranges-index");
+    flags.insert("--ranges");
+    flags.insert("--cidr");
+    flags.insert("--summary");
 
     std::vector<std::string> input_list;
     std::string import;
     std::string output;
+    std::string shm_ring;
+    std::string shm_serve_ring;
 
     std::string data_file_name = default_file();
-    bool show_headers = false;
+    QueryOptions options;
+    ImportOptions import_options;
+    CountOptions count_options;
+    SketchOptions sketch_options;
+    RangesOptions ranges_options;
+    bool verify_data = false;
+    std::vector<std::string> compare_files;
+    std::vector<std::string> diff_files;
+    std::string bench_sample;
+    std::vector<std::string> delta_files;
+    std::vector<std::string> mmdb_files;
+    std::vector<HistorySource> history;
 
     while (!args.empty())
     {
@@ -101,7 +216,324 @@ int main(int argc, char** argv)
         }
         else if (strcmp(args.peek(), "--headers") == 0)
         {
-            show_headers = true;
+            options.show_headers = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--prefault") == 0)
+        {
+            options.map.prefault = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--mlock") == 0)
+        {
+            options.map.lock = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--hugepages") == 0)
+        {
+            options.map.huge = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--compress-blocks") == 0)
+        {
+            import_options.compress_blocks = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--compact-locations") == 0)
+        {
+            import_options.compact_locations = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--string-pool") == 0)
+        {
+            import_options.string_pool = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--coalesce") == 0)
+        {
+            import_options.coalesce = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--ranges-index") == 0)
+        {
+            import_options.ranges_index = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--compare") == 0)
+        {
+            args.pop();
+
+            const char* a = args.pop();
+            const char* b = args.pop();
+
+            if (!a || !b)
+            {
+                usage("compare needs two files");
+            }
+
+            compare_files.push_back(a);
+            compare_files.push_back(b);
+        }
+        else if (strcmp(args.peek(), "--diff") == 0)
+        {
+            args.pop();
+
+            const char* a = args.pop();
+            const char* b = args.pop();
+
+            if (!a || !b)
+            {
+                usage("diff needs two files");
+            }
+
+            diff_files.push_back(a);
+            diff_files.push_back(b);
+        }
+        else if (strcmp(args.peek(), "--import-mmdb") == 0)
+        {
+            args.pop();
+
+            while (true)
+            {
+                const char* fn = args.pop();
+
+                if (!fn)
+                {
+                    usage("empty import-mmdb arg");
+                }
+
+                mmdb_files.push_back(fn);
+
+                if (args.empty() || flags.count(args.peek()))
+                    break;
+            }
+        }
+        else if (strcmp(args.peek(), "--history") == 0)
+        {
+            args.pop();
+
+            while (true)
+            {
+                const char* month = args.pop();
+                const char* fn = args.pop();
+
+                HistorySource source;
+
+                if (!month || !fn ||
+                    !parse_month(month, strlen(month), source.month))
+                {
+                    usage("history needs YYYY-MM file pairs");
+                }
+
+                source.file = fn;
+                history.push_back(source);
+
+                if (args.empty() || flags.count(args.peek()))
+                    break;
+            }
+        }
+        else if (strcmp(args.peek(), "--as-of") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg || !parse_month(arg, strlen(arg), options.as_of))
+            {
+                usage("bad as-of arg");
+            }
+        }
+        else if (strcmp(args.peek(), "--count-by") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg || !parse_count_fields(arg, count_options.fields))
+            {
+                usage("bad count-by arg");
+            }
+        }
+        else if (strcmp(args.peek(), "--distinct") == 0)
+        {
+            count_options.distinct = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--sketch") == 0)
+        {
+            sketch_options.enabled = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--top") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg || to_u(arg) == 0)
+            {
+                usage("bad top arg");
+            }
+
+            sketch_options.top = to_u(arg);
+        }
+        else if (strcmp(args.peek(), "--dump-every") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg || to_u(arg) == 0)
+            {
+                usage("bad dump-every arg");
+            }
+
+            sketch_options.dump_every = to_u(arg);
+        }
+        else if (strcmp(args.peek(), "--where") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg || !strchr(arg, '='))
+            {
+                usage("bad where arg");
+            }
+
+            options.where.push_back(arg);
+        }
+        else if (strcmp(args.peek(), "--ranges") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg || !strchr(arg, '='))
+            {
+                usage("bad ranges arg");
+            }
+
+            ranges_options.where.push_back(arg);
+        }
+        else if (strcmp(args.peek(), "--summary") == 0)
+        {
+            options.summary = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--cidr") == 0)
+        {
+            ranges_options.cidr = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--apply-delta") == 0)
+        {
+            args.pop();
+
+            const char* data = args.pop();
+            const char* changes = args.pop();
+
+            if (!data || !changes)
+            {
+                usage("apply-delta needs a database and a delta");
+            }
+
+            delta_files.push_back(data);
+            delta_files.push_back(changes);
+        }
+        else if (strcmp(args.peek(), "--granularity") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg)
+            {
+                usage("empty granularity arg");
+            }
+            else if (strcmp(arg, "country") == 0)
+            {
+                import_options.granularity = GRANULARITY_COUNTRY;
+            }
+            else if (strcmp(arg, "region") == 0)
+            {
+                import_options.granularity = GRANULARITY_REGION;
+            }
+            else if (strcmp(arg, "city") == 0)
+            {
+                import_options.granularity = GRANULARITY_CITY;
+            }
+            else
+            {
+                usage("bad granularity arg");
+            }
+        }
+        else if (strcmp(args.peek(), "--bench") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg)
+            {
+                usage("empty bench arg");
+            }
+
+            bench_sample = arg;
+        }
+        else if (strcmp(args.peek(), "--profile") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg)
+            {
+                usage("empty profile arg");
+            }
+
+            import_options.profile = arg;
+        }
+        else if (strcmp(args.peek(), "--overlay") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg)
+            {
+                usage("empty overlay arg");
+            }
+
+            import_options.overlay = arg;
+        }
+        else if (strcmp(args.peek(), "--no-asn") == 0)
+        {
+            import_options.no_asn = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--threads") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg || to_u(arg) == 0)
+            {
+                usage("bad threads arg");
+            }
+
+            // more workers than cpus only adds contention.
+            import_options.threads = std::min(to_u(arg), cpu_count());
+        }
+        else if (strcmp(args.peek(), "--load-report") == 0)
+        {
+            options.load_report = true;
+            args.pop();
+        }
+        else if (strcmp(args.peek(), "--verify") == 0)
+        {
+            verify_data = true;
             args.pop();
         }
         else if (strcmp(args.peek(), "-o") == 0)
@@ -117,6 +549,32 @@ int main(int argc, char** argv)
 
             output = arg;
         }
+        else if (strcmp(args.peek(), "--shm") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg)
+            {
+                usage("empty shm arg");
+            }
+
+            shm_ring = arg;
+        }
+        else if (strcmp(args.peek(), "--shm-serve") == 0)
+        {
+            args.pop();
+
+            const char* arg = args.pop();
+
+            if (!arg)
+            {
+                usage("empty shm-serve arg");
+            }
+
+            shm_serve_ring = arg;
+        }
         else if (strcmp(args.peek(), "--import") == 0)
         {
             args.pop();
@@ -165,24 +623,152 @@ int main(int argc, char** argv)
         }
     }
 
-    if (!import.empty())
+    if (!import.empty() || !mmdb_files.empty())
     {
         if (!input_list.empty())
         {
             usage("import and query are mutually exclusive");
         }
 
+        if (!import.empty() && !mmdb_files.empty())
+        {
+            usage("too many import options");
+        }
+
         if (output.empty())
         {
             usage("no output specified with import");
         }
 
-        std::string city_blocks = import + "/blocks.csv";
-        std::string city_locs = import + "/location.csv";
-        std::string geo_asns = import + "/asnum.csv";
+        import_options.report = stderr;
+
+        ImportStats stats;
+
+        if (!mmdb_files.empty())
+        {
+            etl_mmdb(mmdb_files, output.c_str(), import_options, &stats);
+        }
+        else
+        {
+            std::string city_blocks = import + "/blocks.csv";
+            std::string city_locs = import + "/location.csv";
+            std::string geo_asns = import + "/asnum.csv";
+
+            etl(city_blocks.c_str(), city_locs.c_str(), geo_asns.c_str(), 
+                output.c_str(), import_options, &stats);
+        }
+
+        report_import(import_options, stats);
+    }
+    else if (!history.empty())
+    {
+        if (!input_list.empty())
+        {
+            usage("history and query are mutually exclusive");
+        }
+
+        if (output.empty())
+        {
+            usage("no output specified with history");
+        }
+
+        HistoryStats stats;
+
+        build_history(history, output.c_str(), import_options, &stats);
+
+        char first[16];
+        char last[16];
+
+        month_to_s(first, stats.first_month);
+        month_to_s(last, stats.last_month);
+
+        fprintf(stderr, "built a history of %zu snapshots from %s to %s, "
+                        "%zu locations and %zu asns, "
+                        "%zu of %zu block tables shared\n",
+                stats.snapshots, first, last, stats.locations, stats.asns,
+                stats.tables_shared, stats.tables);
+    }
+    else if (!delta_files.empty())
+    {
+        if (!input_list.empty())
+        {
+            usage("apply-delta and query are mutually exclusive");
+        }
+
+        if (output.empty())
+        {
+            usage("no output specified with apply-delta");
+        }
+
+        DeltaStats stats;
+
+        apply_delta(delta_files[0].c_str(), delta_files[1].c_str(),
+                    output.c_str(), &stats);
+
+        fprintf(stderr, "applied %zu location and %zu asn changes, "
+                        "added %zu locations and %zu asns, "
+                        "copied %zu sections\n",
+                stats.loc_changes, stats.asn_changes, stats.loc_added,
+                stats.asn_added, stats.sections_copied);
+    }
+    else if (!bench_sample.empty())
+    {
+        if (!input_list.empty())
+        {
+            usage("bench and query are mutually exclusive");
+        }
+
+        bench(data_file_name.c_str(), bench_sample.c_str(), options);
+    }
+    else if (!compare_files.empty())
+    {
+        if (!input_list.empty())
+        {
+            usage("compare and query are mutually exclusive");
+        }
+
+        compare(compare_files[0].c_str(), compare_files[1].c_str());
+    }
+    else if (!diff_files.empty())
+    {
+        if (!input_list.empty())
+        {
+            usage("diff and query are mutually exclusive");
+        }
+
+        diff(diff_files[0].c_str(), diff_files[1].c_str());
+    }
+    else if (!ranges_options.where.empty())
+    {
+        if (!input_list.empty())
+        {
+            usage("ranges and query are mutually exclusive");
+        }
 
-        etl(city_blocks.c_str(), city_locs.c_str(), geo_asns.c_str(), 
-            output.c_str());
+        if (options.as_of)
+        {
+            usage("ranges lists the latest snapshot, as-of is not supported");
+        }
+
+        ranges(data_file_name.c_str(), options, ranges_options);
+    }
+    else if (verify_data)
+    {
+        if (!input_list.empty())
+        {
+            usage("verify and query are mutually exclusive");
+        }
+
+        verify(data_file_name.c_str());
+    }
+    else if (!shm_serve_ring.empty())
+    {
+        if (!input_list.empty())
+        {
+            usage("shm-serve and query are mutually exclusive");
+        }
+
+        shm_serve(data_file_name.c_str(), shm_serve_ring.c_str(), options);
     }
     else
     {
@@ -196,7 +782,65 @@ int main(int argc, char** argv)
             usage("import and query are mutually exclusive");
         }
 
-        query(data_file_name.c_str(), input_list, show_headers);
+        if (count_options.distinct && count_options.fields.empty())
+        {
+            usage("distinct needs count-by");
+        }
+
+        if (ranges_options.cidr)
+        {
+            usage("cidr needs ranges");
+        }
+
+        if (options.summary && (sketch_options.enabled ||
+                                !count_options.fields.empty() ||
+                                !shm_ring.empty()))
+        {
+            usage("summary is not supported with sketch, count-by or shm");
+        }
+
+        if (sketch_options.enabled)
+        {
+            if (!shm_ring.empty() || !count_options.fields.empty())
+            {
+                usage("sketch, count-by and shm are mutually exclusive");
+            }
+
+            sketch_options.threads = import_options.threads;
+
+            sketch(data_file_name.c_str(), input_list, options,
+                   sketch_options);
+        }
+        else if (!count_options.fields.empty())
+        {
+            if (!shm_ring.empty())
+            {
+                usage("count-by and shm are mutually exclusive");
+            }
+
+            count_options.threads = import_options.threads;
+
+            count(data_file_name.c_str(), input_list, options, count_options);
+        }
+        else if (!shm_ring.empty())
+        {
+            if (options.as_of)
+            {
+                usage("with --shm, give --as-of to --shm-serve");
+            }
+
+            if (!options.where.empty())
+            {
+                usage("where and shm are mutually exclusive");
+            }
+
+            shm_query(data_file_name.c_str(), shm_ring.c_str(), input_list,
+                      options);
+        }
+        else
+        {
+            query(data_file_name.c_str(), input_list, options);
+        }
     }
 
     return 0;
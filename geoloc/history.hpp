@@ -0,0 +1,487 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module builds history files, for geoloc --history, which keep
+ * monthly snapshots of a database so that old log entries can be located
+ * against the data that was current when they were written.
+ *
+ * Each snapshot is a v002 database, given with the month it was current
+ * from. The locations and asns of every snapshot go into one shared set of
+ * data tables, where records that are the same in every field are stored
+ * once, and each snapshot's block tables are renumbered against them. A
+ * block table that did not change since the next snapshot shares that
+ * snapshot's section, so months with no changes cost nothing.
+ *
+ * The latest snapshot's block tables take the plain section names, so a
+ * history file is also an ordinary database for the latest month. The
+ * snapshots section lists the tables of each snapshot (see SnapshotEntry),
+ * then the snapshot current in each month from the first to the latest, so
+ * a query finds its snapshot with one index.
+*/
+
+#ifndef HISTORY_HPP_3A91F4C6
+#define HISTORY_HPP_3A91F4C6
+
+#include "etl.hpp"
+#include "query.hpp"
+
+#include <map>
+
+struct HistorySource
+{
+    unsigned month;
+    std::string file;
+};
+
+struct HistorySourceLess
+{
+    bool operator()(const HistorySource &a, const HistorySource &b) const
+    {
+        return a.month < b.month;
+    }
+};
+
+struct HistoryStats
+{
+    HistoryStats()
+        :
+        snapshots(0),
+        tables(0),
+        tables_shared(0),
+        locations(0),
+        asns(0),
+        first_month(0),
+        last_month(0)
+    {
+    }
+
+    size_t snapshots;
+    size_t tables;
+    size_t tables_shared;
+    size_t locations;
+    size_t asns;
+    unsigned first_month;
+    unsigned last_month;
+};
+
+inline bool same_block(const Block &a, const Block &b)
+{
+    return a.start_ip == b.start_ip && a.end_ip == b.end_ip && a.loc == b.loc;
+}
+
+inline bool same_block(const Block6 &a, const Block6 &b)
+{
+    return a.start == b.start && a.end == b.end && a.loc == b.loc;
+}
+
+template <typename BlockType>
+inline bool same_blocks(const std::vector<BlockType> &a,
+                        const std::vector<BlockType> &b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (!same_block(a[i], b[i]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// the shared data tables of a history, and the maps from each snapshot's
+// numbers into them.
+class HistoryBuilder
+{
+  public:
+    HistoryBuilder()
+        :
+        locations(),
+        asns(),
+        next_location_(0),
+        index_()
+    {
+    }
+
+    // the shared number of each location of table, NO_RECORD for the gaps
+    // of a table indexed by id.
+    void add_locations(const LocationTable &table,
+                       std::vector<unsigned> &remap)
+    {
+        remap.assign(table.size(), NO_RECORD);
+
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            PackedLocation loc;
+            table.unpack(i, loc);
+
+            if (loc.id != i)
+            {
+                continue;
+            }
+
+            LocationRow row = locations.make_row(
+                next_location_, field(table.country[loc.country]),
+                field(table.region[loc.region]), field(table.city[loc.city]),
+                loc.lat, loc.lon);
+
+            std::map<LocationRow, unsigned, LocationRowLess>::iterator iter =
+                index_.find(row);
+
+            if (iter == index_.end())
+            {
+                locations.add(row);
+                iter = index_.insert(std::make_pair(row,
+                                                    next_location_++)).first;
+            }
+
+            remap[i] = iter->second;
+        }
+    }
+
+    // the shared number of each asn of table. as on import, an asn number
+    // keeps the first text it was seen with, which is the latest one, as
+    // snapshots are added latest first.
+    void add_asns(const ASNTable &table, std::vector<unsigned> &remap)
+    {
+        remap.assign(table.asns.size(), NO_RECORD);
+
+        for (size_t i = 0; i < table.asns.size(); ++i)
+        {
+            const PackedASN &asn = table.asns[i];
+            const char* text = table.text[asn.text];
+
+            remap[i] = asns.add_asn(asn.number, text, strlen(text));
+        }
+    }
+
+    // a block table, with its payloads renumbered. blocks that point at a
+    // gap are dropped.
+    static void remap_table(const BlockTable &table,
+                            const std::vector<unsigned> &remap,
+                            std::vector<Block> &out)
+    {
+        out.clear();
+        out.reserve(table.size());
+
+        BlockIterator iter(table);
+        Block block;
+
+        while (iter.next(block))
+        {
+            if (block.loc < remap.size() && remap[block.loc] != NO_RECORD)
+            {
+                block.loc = remap[block.loc];
+                out.push_back(block);
+            }
+        }
+    }
+
+    static void remap_table(const Block6Table &table,
+                            const std::vector<unsigned> &remap,
+                            std::vector<Block6> &out)
+    {
+        out.clear();
+        out.reserve(table.size());
+
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            Block6 block;
+            table.get(i, block);
+
+            if (block.loc < remap.size() && remap[block.loc] != NO_RECORD)
+            {
+                block.loc = remap[block.loc];
+                out.push_back(block);
+            }
+        }
+    }
+
+    LocationBuilder locations;
+    ASNBuilder asns;
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(HistoryBuilder);
+
+    enum { NO_RECORD = 0xFFFFFFFF };
+
+    static CsvField field(const char* s)
+    {
+        CsvField out = { s, strlen(s) };
+        return out;
+    }
+
+    unsigned next_location_;
+    std::map<LocationRow, unsigned, LocationRowLess> index_;
+};
+
+// one block table of snapshot k. it is saved unless it is the same as the
+// table of the snapshot after, last, whose section it then shares. returns
+// the number of the snapshot whose section holds it.
+inline unsigned save_history_table(BinaryFile &file,
+                                   const char* base,
+                                   unsigned k,
+                                   unsigned latest,
+                                   std::vector<Block> &blocks,
+                                   std::vector<Block> &last,
+                                   unsigned last_table,
+                                   bool compress_blocks,
+                                   HistoryStats &stats)
+{
+    unsigned table = k;
+
+    if (k != latest && same_blocks(blocks, last))
+    {
+        table = last_table;
+        stats.tables_shared++;
+    }
+    else
+    {
+        file.begin_section(snapshot_section(base, k, latest).c_str());
+        save_blocks(file, blocks, compress_blocks);
+    }
+
+    stats.tables++;
+    last.swap(blocks);
+
+    return table;
+}
+
+// v6 tables are always raw, and a snapshot with no v6 blocks has no table.
+inline unsigned save_history_table(BinaryFile &file,
+                                   const char* base,
+                                   unsigned k,
+                                   unsigned latest,
+                                   std::vector<Block6> &blocks,
+                                   std::vector<Block6> &last,
+                                   unsigned last_table,
+                                   HistoryStats &stats)
+{
+    unsigned table = k;
+
+    if (blocks.empty())
+    {
+        table = HISTORY_NO_TABLE;
+    }
+    else if (k != latest && last_table != HISTORY_NO_TABLE &&
+             same_blocks(blocks, last))
+    {
+        table = last_table;
+        stats.tables_shared++;
+        stats.tables++;
+    }
+    else
+    {
+        file.begin_section(snapshot_section(base, k, latest).c_str());
+        save_blocks6(file, blocks);
+        stats.tables++;
+    }
+
+    last.swap(blocks);
+
+    return table;
+}
+
+// the snapshot current in each month from the first snapshot's to the
+// latest's.
+inline void month_index(const std::vector<SnapshotEntry> &entries,
+                        std::vector<unsigned> &out)
+{
+    unsigned first = entries.front().month;
+    unsigned last = entries.back().month;
+
+    out.resize(last - first + 1);
+
+    for (size_t k = 0, m = 0; m < out.size(); ++m)
+    {
+        while (k + 1 < entries.size() && entries[k + 1].month <= first + m)
+        {
+            ++k;
+        }
+
+        out[m] = k;
+    }
+}
+
+// build a history file from snapshots, in any order. every snapshot must
+// have the same tables. compress_blocks, compact_locations and string_pool
+// apply as on import.
+inline void build_history(std::vector<HistorySource> sources,
+                          const char* output,
+                          const ImportOptions &options = ImportOptions(),
+                          HistoryStats* stats = 0)
+{
+    LOG_CONTEXT("build_history of %zu snapshots into file %s",
+                sources.size(), output);
+
+    if (sources.empty())
+    {
+        FATAL_ERROR("a history needs at least one snapshot");
+    }
+
+    std::stable_sort(sources.begin(), sources.end(), HistorySourceLess());
+
+    for (size_t k = 1; k < sources.size(); ++k)
+    {
+        if (sources[k].month == sources[k - 1].month)
+        {
+            char month[16];
+            month_to_s(month, sources[k].month);
+
+            FATAL_ERROR("more than one snapshot for %s", month);
+        }
+    }
+
+    HistoryStats local_stats;
+    HistoryStats &out_stats = stats ? *stats : local_stats;
+
+    BinaryFile file;
+
+    if (!file.open(output))
+    {
+        FATAL_ERROR("could not open %s for writing", output);
+    }
+
+    char buf[32]; get_header(buf, sizeof(buf));
+
+    file.save_bytes_raw(buf, sizeof(buf));
+    file.reserve_section_directory();
+
+    unsigned latest = sources.size() - 1;
+    unsigned tables = 0;
+
+    HistoryBuilder builder;
+    std::vector<SnapshotEntry> entries(sources.size());
+
+    std::vector<Block> last_loc;
+    std::vector<Block> last_asn;
+    std::vector<Block6> last_loc6;
+    std::vector<Block6> last_asn6;
+
+    // latest first, so that the latest tables are saved under their plain
+    // names, and each snapshot only needs the tables of the one after it.
+
+    for (unsigned k = latest; k != -1U; --k)
+    {
+        const char* fn = sources[k].file.c_str();
+
+        LOG_CONTEXT("snapshot %s", fn);
+
+        GeoData data;
+        data.open(fn);
+
+        if (k == latest)
+        {
+            tables = data.loaded();
+        }
+        else if (data.loaded() != tables)
+        {
+            FATAL_ERROR("%s does not have the same tables as %s", fn,
+                        sources[latest].file.c_str());
+        }
+
+        SnapshotEntry &entry = entries[k];
+        const SnapshotEntry &next = entries[k == latest ? k : k + 1];
+
+        entry.month = sources[k].month;
+        entry.location = HISTORY_NO_TABLE;
+        entry.asn = HISTORY_NO_TABLE;
+        entry.location6 = HISTORY_NO_TABLE;
+        entry.asn6 = HISTORY_NO_TABLE;
+
+        std::vector<unsigned> remap;
+        std::vector<Block> blocks;
+        std::vector<Block6> blocks6;
+
+        if (tables & GEO_LOCATIONS)
+        {
+            builder.add_locations(data.location_data(), remap);
+
+            builder.remap_table(data.location_blocks(), remap, blocks);
+            entry.location = save_history_table(
+                file, "loc.blocks", k, latest, blocks, last_loc,
+                next.location, options.compress_blocks, out_stats);
+
+            builder.remap_table(data.location_blocks6(), remap, blocks6);
+            entry.location6 = save_history_table(
+                file, "loc6.blocks", k, latest, blocks6, last_loc6,
+                next.location6, out_stats);
+        }
+
+        if (tables & GEO_ASNS)
+        {
+            builder.add_asns(data.asn_data(), remap);
+
+            builder.remap_table(data.asn_blocks(), remap, blocks);
+            entry.asn = save_history_table(
+                file, "asn.blocks", k, latest, blocks, last_asn, next.asn,
+                options.compress_blocks, out_stats);
+
+            builder.remap_table(data.asn_blocks6(), remap, blocks6);
+            entry.asn6 = save_history_table(
+                file, "asn6.blocks", k, latest, blocks6, last_asn6,
+                next.asn6, out_stats);
+        }
+    }
+
+    StringPool pool;
+
+    if (options.string_pool)
+    {
+        pool.add(builder.locations.country());
+        pool.add(builder.locations.region());
+        pool.add(builder.locations.city());
+
+        if (tables & GEO_ASNS)
+        {
+            pool.add(builder.asns.text());
+        }
+
+        pool.build();
+    }
+
+    const StringPool* pool_ptr = options.string_pool ? &pool : 0;
+
+    if (tables & GEO_LOCATIONS)
+    {
+        file.begin_section("loc.data");
+        save_locations(file, builder.locations, options.compact_locations,
+                       pool_ptr);
+    }
+
+    if (tables & GEO_ASNS)
+    {
+        save_asn_data(file, builder.asns, pool_ptr);
+    }
+
+    if (pool_ptr)
+    {
+        save_string_pool(file, pool);
+    }
+
+    std::vector<unsigned> months;
+    month_index(entries, months);
+
+    file.begin_section("snapshots");
+    file.save_pod_vector(entries);
+    file.save_pod_vector(months);
+
+    file.finish();
+
+    out_stats.snapshots = sources.size();
+    out_stats.locations = builder.locations.size();
+    out_stats.asns = builder.asns.asns().size();
+    out_stats.first_month = entries.front().month;
+    out_stats.last_month = entries.back().month;
+}
+
+#endif
@@ -0,0 +1,719 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module handles ipv6 addresses and the ipv6 block tables.
+ *
+ * An IP6 is a 128 bit address split into high and low 64 bit words, so it
+ * compares with two integer compares. A Block6 is a range of them, and an
+ * index into the same location or asn data as the v4 blocks.
+ *
+ * A Block6Table is stored as split columns of high and low words for the
+ * starts and ends, plus the payloads. A lookup searches the high words of
+ * the starts, and only searches low words within a run of blocks that share
+ * a high word, which allocations rarely do, so most lookups are a single
+ * binary search over 8 byte keys.
+ *
+ * v4-mapped addresses (::ffff:a.b.c.d) are answered by the v4 tables.
+*/
+
+#ifndef IP6_HPP_5C2E9A71
+#define IP6_HPP_5C2E9A71
+
+#include "error.hpp"
+#include "serialization.hpp"
+#include "csv.hpp"
+
+#include <algorithm>
+#include <queue>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+struct IP6
+{
+    uint64_t hi;
+    uint64_t lo;
+};
+
+inline bool operator<(const IP6 &a, const IP6 &b)
+{
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+inline bool operator==(const IP6 &a, const IP6 &b)
+{
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+inline bool operator<=(const IP6 &a, const IP6 &b)
+{
+    return !(b < a);
+}
+
+// the address after a. the last address wraps to ::.
+inline IP6 ip6_next(const IP6 &a)
+{
+    IP6 out = a;
+
+    if (++out.lo == 0)
+    {
+        out.hi++;
+    }
+
+    return out;
+}
+
+// the address before a. :: wraps to the last address.
+inline IP6 ip6_prev(const IP6 &a)
+{
+    IP6 out = a;
+
+    if (out.lo-- == 0)
+    {
+        out.hi--;
+    }
+
+    return out;
+}
+
+inline bool ip6_is_max(const IP6 &a)
+{
+    return a.hi == ~(uint64_t) 0 && a.lo == ~(uint64_t) 0;
+}
+
+// the first and last addresses of the prefix of ip that is len bits long.
+inline void ip6_prefix(const IP6 &ip, unsigned len, IP6 &first, IP6 &last)
+{
+    uint64_t hi_mask = len >= 64 ? ~0ULL : len ? ~0ULL << (64 - len) : 0;
+    uint64_t lo_mask = len <= 64 ? 0 : len >= 128 ? ~0ULL :
+                       ~0ULL << (128 - len);
+
+    first.hi = ip.hi & hi_mask;
+    first.lo = ip.lo & lo_mask;
+    last.hi = ip.hi | ~hi_mask;
+    last.lo = ip.lo | ~lo_mask;
+}
+
+// true, with the v4 address, for ::ffff:a.b.c.d.
+inline bool ip6_v4_mapped(const IP6 &a, unsigned &quad)
+{
+    if (a.hi != 0 || (a.lo >> 32) != 0xFFFF)
+    {
+        return false;
+    }
+
+    quad = (unsigned) a.lo;
+
+    return true;
+}
+
+inline int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+
+    return -1;
+}
+
+// parse a textual ipv6 address, with :: for a run of zero groups and
+// optionally a dotted quad for the last 32 bits. false if it is not one.
+inline bool parse_ip6(const char* s, size_t n, IP6 &out)
+{
+    const char* end = s + n;
+
+    while (end != s && (end[-1] == '\n' || end[-1] == '\r' ||
+                        end[-1] == ' ' || end[-1] == '\t'))
+    {
+        --end;
+    }
+
+    unsigned groups[8];
+    unsigned count = 0;
+    int gap = -1;
+
+    const char* p = s;
+
+    if (end - p >= 2 && p[0] == ':' && p[1] == ':')
+    {
+        gap = 0;
+        p += 2;
+    }
+
+    while (p != end)
+    {
+        if (count == 8)
+        {
+            return false;
+        }
+
+        const char* q = p;
+        unsigned group = 0;
+
+        for (; q != end && q - p < 5 && hex_value(*q) >= 0; ++q)
+        {
+            group = group << 4 | hex_value(*q);
+        }
+
+        // a dotted quad tail takes the last two groups.
+
+        if (q != end && *q == '.')
+        {
+            unsigned quad;
+
+            if (count > 6 || !parse_quad(p, end - p, quad))
+            {
+                return false;
+            }
+
+            groups[count++] = quad >> 16;
+            groups[count++] = quad & 0xFFFF;
+
+            break;
+        }
+
+        if (q == p || q - p > 4)
+        {
+            return false;
+        }
+
+        groups[count++] = group;
+        p = q;
+
+        if (p == end)
+        {
+            break;
+        }
+
+        if (*p++ != ':' || p == end)
+        {
+            return false;
+        }
+
+        if (*p == ':')
+        {
+            if (gap >= 0)
+            {
+                return false;
+            }
+
+            gap = count;
+            p++;
+        }
+    }
+
+    if (gap < 0 ? count != 8 : count > 7)
+    {
+        return false;
+    }
+
+    unsigned words[8];
+    unsigned zeros = 8 - count;
+
+    for (unsigned i = 0, j = 0; i < 8; ++i)
+    {
+        if (gap >= 0 && i >= (unsigned) gap && i < gap + zeros)
+        {
+            words[i] = 0;
+        }
+        else
+        {
+            words[i] = groups[j++];
+        }
+    }
+
+    out.hi = 0;
+    out.lo = 0;
+
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        out.hi = out.hi << 16 | words[i];
+        out.lo = out.lo << 16 | words[i + 4];
+    }
+
+    return true;
+}
+
+// parse a v6 CIDR block, like 2001:db8::/32, as parse_cidr does v4 ones.
+inline bool parse_cidr6(const char* s, size_t n, IP6 &first, IP6 &last)
+{
+    const char* slash = (const char*) memchr(s, '/', n);
+
+    if (!slash)
+    {
+        return false;
+    }
+
+    IP6 ip;
+
+    if (!parse_ip6(s, slash - s, ip))
+    {
+        return false;
+    }
+
+    unsigned bits;
+
+    if (!parse_ip(slash + 1, s + n - slash - 1, bits) || bits > 128 ||
+        memchr(slash + 1, '.', s + n - slash - 1))
+    {
+        return false;
+    }
+
+    ip6_prefix(ip, bits, first, last);
+
+    return true;
+}
+
+// format as in RFC 5952: lower case, no leading zeros, the longest run of
+// two or more zero groups as ::, and v4-mapped addresses with a dotted
+// quad. out needs 46 bytes.
+inline int ip6_to_s(char* out, const IP6 &a)
+{
+    unsigned quad;
+
+    if (ip6_v4_mapped(a, quad))
+    {
+        return sprintf(out, "::ffff:%u.%u.%u.%u", quad >> 24,
+                       (quad >> 16) & 0xFF, (quad >> 8) & 0xFF, quad & 0xFF);
+    }
+
+    unsigned words[8];
+
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        words[i] = (a.hi >> (48 - 16 * i)) & 0xFFFF;
+        words[i + 4] = (a.lo >> (48 - 16 * i)) & 0xFFFF;
+    }
+
+    int best = -1;
+    int best_len = 1;
+
+    for (int i = 0; i < 8; )
+    {
+        int j = i;
+
+        while (j < 8 && words[j] == 0)
+        {
+            ++j;
+        }
+
+        if (j - i > best_len)
+        {
+            best = i;
+            best_len = j - i;
+        }
+
+        i = j == i ? i + 1 : j;
+    }
+
+    int nb = 0;
+
+    for (int i = 0; i < 8; ++i)
+    {
+        if (i == best)
+        {
+            nb += sprintf(out + nb, "::");
+            i += best_len - 1;
+            continue;
+        }
+
+        nb += sprintf(out + nb, "%s%x", i && i != best + best_len ? ":" : "",
+                      words[i]);
+    }
+
+    return nb;
+}
+
+struct Block6
+{
+    IP6 start;
+    IP6 end;
+    unsigned loc;
+};
+
+// true if the blocks are sorted and disjoint, as save_blocks6 needs.
+inline bool blocks6_ordered(const std::vector<Block6> &v)
+{
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        if (v[i].end < v[i].start)
+        {
+            return false;
+        }
+
+        if (i && v[i].start <= v[i - 1].end)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// append a block, merging it into the last one if they are contiguous and
+// have the same payload.
+inline void append_block6(std::vector<Block6> &out, const Block6 &block)
+{
+    if (!out.empty() && out.back().loc == block.loc &&
+        !ip6_is_max(out.back().end) && ip6_next(out.back().end) == block.start)
+    {
+        out.back().end = block.end;
+        return;
+    }
+
+    out.push_back(block);
+}
+
+// merge runs of contiguous blocks that have the same payload. returns the
+// number of blocks removed.
+inline size_t coalesce_blocks6(std::vector<Block6> &v)
+{
+    std::vector<Block6> out;
+    out.reserve(v.size());
+
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        append_block6(out, v[i]);
+    }
+
+    size_t removed = v.size() - out.size();
+    v.swap(out);
+
+    return removed;
+}
+
+// a range with its width, and its position in the source for breaking
+// ties, as RankedBlock is for v4 ranges.
+struct RankedBlock6
+{
+    Block6 block;
+    IP6 width;
+    unsigned seq;
+};
+
+// true when the range a should lose to the range b. the narrower range
+// wins, and of two equally wide ones the later, as for v4 ranges (see
+// block_sort.hpp).
+struct Block6PriorityLess
+{
+    bool operator()(const RankedBlock6 &a, const RankedBlock6 &b) const
+    {
+        if (!(a.width == b.width))
+        {
+            return b.width < a.width;
+        }
+
+        return a.seq < b.seq;
+    }
+};
+
+struct RankedBlock6Less
+{
+    bool operator()(const RankedBlock6 &a, const RankedBlock6 &b) const
+    {
+        return a.block.start < b.block.start;
+    }
+};
+
+// sweep ranges sorted by start into disjoint blocks. at each point, the
+// highest priority range that covers it wins.
+inline void resolve_overlaps6(const std::vector<RankedBlock6> &in,
+                              std::vector<Block6> &out)
+{
+    std::priority_queue<RankedBlock6,
+                        std::vector<RankedBlock6>,
+                        Block6PriorityLess> active;
+
+    out.clear();
+
+    size_t i = 0;
+    IP6 pos = { 0, 0 };
+
+    while (i < in.size() || !active.empty())
+    {
+        if (active.empty())
+        {
+            pos = in[i].block.start;
+        }
+
+        while (i < in.size() && in[i].block.start <= pos)
+        {
+            active.push(in[i++]);
+        }
+
+        // ranges that have ended are dropped once they reach the top.
+
+        while (!active.empty() && active.top().block.end < pos)
+        {
+            active.pop();
+        }
+
+        if (active.empty())
+        {
+            continue;
+        }
+
+        Block6 block = active.top().block;
+
+        block.start = pos;
+
+        if (i < in.size() && in[i].block.start <= block.end)
+        {
+            block.end = ip6_prev(in[i].block.start);
+        }
+
+        append_block6(out, block);
+
+        if (ip6_is_max(block.end))
+        {
+            break;
+        }
+
+        pos = ip6_next(block.end);
+    }
+}
+
+// sort the blocks and resolve their overlaps by the same rule as
+// normalize_blocks. returns the number of ranges that overlapped an
+// earlier one.
+inline size_t normalize_blocks6(std::vector<Block6> &v)
+{
+    if (blocks6_ordered(v))
+    {
+        return 0;
+    }
+
+    std::vector<RankedBlock6> ranked(v.size());
+
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        const Block6 &b = v[i];
+
+        ranked[i].block = b;
+        ranked[i].width.hi = b.end.hi - b.start.hi - (b.end.lo < b.start.lo);
+        ranked[i].width.lo = b.end.lo - b.start.lo;
+        ranked[i].seq = i;
+    }
+
+    std::stable_sort(ranked.begin(), ranked.end(), RankedBlock6Less());
+
+    // count the ranges that start inside the span of those before them.
+
+    size_t conflicts = 0;
+    const Block6* widest = 0;
+
+    for (size_t i = 0; i < ranked.size(); ++i)
+    {
+        const Block6 &b = ranked[i].block;
+
+        if (widest && b.start <= widest->end)
+        {
+            conflicts++;
+        }
+
+        if (!widest || widest->end < b.end)
+        {
+            widest = &b;
+        }
+    }
+
+    resolve_overlaps6(ranked, v);
+
+    return conflicts;
+}
+
+// point the blocks at new payloads, dropping those with none, as
+// remap_blocks does for v4 blocks.
+template <typename Map>
+inline void remap_blocks6(const Map &id_map, std::vector<Block6> &blocks)
+{
+    size_t kept = 0;
+
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        typename Map::const_iterator iter = id_map.find(blocks[i].loc);
+
+        if (iter == id_map.end())
+        {
+            continue;
+        }
+
+        blocks[kept] = blocks[i];
+        blocks[kept].loc = iter->second;
+        kept++;
+    }
+
+    blocks.resize(kept);
+}
+
+// one word of a 64 bit column. pod vectors put their data 4 bytes in, so
+// entries are only 4 byte aligned, and are read with memcpy.
+struct Word64
+{
+    unsigned w[2];
+
+    uint64_t get() const
+    {
+        uint64_t x;
+        memcpy(&x, w, sizeof(x));
+
+        return x;
+    }
+
+    void set(uint64_t x)
+    {
+        memcpy(w, &x, sizeof(x));
+    }
+};
+
+struct Word64Less
+{
+    bool operator()(uint64_t a, const Word64 &b) const
+    {
+        return a < b.get();
+    }
+
+    bool operator()(const Word64 &a, uint64_t b) const
+    {
+        return a.get() < b;
+    }
+};
+
+inline void save_blocks6(BinaryFile &file, const std::vector<Block6> &v)
+{
+    REL_ASSERT(!v.empty() && blocks6_ordered(v));
+
+    std::vector<Word64> start_hi(v.size());
+    std::vector<Word64> start_lo(v.size());
+    std::vector<Word64> end_hi(v.size());
+    std::vector<Word64> end_lo(v.size());
+    std::vector<unsigned> loc(v.size());
+
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        start_hi[i].set(v[i].start.hi);
+        start_lo[i].set(v[i].start.lo);
+        end_hi[i].set(v[i].end.hi);
+        end_lo[i].set(v[i].end.lo);
+        loc[i] = v[i].loc;
+    }
+
+    file.save_pod_vector(start_hi);
+    file.save_pod_vector(start_lo);
+    file.save_pod_vector(end_hi);
+    file.save_pod_vector(end_lo);
+    file.save_pod_vector(loc);
+}
+
+class Block6Table
+{
+  public:
+    Block6Table()
+        :
+        count_(0)
+    {
+    }
+
+    void load(MemoryFile &file)
+    {
+        file.load_mapped_vector(start_hi);
+        file.load_mapped_vector(start_lo);
+        file.load_mapped_vector(end_hi);
+        file.load_mapped_vector(end_lo);
+        file.load_mapped_vector(loc);
+
+        count_ = loc.size();
+    }
+
+    // 0 for a table that was not loaded.
+    size_t size() const
+    {
+        return count_;
+    }
+
+    // the index of the block holding ip, -1 when there is none.
+    unsigned find(const IP6 &ip) const
+    {
+        size_t i = upper_bound(ip);
+
+        if (i == 0)
+        {
+            return -1;
+        }
+
+        --i;
+
+        IP6 end = { end_hi[i].get(), end_lo[i].get() };
+
+        return ip <= end ? i : -1;
+    }
+
+    // index of the first block that ends at or after ip, size() if there is
+    // none.
+    size_t lower_bound(const IP6 &ip) const
+    {
+        size_t i = upper_bound(ip);
+
+        if (i == 0)
+        {
+            return 0;
+        }
+
+        IP6 end = { end_hi[i - 1].get(), end_lo[i - 1].get() };
+
+        return ip <= end ? i - 1 : i;
+    }
+
+    unsigned payload(size_t i) const
+    {
+        return loc[i];
+    }
+
+    void get(size_t i, Block6 &out) const
+    {
+        out.start.hi = start_hi[i].get();
+        out.start.lo = start_lo[i].get();
+        out.end.hi = end_hi[i].get();
+        out.end.lo = end_lo[i].get();
+        out.loc = loc[i];
+    }
+
+    MappedVector<Word64> start_hi;
+    MappedVector<Word64> start_lo;
+    MappedVector<Word64> end_hi;
+    MappedVector<Word64> end_lo;
+    MappedVector<unsigned> loc;
+
+  private:
+    // the number of blocks that start at or before ip.
+    size_t upper_bound(const IP6 &ip) const
+    {
+        const Word64* hi = start_hi.begin();
+        const Word64* lo = start_lo.begin();
+
+        size_t i = std::upper_bound(hi, hi + size(), ip.hi, Word64Less()) -
+                   hi;
+
+        // blocks that start in the same high word are told apart by their
+        // low words.
+
+        if (i && hi[i - 1].get() == ip.hi)
+        {
+            size_t first = std::lower_bound(hi, hi + i, ip.hi, Word64Less()) -
+                           hi;
+
+            i = std::upper_bound(lo + first, lo + i, ip.lo, Word64Less()) -
+                lo;
+        }
+
+        return i;
+    }
+
+    size_t count_;
+};
+
+#endif
@@ -8,34 +8,28 @@
  * This module handles representations of location data, both normal and packed 
  * formats.
  * 
- * A Location stores an id and positional information from the MaxMind dataset, 
+ * A location has an id and positional information from the MaxMind dataset, 
  * namely:
  * 
  * country, region, city, latitude, longitude
+ *
+ * Locations are never held as strings. The parser interns each string as it
+ * streams past, and keeps a fixed size LocationRow per location.
 */
 
 #ifndef LOCATIONS_HPP_CCAC801C
 #define LOCATIONS_HPP_CCAC801C
 
 #include "string_table.hpp"
+#include "string_pool.hpp"
 #include "error.hpp"
 #include "csv.hpp"
+#include "bitpack.hpp"
+#include "blocks.hpp"
+#include "hash_map.hpp"
 
-struct Location
-{
-    Location()
-        :
-        id(0)
-    {
-    }
-
-    unsigned id;
-    std::string country;
-    std::string region;
-    std::string city;
-    std::string lat;
-    std::string lon;
-};
+#include <math.h>
+#include <algorithm>
 
 struct PackedLocation
 {
@@ -59,24 +53,163 @@ struct PackedLocation
     float lon;
 };
 
+// a compact location table (CLOC) drops the id, since locations are
+// numbered densely, and packs each location into a record of record_bytes.
+// the string index fields are only as wide as their table needs, and lat/lon
+// are fixed point, biased to be unsigned.
+
+enum
+{
+    CLOC_COUNTRY,
+    CLOC_REGION,
+    CLOC_CITY,
+    CLOC_LAT,
+    CLOC_LON,
+    CLOC_FIELDS
+};
+
+// how much of a location a database keeps. coarser databases merge all the
+// locations of a country (or region) into one.
+enum
+{
+    GRANULARITY_COUNTRY,
+    GRANULARITY_REGION,
+    GRANULARITY_CITY
+};
+
+#define CLOC_SCALE 10000.0
+#define CLOC_LAT_BIAS 90.0
+#define CLOC_LON_BIAS 180.0
+
+// records are padded with this many bytes, so that every field can be read
+// with one unaligned 64 bit load.
+#define CLOC_PADDING 8
+
+struct CompactLocationLayout
+{
+    unsigned count;
+    unsigned record_bytes;
+    unsigned bits[CLOC_FIELDS];
+    unsigned shift[CLOC_FIELDS];
+};
+
+inline unsigned compact_field(const char* record,
+                              const CompactLocationLayout &layout,
+                              unsigned field)
+{
+    unsigned shift = layout.shift[field];
+
+    uint64_t x;
+    memcpy(&x, record + shift / 8, sizeof(x));
+
+    return (x >> (shift & 7)) & bit_mask(layout.bits[field]);
+}
+
+inline void set_compact_field(char* record,
+                              const CompactLocationLayout &layout,
+                              unsigned field,
+                              unsigned value)
+{
+    unsigned shift = layout.shift[field];
+
+    uint64_t x;
+    memcpy(&x, record + shift / 8, sizeof(x));
+
+    x |= (uint64_t) value << (shift & 7);
+    memcpy(record + shift / 8, &x, sizeof(x));
+}
+
 class LocationTable
 {
   public:
-    void load(MemoryFile& file)
+    LocationTable()
+        :
+        layout_(0),
+        records_(0)
+    {
+    }
+
+    // pool is the str.pool section, if the file has one.
+    void load(MemoryFile& file, const char* pool = 0)
     {
-        file.load_mapped_string_vector(country);
-        file.load_mapped_string_vector(region);
-        file.load_mapped_string_vector(city);
+        file.load_mapped_string_vector(country, pool);
+        file.load_mapped_string_vector(region, pool);
+        file.load_mapped_string_vector(city, pool);
+
+        const char* type = file.peek_type();
+
+        if (type && memcmp(type, "CLOC", 4) == 0)
+        {
+            file.load_type();
+
+            MappedVector<CompactLocationLayout> layout;
+            file.load_mapped_vector(layout);
+
+            MappedVector<char> records;
+            file.load_mapped_vector(records);
+
+            REL_ASSERT(layout.size() == 1);
+
+            layout_ = &layout[0];
+            records_ = records.begin();
+
+            return;
+        }
+
         file.load_mapped_vector(locations);
     }
 
+    size_t size() const
+    {
+        return layout_ ? layout_->count : locations.size();
+    }
+
+    // the record of location i, whichever way the table is stored.
+    const void* record(size_t i) const
+    {
+        if (!layout_)
+        {
+            return &locations[i];
+        }
+
+        return records_ + i * layout_->record_bytes;
+    }
+
+    bool compact() const
+    {
+        return layout_ != 0;
+    }
+
+    // fetch location i, whichever way the table is stored.
+    void unpack(size_t i, PackedLocation &out) const
+    {
+        if (!layout_)
+        {
+            out = locations[i];
+            return;
+        }
+
+        const char* record = records_ + i * layout_->record_bytes;
+
+        out.id = i;
+        out.country = compact_field(record, *layout_, CLOC_COUNTRY);
+        out.region = compact_field(record, *layout_, CLOC_REGION);
+        out.city = compact_field(record, *layout_, CLOC_CITY);
+
+        out.lat = compact_field(record, *layout_, CLOC_LAT) / CLOC_SCALE - 
+                  CLOC_LAT_BIAS;
+        out.lon = compact_field(record, *layout_, CLOC_LON) / CLOC_SCALE -
+                  CLOC_LON_BIAS;
+    }
+
     void dump()
     {
-        printf("loc size %d\n", (int) locations.size());
+        printf("loc size %d\n", (int) size());
 
-        for (size_t i = 0; i < locations.size(); ++i)
+        for (size_t i = 0; i < size(); ++i)
         {
-            const PackedLocation &loc = locations[i];
+            PackedLocation loc;
+            unpack(i, loc);
 
             printf("%d %s %s %s\n", loc.id,
                    country[loc.country],
@@ -91,16 +224,334 @@ class LocationTable
     MappedStringVector region;
     MappedStringVector city;
     MappedVector<PackedLocation> locations;
+
+  private:
+    const CompactLocationLayout* layout_;
+    const char* records_;
+};
+
+// bits needed to index a table of n entries.
+inline unsigned index_bits(size_t n)
+{
+    return n > 1 ? bit_width(n - 1) : 0;
+}
+
+inline unsigned to_fixed(double x, double bias)
+{
+    x += bias;
+    return x > 0 ? (unsigned) floor(x * CLOC_SCALE + 0.5) : 0;
+}
+
+// a parsed location, with its strings interned. lat/lon are kept both as
+// floats, for PackedLocation, and fixed point, for CLOC records.
+struct LocationRow
+{
+    unsigned id;
+    unsigned country;
+    unsigned region;
+    unsigned city;
+
+    float lat;
+    float lon;
+
+    unsigned lat_fixed;
+    unsigned lon_fixed;
+};
+
+struct LocationRowIdLess
+{
+    bool operator()(const LocationRow &a, const LocationRow &b) const
+    {
+        return a.id < b.id;
+    }
 };
 
+// orders locations by what they hold, coordinates to CLOC precision.
+struct LocationRowLess
+{
+    bool operator()(const LocationRow &a, const LocationRow &b) const
+    {
+        if (a.country != b.country) return a.country < b.country;
+        if (a.region != b.region) return a.region < b.region;
+        if (a.city != b.city) return a.city < b.city;
+        if (a.lat_fixed != b.lat_fixed) return a.lat_fixed < b.lat_fixed;
+
+        return a.lon_fixed < b.lon_fixed;
+    }
+};
+
+// accumulates the location tables as the csv streams through, so memory
+// is bounded by the size of the output rather than the csv.
+class LocationBuilder
+{
+  public:
+    LocationBuilder() {}
+
+    void add(unsigned id,
+             const CsvField &country,
+             const CsvField &region,
+             const CsvField &city,
+             const CsvField &lat,
+             const CsvField &lon)
+    {
+        rows_.push_back(make_row(id, country, region, city, lat, lon));
+    }
+
+    void add(const LocationRow &row)
+    {
+        rows_.push_back(row);
+    }
+
+    // a row with its strings interned, that is not added yet.
+    LocationRow make_row(unsigned id,
+                         const CsvField &country,
+                         const CsvField &region,
+                         const CsvField &city,
+                         const CsvField &lat,
+                         const CsvField &lon)
+    {
+        LocationRow row;
+
+        row.id = id;
+        row.country = country_.intern(country.data, country.size);
+        row.region = region_.intern(region.data, region.size);
+        row.city = city_.intern(city.data, city.size);
+
+        parse_coord(lat, CLOC_LAT_BIAS, row.lat, row.lat_fixed);
+        parse_coord(lon, CLOC_LON_BIAS, row.lon, row.lon_fixed);
+
+        return row;
+    }
+
+    // the same, for coordinates that are already numbers.
+    LocationRow make_row(unsigned id,
+                         const CsvField &country,
+                         const CsvField &region,
+                         const CsvField &city,
+                         double lat,
+                         double lon)
+    {
+        LocationRow row;
+
+        row.id = id;
+        row.country = country_.intern(country.data, country.size);
+        row.region = region_.intern(region.data, region.size);
+        row.city = city_.intern(city.data, city.size);
+
+        row.lat = lat;
+        row.lon = lon;
+        row.lat_fixed = to_fixed(lat, CLOC_LAT_BIAS);
+        row.lon_fixed = to_fixed(lon, CLOC_LON_BIAS);
+
+        return row;
+    }
+
+    // load the locations of a database back, so that more can be added.
+    // locations keep their numbers, and strings keep their ids. the gaps of
+    // a table indexed by id stay gaps.
+    void load(const LocationTable &table)
+    {
+        load_string_table(table.country, country_);
+        load_string_table(table.region, region_);
+        load_string_table(table.city, city_);
+
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            PackedLocation loc;
+            table.unpack(i, loc);
+
+            if (loc.id != i)
+            {
+                continue;
+            }
+
+            LocationRow row;
+
+            row.id = i;
+            row.country = loc.country;
+            row.region = loc.region;
+            row.city = loc.city;
+            row.lat = loc.lat;
+            row.lon = loc.lon;
+
+            // a float is well within half a CLOC step of the fixed point
+            // value it was unpacked from.
+
+            row.lat_fixed = to_fixed(loc.lat, CLOC_LAT_BIAS);
+            row.lon_fixed = to_fixed(loc.lon, CLOC_LON_BIAS);
+
+            rows_.push_back(row);
+        }
+    }
+
+    size_t size() const
+    {
+        return rows_.size();
+    }
+
+    // number the locations densely in id order, for CLOC. row i becomes
+    // record i.
+    void renumber(hash_map<unsigned, unsigned> &id_to_dense)
+    {
+        std::stable_sort(rows_.begin(), rows_.end(), LocationRowIdLess());
+
+        for (size_t i = 0; i < rows_.size(); ++i)
+        {
+            id_to_dense[rows_[i].id] = i;
+        }
+    }
+
+    // merge locations down to one per country, or per country and region.
+    // the merged locations are numbered densely, in the order they were
+    // first seen, and have no city or coordinates.
+    void project(unsigned granularity,
+                 hash_map<unsigned, unsigned> &id_to_coarse)
+    {
+        StringTable country;
+        StringTable region;
+        StringTable city;
+
+        std::vector<LocationRow> rows;
+        hash_map<uint64_t, unsigned> key_to_coarse;
+
+        city.intern("", 0);
+
+        for (size_t i = 0; i < rows_.size(); ++i)
+        {
+            const LocationRow &row = rows_[i];
+
+            unsigned region_idx = granularity == GRANULARITY_REGION ?
+                                  row.region : 0;
+
+            uint64_t key = ((uint64_t) row.country << 32) | region_idx;
+
+            hash_map<uint64_t, unsigned>::const_iterator iter = 
+                key_to_coarse.find(key);
+
+            if (iter != key_to_coarse.end())
+            {
+                id_to_coarse[row.id] = iter->second;
+                continue;
+            }
+
+            LocationRow coarse;
+            memset(&coarse, 0, sizeof(coarse));
+
+            coarse.id = rows.size();
+            coarse.country = country.intern(country_[row.country],
+                                            country_.length(row.country));
+
+            if (granularity == GRANULARITY_REGION)
+            {
+                coarse.region = region.intern(region_[row.region],
+                                              region_.length(row.region));
+            }
+            else
+            {
+                coarse.region = region.intern("", 0);
+            }
+
+            coarse.lat_fixed = to_fixed(0, CLOC_LAT_BIAS);
+            coarse.lon_fixed = to_fixed(0, CLOC_LON_BIAS);
+
+            key_to_coarse[key] = coarse.id;
+            id_to_coarse[row.id] = coarse.id;
+
+            rows.push_back(coarse);
+        }
+
+        country_.swap(country);
+        region_.swap(region);
+        city_.swap(city);
+
+        rows_.swap(rows);
+    }
+
+    // renumber the locations by how often a sample workload hit them, most
+    // first, and lay the string tables out in the same order. the hot
+    // locations and their strings then share cache lines and pages.
+    void reorder(const hash_map<unsigned, size_t> &hits,
+                 hash_map<unsigned, unsigned> &id_map)
+    {
+        std::vector<size_t> row_hits(rows_.size());
+        std::vector<unsigned> order(rows_.size());
+
+        for (size_t i = 0; i < rows_.size(); ++i)
+        {
+            hash_map<unsigned, size_t>::const_iterator iter = 
+                hits.find(rows_[i].id);
+
+            row_hits[i] = iter == hits.end() ? 0 : iter->second;
+            order[i] = i;
+        }
+
+        std::stable_sort(order.begin(), order.end(), HitsGreater(row_hits));
+
+        StringTable country;
+        StringTable region;
+        StringTable city;
+
+        std::vector<LocationRow> rows;
+        rows.reserve(rows_.size());
+
+        for (size_t k = 0; k < order.size(); ++k)
+        {
+            LocationRow row = rows_[order[k]];
+
+            id_map[row.id] = k;
+
+            row.id = k;
+            row.country = country.intern(country_[row.country],
+                                         country_.length(row.country));
+            row.region = region.intern(region_[row.region],
+                                       region_.length(row.region));
+            row.city = city.intern(city_[row.city], city_.length(row.city));
+
+            rows.push_back(row);
+        }
+
+        country_.swap(country);
+        region_.swap(region);
+        city_.swap(city);
+
+        rows_.swap(rows);
+    }
+
+    const std::vector<LocationRow> &rows() const { return rows_; }
+
+    const StringTable &country() const { return country_; }
+    const StringTable &region() const { return region_; }
+    const StringTable &city() const { return city_; }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(LocationBuilder);
+
+    void parse_coord(const CsvField &f,
+                     double bias,
+                     float &value,
+                     unsigned &fixed)
+    {
+        scratch_.assign(f.data, f.size);
+
+        value = strtof(scratch_.c_str(), 0);
+        fixed = to_fixed(strtod(scratch_.c_str(), 0), bias);
+    }
+
+    StringTable country_;
+    StringTable region_;
+    StringTable city_;
+
+    std::vector<LocationRow> rows_;
+    std::string scratch_;
+};
+
+// feeds CsvRecords into a LocationBuilder.
 class LocationParser : public Connector
 {
   public:
-    LocationParser()
+    explicit LocationParser(LocationBuilder &out)
         :
-        str_(),
-        scratch_(),
-        toks_(),
+        out_(out),
         line_(0)
     {
     }
@@ -110,74 +561,121 @@ class LocationParser : public Connector
         line_++;
         if (line_ < 3) return;
 
-        csv_split((const char*) b.data(), b.size(), scratch_, toks_);
+        const CsvRecord* record = (const CsvRecord*) b.data();
 
-        if (toks_.size() != 9)
+        if (record->count != 9)
         {
             return;
         }
 
-        Location loc;
-
-        loc.id = to_u(toks_[0]);
-        loc.country = toks_[1];
-        loc.region = toks_[2];
-        loc.city = toks_[3];
-        loc.lat = toks_[5];
-        loc.lon = toks_[6];
+        const CsvField* toks = record->fields;
 
-        emit(Buffer(&loc, sizeof(loc)));
+        out_.add(to_u(toks[0]), toks[1], toks[2], toks[3], toks[5], toks[6]);
     }
 
   private:
-    std::string str_;
-    std::string scratch_;
-    std::vector<char*> toks_;
-
+    LocationBuilder &out_;
     size_t line_;
 };
 
-// convert string columns into string tables
-// turn location into packed location
-inline void save_locations(BinaryFile &file, 
-                           const std::vector<Location> &locations)
+// save locations as CLOC records. row i of the builder becomes record i.
+inline void save_compact_locations(BinaryFile &file,
+                                   const LocationBuilder &locations)
 {
-    unsigned maxid = 0;
+    const std::vector<LocationRow> &rows = locations.rows();
+
+    unsigned max_lat = 0;
+    unsigned max_lon = 0;
+
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        max_lat = std::max(max_lat, rows[i].lat_fixed);
+        max_lon = std::max(max_lon, rows[i].lon_fixed);
+    }
+
+    std::vector<CompactLocationLayout> layout(1);
+    CompactLocationLayout &l = layout[0];
+
+    memset(&l, 0, sizeof(l));
+
+    l.count = rows.size();
+    l.bits[CLOC_COUNTRY] = index_bits(locations.country().size());
+    l.bits[CLOC_REGION] = index_bits(locations.region().size());
+    l.bits[CLOC_CITY] = index_bits(locations.city().size());
+    l.bits[CLOC_LAT] = bit_width(max_lat);
+    l.bits[CLOC_LON] = bit_width(max_lon);
+
+    unsigned shift = 0;
+
+    for (unsigned f = 0; f < CLOC_FIELDS; ++f)
+    {
+        l.shift[f] = shift;
+        shift += l.bits[f];
+    }
+
+    l.record_bytes = std::max((shift + 7) / 8, 1U);
 
-    StringTable country;
-    StringTable region;
-    StringTable city;
+    std::vector<char> records(l.count * l.record_bytes + CLOC_PADDING, 0);
 
-    for (size_t i = 0; i < locations.size(); ++i)
+    for (size_t i = 0; i < rows.size(); ++i)
     {
-        const Location &loc = locations[i];
+        const LocationRow &row = rows[i];
+        char* record = &records[i * l.record_bytes];
+
+        set_compact_field(record, l, CLOC_COUNTRY, row.country);
+        set_compact_field(record, l, CLOC_REGION, row.region);
+        set_compact_field(record, l, CLOC_CITY, row.city);
+        set_compact_field(record, l, CLOC_LAT, row.lat_fixed);
+        set_compact_field(record, l, CLOC_LON, row.lon_fixed);
+    }
 
-        maxid = std::max(loc.id, maxid);
+    file.save_type("CLOC");
+    file.save_pod_vector(layout);
+    file.save_pod_vector(records);
+}
+
+// save the string tables, then the locations, either as PackedLocations
+// indexed by id or as CLOC records. with a pool, the string tables are saved
+// as refs into it.
+inline void save_locations(BinaryFile &file, 
+                           const LocationBuilder &locations,
+                           bool compact = false,
+                           const StringPool* pool = 0)
+{
+    save_strings(file, locations.country(), pool);
+    save_strings(file, locations.region(), pool);
+    save_strings(file, locations.city(), pool);
 
-        country.insert(loc.country);
-        region.insert(loc.region);
-        city.insert(loc.city);
+    if (compact)
+    {
+        save_compact_locations(file, locations);
+        return;
     }
 
-    save_string_table(file, country);
-    save_string_table(file, region);
-    save_string_table(file, city);
+    const std::vector<LocationRow> &rows = locations.rows();
+
+    unsigned maxid = 0;
+
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        maxid = std::max(rows[i].id, maxid);
+    }
 
     std::vector<PackedLocation> packed;
     packed.resize(maxid + 1);
 
-    for (size_t i = 0; i < locations.size(); ++i)
+    for (size_t i = 0; i < rows.size(); ++i)
     {
-        const Location &loc = locations[i];
+        const LocationRow &row = rows[i];
 
-        PackedLocation &ploc = packed[loc.id];
+        PackedLocation &ploc = packed[row.id];
 
-        ploc.id = loc.id;
-        ploc.country = country.index_of(loc.country);
-        ploc.region = region.index_of(loc.region);
-        ploc.city = city.index_of(loc.city);
-        ploc.lat = strtof(loc.lat.c_str(), 0);
-        ploc.lon = strtof(loc.lon.c_str(), 0);
+        ploc.id = row.id;
+        ploc.country = row.country;
+        ploc.region = row.region;
+        ploc.city = row.city;
+        ploc.lat = row.lat;
+        ploc.lon = row.lon;
     }
 
     file.save_pod_vector(packed);
@@ -11,6 +11,9 @@
 #ifndef MACROS_HPP_942AF38F
 #define MACROS_HPP_942AF38F
 
+#include <sys/time.h>
+#include <stddef.h>
+
 #define UNUSED(x) (void)(x)
 
 #define DISALLOW_COPY_AND_ASSIGN(TypeName) \
@@ -30,4 +33,12 @@ inline const char* get_endian()
     return data.s[0] == 0x04 ? "little" : "big";
 }
 
+inline double now_msec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
 #endif
@@ -0,0 +1,1191 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module imports MaxMind DB (.mmdb) files, such as GeoLite2-City and
+ * GeoLite2-ASN, for geoloc --import-mmdb, as the legacy csvs are no longer
+ * updated.
+ *
+ * An mmdb is a binary tree over the bits of an address, followed by a data
+ * section of records, and a metadata map at the end of the file. The ipv4
+ * part of the tree (::/96 of an ipv6 tree) is walked and flattened into
+ * sorted, disjoint blocks, each pointing at the record of its leaf. The rest
+ * of an ipv6 tree is walked into v6 blocks, leaving out the subtrees that
+ * alias the ipv4 part, such as ::ffff:0:0/96. The walk is split into
+ * subtrees, which the import threads take in turn.
+ *
+ * Each distinct record is decoded once. City and country databases give
+ * locations: the country and first subdivision iso codes, the english city
+ * name and the coordinates. ASN databases give the asn number and
+ * organization. The tables then go through the same steps as a csv import,
+ * so every import option applies.
+*/
+
+#ifndef MMDB_HPP_0B7D3E95
+#define MMDB_HPP_0B7D3E95
+
+#include "etl.hpp"
+
+#include <map>
+#include <stdint.h>
+#include <string.h>
+
+#define MMDB_METADATA_MARKER "\xAB\xCD\xEFMaxMind.com"
+#define MMDB_METADATA_MARKER_SIZE 14
+#define MMDB_METADATA_MAX_SIZE (128U << 10)
+
+// zero bytes between the tree and the data section.
+#define MMDB_DATA_SEPARATOR 16
+
+// maps and arrays nested deeper than this are refused, so that a crafted
+// file cannot exhaust the stack. real databases nest a few levels.
+#define MMDB_MAX_DEPTH 512
+
+// the walk is split into up to 2^MMDB_SPLIT_BITS subtrees.
+#define MMDB_SPLIT_BITS 8
+
+// ipv6 networks sit deeper, mostly under 2000::/3.
+#define MMDB_SPLIT_BITS6 16
+
+enum
+{
+    MMDB_EXTENDED,
+    MMDB_POINTER,
+    MMDB_STRING,
+    MMDB_DOUBLE,
+    MMDB_BYTES,
+    MMDB_UINT16,
+    MMDB_UINT32,
+    MMDB_MAP,
+    MMDB_INT32,
+    MMDB_UINT64,
+    MMDB_UINT128,
+    MMDB_ARRAY,
+    MMDB_CONTAINER,
+    MMDB_END_MARKER,
+    MMDB_BOOLEAN,
+    MMDB_FLOAT
+};
+
+// the header of a value. size is the number of entries of a map or array,
+// the value of a boolean, the target of a pointer, and otherwise the number
+// of payload bytes, which start at data.
+struct MMDBValue
+{
+    unsigned type;
+    size_t size;
+    size_t data;
+};
+
+// reads values out of a data section, or the metadata. offsets are relative
+// to the start of the section, as mmdb pointers are.
+class MMDBDecoder
+{
+  public:
+    MMDBDecoder()
+        :
+        begin_(0),
+        size_(0)
+    {
+    }
+
+    MMDBDecoder(const unsigned char* begin, size_t size)
+        :
+        begin_(begin),
+        size_(size)
+    {
+    }
+
+    // the header of the value at offset, following it if it is a pointer.
+    // returns the offset after the value, or for a map or array that is
+    // not behind a pointer, after its header.
+    size_t decode(size_t offset, MMDBValue &v) const
+    {
+        size_t next = header(offset, v);
+
+        if (v.type == MMDB_POINTER)
+        {
+            header(v.size, v);
+
+            if (v.type == MMDB_POINTER)
+            {
+                FATAL_ERROR("mmdb pointer at %zu points to a pointer",
+                            offset);
+            }
+        }
+
+        return next;
+    }
+
+    // the offset after the value at offset, entries and all. depth is the
+    // nesting of the value.
+    size_t skip(size_t offset, unsigned depth = 0) const
+    {
+        if (depth > MMDB_MAX_DEPTH)
+        {
+            FATAL_ERROR("mmdb value at %zu is nested more than %u deep",
+                        offset, MMDB_MAX_DEPTH);
+            return size_;
+        }
+
+        MMDBValue v;
+        size_t next = header(offset, v);
+
+        if (v.type == MMDB_MAP || v.type == MMDB_ARRAY)
+        {
+            size_t n = v.type == MMDB_MAP ? v.size * 2 : v.size;
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                next = skip(next, depth + 1);
+            }
+        }
+
+        return next;
+    }
+
+    // the value of key in the map at offset.
+    bool find(size_t offset, const char* key, size_t &value) const
+    {
+        MMDBValue map;
+        decode(offset, map);
+
+        if (map.type != MMDB_MAP)
+        {
+            return false;
+        }
+
+        size_t n = strlen(key);
+        size_t next = map.data;
+
+        for (size_t i = 0; i < map.size; ++i)
+        {
+            MMDBValue k;
+            size_t after = decode(next, k);
+
+            if (k.type != MMDB_STRING)
+            {
+                FATAL_ERROR("mmdb map at %zu has a key that is not a "
+                            "string", offset);
+            }
+
+            if (k.size == n && memcmp(begin_ + k.data, key, n) == 0)
+            {
+                value = after;
+                return true;
+            }
+
+            next = skip(after);
+        }
+
+        return false;
+    }
+
+    // follow a null terminated list of keys down from offset. an array on
+    // the way stands for its first entry.
+    bool path(size_t offset, const char* const* keys, size_t &value) const
+    {
+        for (; *keys; ++keys)
+        {
+            MMDBValue v;
+            decode(offset, v);
+
+            if (v.type == MMDB_ARRAY)
+            {
+                if (v.size == 0)
+                {
+                    return false;
+                }
+
+                offset = v.data;
+            }
+
+            if (!find(offset, *keys, offset))
+            {
+                return false;
+            }
+        }
+
+        value = offset;
+
+        return true;
+    }
+
+    bool string(size_t offset, CsvField &out) const
+    {
+        MMDBValue v;
+        decode(offset, v);
+
+        if (v.type != MMDB_STRING)
+        {
+            return false;
+        }
+
+        out.data = (const char*) begin_ + v.data;
+        out.size = v.size;
+
+        return true;
+    }
+
+    bool number(size_t offset, uint64_t &out) const
+    {
+        MMDBValue v;
+        decode(offset, v);
+
+        if (v.type != MMDB_UINT16 && v.type != MMDB_UINT32 &&
+            v.type != MMDB_UINT64 && v.type != MMDB_INT32)
+        {
+            return false;
+        }
+
+        out = read_be(v.data, v.size);
+
+        return true;
+    }
+
+    bool number(size_t offset, double &out) const
+    {
+        MMDBValue v;
+        decode(offset, v);
+
+        if (v.type == MMDB_DOUBLE && v.size == 8)
+        {
+            uint64_t bits = read_be(v.data, 8);
+            memcpy(&out, &bits, sizeof(out));
+
+            return true;
+        }
+
+        if (v.type == MMDB_FLOAT && v.size == 4)
+        {
+            uint32_t bits = read_be(v.data, 4);
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+
+            out = f;
+
+            return true;
+        }
+
+        return false;
+    }
+
+  private:
+    void check(size_t offset, size_t n) const
+    {
+        if (offset > size_ || n > size_ - offset)
+        {
+            FATAL_ERROR("mmdb value at %zu runs past the end of its "
+                        "section", offset);
+        }
+    }
+
+    uint64_t read_be(size_t offset, size_t n) const
+    {
+        if (n > 8)
+        {
+            FATAL_ERROR("mmdb number at %zu is %zu bytes wide", offset, n);
+        }
+
+        uint64_t x = 0;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            x = x << 8 | begin_[offset + i];
+        }
+
+        return x;
+    }
+
+    size_t header(size_t offset, MMDBValue &v) const
+    {
+        check(offset, 1);
+
+        unsigned ctrl = begin_[offset++];
+        v.type = ctrl >> 5;
+
+        if (v.type == MMDB_POINTER)
+        {
+            static const size_t pointer_bias[] = { 0, 2048, 526336, 0 };
+
+            unsigned n = ((ctrl >> 3) & 3) + 1;
+            check(offset, n);
+
+            size_t p = n == 4 ? 0 : ctrl & 7;
+
+            for (unsigned i = 0; i < n; ++i)
+            {
+                p = p << 8 | begin_[offset + i];
+            }
+
+            v.size = p + pointer_bias[n - 1];
+            v.data = v.size;
+
+            return offset + n;
+        }
+
+        if (v.type == MMDB_EXTENDED)
+        {
+            check(offset, 1);
+            v.type = 7 + begin_[offset++];
+
+            if (v.type < MMDB_INT32 || v.type > MMDB_FLOAT)
+            {
+                FATAL_ERROR("mmdb value at %zu has unknown type %u",
+                            offset, v.type);
+            }
+        }
+
+        static const size_t size_bias[] = { 29, 285, 65821 };
+
+        size_t size = ctrl & 31;
+
+        if (size >= 29)
+        {
+            unsigned n = size - 28;
+            check(offset, n);
+
+            size = size_bias[n - 1] + read_be(offset, n);
+            offset += n;
+        }
+
+        v.size = size;
+        v.data = offset;
+
+        if (v.type == MMDB_MAP || v.type == MMDB_ARRAY ||
+            v.type == MMDB_BOOLEAN)
+        {
+            return offset;
+        }
+
+        check(offset, size);
+
+        return offset + size;
+    }
+
+    const unsigned char* begin_;
+    size_t size_;
+};
+
+// a mapped mmdb file.
+class MMDB
+{
+  public:
+    MMDB()
+        :
+        map_(),
+        tree_(0),
+        data_(),
+        node_count_(0),
+        record_size_(0),
+        ip_version_(0),
+        ipv4_root_(0),
+        database_type_()
+    {
+    }
+
+    bool open(const char* fn)
+    {
+        LOG_CONTEXT("MMDB open %s", fn);
+
+        if (!map_.open(fn))
+        {
+            return false;
+        }
+
+        const unsigned char* begin = (const unsigned char*) map_.begin();
+        size_t size = map_.size();
+
+        // the metadata follows the last marker, near the end of the file.
+
+        size_t window = std::min(size, (size_t) MMDB_METADATA_MAX_SIZE);
+        size_t marker = size;
+
+        for (size_t i = MMDB_METADATA_MARKER_SIZE; i <= window; ++i)
+        {
+            if (memcmp(begin + size - i, MMDB_METADATA_MARKER,
+                       MMDB_METADATA_MARKER_SIZE) == 0)
+            {
+                marker = size - i;
+                break;
+            }
+        }
+
+        if (marker == size)
+        {
+            FATAL_ERROR("%s has no mmdb metadata", fn);
+            return false;
+        }
+
+        size_t meta = marker + MMDB_METADATA_MARKER_SIZE;
+        MMDBDecoder metadata(begin + meta, size - meta);
+
+        if (metadata_number(metadata, "binary_format_major_version") != 2)
+        {
+            FATAL_ERROR("%s is not a version 2 mmdb", fn);
+        }
+
+        node_count_ = metadata_number(metadata, "node_count");
+        record_size_ = metadata_number(metadata, "record_size");
+        ip_version_ = metadata_number(metadata, "ip_version");
+
+        size_t offset;
+        CsvField type;
+
+        if (metadata.find(0, "database_type", offset) &&
+            metadata.string(offset, type))
+        {
+            database_type_.assign(type.data, type.size);
+        }
+
+        if (record_size_ != 24 && record_size_ != 28 && record_size_ != 32)
+        {
+            FATAL_ERROR("%s has unknown record size %u", fn, record_size_);
+        }
+
+        if (ip_version_ != 4 && ip_version_ != 6)
+        {
+            FATAL_ERROR("%s has unknown ip version %u", fn, ip_version_);
+        }
+
+        size_t tree_size = (size_t) node_count_ * record_size_ / 4;
+
+        if (tree_size + MMDB_DATA_SEPARATOR > marker)
+        {
+            FATAL_ERROR("%s is too short for its tree", fn);
+        }
+
+        tree_ = begin;
+        data_ = MMDBDecoder(begin + tree_size + MMDB_DATA_SEPARATOR,
+                            marker - tree_size - MMDB_DATA_SEPARATOR);
+
+        ipv4_root_ = find_ipv4_root();
+
+        return true;
+    }
+
+    // the left (bit 0) or right record of a node.
+    unsigned record(unsigned node, unsigned bit) const
+    {
+        const unsigned char* p = tree_ + (size_t) node * record_size_ / 4;
+
+        if (record_size_ == 24)
+        {
+            p += bit * 3;
+
+            return p[0] << 16 | p[1] << 8 | p[2];
+        }
+
+        if (record_size_ == 28)
+        {
+            unsigned high = bit ? p[3] & 0x0F : p[3] >> 4;
+
+            p += bit * 4;
+
+            return high << 24 | p[0] << 16 | p[1] << 8 | p[2];
+        }
+
+        p += bit * 4;
+
+        return (unsigned) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    }
+
+    // the record of 0.0.0.0/0, which is ::/96 in an ipv6 tree.
+    unsigned ipv4_root() const
+    {
+        return ipv4_root_;
+    }
+
+    const MMDBDecoder &data() const { return data_; }
+    unsigned node_count() const { return node_count_; }
+    unsigned ip_version() const { return ip_version_; }
+    const std::string &database_type() const { return database_type_; }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(MMDB);
+
+    unsigned find_ipv4_root() const
+    {
+        unsigned node = 0;
+
+        for (unsigned i = 0; ip_version_ == 6 && i < 96; ++i)
+        {
+            if (node >= node_count_)
+            {
+                break;
+            }
+
+            node = record(node, 0);
+        }
+
+        return node;
+    }
+
+    static unsigned metadata_number(const MMDBDecoder &metadata,
+                                    const char* key)
+    {
+        size_t offset;
+        uint64_t value = 0;
+
+        if (!metadata.find(0, key, offset) ||
+            !metadata.number(offset, value))
+        {
+            FATAL_ERROR("mmdb metadata has no %s", key);
+        }
+
+        return value;
+    }
+
+    MemoryMap map_;
+
+    const unsigned char* tree_;
+    MMDBDecoder data_;
+
+    unsigned node_count_;
+    unsigned record_size_;
+    unsigned ip_version_;
+    unsigned ipv4_root_;
+
+    std::string database_type_;
+};
+
+// a prefix of the ipv4 tree, and the record it leads to.
+struct MMDBPrefix
+{
+    unsigned start_ip;
+    unsigned depth;
+    unsigned record;
+};
+
+// append a block, merging it into the last one if they are contiguous and
+// have the same payload.
+inline void append_block(std::vector<Block> &out, const Block &block)
+{
+    if (!out.empty() && out.back().loc == block.loc &&
+        out.back().end_ip + 1 == block.start_ip)
+    {
+        out.back().end_ip = block.end_ip;
+        return;
+    }
+
+    out.push_back(block);
+}
+
+// flatten the subtree under prefix into blocks whose loc is the data
+// section offset of their record. networks with no record are left out.
+inline void walk_mmdb(const MMDB &db,
+                      const MMDBPrefix &prefix,
+                      std::vector<Block> &out)
+{
+    unsigned nodes = db.node_count();
+
+    if (prefix.record == nodes)
+    {
+        return;
+    }
+
+    if (prefix.record > nodes)
+    {
+        if (prefix.record - nodes < MMDB_DATA_SEPARATOR)
+        {
+            FATAL_ERROR("mmdb record %u points into the separator",
+                        prefix.record);
+        }
+
+        Block block;
+
+        block.start_ip = prefix.start_ip;
+        block.end_ip = prefix.start_ip +
+                       (prefix.depth == 32 ? 0 : 0xFFFFFFFF >> prefix.depth);
+        block.loc = prefix.record - nodes - MMDB_DATA_SEPARATOR;
+
+        append_block(out, block);
+
+        return;
+    }
+
+    if (prefix.depth == 32)
+    {
+        FATAL_ERROR("mmdb tree is deeper than 32 bits at %u",
+                    prefix.start_ip);
+    }
+
+    for (unsigned bit = 0; bit < 2; ++bit)
+    {
+        MMDBPrefix child;
+
+        child.start_ip = prefix.start_ip | bit << (31 - prefix.depth);
+        child.depth = prefix.depth + 1;
+        child.record = db.record(prefix.record, bit);
+
+        walk_mmdb(db, child, out);
+    }
+}
+
+// the prefixes of the tree bits deep, or less where the tree ends sooner,
+// in address order.
+inline void split_mmdb(const MMDB &db,
+                       const MMDBPrefix &prefix,
+                       unsigned bits,
+                       std::vector<MMDBPrefix> &out)
+{
+    if (prefix.depth == bits || prefix.record >= db.node_count())
+    {
+        out.push_back(prefix);
+        return;
+    }
+
+    for (unsigned bit = 0; bit < 2; ++bit)
+    {
+        MMDBPrefix child;
+
+        child.start_ip = prefix.start_ip | bit << (31 - prefix.depth);
+        child.depth = prefix.depth + 1;
+        child.record = db.record(prefix.record, bit);
+
+        split_mmdb(db, child, bits, out);
+    }
+}
+
+// a prefix of the ipv6 tree, and the record it leads to.
+struct MMDBPrefix6
+{
+    IP6 start;
+    unsigned depth;
+    unsigned record;
+};
+
+inline void append_block(std::vector<Block6> &out, const Block6 &block)
+{
+    append_block6(out, block);
+}
+
+// the child of a v6 prefix on the side of bit.
+inline MMDBPrefix6 mmdb_child(const MMDB &db,
+                              const MMDBPrefix6 &prefix,
+                              unsigned bit)
+{
+    MMDBPrefix6 child = prefix;
+
+    if (bit && prefix.depth < 64)
+    {
+        child.start.hi |= (uint64_t) 1 << (63 - prefix.depth);
+    }
+    else if (bit)
+    {
+        child.start.lo |= (uint64_t) 1 << (127 - prefix.depth);
+    }
+
+    child.depth = prefix.depth + 1;
+    child.record = db.record(prefix.record, bit);
+
+    return child;
+}
+
+// true for the nodes of the ipv4 part of a v6 tree, which is reached
+// through ::/96 and through aliases of it.
+inline bool mmdb_ipv4_node(const MMDB &db, unsigned record)
+{
+    return record == db.ipv4_root() && record < db.node_count();
+}
+
+// as walk_mmdb, for the ipv6 tree outside of its ipv4 part.
+inline void walk_mmdb(const MMDB &db,
+                      const MMDBPrefix6 &prefix,
+                      std::vector<Block6> &out)
+{
+    unsigned nodes = db.node_count();
+
+    if (prefix.record == nodes || mmdb_ipv4_node(db, prefix.record))
+    {
+        return;
+    }
+
+    if (prefix.record > nodes)
+    {
+        if (prefix.record - nodes < MMDB_DATA_SEPARATOR)
+        {
+            FATAL_ERROR("mmdb record %u points into the separator",
+                        prefix.record);
+        }
+
+        uint64_t ones = ~(uint64_t) 0;
+
+        Block6 block;
+
+        block.start = prefix.start;
+        block.end = prefix.start;
+
+        if (prefix.depth < 64)
+        {
+            block.end.hi |= prefix.depth ? ones >> prefix.depth : ones;
+            block.end.lo = ones;
+        }
+        else if (prefix.depth < 128)
+        {
+            block.end.lo |= prefix.depth > 64 ? ones >> (prefix.depth - 64) :
+                                                ones;
+        }
+
+        block.loc = prefix.record - nodes - MMDB_DATA_SEPARATOR;
+
+        append_block6(out, block);
+
+        return;
+    }
+
+    if (prefix.depth == 128)
+    {
+        FATAL_ERROR("mmdb tree is deeper than 128 bits");
+    }
+
+    for (unsigned bit = 0; bit < 2; ++bit)
+    {
+        walk_mmdb(db, mmdb_child(db, prefix, bit), out);
+    }
+}
+
+// as split_mmdb, for the ipv6 tree.
+inline void split_mmdb(const MMDB &db,
+                       const MMDBPrefix6 &prefix,
+                       unsigned bits,
+                       std::vector<MMDBPrefix6> &out)
+{
+    if (prefix.depth == bits || prefix.record >= db.node_count() ||
+        mmdb_ipv4_node(db, prefix.record))
+    {
+        out.push_back(prefix);
+        return;
+    }
+
+    for (unsigned bit = 0; bit < 2; ++bit)
+    {
+        split_mmdb(db, mmdb_child(db, prefix, bit), bits, out);
+    }
+}
+
+// walks whichever subtree is next, until there are none left, so that the
+// threads stay busy however uneven the subtrees are.
+template <typename Prefix, typename BlockType>
+class MMDBWalkTask : public Thread
+{
+  public:
+    MMDBWalkTask(const MMDB &db,
+                 const std::vector<Prefix> &prefixes,
+                 std::vector<std::vector<BlockType> > &out,
+                 size_t &next,
+                 Mutex &mutex)
+        :
+        db_(db),
+        prefixes_(prefixes),
+        out_(out),
+        next_(next),
+        mutex_(mutex)
+    {
+    }
+
+  protected:
+    void run()
+    {
+        while (true)
+        {
+            size_t i;
+
+            {
+                MutexLock lock(mutex_);
+
+                if (next_ == prefixes_.size())
+                {
+                    return;
+                }
+
+                i = next_++;
+            }
+
+            walk_mmdb(db_, prefixes_[i], out_[i]);
+        }
+    }
+
+  private:
+    const MMDB &db_;
+    const std::vector<Prefix> &prefixes_;
+    std::vector<std::vector<BlockType> > &out_;
+    size_t &next_;
+    Mutex &mutex_;
+};
+
+// flatten the tree under root into sorted, disjoint blocks pointing at
+// records.
+template <typename Prefix, typename BlockType>
+inline void read_mmdb_blocks(const MMDB &db,
+                             const Prefix &root,
+                             unsigned split_bits,
+                             unsigned threads,
+                             std::vector<BlockType> &out)
+{
+    typedef MMDBWalkTask<Prefix, BlockType> Task;
+
+    threads = std::max(threads, 1U);
+
+    std::vector<Prefix> prefixes;
+    split_mmdb(db, root, threads > 1 ? split_bits : 0, prefixes);
+
+    std::vector<std::vector<BlockType> > parts(prefixes.size());
+    std::vector<Task*> tasks;
+
+    size_t next = 0;
+    Mutex mutex;
+
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        tasks.push_back(new Task(db, prefixes, parts, next, mutex));
+        tasks.back()->start();
+    }
+
+    size_t total = 0;
+
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        tasks[t]->join();
+        delete tasks[t];
+    }
+
+    for (size_t i = 0; i < parts.size(); ++i)
+    {
+        total += parts[i].size();
+    }
+
+    out.reserve(out.size() + total);
+
+    // a network split over two subtrees comes back together here.
+
+    for (size_t i = 0; i < parts.size(); ++i)
+    {
+        for (size_t j = 0; j < parts[i].size(); ++j)
+        {
+            append_block(out, parts[i][j]);
+        }
+
+        std::vector<BlockType>().swap(parts[i]);
+    }
+}
+
+// the ipv4 networks of an mmdb.
+inline void read_mmdb_blocks(const MMDB &db,
+                             unsigned threads,
+                             std::vector<Block> &out)
+{
+    MMDBPrefix root;
+
+    root.start_ip = 0;
+    root.depth = 0;
+    root.record = db.ipv4_root();
+
+    read_mmdb_blocks(db, root, MMDB_SPLIT_BITS, threads, out);
+}
+
+// the ipv6 networks of an mmdb, none for an ipv4 tree.
+inline void read_mmdb_blocks(const MMDB &db,
+                             unsigned threads,
+                             std::vector<Block6> &out)
+{
+    if (db.ip_version() != 6)
+    {
+        return;
+    }
+
+    MMDBPrefix6 root;
+
+    root.start.hi = 0;
+    root.start.lo = 0;
+    root.depth = 0;
+    root.record = 0;
+
+    read_mmdb_blocks(db, root, MMDB_SPLIT_BITS6, threads, out);
+}
+
+// fills the location and asn tables from one or more mmdbs. records are
+// decoded once each, and records that make the same location share it.
+class MMDBSource
+{
+  public:
+    MMDBSource(LocationBuilder &locations,
+               std::vector<Block> &blocks,
+               std::vector<Block6> &blocks6,
+               ASNBuilder &asns,
+               bool read_asns)
+        :
+        locations_(locations),
+        blocks_(blocks),
+        blocks6_(blocks6),
+        asns_(asns),
+        read_asns_(read_asns),
+        has_asns_(false),
+        next_location_(0),
+        index_()
+    {
+    }
+
+    void read(const char* fn, unsigned threads)
+    {
+        LOG_CONTEXT("MMDBSource read %s", fn);
+
+        MMDB db;
+
+        if (!db.open(fn))
+        {
+            FATAL_ERROR("could not open %s", fn);
+        }
+
+        std::vector<Block> tree;
+        read_mmdb_blocks(db, threads, tree);
+
+        std::vector<Block6> tree6;
+        read_mmdb_blocks(db, threads, tree6);
+
+        LOG_CONTEXT("%s is a %s with %zu ipv4 and %zu ipv6 networks", fn,
+                    db.database_type().c_str(), tree.size(), tree6.size());
+
+        // record offset to location or asn index, or NO_RECORD, shared by
+        // the v4 and v6 networks.
+
+        hash_map<unsigned, unsigned> location_ids;
+        hash_map<unsigned, unsigned> asn_ids;
+
+        add_blocks(db.data(), tree, blocks_, location_ids, asn_ids);
+        add_blocks(db.data(), tree6, blocks6_, location_ids, asn_ids);
+    }
+
+    bool has_asns() const
+    {
+        return has_asns_;
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(MMDBSource);
+
+    enum { NO_RECORD = 0xFFFFFFFF };
+
+    template <typename BlockType>
+    void add_blocks(const MMDBDecoder &data,
+                    const std::vector<BlockType> &tree,
+                    std::vector<BlockType> &blocks,
+                    hash_map<unsigned, unsigned> &location_ids,
+                    hash_map<unsigned, unsigned> &asn_ids)
+    {
+        for (size_t i = 0; i < tree.size(); ++i)
+        {
+            BlockType block = tree[i];
+
+            hash_map<unsigned, unsigned>::iterator iter =
+                location_ids.find(block.loc);
+
+            if (iter == location_ids.end())
+            {
+                iter = location_ids.insert(std::make_pair(block.loc,
+                    location(data, block.loc))).first;
+            }
+
+            if (iter->second != NO_RECORD)
+            {
+                BlockType loc = block;
+                loc.loc = iter->second;
+
+                append_block(blocks, loc);
+            }
+
+            if (!read_asns_)
+            {
+                continue;
+            }
+
+            iter = asn_ids.find(block.loc);
+
+            if (iter == asn_ids.end())
+            {
+                iter = asn_ids.insert(std::make_pair(block.loc,
+                    asn(data, block.loc))).first;
+            }
+
+            if (iter->second != NO_RECORD)
+            {
+                block.loc = iter->second;
+
+                asns_.add(block);
+                has_asns_ = true;
+            }
+        }
+    }
+
+    // the location of a record, or NO_RECORD if it has none, as in an asn
+    // database.
+    unsigned location(const MMDBDecoder &data, size_t record)
+    {
+        static const char* const country_path[] =
+            { "country", "iso_code", 0 };
+        static const char* const registered_path[] =
+            { "registered_country", "iso_code", 0 };
+        static const char* const region_path[] =
+            { "subdivisions", "iso_code", 0 };
+        static const char* const city_path[] =
+            { "city", "names", "en", 0 };
+        static const char* const lat_path[] =
+            { "location", "latitude", 0 };
+        static const char* const lon_path[] =
+            { "location", "longitude", 0 };
+
+        CsvField empty = { "", 0 };
+
+        CsvField country = empty;
+        CsvField region = empty;
+        CsvField city = empty;
+
+        double lat = 0;
+        double lon = 0;
+
+        size_t offset;
+
+        // networks with no country of their own, such as anonymous
+        // proxies, still have the country they are registered in.
+
+        bool has_country =
+            (data.path(record, country_path, offset) ||
+             data.path(record, registered_path, offset)) &&
+            data.string(offset, country);
+
+        bool has_coords =
+            data.path(record, lat_path, offset) &&
+            data.number(offset, lat) &&
+            data.path(record, lon_path, offset) &&
+            data.number(offset, lon);
+
+        if (!has_country && !has_coords)
+        {
+            return NO_RECORD;
+        }
+
+        if (data.path(record, region_path, offset))
+        {
+            data.string(offset, region);
+        }
+
+        if (data.path(record, city_path, offset))
+        {
+            data.string(offset, city);
+        }
+
+        LocationRow row = locations_.make_row(next_location_, country,
+                                              region, city, lat, lon);
+
+        std::map<LocationRow, unsigned, LocationRowLess>::iterator iter =
+            index_.find(row);
+
+        if (iter == index_.end())
+        {
+            locations_.add(row);
+            iter = index_.insert(std::make_pair(row, next_location_++)).first;
+        }
+
+        return iter->second;
+    }
+
+    // the asn index of a record, or NO_RECORD if it has none.
+    unsigned asn(const MMDBDecoder &data, size_t record)
+    {
+        size_t offset;
+        uint64_t number;
+
+        if (!data.find(record, "autonomous_system_number", offset) ||
+            !data.number(offset, number))
+        {
+            return NO_RECORD;
+        }
+
+        CsvField text = { "", 0 };
+
+        if (data.find(record, "autonomous_system_organization", offset))
+        {
+            data.string(offset, text);
+        }
+
+        return asns_.add_asn(number, text.data, text.size);
+    }
+
+    LocationBuilder &locations_;
+    std::vector<Block> &blocks_;
+    std::vector<Block6> &blocks6_;
+    ASNBuilder &asns_;
+
+    bool read_asns_;
+    bool has_asns_;
+
+    unsigned next_location_;
+    std::map<LocationRow, unsigned, LocationRowLess> index_;
+};
+
+// import mmdbs into a database, as etl does csvs. if none of them has asns,
+// the database is built as with --no-asn.
+inline void etl_mmdb(const std::vector<std::string> &sources,
+                     const char* output,
+                     const ImportOptions &options = ImportOptions(),
+                     ImportStats* stats = 0)
+{
+    LOG_CONTEXT("etl_mmdb %zu files into file %s", sources.size(), output);
+
+    BinaryFile file;
+    bool ok = file.open(output);
+
+    if (!ok)
+    {
+        FATAL_ERROR("could not open %s for writing", output);
+    }
+
+    char buf[32]; get_header(buf, sizeof(buf));
+
+    file.save_bytes_raw(buf, sizeof(buf));
+    file.reserve_section_directory();
+
+    std::vector<unsigned> sample;
+    Overlay overlay;
+
+    read_import_inputs(options, sample, overlay);
+
+    ImportOptions mmdb_options = options;
+    ImportStats local_stats;
+    ImportStats &out_stats = stats ? *stats : local_stats;
+
+    LocationBuilder locations;
+    std::vector<Block> blocks;
+    std::vector<Block6> blocks6;
+    ASNTask asns(0, mmdb_options, sample, overlay);
+
+    MMDBSource source(locations, blocks, blocks6, asns.asns,
+                      !options.no_asn);
+
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        source.read(sources[i].c_str(), options.threads);
+    }
+
+    mmdb_options.no_asn = !source.has_asns();
+
+    // blocks from more than one location database overlap.
+
+    out_stats.loc_conflicts = normalize_blocks(blocks, options.threads,
+                                               "location", options.report) +
+                              normalize_blocks6(blocks6);
+
+    if (!mmdb_options.no_asn)
+    {
+        asns.start();
+    }
+
+    save_geo_data(file, locations, blocks, blocks6, asns, sample, overlay,
+                  mmdb_options, out_stats);
+    file.finish();
+}
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module handles overlays, user supplied ranges with their own
+ * location and asn labels (geoloc --import dir --overlay ours.csv). They are
+ * compiled into the block tables, so they resolve with the same single
+ * lookup as the MaxMind data. An overlay outranks the source wherever they
+ * overlap.
+ *
+ * An overlay csv has one range per line:
+ *
+ * start_ip,end_ip,country,region,city,latitude,longitude,as_number,as_text
+ *
+ * The range is a pair of ips, as numbers or dotted quads, or a CIDR block in
+ * the first column with the second left empty. A range with no as_number is
+ * only laid over the location table. Blank lines and lines starting with #
+ * are skipped.
+ *
+ * The csv is also saved whole, in the overlay section, so that
+ * --apply-delta can lay it over the tables again after changing them.
+*/
+
+#ifndef OVERLAY_HPP_31F5A0C8
+#define OVERLAY_HPP_31F5A0C8
+
+#include "csv_scanner.hpp"
+#include "block_sort.hpp"
+#include "locations.hpp"
+#include "asns.hpp"
+
+#include <map>
+
+struct OverlayRange
+{
+    unsigned start_ip;
+    unsigned end_ip;
+
+    CsvField country;
+    CsvField region;
+    CsvField city;
+    CsvField lat;
+    CsvField lon;
+
+    CsvField asn;
+    CsvField asn_text;
+
+    size_t line;
+};
+
+// the number of an as_number field, which may be given as AS<number>.
+inline unsigned asn_number(const CsvField &f)
+{
+    size_t skip = f.size > 2 && f.data[0] == 'A' && f.data[1] == 'S' ? 2 : 0;
+
+    return to_u(f.data + skip, f.size - skip);
+}
+
+// feeds CsvRecords of an overlay into OverlayRanges.
+class OverlayParser : public Connector
+{
+  public:
+    explicit OverlayParser(std::vector<OverlayRange> &out)
+        :
+        out_(out),
+        line_(0)
+    {
+    }
+
+    void consume(const Buffer &b)
+    {
+        line_++;
+
+        const CsvRecord* record = (const CsvRecord*) b.data();
+        const CsvField* toks = record->fields;
+
+        if (record->count == 0 || (record->count == 1 && toks[0].size == 0) ||
+            (toks[0].size && toks[0].data[0] == '#'))
+        {
+            return;
+        }
+
+        if (record->count != 9)
+        {
+            FATAL_ERROR("overlay line %zu does not have 9 fields", line_);
+        }
+
+        OverlayRange range;
+
+        bool ok = toks[1].size == 0 ?
+                  parse_cidr(toks[0].data, toks[0].size,
+                             range.start_ip, range.end_ip) :
+                  parse_ip(toks[0].data, toks[0].size, range.start_ip) &&
+                  parse_ip(toks[1].data, toks[1].size, range.end_ip);
+
+        if (!ok || range.end_ip < range.start_ip)
+        {
+            FATAL_ERROR("overlay line %zu has a bad range", line_);
+        }
+
+        range.country = toks[2];
+        range.region = toks[3];
+        range.city = toks[4];
+        range.lat = toks[5];
+        range.lon = toks[6];
+        range.asn = toks[7];
+        range.asn_text = toks[8];
+        range.line = line_;
+
+        out_.push_back(range);
+    }
+
+  private:
+    std::vector<OverlayRange> &out_;
+    size_t line_;
+};
+
+// an overlay csv, held in memory, and its ranges, whose fields point into
+// it.
+class Overlay
+{
+  public:
+    Overlay() {}
+
+    bool read(const char* fn)
+    {
+        MemoryMap csv;
+
+        if (!csv.open(fn))
+        {
+            return false;
+        }
+
+        load(csv.begin(), csv.size());
+
+        return true;
+    }
+
+    void load(const char* text, size_t n)
+    {
+        LOG_CONTEXT("Overlay load %zu bytes", n);
+
+        text_.assign(text, text + n);
+        ranges_.clear();
+
+        if (text_.empty())
+        {
+            return;
+        }
+
+        CsvScanner reader(&text_[0], &text_[0] + text_.size());
+        OverlayParser parser(ranges_);
+
+        reader | parser;
+        reader.produce();
+    }
+
+    bool empty() const
+    {
+        return ranges_.empty();
+    }
+
+    const std::vector<OverlayRange> &ranges() const { return ranges_; }
+    const std::vector<char> &text() const { return text_; }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(Overlay);
+
+    std::vector<char> text_;
+    std::vector<OverlayRange> ranges_;
+};
+
+// add the overlay's locations, numbered after the existing ones, and lay
+// its ranges over blocks. ranges of the same location share one record.
+// returns the number of ranges that conflict within the overlay.
+inline size_t overlay_locations(const Overlay &overlay,
+                                LocationBuilder &locations,
+                                std::vector<Block> &blocks,
+                                unsigned threads,
+                                FILE* out)
+{
+    unsigned next = 0;
+
+    for (size_t i = 0; i < locations.rows().size(); ++i)
+    {
+        next = std::max(next, locations.rows()[i].id + 1);
+    }
+
+    std::map<LocationRow, unsigned, LocationRowLess> index;
+    std::vector<Block> over;
+
+    for (size_t i = 0; i < overlay.ranges().size(); ++i)
+    {
+        const OverlayRange &range = overlay.ranges()[i];
+
+        LocationRow row = locations.make_row(next, range.country,
+                                             range.region, range.city,
+                                             range.lat, range.lon);
+
+        std::map<LocationRow, unsigned, LocationRowLess>::iterator iter =
+            index.find(row);
+
+        if (iter == index.end())
+        {
+            locations.add(row);
+            iter = index.insert(std::make_pair(row, next++)).first;
+        }
+
+        Block block;
+
+        block.start_ip = range.start_ip;
+        block.end_ip = range.end_ip;
+        block.loc = iter->second;
+
+        over.push_back(block);
+    }
+
+    size_t conflicts = normalize_blocks(over, threads, "overlay", out);
+    overlay_blocks(blocks, over);
+
+    return conflicts;
+}
+
+// add the overlay's asns, and lay its ranges that have one over the asn
+// blocks.
+inline void overlay_asns(const Overlay &overlay,
+                         ASNBuilder &asns,
+                         unsigned threads)
+{
+    std::vector<Block> over;
+
+    for (size_t i = 0; i < overlay.ranges().size(); ++i)
+    {
+        const OverlayRange &range = overlay.ranges()[i];
+
+        if (range.asn.size == 0)
+        {
+            continue;
+        }
+
+        Block block;
+
+        block.start_ip = range.start_ip;
+        block.end_ip = range.end_ip;
+        block.loc = asns.add_asn(asn_number(range.asn), range.asn_text.data,
+                                 range.asn_text.size);
+
+        over.push_back(block);
+    }
+
+    // conflicts within the overlay are reported for the location table.
+
+    normalize_blocks(over, threads, "overlay", 0);
+    asns.overlay(over);
+}
+
+inline void save_overlay(BinaryFile &file, const Overlay &overlay)
+{
+    file.begin_section("overlay");
+    file.save_pod_vector(overlay.text());
+}
+
+#endif
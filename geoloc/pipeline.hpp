@@ -12,10 +12,13 @@
 #ifndef PIPELINE_HPP_0D24961E
 #define PIPELINE_HPP_0D24961E
 
+#include <algorithm>
 #include <vector>
 #include <string>
+#include <string.h>
 
 #include "connector.hpp"
+#include "csv.hpp"
 
 class FileReader : public Connector
 {
@@ -94,6 +97,101 @@ class FileReader : public Connector
     FILE* file_;
 };
 
+// emits the lines of a memory range, e.g. one chunk of a mapped file.
+class MemoryReader : public Connector
+{
+  public:
+    MemoryReader(const char* begin, const char* end)
+        :
+        iter_(begin),
+        end_(end)
+    {
+    }
+
+    void consume(const Buffer &b) {}
+
+    void produce()
+    {
+        while (produce_one());
+        flush();
+    }
+
+    bool produce_one()
+    {
+        if (iter_ == end_)
+        {
+            return false;
+        }
+
+        const char* nl = (const char*) memchr(iter_, '\n', end_ - iter_);
+        const char* line_end = nl ? nl : end_;
+
+        emit(Buffer(iter_, line_end - iter_));
+        iter_ = nl ? nl + 1 : end_;
+
+        return true;
+    }
+
+  private:
+    const char* iter_;
+    const char* end_;
+};
+
+// split [begin, end) into n ranges that end on line boundaries. returns the
+// n + 1 boundaries.
+inline std::vector<const char*> split_lines(const char* begin,
+                                            const char* end,
+                                            size_t n)
+{
+    std::vector<const char*> out;
+    out.push_back(begin);
+
+    for (size_t i = 1; i < n; ++i)
+    {
+        const char* iter = begin + (end - begin) * i / n;
+        iter = std::max(iter, out.back());
+
+        const char* nl = (const char*) memchr(iter, '\n', end - iter);
+        out.push_back(nl ? nl + 1 : end);
+    }
+
+    out.push_back(end);
+    return out;
+}
+
+// how many chunks to split size bytes into for threads workers, so that no
+// chunk is smaller than min_chunk. at least one.
+inline size_t chunk_count(size_t size, size_t min_chunk, size_t threads)
+{
+    return std::max<size_t>(std::min(threads, size / min_chunk), 1);
+}
+
+// read a file of dotted quads, one per line. other lines are skipped.
+inline bool read_quads(const char* fn, std::vector<unsigned> &out)
+{
+    FILE* file = fopen(fn, "r");
+
+    if (!file)
+    {
+        return false;
+    }
+
+    char line[256];
+
+    while (fgets(line, sizeof(line), file))
+    {
+        unsigned quad;
+
+        if (parse_quad(line, strlen(line), quad))
+        {
+            out.push_back(quad);
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
 template <typename T>
 class Collector : public Connector
 {
@@ -10,6 +10,11 @@
  * 
  * The main part of the query code uses a binary search (std::upper_bound) 
  * against a set of memory mapped sorted vectors.
+ *
+ * A history file (see history.hpp) holds several monthly snapshots of the
+ * block tables over shared data tables. Its plain sections are the latest
+ * snapshot, so it reads as an ordinary database, and a month index in the
+ * snapshots section picks the snapshot current in any month in O(1).
 */
 
 #ifndef QUERY_HPP_EC6CE5A7
@@ -20,15 +25,113 @@
 #include "blocks.hpp"
 #include "locations.hpp"
 #include "asns.hpp"
+#include "ip6.hpp"
 #include "csv.hpp"
 #include "pipeline.hpp"
+#include "where.hpp"
 
 #include <algorithm>
+#include <map>
+#include <time.h>
+
+// how an address was given. v4-mapped v6 addresses are looked up in the v4
+// tables, but printed as they were given.
+enum
+{
+    IP_V4,
+    IP_V6,
+    IP_V4_MAPPED
+};
+
+// months count from year 0, so that they index the month table directly.
+inline unsigned make_month(unsigned year, unsigned month)
+{
+    return year * 12 + month - 1;
+}
+
+inline int month_to_s(char* out, unsigned month)
+{
+    return sprintf(out, "%04u-%02u", month / 12, month % 12 + 1);
+}
+
+// the month of a timestamp, given as YYYY-MM, optionally followed by the
+// rest of an iso date or time, or as unix seconds. false if it is neither.
+inline bool parse_month(const char* s, size_t n, unsigned &out)
+{
+    size_t digits = 0;
+
+    while (digits < n && s[digits] >= '0' && s[digits] <= '9')
+    {
+        ++digits;
+    }
+
+    if (digits == n && n > 0 && n <= 12)
+    {
+        time_t t = strtoull(std::string(s, n).c_str(), 0, 10);
+        struct tm tm;
+
+        if (!gmtime_r(&t, &tm))
+        {
+            return false;
+        }
+
+        out = make_month(tm.tm_year + 1900, tm.tm_mon + 1);
+        return true;
+    }
+
+    if (digits != 4 || n < 7 || s[4] != '-' ||
+        s[5] < '0' || s[5] > '9' || s[6] < '0' || s[6] > '9' ||
+        (n > 7 && s[7] >= '0' && s[7] <= '9'))
+    {
+        return false;
+    }
+
+    unsigned year = to_u(s, 4);
+    unsigned month = (s[5] - '0') * 10 + s[6] - '0';
+
+    if (year == 0 || month < 1 || month > 12)
+    {
+        return false;
+    }
+
+    out = make_month(year, month);
+    return true;
+}
+
+struct IPAddress
+{
+    IPAddress()
+        :
+        family(IP_V4),
+        quad(0),
+        ip6(),
+        month(0),
+        range(false),
+        end_quad(0),
+        end6()
+    {
+    }
+
+    unsigned family;
+    unsigned quad;
+    IP6 ip6;
+
+    // the month of the line's timestamp, 0 when it has none.
+    unsigned month;
+
+    // a range query, given as a.b.c.d/len or start-end, runs from quad or
+    // ip6 to end_quad or end6.
+    bool range;
+    unsigned end_quad;
+    IP6 end6;
+};
 
 struct IPResult
 {
     IPResult()
         :
+        family(IP_V4),
+        ip6(),
         quad(0),
         country(0),
         region(0),
@@ -36,10 +139,15 @@ struct IPResult
         lat(0),
         lon(0),
         asn(0),
-        asn_text(0)
+        asn_text(0),
+        range(false),
+        end_quad(0),
+        end6()
     {
     }
 
+    unsigned family;
+    IP6 ip6;
     unsigned quad;
 
     const char* country;
@@ -51,206 +159,1480 @@ struct IPResult
 
     const unsigned* asn;
     const char* asn_text;
+
+    // a piece of a range query, or its summary, ends at end_quad or end6.
+    bool range;
+    unsigned end_quad;
+    IP6 end6;
+};
+
+// one snapshot of a history file, as saved in its snapshots section. each
+// table is the number of the snapshot whose section holds it, so that
+// snapshots with the same table share one, or HISTORY_NO_TABLE. the
+// sections of the latest snapshot's tables have the plain names, and the
+// others have the number as a suffix, as in loc.blocks.3.
+struct SnapshotEntry
+{
+    unsigned month;
+    unsigned location;
+    unsigned asn;
+    unsigned location6;
+    unsigned asn6;
+};
+
+#define HISTORY_NO_TABLE 0xFFFFFFFFU
+
+inline std::string snapshot_section(const char* base,
+                                    unsigned table,
+                                    unsigned latest)
+{
+    if (table == latest)
+    {
+        return base;
+    }
+
+    char buf[SECTION_NAME_LEN];
+    snprintf(buf, sizeof(buf), "%s.%u", base, table);
+
+    return buf;
+}
+
+// the block tables a query searches. a plain file has one set, its own.
+struct SnapshotTables
+{
+    unsigned month;
+
+    const BlockTable* location;
+    const BlockTable* asn;
+    const Block6Table* location6;
+    const Block6Table* asn6;
+};
+
+// the tables GeoData::open can be asked to map.
+enum
+{
+    GEO_LOCATIONS = 1,
+    GEO_ASNS = 2,
+    GEO_ALL = GEO_LOCATIONS | GEO_ASNS
 };
 
 class GeoData
 {
   public:
-    GeoData() {}
-    ~GeoData() {}
+    GeoData()
+        :
+        loaded_(0),
+        loaded6_(0),
+        file_bytes_(0),
+        fingerprint_(0),
+        open_msec_(0),
+        snapshots_(),
+        selected_(0),
+        first_month_(0),
+        month_count_(0)
+    {
+        SnapshotTables own = { 0, &location_ip_blocks_, &asn_ip_blocks_,
+                               0, 0 };
+
+        snapshots_.push_back(own);
+    }
+
+    ~GeoData()
+    {
+        for (size_t i = 0; i < sections_.size(); ++i)
+        {
+            delete sections_[i];
+        }
+
+        for (size_t i = 0; i < history_blocks_.size(); ++i)
+        {
+            delete history_blocks_[i];
+        }
 
-    void open(const char* fn)
+        for (size_t i = 0; i < history_blocks6_.size(); ++i)
+        {
+            delete history_blocks6_[i];
+        }
+    }
+
+    // v002 files only map the sections needed for the selected tables.
+    // v001 files have no directory, and are mapped whole.
+    void open(const char* fn,
+              unsigned tables = GEO_ALL,
+              const MapOptions &options = MapOptions())
     {
         LOG_CONTEXT("GeoData open %s", fn);
 
-        bool ok = mem_file_.open(fn);
+        double start = now_msec();
+
+        LOG_CONTEXT("GeoData read header");
+        version_ = read_header(fn);
+
+        if (version_ == "v001")
+        {
+            open_v001(fn, options);
+        }
+        else
+        {
+            open_v002(fn, tables, options);
+        }
+
+        open_msec_ = now_msec() - start;
+    }
+
+    void open_v001(const char* fn, const MapOptions &options)
+    {
+        double start = now_msec();
+
+        bool ok = mem_file_.open(fn, options);
 
         if (!ok)
         {
             FATAL_ERROR("could not open %s for reading", fn);
         }
 
-        LOG_CONTEXT("GeoData read header");
-        read_header();
+        add_load_stat("file", mem_file_, now_msec() - start);
+
+        mem_file_.get_mem(32);
 
         LOG_CONTEXT("GeoData load location_ip_blocks");
         location_ip_blocks_.load(mem_file_);
 
-        LOG_CONTEXT("GeoData load location_data");
-        location_data_.load(mem_file_);
+        LOG_CONTEXT("GeoData load location_data");
+        location_data_.load(mem_file_);
+
+        LOG_CONTEXT("GeoData load asn_ip_blocks");
+        asn_ip_blocks_.load(mem_file_);
+
+        LOG_CONTEXT("GeoData load asn_data");
+        asn_data_.load(mem_file_);
+
+        loaded_ = GEO_ALL;
+    }
+
+    void open_v002(const char* fn, unsigned tables, const MapOptions &options)
+    {
+        SectionDirectory dir;
+
+        if (!dir.open(fn))
+        {
+            FATAL_ERROR("could not read section directory of %s", fn);
+        }
+
+        for (size_t i = 0; i < dir.entries().size(); ++i)
+        {
+            const SectionEntry &entry = dir.entries()[i];
+
+            fingerprint_ = checksum(entry.name, SECTION_NAME_LEN,
+                                    fingerprint_);
+            fingerprint_ = checksum(&entry.length, sizeof(entry.length),
+                                    fingerprint_);
+            fingerprint_ = checksum(&entry.checksum, sizeof(entry.checksum),
+                                    fingerprint_);
+        }
+
+        // slim databases may leave tables out. those tables are not loaded,
+        // and their lookups come back empty.
+
+        if (!dir.find("loc.blocks"))
+        {
+            tables &= ~GEO_LOCATIONS;
+        }
+
+        if (!dir.find("asn.blocks"))
+        {
+            tables &= ~GEO_ASNS;
+        }
+
+        // the string tables of both loc.data and asn.data may be refs into
+        // the shared pool.
+
+        const char* pool = 0;
+
+        if (tables && dir.find("str.pool"))
+        {
+            LOG_CONTEXT("GeoData load string_pool");
+            map_section(fn, dir, "str.pool", data_options(options))
+                .load_mapped_vector(string_pool_);
+
+            pool = string_pool_.begin();
+        }
+
+        if (tables & GEO_LOCATIONS)
+        {
+            LOG_CONTEXT("GeoData load location_ip_blocks");
+            location_ip_blocks_.load(
+                map_section(fn, dir, "loc.blocks", options));
+
+            LOG_CONTEXT("GeoData load location_data");
+            location_data_.load(
+                map_section(fn, dir, "loc.data", data_options(options)),
+                pool);
+
+            if (dir.find("loc6.blocks"))
+            {
+                LOG_CONTEXT("GeoData load location_ip6_blocks");
+                location_ip6_blocks_.load(
+                    map_section(fn, dir, "loc6.blocks", options));
+
+                loaded6_ |= GEO_LOCATIONS;
+            }
+        }
+
+        if (tables & GEO_ASNS)
+        {
+            LOG_CONTEXT("GeoData load asn_ip_blocks");
+            asn_ip_blocks_.load(
+                map_section(fn, dir, "asn.blocks", options));
+
+            LOG_CONTEXT("GeoData load asn_data");
+            asn_data_.load(
+                map_section(fn, dir, "asn.data", data_options(options)),
+                pool);
+
+            if (dir.find("asn6.blocks"))
+            {
+                LOG_CONTEXT("GeoData load asn_ip6_blocks");
+                asn_ip6_blocks_.load(
+                    map_section(fn, dir, "asn6.blocks", options));
+
+                loaded6_ |= GEO_ASNS;
+            }
+        }
+
+        loaded_ = tables;
+
+        snapshots_[0].location6 = loaded6_ & GEO_LOCATIONS ?
+                                  &location_ip6_blocks_ : 0;
+        snapshots_[0].asn6 = loaded6_ & GEO_ASNS ? &asn_ip6_blocks_ : 0;
+
+        if (dir.find("snapshots"))
+        {
+            open_snapshots(fn, dir, options);
+        }
+    }
+
+    // map the block tables of every snapshot of a history file. the latest
+    // snapshot is selected.
+    void open_snapshots(const char* fn,
+                        const SectionDirectory &dir,
+                        const MapOptions &options)
+    {
+        LOG_CONTEXT("GeoData load snapshots");
+
+        MemoryFile &file = map_section(fn, dir, "snapshots",
+                                       data_options(options));
+
+        MappedVector<SnapshotEntry> entries;
+        file.load_mapped_vector(entries);
+        file.load_mapped_vector(month_index_);
+
+        if (entries.size() == 0 || month_index_.size() == 0)
+        {
+            FATAL_ERROR("%s has an empty snapshots section", fn);
+        }
+
+        const SnapshotEntry &latest = entries[entries.size() - 1];
+
+        first_month_ = entries[0].month;
+        month_count_ = month_index_.size();
+
+        std::map<unsigned, const BlockTable*> loc_tables;
+        std::map<unsigned, const BlockTable*> asn_tables;
+        std::map<unsigned, const Block6Table*> loc6_tables;
+        std::map<unsigned, const Block6Table*> asn6_tables;
+
+        snapshots_.clear();
+
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            const SnapshotEntry &entry = entries[i];
+            SnapshotTables tables = { entry.month, 0, 0, 0, 0 };
+
+            if (loaded_ & GEO_LOCATIONS)
+            {
+                tables.location = history_table(
+                    fn, dir, options, "loc.blocks", entry.location,
+                    latest.location, location_ip_blocks_, loc_tables);
+
+                tables.location6 = history_table(
+                    fn, dir, options, "loc6.blocks", entry.location6,
+                    latest.location6, location_ip6_blocks_, loc6_tables);
+            }
+
+            if (loaded_ & GEO_ASNS)
+            {
+                tables.asn = history_table(
+                    fn, dir, options, "asn.blocks", entry.asn, latest.asn,
+                    asn_ip_blocks_, asn_tables);
+
+                tables.asn6 = history_table(
+                    fn, dir, options, "asn6.blocks", entry.asn6,
+                    latest.asn6, asn_ip6_blocks_, asn6_tables);
+            }
+
+            if (!tables.location)
+            {
+                tables.location = &location_ip_blocks_;
+            }
+
+            if (!tables.asn)
+            {
+                tables.asn = &asn_ip_blocks_;
+            }
+
+            snapshots_.push_back(tables);
+        }
+
+        selected_ = snapshots_.size() - 1;
+    }
+
+    // the table of a snapshot, mapped once however many snapshots share
+    // it. the latest snapshot's is the one already loaded.
+    template <typename Table>
+    const Table* history_table(const char* fn,
+                               const SectionDirectory &dir,
+                               const MapOptions &options,
+                               const char* base,
+                               unsigned table,
+                               unsigned latest,
+                               const Table &loaded,
+                               std::map<unsigned, const Table*> &mapped)
+    {
+        if (table == HISTORY_NO_TABLE)
+        {
+            return 0;
+        }
+
+        if (table == latest)
+        {
+            return &loaded;
+        }
+
+        typename std::map<unsigned, const Table*>::const_iterator iter =
+            mapped.find(table);
+
+        if (iter != mapped.end())
+        {
+            return iter->second;
+        }
+
+        std::string name = snapshot_section(base, table, latest);
+
+        LOG_CONTEXT("GeoData load %s", name.c_str());
+
+        Table* out = new Table();
+        add_history_table(out);
+
+        out->load(map_section(fn, dir, name.c_str(), options));
+        mapped[table] = out;
+
+        return out;
+    }
+
+    void add_history_table(BlockTable* table)
+    {
+        history_blocks_.push_back(table);
+    }
+
+    void add_history_table(Block6Table* table)
+    {
+        history_blocks6_.push_back(table);
+    }
+
+    size_t snapshot_count() const
+    {
+        return snapshots_.size();
+    }
+
+    // the month of snapshot i, 0 for a file that is not a history.
+    unsigned snapshot_month(size_t i) const
+    {
+        return snapshots_[i].month;
+    }
+
+    // the snapshot that was current in month, the first one for months
+    // before it, and the latest one for months after it.
+    size_t snapshot_index(unsigned month) const
+    {
+        if (month_count_ == 0 || month < first_month_)
+        {
+            return 0;
+        }
+
+        size_t i = month - first_month_;
+
+        return i < month_count_ ? month_index_[i] : snapshots_.size() - 1;
+    }
+
+    // answer queries with no timestamp of their own from the snapshot
+    // current in month. a month before the first snapshot is an error, as
+    // nothing says what was current then.
+    void select_month(unsigned month)
+    {
+        if (month_count_ == 0)
+        {
+            FATAL_ERROR("the database has no snapshots");
+            return;
+        }
+
+        if (month < first_month_)
+        {
+            char asked[16];
+            char first[16];
+
+            month_to_s(asked, month);
+            month_to_s(first, first_month_);
+
+            FATAL_ERROR("no snapshot is as old as %s, the first is %s",
+                        asked, first);
+            return;
+        }
+
+        selected_ = snapshot_index(month);
+    }
+
+    size_t selected_snapshot() const
+    {
+        return selected_;
+    }
+
+    // only the block tables are worth copying into huge pages, they take
+    // the random access of the binary searches.
+    static MapOptions data_options(const MapOptions &options)
+    {
+        MapOptions out = options;
+        out.huge = false;
+
+        return out;
+    }
+
+    MemoryFile& map_section(const char* fn,
+                            const SectionDirectory &dir,
+                            const char* name,
+                            const MapOptions &options)
+    {
+        const SectionEntry* entry = dir.find(name);
+
+        if (!entry)
+        {
+            FATAL_ERROR("%s has no %s section", fn, name);
+        }
+
+        MappedSection* section = new MappedSection();
+        sections_.push_back(section);
+
+        section->entry = *entry;
+
+        double start = now_msec();
+
+        if (!section->file.open(fn, *entry, options))
+        {
+            FATAL_ERROR("could not map section %s of %s", name, fn);
+        }
+
+        add_load_stat(name, section->file, now_msec() - start);
+
+        return section->file;
+    }
+
+    void add_load_stat(const char* name, const MemoryFile &file, double msec)
+    {
+        LoadStat stat;
+
+        stat.name = name;
+        stat.bytes = file.size();
+        stat.msec = msec;
+        stat.backing = file.map().backing();
+        stat.locked = file.map().locked();
+
+        load_stats_.push_back(stat);
+    }
+
+    // how long each mapping took to set up, and how it ended up backed.
+    void report(FILE* out) const
+    {
+        fprintf(out, "geoloc load report (%s)\n", version_.c_str());
+        fprintf(out, "%-12s %12s %10s %-8s %s\n",
+                "section", "bytes", "msec", "backing", "locked");
+
+        for (size_t i = 0; i < load_stats_.size(); ++i)
+        {
+            const LoadStat &stat = load_stats_[i];
+
+            fprintf(out, "%-12s %12zu %10.3f %-8s %s\n",
+                    stat.name.c_str(), stat.bytes, stat.msec, stat.backing,
+                    stat.locked ? "yes" : "no");
+        }
+
+        fprintf(out, "open took %.3f msec\n", open_msec_);
+    }
+
+    // compare the mapped sections against their checksums. this reads every
+    // mapped page, so it is not done by default.
+    bool verify() const
+    {
+        bool ok = true;
+
+        for (size_t i = 0; i < sections_.size(); ++i)
+        {
+            const MappedSection &section = *sections_[i];
+            unsigned sum = checksum(section.file.begin(),
+                                    section.file.size());
+
+            if (sum != section.entry.checksum)
+            {
+                LOG_CONTEXT("section %s checksum %08x expected %08x",
+                            section.entry.name, sum,
+                            section.entry.checksum);
+                ok = false;
+            }
+        }
+
+        return ok;
+    }
+
+    unsigned loaded() const
+    {
+        return loaded_;
+    }
+
+    // the tables that have v6 blocks.
+    unsigned loaded6() const
+    {
+        return loaded6_;
+    }
+
+    void check_header_value(const char* type,
+                            const char* value,
+                            const char* expected)
+    {
+        if (strcmp(value, expected) != 0)
+        {
+            FATAL_ERROR("header %s expecting %s got %s",
+                        type, expected, value);
+        }
+    }
+
+    // returns the format version.
+    std::string read_header(const char* fn)
+    {
+        int fd = ::open(fn, O_RDONLY);
+
+        if (fd < 0)
+        {
+            FATAL_ERROR("could not open %s for reading", fn);
+        }
+
+        char raw[32];
+        ssize_t rn = pread(fd, raw, sizeof(raw), 0);
+
+        file_bytes_ = lseek(fd, 0, SEEK_END);
+        fingerprint_ = checksum(&file_bytes_, sizeof(file_bytes_));
+        ::close(fd);
+
+        if (rn != (ssize_t) sizeof(raw))
+        {
+            FATAL_ERROR("header is truncated");
+        }
+
+        std::string header(raw, raw + 32);
+        std::string scratch;
+        std::vector<char*> toks;
+
+        char_split(header, scratch, toks, ' ');
+
+        if (toks.size() != 5)
+        {
+            FATAL_ERROR("header is corrupt - %s", header.c_str());
+        }
+
+        check_header_value("header1", toks[0], "geoloc");
+        check_header_value("header2", toks[1], "loadzero");
+        check_header_value("endian", toks[3], get_endian());
+
+        std::string version = toks[2];
+
+        if (version != "v001" && version != "v002")
+        {
+            FATAL_ERROR("header version %s is not supported",
+                        version.c_str());
+        }
+
+        return version;
+    }
+
+    size_t byte_size() const
+    {
+        return file_bytes_;
+    }
+
+    // tells data files apart, for clients that must use the same one as a
+    // server. v002 files are identified by the checksums of their sections,
+    // and v001 files, which have none, only by their size.
+    unsigned fingerprint() const
+    {
+        return fingerprint_;
+    }
+
+    unsigned block_query(const BlockTable &blocks, unsigned quad) const
+    {
+        return blocks.find(quad);
+    }
+
+    // the packed record of a location, for tracing its memory accesses.
+    const void* location_record(unsigned loc_idx) const
+    {
+        return location_data_.record(loc_idx);
+    }
+
+    const BlockTable &location_blocks() const
+    {
+        return location_ip_blocks_;
+    }
+
+    const BlockTable &asn_blocks() const
+    {
+        return asn_ip_blocks_;
+    }
+
+    const Block6Table &location_blocks6() const
+    {
+        return location_ip6_blocks_;
+    }
+
+    const Block6Table &asn_blocks6() const
+    {
+        return asn_ip6_blocks_;
+    }
+
+    const LocationTable &location_data() const
+    {
+        return location_data_;
+    }
+
+    const ASNTable &asn_data() const
+    {
+        return asn_data_;
+    }
+
+    unsigned location_block_query(unsigned quad) const
+    {
+        return block_query(location_ip_blocks_, quad);
+    }
+
+    // find the location and asn indices for quad, -1 when not found.
+    void lookup(unsigned quad, unsigned &loc_idx, unsigned &asn_idx) const
+    {
+        lookup(snapshots_[selected_], quad, loc_idx, asn_idx);
+    }
+
+    // the same, in the tables of one snapshot.
+    void lookup(const SnapshotTables &tables,
+                unsigned quad,
+                unsigned &loc_idx,
+                unsigned &asn_idx) const
+    {
+        loc_idx = -1U;
+        asn_idx = -1U;
+
+        if (loaded_ & GEO_LOCATIONS)
+        {
+            unsigned block_idx = block_query(*tables.location, quad);
+
+            if (block_idx != -1U)
+            {
+                loc_idx = tables.location->payload(block_idx);
+            }
+        }
+
+        if (loaded_ & GEO_ASNS)
+        {
+            unsigned block_idx = block_query(*tables.asn, quad);
+
+            if (block_idx != -1U)
+            {
+                asn_idx = tables.asn->payload(block_idx);
+            }
+        }
+    }
+
+    // turn indices found by lookup into a result.
+    void resolve(unsigned quad,
+                 unsigned loc_idx,
+                 unsigned asn_idx,
+                 IPResult &result) const
+    {
+        result.quad = quad;
+
+        if (loc_idx != -1U)
+        {
+            PackedLocation loc;
+            location_data_.unpack(loc_idx, loc);
+
+            result.country = location_data_.country[loc.country];
+            result.region = location_data_.region[loc.region];
+            result.city = location_data_.city[loc.city];
+            result.lat = loc.lat;
+            result.lon = loc.lon;
+        }
+
+        if (asn_idx != -1U)
+        {
+            const PackedASN& asn = asn_data_.asns[asn_idx];
+
+            result.asn = &asn.number;
+            result.asn_text = asn_data_.text[asn.text];
+        }
+    }
+
+    void query(unsigned quad, IPResult &result) const
+    {
+        unsigned loc_idx;
+        unsigned asn_idx;
+
+        lookup(quad, loc_idx, asn_idx);
+        resolve(quad, loc_idx, asn_idx, result);
+    }
+
+    // as lookup, in the v6 tables.
+    void lookup6(const IP6 &ip, unsigned &loc_idx, unsigned &asn_idx) const
+    {
+        lookup6(snapshots_[selected_], ip, loc_idx, asn_idx);
+    }
+
+    void lookup6(const SnapshotTables &tables,
+                 const IP6 &ip,
+                 unsigned &loc_idx,
+                 unsigned &asn_idx) const
+    {
+        loc_idx = -1U;
+        asn_idx = -1U;
+
+        if (tables.location6)
+        {
+            unsigned block_idx = tables.location6->find(ip);
+
+            if (block_idx != -1U)
+            {
+                loc_idx = tables.location6->payload(block_idx);
+            }
+        }
+
+        if (tables.asn6)
+        {
+            unsigned block_idx = tables.asn6->find(ip);
+
+            if (block_idx != -1U)
+            {
+                asn_idx = tables.asn6->payload(block_idx);
+            }
+        }
+    }
+
+    void query6(const IP6 &ip, IPResult &result) const
+    {
+        unsigned loc_idx;
+        unsigned asn_idx;
+
+        lookup6(ip, loc_idx, asn_idx);
+        resolve(0, loc_idx, asn_idx, result);
+
+        result.family = IP_V6;
+        result.ip6 = ip;
+    }
+
+    // addresses with a timestamp are looked up in the snapshot current at
+    // the time.
+    const SnapshotTables &tables(const IPAddress &address) const
+    {
+        return address.month ? snapshots_[snapshot_index(address.month)] :
+                               snapshots_[selected_];
+    }
+
+    void lookup(const IPAddress &address,
+                unsigned &loc_idx,
+                unsigned &asn_idx) const
+    {
+        const SnapshotTables &tables = this->tables(address);
+
+        if (address.family == IP_V6)
+        {
+            lookup6(tables, address.ip6, loc_idx, asn_idx);
+        }
+        else
+        {
+            lookup(tables, address.quad, loc_idx, asn_idx);
+        }
+    }
+
+    void resolve(const IPAddress &address,
+                 unsigned loc_idx,
+                 unsigned asn_idx,
+                 IPResult &result) const
+    {
+        resolve(address.family == IP_V6 ? 0 : address.quad, loc_idx, asn_idx,
+                result);
+
+        result.family = address.family;
+        result.ip6 = address.ip6;
+        result.range = address.range;
+        result.end_quad = address.end_quad;
+        result.end6 = address.end6;
+    }
+
+    void query(const IPAddress &address, IPResult &result) const
+    {
+        unsigned loc_idx;
+        unsigned asn_idx;
+
+        lookup(address, loc_idx, asn_idx);
+        resolve(address, loc_idx, asn_idx, result);
+    }
+
+  private:
+
+    DISALLOW_COPY_AND_ASSIGN(GeoData);
+
+    struct MappedSection
+    {
+        SectionEntry entry;
+        MemoryFile file;
+    };
+
+    struct LoadStat
+    {
+        std::string name;
+        size_t bytes;
+        double msec;
+        const char* backing;
+        bool locked;
+    };
+
+    MemoryFile mem_file_;
+    std::vector<MappedSection*> sections_;
+
+    unsigned loaded_;
+    unsigned loaded6_;
+    size_t file_bytes_;
+    unsigned fingerprint_;
+
+    std::string version_;
+    std::vector<LoadStat> load_stats_;
+    double open_msec_;
+
+    BlockTable location_ip_blocks_;
+    LocationTable location_data_;
+
+    BlockTable asn_ip_blocks_;
+    ASNTable asn_data_;
+
+    Block6Table location_ip6_blocks_;
+    Block6Table asn_ip6_blocks_;
+
+    // the tables of each snapshot, in month order. a plain file has one.
+    std::vector<SnapshotTables> snapshots_;
+    size_t selected_;
+
+    // the snapshot of each month from the first snapshot's to the latest's.
+    MappedVector<unsigned> month_index_;
+    unsigned first_month_;
+    size_t month_count_;
+
+    std::vector<BlockTable*> history_blocks_;
+    std::vector<Block6Table*> history_blocks6_;
+
+    MappedVector<char> string_pool_;
+};
+
+inline int ip_to_s(char* out, unsigned quad)
+{
+    int a = (quad >> 24) & 0xff;
+    int b = (quad >> 16) & 0xff;
+    int c = (quad >> 8) & 0xff;
+    int d = (quad) & 0xff;
+
+    return sprintf(out, "%d.%d.%d.%d", a, b, c, d);
+}
+
+inline int ip_to_s(char* out, const IP6 &ip)
+{
+    return ip6_to_s(out, ip);
+}
+
+// steps through the address space, for code that handles both families.
+inline unsigned ip_prev(unsigned ip) { return ip - 1; }
+inline unsigned ip_next(unsigned ip) { return ip + 1; }
+inline bool ip_is_max(unsigned ip) { return ip == 0xFFFFFFFF; }
+
+inline IP6 ip_prev(const IP6 &ip) { return ip6_prev(ip); }
+inline IP6 ip_next(const IP6 &ip) { return ip6_next(ip); }
+inline bool ip_is_max(const IP6 &ip) { return ip6_is_max(ip); }
+
+// the number of addresses from start to end, as a weight.
+inline double ip_width(unsigned start, unsigned end)
+{
+    return (double) (end - start) + 1;
+}
+
+inline double ip_width(const IP6 &start, const IP6 &end)
+{
+    uint64_t lo = end.lo - start.lo;
+    uint64_t hi = end.hi - start.hi - (end.lo < start.lo);
+
+    return hi * 18446744073709551616.0 + lo + 1;
+}
+
+// the blocks of a table from the first one that ends at or after start,
+// in order, for a range query. a table that was not loaded has none.
+class RangeCursor
+{
+  public:
+    RangeCursor(const BlockTable &table, unsigned start)
+        :
+        iter_(table, table.size() ? table.lower_bound(start) : 0),
+        valid_(false),
+        block_()
+    {
+        advance();
+    }
+
+    void advance()
+    {
+        valid_ = iter_.next(block_);
+    }
+
+    bool valid() const { return valid_; }
+    unsigned start() const { return block_.start_ip; }
+    unsigned end() const { return block_.end_ip; }
+    unsigned payload() const { return block_.loc; }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(RangeCursor);
+
+    BlockIterator iter_;
+    bool valid_;
+    Block block_;
+};
+
+class RangeCursor6
+{
+  public:
+    RangeCursor6(const Block6Table* table, const IP6 &start)
+        :
+        table_(table),
+        next_(table ? table->lower_bound(start) : 0),
+        valid_(false),
+        block_()
+    {
+        advance();
+    }
+
+    void advance()
+    {
+        valid_ = table_ && next_ < table_->size();
+
+        if (valid_)
+        {
+            table_->get(next_++, block_);
+        }
+    }
+
+    bool valid() const { return valid_; }
+    const IP6 &start() const { return block_.start; }
+    const IP6 &end() const { return block_.end; }
+    unsigned payload() const { return block_.loc; }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(RangeCursor6);
+
+    const Block6Table* table_;
+    size_t next_;
+    bool valid_;
+    Block6 block_;
+};
+
+// the payload of cursor's table at ip, -1 for none. stop is pulled back to
+// where that answer ends, if it ends first.
+template <typename Cursor, typename Address>
+inline unsigned range_payload(Cursor &cursor, const Address &ip, Address &stop)
+{
+    while (cursor.valid() && cursor.end() < ip)
+    {
+        cursor.advance();
+    }
+
+    if (!cursor.valid())
+    {
+        return -1;
+    }
+
+    if (ip < cursor.start())
+    {
+        Address before = ip_prev(cursor.start());
+
+        if (before < stop)
+        {
+            stop = before;
+        }
+
+        return -1;
+    }
+
+    if (cursor.end() < stop)
+    {
+        stop = cursor.end();
+    }
+
+    return cursor.payload();
+}
+
+// convert dotted quads, and v6 addresses, into IPAddresses. a line may
+// start with a timestamp, for history files, as in "2026-03-14 1.2.3.4".
+// with ranges, a line may also be a range query, as a.b.c.d/len or
+// start-end, or the same in v6.
+class IPParser : public Connector
+{
+  public:
+    explicit IPParser(bool ranges = false)
+        :
+        str_(),
+        scratch_(),
+        toks(),
+        ranges_(ranges)
+    {
+    }
+
+    void consume(const Buffer &b)
+    {
+        const char* s = (const char*) b.data();
+        size_t n = b.size();
+
+        IPAddress address;
+
+        split_timestamp(s, n, address.month);
+
+        // only the first word can be an address or a range, so text after
+        // it, such as a time of day or a url, is ignored.
+
+        size_t word = 0;
+
+        while (word != n && s[word] != ' ' && s[word] != '\t')
+        {
+            ++word;
+        }
+
+        if (ranges_)
+        {
+            const char* sep = (const char*) memchr(s, '/', word);
+
+            if (!sep)
+            {
+                sep = (const char*) memchr(s, '-', word);
+            }
+
+            if (sep)
+            {
+                if (parse_range(s, word, sep, address))
+                {
+                    emit(Buffer(&address, sizeof(address)));
+                }
+
+                return;
+            }
+        }
+
+        if (memchr(s, ':', word))
+        {
+            if (!parse_ip6(s, word, address.ip6))
+            {
+                return;
+            }
+
+            address.family = ip6_v4_mapped(address.ip6, address.quad) ?
+                             IP_V4_MAPPED : IP_V6;
+
+            emit(Buffer(&address, sizeof(address)));
+            return;
+        }
+
+        str_.assign(s, n);
+        char_split(str_, scratch_, toks, '.');
+
+        if (toks.size() != 4)
+        {
+            return;
+        }
+
+        address.quad = to_u(toks[0]) << 24 | 
+                       to_u(toks[1]) << 16 | 
+                       to_u(toks[2]) << 8 | 
+                       to_u(toks[3]);
+
+        emit(Buffer(&address, sizeof(address)));
+    }
+
+  private:
+    // parse a range query, split at sep, its / or -. host bits of a
+    // prefix are ignored. false if it is not one.
+    static bool parse_range(const char* s,
+                            size_t n,
+                            const char* sep,
+                            IPAddress &address)
+    {
+        const char* right = sep + 1;
+        size_t left_n = sep - s;
+        size_t right_n = s + n - right;
+
+        bool v6 = memchr(s, ':', left_n);
+
+        if (*sep == '/')
+        {
+            if (v6 ? !parse_cidr6(s, n, address.ip6, address.end6) :
+                     !parse_cidr(s, n, address.quad, address.end_quad))
+            {
+                return false;
+            }
+        }
+        else if (v6)
+        {
+            if (!parse_ip6(s, left_n, address.ip6) ||
+                !parse_ip6(right, right_n, address.end6))
+            {
+                return false;
+            }
+        }
+        else if (!parse_quad(s, left_n, address.quad) ||
+                 !parse_quad(right, right_n, address.end_quad))
+        {
+            return false;
+        }
+
+        if (v6)
+        {
+            if (address.end6 < address.ip6)
+            {
+                return false;
+            }
+
+            // a range within the v4-mapped space is answered by the v4
+            // tables. one that only crosses it is split by the scanner.
+
+            address.family =
+                ip6_v4_mapped(address.ip6, address.quad) &&
+                ip6_v4_mapped(address.end6, address.end_quad) ?
+                    IP_V4_MAPPED : IP_V6;
+        }
+        else if (address.end_quad < address.quad)
+        {
+            return false;
+        }
+
+        address.range = true;
+
+        return true;
+    }
+
+    // move s past a leading timestamp, and parse its month. a first word
+    // that is not a timestamp is left alone, as in "1.2.3.4 GET /x".
+    static void split_timestamp(const char* &s, size_t &n, unsigned &month)
+    {
+        const char* end = s + n;
+        const char* sp = s;
+
+        while (sp != end && *sp != ' ' && *sp != '\t')
+        {
+            ++sp;
+        }
+
+        const char* ip = sp;
+
+        while (ip != end && (*ip == ' ' || *ip == '\t'))
+        {
+            ++ip;
+        }
+
+        unsigned first = 0;
+
+        if (ip == end || *ip == '\n' || *ip == '\r' ||
+            !parse_month(s, sp - s, first))
+        {
+            return;
+        }
+
+        month = first;
+        s = ip;
+        n = end - ip;
+    }
+
+    std::string str_;
+    std::string scratch_;
+    std::vector<char*> toks;
+
+    bool ranges_;
+};
+
+class IPScanner: public Connector
+{
+  public:
+    // rows that fail filter, if given, are dropped before they are
+    // resolved. range queries give a row per piece of the range with one
+    // answer, or with summary, one row for the range, with the country and
+    // asn that cover the most addresses of it.
+    explicit IPScanner(const GeoData &geo_data,
+                       const WhereFilter* filter = 0,
+                       bool summary = false)
+        :
+        geo_data_(geo_data),
+        filter_(filter),
+        summary_(summary),
+        countries_(),
+        asns_()
+    {
+    }
+
+    void consume(const Buffer &b)
+    {
+        const IPAddress* address = (const IPAddress*)(b.data());
+
+        if (address->range)
+        {
+            scan_range(*address);
+            return;
+        }
 
-        LOG_CONTEXT("GeoData load asn_ip_blocks");
-        asn_ip_blocks_.load(mem_file_);
+        unsigned loc_idx;
+        unsigned asn_idx;
 
-        LOG_CONTEXT("GeoData load asn_data");
-        asn_data_.load(mem_file_);
-    }
+        geo_data_.lookup(*address, loc_idx, asn_idx);
 
-    void check_header_value(const char* type,
-                            const char* value,
-                            const char* expected)
-    {
-        if (strcmp(value, expected) != 0)
+        if (filter_ && !filter_->pass(loc_idx, asn_idx))
         {
-            FATAL_ERROR("header %s expecting %s got %s",
-                        type, value, expected);
+            return;
         }
-    }
 
-    void read_header()
-    {
-        const char* raw = (const char*) mem_file_.get_mem(32);
+        IPResult result;
+        geo_data_.resolve(*address, loc_idx, asn_idx, result);
 
-        std::string header(raw, raw + 32);
-        std::string scratch;
-        std::vector<char*> toks;
+        emit(Buffer(&result, sizeof(result)));
+    }
 
-        char_split(header, scratch, toks, ' ');
+  private:
+    DISALLOW_COPY_AND_ASSIGN(IPScanner);
 
-        if (toks.size() != 5)
+    // walk both tables from the lower bound of the range's start, cutting
+    // the range wherever either answer changes. gaps between blocks are
+    // pieces too, with no answer, so the pieces cover the range exactly.
+    void scan_range(const IPAddress &address)
+    {
+        countries_.clear();
+        asns_.clear();
+
+        if (address.family == IP_V6)
         {
-            FATAL_ERROR("header is corrupt - %s", header.c_str());
+            scan_range6(address);
+        }
+        else
+        {
+            sweep4(address, address.quad, address.end_quad);
         }
 
-        check_header_value("header1", toks[0], "geoloc");
-        check_header_value("header2", toks[1], "loadzero");
-        check_header_value("version", toks[2], "v001");
-        check_header_value("endian", toks[3], get_endian());
+        if (summary_ && !countries_.empty())
+        {
+            emit_summary(address);
+        }
     }
 
-    unsigned block_query(const BlockTable &blocks, unsigned quad) const
+    // the part of a v6 range in ::ffff:0:0/96 is answered by the v4
+    // tables, as single v4-mapped addresses are.
+    void scan_range6(const IPAddress &address)
     {
-        // find first pos compares gt quad
-        
-        const unsigned* iter = 
-            std::upper_bound(blocks.start_ip.begin(),
-                             blocks.start_ip.end(),
-                             quad);
+        const IP6 mapped_first = { 0, 0xFFFF00000000ULL };
+        const IP6 mapped_last = { 0, 0xFFFFFFFFFFFFULL };
 
-        if (iter == blocks.start_ip.begin())
+        if (address.end6 < mapped_first || mapped_last < address.ip6)
         {
-            return -1;
+            sweep6(address, address.ip6, address.end6);
+            return;
         }
 
-        unsigned idx = iter - blocks.start_ip.begin();
-        unsigned ri = idx - 1;
-
-        if (quad >= blocks.start_ip[ri] &&
-            quad <= blocks.end_ip[ri])
+        if (address.ip6 < mapped_first)
         {
-            return ri;
+            sweep6(address, address.ip6, ip6_prev(mapped_first));
         }
 
-        return -1;
-    }
+        IPAddress mapped = address;
+        mapped.family = IP_V4_MAPPED;
 
-    unsigned location_block_query(unsigned quad) const
-    {
-        return block_query(location_ip_blocks_, quad);
+        sweep4(mapped,
+               mapped_first < address.ip6 ? (unsigned) address.ip6.lo : 0,
+               address.end6 < mapped_last ? (unsigned) address.end6.lo :
+                                            0xFFFFFFFF);
+
+        if (mapped_last < address.end6)
+        {
+            sweep6(address, ip6_next(mapped_last), address.end6);
+        }
     }
 
-    void query(unsigned quad, IPResult &result) const
+    void sweep4(const IPAddress &address, unsigned start, unsigned end)
     {
-        result.quad = quad;
+        const SnapshotTables &tables = geo_data_.tables(address);
 
-        unsigned block_idx = block_query(location_ip_blocks_, quad);
+        RangeCursor loc(*tables.location, start);
+        RangeCursor asn(*tables.asn, start);
 
-        if (block_idx != -1U)
-        {
-            unsigned loc_idx = location_ip_blocks_.loc[block_idx];
-            const PackedLocation& loc = location_data_.locations[loc_idx];
+        sweep(address, loc, asn, start, end);
+    }
 
-            result.country = location_data_.country[loc.country];
-            result.region = location_data_.region[loc.region];
-            result.city = location_data_.city[loc.city];
-            result.lat = loc.lat;
-            result.lon = loc.lon;
-        }
+    void sweep6(const IPAddress &address, const IP6 &start, const IP6 &end)
+    {
+        const SnapshotTables &tables = geo_data_.tables(address);
 
-        block_idx = block_query(asn_ip_blocks_, quad);
+        RangeCursor6 loc(tables.location6, start);
+        RangeCursor6 asn(tables.asn6, start);
 
-        if (block_idx != -1U)
-        {
-            unsigned asn_idx = asn_ip_blocks_.loc[block_idx];
-            const PackedASN& asn = asn_data_.asns[asn_idx];
+        sweep(address, loc, asn, start, end);
+    }
 
-            result.asn = &asn.number;
-            result.asn_text = asn_data_.text[asn.text];
+    template <typename Cursor, typename Address>
+    void sweep(const IPAddress &address,
+               Cursor &loc,
+               Cursor &asn,
+               Address ip,
+               const Address &end)
+    {
+        while (true)
+        {
+            Address stop = end;
+
+            unsigned loc_idx = range_payload(loc, ip, stop);
+            unsigned asn_idx = range_payload(asn, ip, stop);
+
+            if (!filter_ || filter_->pass(loc_idx, asn_idx))
+            {
+                if (summary_)
+                {
+                    tally(loc_idx, asn_idx, ip_width(ip, stop));
+                }
+                else
+                {
+                    emit_piece(address, ip, stop, loc_idx, asn_idx);
+                }
+            }
+
+            if (stop == end)
+            {
+                break;
+            }
+
+            ip = ip_next(stop);
         }
     }
 
-  private:
+    void emit_piece(const IPAddress &address,
+                    unsigned start,
+                    unsigned end,
+                    unsigned loc_idx,
+                    unsigned asn_idx)
+    {
+        IPAddress piece = address;
+        piece.quad = start;
+        piece.end_quad = end;
 
-    DISALLOW_COPY_AND_ASSIGN(GeoData);
+        if (address.family == IP_V4_MAPPED)
+        {
+            piece.ip6.hi = 0;
+            piece.end6.hi = 0;
+            piece.ip6.lo = 0xFFFF00000000ULL | start;
+            piece.end6.lo = 0xFFFF00000000ULL | end;
+        }
 
-    MemoryFile mem_file_;
+        emit_result(piece, loc_idx, asn_idx);
+    }
 
-    BlockTable location_ip_blocks_;
-    LocationTable location_data_;
+    void emit_piece(const IPAddress &address,
+                    const IP6 &start,
+                    const IP6 &end,
+                    unsigned loc_idx,
+                    unsigned asn_idx)
+    {
+        IPAddress piece = address;
+        piece.ip6 = start;
+        piece.end6 = end;
 
-    BlockTable asn_ip_blocks_;
-    ASNTable asn_data_;
-};
+        emit_result(piece, loc_idx, asn_idx);
+    }
 
-inline int ip_to_s(char* out, unsigned quad)
-{
-    int a = (quad >> 24) & 0xff;
-    int b = (quad >> 16) & 0xff;
-    int c = (quad >> 8) & 0xff;
-    int d = (quad) & 0xff;
+    void emit_result(const IPAddress &address,
+                     unsigned loc_idx,
+                     unsigned asn_idx)
+    {
+        IPResult result;
+        geo_data_.resolve(address, loc_idx, asn_idx, result);
 
-    return sprintf(out, "%d.%d.%d.%d", a, b, c, d);
-}
+        emit(Buffer(&result, sizeof(result)));
+    }
 
-// convert dotted quads into unsigned ints
-class IPParser : public Connector
-{
-  public:
-    void consume(const Buffer &b)
+    // countries are counted by their string id, so the locations of a
+    // country vote together. -1 is no answer.
+    void tally(unsigned loc_idx, unsigned asn_idx, double addresses)
     {
-        str_.assign((char*) b.data(), b.size());
-        char_split(str_, scratch_, toks, '.');
+        unsigned country = -1U;
 
-        if (toks.size() != 4)
+        if (loc_idx != -1U)
         {
-            return;
-        }
+            PackedLocation loc;
+            geo_data_.location_data().unpack(loc_idx, loc);
 
-        unsigned quad = to_u(toks[0]) << 24 | 
-                        to_u(toks[1]) << 16 | 
-                        to_u(toks[2]) << 8 | 
-                        to_u(toks[3]);
+            country = loc.country;
+        }
 
-        emit(Buffer(&quad, sizeof(quad)));
+        countries_[country] += addresses;
+        asns_[asn_idx] += addresses;
     }
 
-  private:
-    std::string str_;
-    std::string scratch_;
-    std::vector<char*> toks;
-};
-
-class IPScanner: public Connector
-{
-  public:
-    explicit IPScanner(const GeoData &geo_data)
-        :
-        geo_data_(geo_data)
+    // the answer with the most addresses, the lowest on a tie. no answer,
+    // which sorts last, only wins when there is nothing else.
+    static unsigned majority(const std::map<unsigned, double> &votes)
     {
+        std::map<unsigned, double>::const_iterator best = votes.begin();
+        std::map<unsigned, double>::const_iterator iter;
+
+        for (iter = votes.begin(); iter != votes.end(); ++iter)
+        {
+            if (iter->first != -1U && iter->second > best->second)
+            {
+                best = iter;
+            }
+        }
+
+        return best->first;
     }
 
-    void consume(const Buffer &b)
+    void emit_summary(const IPAddress &address)
     {
-        unsigned quad = *(unsigned*)(b.data());
+        unsigned country = majority(countries_);
 
         IPResult result;
-        geo_data_.query(quad, result);
+        geo_data_.resolve(address, -1U, majority(asns_), result);
+
+        if (country != -1U)
+        {
+            result.country = geo_data_.location_data().country[country];
+        }
 
         emit(Buffer(&result, sizeof(result)));
     }
 
-  private:
     const GeoData &geo_data_;
+    const WhereFilter* filter_;
+
+    bool summary_;
+
+    // addresses of the range so far, by country and by asn.
+    std::map<unsigned, double> countries_;
+    std::map<unsigned, double> asns_;
 };
 
 // currently just turns spaces into +
@@ -288,10 +1670,18 @@ inline void escape(std::string &out, const char* str)
 class IPResultEmitter : public Connector
 {
   public:
-    void print_ip(unsigned quad)
+    void print_ip(const IPResult &result)
     {
-        char buf[32];
-        int nb = ip_to_s(buf, quad);
+        char buf[128];
+        int nb = result.family == IP_V4 ? ip_to_s(buf, result.quad) :
+                                          ip6_to_s(buf, result.ip6);
+
+        if (result.range)
+        {
+            buf[nb++] = '-';
+            nb += result.family == IP_V4 ? ip_to_s(buf + nb, result.end_quad) :
+                                           ip6_to_s(buf + nb, result.end6);
+        }
 
         writes(buf, nb);
     }
@@ -355,7 +1745,7 @@ class IPResultEmitter : public Connector
 
         print_buf_.clear();
 
-        print_ip(result->quad); delimit();
+        print_ip(*result); delimit();
         print(result->country); delimit();
         print(result->region); delimit();
         print(result->city); delimit();
@@ -378,21 +1768,20 @@ class IPResultEmitter : public Connector
 };
 
 template <typename T>
-inline void query(T &reader, GeoData &data)
+inline void query(T &reader, Connector &scanner, bool ranges = false)
 {
-    IPParser parser;
-    IPScanner scanner(data);
-
+    IPParser parser(ranges);
     IPResultEmitter emitter;
 
     reader | parser | scanner | emitter;
     reader.produce();
 }
 
-inline void query(GeoData &data, const std::string &source)
+// split a source, file:path or query:ip,ip,..., at its protocol.
+inline void split_source(const std::string &source,
+                         std::string &protocol,
+                         std::string &path)
 {
-    LOG_CONTEXT("query data with source %s", source.c_str());
-    
     const char* iter = &source[0];
     const char* end = &source[0] + source.size();
     const char* res = strchr(iter, ':');
@@ -400,15 +1789,29 @@ inline void query(GeoData &data, const std::string &source)
     if (!res)
     {
         FATAL_ERROR("could not parse source %s", source.c_str());
+        return;
     }
 
-    std::string protocol(iter, res);
-    std::string path(res+1, end);
+    protocol.assign(iter, res);
+    path.assign(res+1, end);
+}
+
+// run one source through scanner, which turns quads into IPResults.
+// with ranges, the source may have range queries (see IPParser).
+inline void query(Connector &scanner,
+                  const std::string &source,
+                  bool ranges = false)
+{
+    LOG_CONTEXT("query data with source %s", source.c_str());
+    
+    std::string protocol;
+    std::string path;
+    split_source(source, protocol, path);
 
     if (protocol == "file")
     {
         FileReader reader(path);
-        query(reader, data);
+        query(reader, scanner, ranges);
     }
     else if (protocol == "query")
     {
@@ -420,7 +1823,7 @@ inline void query(GeoData &data, const std::string &source)
         ip_list.assign(toks.begin(), toks.end());
 
         StringInjector reader(ip_list);
-        query(reader, data);
+        query(reader, scanner, ranges);
     }
     else
     {
@@ -428,23 +1831,284 @@ inline void query(GeoData &data, const std::string &source)
     }
 }
 
+inline void query(GeoData &data,
+                  const std::string &source,
+                  const WhereFilter* filter = 0,
+                  bool summary = false)
+{
+    IPScanner scanner(data, filter, summary);
+    query(scanner, source, true);
+}
+
+struct QueryOptions
+{
+    QueryOptions()
+        :
+        show_headers(false),
+        load_report(false),
+        as_of(0),
+        where(),
+        summary(false),
+        map()
+    {
+    }
+
+    bool show_headers;
+    bool load_report;
+
+    // the month whose snapshot of a history file answers queries without a
+    // timestamp, 0 for the latest.
+    unsigned as_of;
+
+    // --where predicates, which rows must all pass.
+    std::vector<std::string> where;
+
+    // answer each range query with one row for the whole range.
+    bool summary;
+
+    MapOptions map;
+};
+
+inline void open_data(GeoData &data,
+                      const char* data_file_name,
+                      const QueryOptions &options,
+                      unsigned tables = GEO_ALL)
+{
+    data.open(data_file_name, tables, options.map);
+
+    if (options.as_of)
+    {
+        data.select_month(options.as_of);
+    }
+
+    if (options.load_report)
+    {
+        data.report(stderr);
+    }
+}
+
+// compile where predicates against data. 0 when there are none, so that
+// callers can skip the test.
+inline const WhereFilter* open_filter(const GeoData &data,
+                                      const std::vector<std::string> &where,
+                                      WhereFilter &filter)
+{
+    for (size_t i = 0; i < where.size(); ++i)
+    {
+        std::vector<std::string> unmatched;
+
+        const char* predicate = where[i].c_str();
+
+        if (!filter.add(predicate,
+                        data.loaded() & GEO_LOCATIONS ?
+                            &data.location_data() : 0,
+                        data.loaded() & GEO_ASNS ? &data.asn_data() : 0,
+                        unmatched))
+        {
+            FATAL_ERROR("could not parse where predicate %s", predicate);
+        }
+
+        for (size_t j = 0; j < unmatched.size(); ++j)
+        {
+            fprintf(stderr, "no match for %s\n", unmatched[j].c_str());
+        }
+    }
+
+    return filter.empty() ? 0 : &filter;
+}
+
+inline const WhereFilter* open_filter(const GeoData &data,
+                                      const QueryOptions &options,
+                                      WhereFilter &filter)
+{
+    return open_filter(data, options.where, filter);
+}
+
+inline void verify(const char* data_file_name)
+{
+    LOG_CONTEXT("verify data %s", data_file_name);
+
+    GeoData data;
+    data.open(data_file_name);
+
+    if (!data.verify())
+    {
+        FATAL_ERROR("%s failed verification", data_file_name);
+    }
+
+    printf("%s ok\n", data_file_name);
+}
+
+// every address where a block of table starts or ends, plus one.
+inline void add_boundaries(const BlockTable &table, std::vector<unsigned> &out)
+{
+    BlockIterator iter(table);
+    Block block;
+
+    while (iter.next(block))
+    {
+        out.push_back(block.start_ip);
+
+        if (block.end_ip != 0xFFFFFFFF)
+        {
+            out.push_back(block.end_ip + 1);
+        }
+    }
+}
+
+inline void add_boundaries6(const Block6Table &table, std::vector<IP6> &out)
+{
+    for (size_t i = 0; i < table.size(); ++i)
+    {
+        Block6 block;
+        table.get(i, block);
+
+        out.push_back(block.start);
+
+        if (!ip6_is_max(block.end))
+        {
+            out.push_back(ip6_next(block.end));
+        }
+    }
+}
+
+inline bool same_string(const char* a, const char* b)
+{
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+inline bool same_result(const IPResult &a, const IPResult &b)
+{
+    return same_string(a.country, b.country) &&
+           same_string(a.region, b.region) &&
+           same_string(a.city, b.city) &&
+           a.lat == b.lat && a.lon == b.lon &&
+           (a.asn ? b.asn && *a.asn == *b.asn : !b.asn) &&
+           same_string(a.asn_text, b.asn_text);
+}
+
+// compare what two databases answer for every address. results can only
+// change where a block of either starts or ends, so checking those points
+// covers the whole address space. returns the number of points that differ,
+// and prints the first few to out.
+inline size_t compare_results(const GeoData &a, const GeoData &b, FILE* out)
+{
+    std::vector<unsigned> points(1, 0);
+
+    add_boundaries(a.location_blocks(), points);
+    add_boundaries(a.asn_blocks(), points);
+    add_boundaries(b.location_blocks(), points);
+    add_boundaries(b.asn_blocks(), points);
+
+    std::sort(points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+
+    size_t differ = 0;
+
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        IPResult ra;
+        IPResult rb;
+
+        a.query(points[i], ra);
+        b.query(points[i], rb);
+
+        if (same_result(ra, rb))
+        {
+            continue;
+        }
+
+        if (out && differ < 10)
+        {
+            char ip[16];
+            ip_to_s(ip, points[i]);
+
+            fprintf(out, "results differ from %s\n", ip);
+        }
+
+        differ++;
+    }
+
+    // the v6 tables, the same way.
+
+    std::vector<IP6> points6(1, IP6());
+
+    add_boundaries6(a.location_blocks6(), points6);
+    add_boundaries6(a.asn_blocks6(), points6);
+    add_boundaries6(b.location_blocks6(), points6);
+    add_boundaries6(b.asn_blocks6(), points6);
+
+    std::sort(points6.begin(), points6.end());
+    points6.erase(std::unique(points6.begin(), points6.end()), points6.end());
+
+    for (size_t i = 0; i < points6.size(); ++i)
+    {
+        IPResult ra;
+        IPResult rb;
+
+        a.query6(points6[i], ra);
+        b.query6(points6[i], rb);
+
+        if (same_result(ra, rb))
+        {
+            continue;
+        }
+
+        if (out && differ < 10)
+        {
+            char ip[64];
+            ip6_to_s(ip, points6[i]);
+
+            fprintf(out, "results differ from %s\n", ip);
+        }
+
+        differ++;
+    }
+
+    return differ;
+}
+
+inline void compare(const char* a_file_name, const char* b_file_name)
+{
+    LOG_CONTEXT("compare %s with %s", a_file_name, b_file_name);
+
+    GeoData a;
+    a.open(a_file_name);
+
+    GeoData b;
+    b.open(b_file_name);
+
+    size_t differ = compare_results(a, b, stderr);
+
+    if (differ)
+    {
+        FATAL_ERROR("%s and %s differ at %zu points", a_file_name,
+                    b_file_name, differ);
+    }
+
+    printf("%s and %s give the same results\n", a_file_name, b_file_name);
+}
+
 inline void query(const char* data_file_name,
                   const std::vector<std::string> &data_sources,
-                  bool show_headers)
+                  const QueryOptions &options)
 {
     LOG_CONTEXT("query data %s with %zu sources", data_file_name, data_sources.size());
 
     GeoData data;
-    data.open(data_file_name);
+    open_data(data, data_file_name, options);
+
+    WhereFilter where;
+    const WhereFilter* filter = open_filter(data, options, where);
 
-    if (show_headers)
+    if (options.show_headers)
     {
         IPResultEmitter::show_headers();
     }
 
     for (size_t i = 0; i < data_sources.size(); ++i)
     {
-        query(data, data_sources[i]);
+        query(data, data_sources[i], filter, options.summary);
     }
 }
 
@@ -0,0 +1,525 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-19
+ *
+ * This module lists the ip ranges of a country, region, city or asn, for
+ * geoloc --ranges, as in
+ *
+ * geoloc --ranges asn=AS15169
+ * geoloc --ranges country=NL --cidr
+ *
+ * The predicates are those of --where (see where.hpp), and they must all be
+ * on locations or all on asns. The matching blocks are printed in address
+ * order as start_ip end_ip, with neighbouring blocks merged into one range,
+ * v4 first, then v6. --cidr prints each range as the fewest prefixes that
+ * cover it exactly instead, one per line.
+ *
+ * A database imported with --ranges-index has a reverse index of each block
+ * table (see ReverseIndex in blocks.hpp), so the blocks of the matching
+ * payloads are read straight from it, and the time taken follows the size
+ * of the answer. Without one, or when the answer is a large share of the
+ * table, the block table is scanned.
+*/
+
+#ifndef RANGES_HPP_4A9D63F0
+#define RANGES_HPP_4A9D63F0
+
+#include "query.hpp"
+
+#include <stdio.h>
+
+struct RangesOptions
+{
+    RangesOptions()
+        :
+        where(),
+        cidr(false)
+    {
+    }
+
+    std::vector<std::string> where;
+
+    // print prefixes instead of start and end.
+    bool cidr;
+};
+
+struct RangesStats
+{
+    RangesStats()
+        :
+        blocks(0),
+        ranges(0),
+        ranges6(0),
+        indexed(true)
+    {
+    }
+
+    size_t blocks;
+    size_t ranges;
+    size_t ranges6;
+
+    // false if any table was scanned, for want of an index or because
+    // most of it matched.
+    bool indexed;
+};
+
+// the prefix arithmetic, for each address family.
+inline unsigned cidr_width(unsigned) { return 32; }
+inline unsigned cidr_width(const IP6 &) { return 128; }
+
+inline unsigned cidr_trailing_zeros(unsigned ip)
+{
+    return ip ? __builtin_ctz(ip) : 32;
+}
+
+inline unsigned cidr_trailing_zeros(const IP6 &ip)
+{
+    if (ip.lo)
+    {
+        return __builtin_ctzll(ip.lo);
+    }
+
+    return ip.hi ? 64 + __builtin_ctzll(ip.hi) : 128;
+}
+
+// the last address of the prefix of start that leaves bits host bits.
+inline unsigned cidr_last(unsigned start, unsigned bits)
+{
+    return bits >= 32 ? 0xFFFFFFFF : start | ((1U << bits) - 1);
+}
+
+inline IP6 cidr_last(const IP6 &start, unsigned bits)
+{
+    IP6 out = start;
+
+    if (bits >= 64)
+    {
+        out.lo = ~0ULL;
+        out.hi |= bits >= 128 ? ~0ULL : (1ULL << (bits - 64)) - 1;
+    }
+    else
+    {
+        out.lo |= (1ULL << bits) - 1;
+    }
+
+    return out;
+}
+
+// prints ranges in address order, merging neighbours.
+template <typename Address>
+class RangeWriter
+{
+  public:
+    RangeWriter(bool cidr, FILE* out)
+        :
+        cidr_(cidr),
+        out_(out),
+        pending_(false),
+        start_(),
+        end_(),
+        ranges_(0),
+        line_()
+    {
+    }
+
+    void add(const Address &start, const Address &end)
+    {
+        if (pending_ && !ip_is_max(end_) && ip_next(end_) == start)
+        {
+            end_ = end;
+            return;
+        }
+
+        flush();
+
+        start_ = start;
+        end_ = end;
+        pending_ = true;
+    }
+
+    void flush()
+    {
+        if (!pending_)
+        {
+            return;
+        }
+
+        pending_ = false;
+        ranges_++;
+
+        if (!out_)
+        {
+            return;
+        }
+
+        line_.clear();
+
+        if (cidr_)
+        {
+            append_cidrs();
+        }
+        else
+        {
+            char buf[64];
+
+            line_.append(buf, ip_to_s(buf, start_));
+            line_ += ' ';
+            line_.append(buf, ip_to_s(buf, end_));
+            line_ += '\n';
+        }
+
+        size_t n = fwrite(line_.data(), line_.size(), 1, out_);
+        REL_ASSERT(n == 1);
+    }
+
+    size_t ranges() const { return ranges_; }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(RangeWriter);
+
+    // the largest aligned prefix at start that stays inside the range,
+    // then the same again from just past it.
+    void append_cidrs()
+    {
+        Address start = start_;
+        unsigned width = cidr_width(start);
+
+        while (true)
+        {
+            unsigned bits = std::min(cidr_trailing_zeros(start), width);
+            Address last = cidr_last(start, bits);
+
+            while (end_ < last)
+            {
+                last = cidr_last(start, --bits);
+            }
+
+            char buf[64];
+
+            line_.append(buf, ip_to_s(buf, start));
+            line_.append(buf, sprintf(buf, "/%u\n", width - bits));
+
+            if (last == end_)
+            {
+                break;
+            }
+
+            start = ip_next(last);
+        }
+    }
+
+    bool cidr_;
+    FILE* out_;
+
+    bool pending_;
+    Address start_;
+    Address end_;
+
+    size_t ranges_;
+    std::string line_;
+};
+
+// reads blocks by index, decoding each group of a compressed table once
+// for a run of indices in it.
+class BlockReader
+{
+  public:
+    explicit BlockReader(const BlockTable &table)
+        :
+        table_(table),
+        group_(-1)
+    {
+    }
+
+    void get(size_t i, Block &out)
+    {
+        if (!table_.compressed())
+        {
+            out.start_ip = table_.start_ip[i];
+            out.end_ip = table_.end_ip[i];
+            out.loc = table_.loc[i];
+
+            return;
+        }
+
+        size_t g = i / PACK_GROUP;
+
+        if (g != group_)
+        {
+            table_.decode_group(g, buf_);
+            group_ = g;
+        }
+
+        out = buf_[i % PACK_GROUP];
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(BlockReader);
+
+    const BlockTable &table_;
+
+    size_t group_;
+    Block buf_[PACK_GROUP];
+};
+
+// the reverse index section of a block table, when the file has one.
+class IndexSection
+{
+  public:
+    IndexSection()
+        :
+        file_(),
+        index_(),
+        loaded_(false)
+    {
+    }
+
+    bool load(const char* fn, const SectionDirectory &dir, const char* name)
+    {
+        const SectionEntry* entry = dir.find(name);
+
+        if (!entry)
+        {
+            return false;
+        }
+
+        LOG_CONTEXT("load reverse index %s", name);
+
+        if (!file_.open(fn, *entry))
+        {
+            FATAL_ERROR("could not map section %s of %s", name, fn);
+            return false;
+        }
+
+        index_.load(file_);
+        loaded_ = true;
+
+        return true;
+    }
+
+    // 0 if the file has none.
+    const ReverseIndex* index() const
+    {
+        return loaded_ ? &index_ : 0;
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(IndexSection);
+
+    MemoryFile file_;
+    ReverseIndex index_;
+    bool loaded_;
+};
+
+// below this share of the table, reading the rows of the index and sorting
+// them beats a sequential scan. tables smaller than RANGES_SCAN_MIN are
+// cheap either way, and always use the index.
+#define RANGES_INDEX_SHARE 8
+#define RANGES_SCAN_MIN 4096
+
+// the blocks of the ids, in order. false, with no rows, if there are so
+// many that the table is better scanned.
+inline bool index_rows(const ReverseIndex &index,
+                       const IdSet &ids,
+                       size_t table_size,
+                       std::vector<unsigned> &rows)
+{
+    size_t payloads = index.payloads();
+    size_t count = 0;
+
+    for (size_t id = ids.next(0); id < payloads; id = ids.next(id + 1))
+    {
+        count += index.end(id) - index.begin(id);
+    }
+
+    if (table_size >= RANGES_SCAN_MIN &&
+        count * RANGES_INDEX_SHARE > table_size)
+    {
+        return false;
+    }
+
+    rows.reserve(count);
+
+    for (size_t id = ids.next(0); id < payloads; id = ids.next(id + 1))
+    {
+        rows.insert(rows.end(), index.begin(id), index.end(id));
+    }
+
+    std::sort(rows.begin(), rows.end());
+
+    return true;
+}
+
+inline void table_ranges(const BlockTable &table,
+                         const ReverseIndex* index,
+                         const IdSet &ids,
+                         RangeWriter<unsigned> &writer,
+                         RangesStats &stats)
+{
+    if (table.size() == 0)
+    {
+        return;
+    }
+
+    Block block;
+    std::vector<unsigned> rows;
+
+    if (!index || !index_rows(*index, ids, table.size(), rows))
+    {
+        stats.indexed = false;
+
+        BlockIterator iter(table);
+
+        while (iter.next(block))
+        {
+            if (ids.test(block.loc))
+            {
+                writer.add(block.start_ip, block.end_ip);
+                stats.blocks++;
+            }
+        }
+
+        return;
+    }
+
+    BlockReader reader(table);
+
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        reader.get(rows[i], block);
+        writer.add(block.start_ip, block.end_ip);
+    }
+
+    stats.blocks += rows.size();
+}
+
+inline void table_ranges(const Block6Table &table,
+                         const ReverseIndex* index,
+                         const IdSet &ids,
+                         RangeWriter<IP6> &writer,
+                         RangesStats &stats)
+{
+    if (table.size() == 0)
+    {
+        return;
+    }
+
+    Block6 block;
+    std::vector<unsigned> rows;
+
+    if (!index || !index_rows(*index, ids, table.size(), rows))
+    {
+        stats.indexed = false;
+
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            if (ids.test(table.payload(i)))
+            {
+                table.get(i, block);
+                writer.add(block.start, block.end);
+                stats.blocks++;
+            }
+        }
+
+        return;
+    }
+
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        table.get(rows[i], block);
+        writer.add(block.start, block.end);
+    }
+
+    stats.blocks += rows.size();
+}
+
+// print the ranges of the blocks that pass filter. data_file_name is the
+// file data was opened from, which is searched for reverse indexes.
+inline void ranges_results(const GeoData &data,
+                           const char* data_file_name,
+                           const WhereFilter &filter,
+                           bool cidr,
+                           FILE* out,
+                           RangesStats &stats)
+{
+    const IdSet* ids = filter.locations();
+
+    if (ids && filter.asns())
+    {
+        FATAL_ERROR("ranges predicates must all be on locations or all on "
+                    "asns");
+        return;
+    }
+
+    bool on_locations = ids;
+
+    if (!ids)
+    {
+        ids = filter.asns();
+    }
+
+    REL_ASSERT(ids);
+
+    const BlockTable &table = on_locations ? data.location_blocks() :
+                                             data.asn_blocks();
+    const Block6Table &table6 = on_locations ? data.location_blocks6() :
+                                               data.asn_blocks6();
+
+    // v001 files have no directory, and so no indexes.
+
+    SectionDirectory dir;
+    bool has_dir = dir.open(data_file_name);
+
+    IndexSection index;
+    IndexSection index6;
+
+    if (has_dir)
+    {
+        index.load(data_file_name, dir,
+                   on_locations ? "loc.index" : "asn.index");
+        index6.load(data_file_name, dir,
+                    on_locations ? "loc6.index" : "asn6.index");
+    }
+
+    {
+        RangeWriter<unsigned> writer(cidr, out);
+        table_ranges(table, index.index(), *ids, writer, stats);
+        writer.flush();
+
+        stats.ranges = writer.ranges();
+    }
+
+    RangeWriter<IP6> writer(cidr, out);
+    table_ranges(table6, index6.index(), *ids, writer, stats);
+    writer.flush();
+
+    stats.ranges6 = writer.ranges();
+}
+
+inline void ranges(const char* data_file_name,
+                   const QueryOptions &query_options,
+                   const RangesOptions &options)
+{
+    LOG_CONTEXT("ranges of data %s", data_file_name);
+
+    GeoData data;
+    open_data(data, data_file_name, query_options);
+
+    WhereFilter where;
+    const WhereFilter* filter = open_filter(data, options.where, where);
+
+    REL_ASSERT(filter);
+
+    RangesStats stats;
+    ranges_results(data, data_file_name, *filter, options.cidr, stdout,
+                   stats);
+
+    fprintf(stderr, "%zu v4 and %zu v6 ranges from %zu blocks, %s\n",
+            stats.ranges, stats.ranges6, stats.blocks,
+            stats.indexed ? "indexed" : "scanned");
+}
+
+#endif
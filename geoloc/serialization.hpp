@@ -15,6 +15,7 @@
 #include "macros.hpp"
 #include "error.hpp"
 
+#include <algorithm>
 #include <assert.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -83,26 +84,101 @@ class MappedVector
     const RawMappedVector<T>* ptr_;
 };
 
+// how a MemoryMap should be brought into memory.
+//
+// prefault - fault every page in up front (MAP_POPULATE / MADV_WILLNEED)
+// lock     - mlock the pages so they cannot be evicted
+// huge     - copy into anonymous memory backed by huge pages (MAP_HUGETLB,
+//            falling back to transparent huge pages), to cut tlb misses
+struct MapOptions
+{
+    MapOptions()
+        :
+        prefault(false),
+        lock(false),
+        huge(false)
+    {
+    }
+
+    bool prefault;
+    bool lock;
+    bool huge;
+};
+
+#define HUGE_PAGE_SIZE (2U << 20)
+
 class MemoryMap
 {
   public:
     MemoryMap()
         :
+        base_(0),
+        base_len_(0),
         data_(0),
-        len_(0)
+        len_(0),
+        backing_("file"),
+        locked_(false)
     {
     }
 
     ~MemoryMap()
     {
-        if (data_)
+        if (base_)
         {
-            int rc = munmap((void*) data_, len_);
+            int rc = munmap(base_, base_len_);
             UNUSED(rc);
         }
     }
 
-    bool open(const char* fn)
+    bool open(const char* fn, const MapOptions &options = MapOptions())
+    {
+        return open(fn, 0, 0, true, options);
+    }
+
+    // map len bytes starting at offset. the mapping itself starts on the
+    // page boundary below offset.
+    bool open(const char* fn,
+              off_t offset,
+              size_t len,
+              const MapOptions &options = MapOptions())
+    {
+        return open(fn, offset, len, false, options);
+    }
+
+    const void* data() const
+    {
+        return data_;
+    }
+
+    const char* begin() const
+    {
+        return (const char*) data_;
+    }
+
+    size_t size() const
+    {
+        return len_;
+    }
+
+    // file, anon, thp or hugetlb
+    const char* backing() const
+    {
+        return backing_;
+    }
+
+    bool locked() const
+    {
+        return locked_;
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(MemoryMap);
+
+    bool open(const char* fn,
+              off_t offset,
+              size_t len,
+              bool whole,
+              const MapOptions &options)
     {
         int fd = ::open(fn, O_RDONLY);
 
@@ -116,53 +192,205 @@ class MemoryMap
         if (end == -1)
         {
             LOG_CONTEXT("could not seek to end of %s", fn);
+            close(fd);
             return false;
         }
 
-        off_t beg = lseek(fd, 0, SEEK_SET);
+        if (whole)
+        {
+            len = end;
+        }
 
-        if (beg == -1)
+        if (offset < 0 || offset + (off_t) len > end)
         {
-            LOG_CONTEXT("could not seek to beg of %s", fn);
+            LOG_CONTEXT("range %zu+%zu is outside of %s", (size_t) offset,
+                        len, fn);
+            close(fd);
             return false;
         }
 
-        len_ = end;
-        data_ = mmap(0, len_, PROT_READ, MAP_SHARED, fd, 0);
+        off_t page = sysconf(_SC_PAGESIZE);
+        off_t base = offset - offset % page;
+
+        base_len_ = len + (offset - base);
+
+        if (base_len_ == 0)
+        {
+            close(fd);
+            return true;
+        }
+
+        int flags = MAP_SHARED;
+
+#ifdef MAP_POPULATE
+        if (options.prefault && !options.huge)
+        {
+            flags |= MAP_POPULATE;
+        }
+#endif
+
+        void* p = mmap(0, base_len_, PROT_READ, flags, fd, base);
 
-        if (!data_)
+        if (p == MAP_FAILED)
         {
             LOG_CONTEXT("could not mmap %s", fn);
             close(fd);
             return false;
         }
 
+        base_ = p;
+        data_ = (const char*) p + (offset - base);
+        len_ = len;
+
         int rc = ::close(fd);
         UNUSED(rc);
 
+        if (options.huge)
+        {
+            copy_to_huge_pages();
+        }
+        else if (options.prefault)
+        {
+            prefault();
+        }
+
+        if (options.lock)
+        {
+            locked_ = mlock(base_, base_len_) == 0;
+
+            if (!locked_)
+            {
+                fprintf(stderr, "warning: could not mlock %zu bytes of %s\n",
+                        base_len_, fn);
+            }
+        }
+
         return true;
     }
 
-    const void* data() const
+    void prefault()
     {
-        return data_;
-    }
+        madvise(base_, base_len_, MADV_WILLNEED);
 
-    const char* begin() const
-    {
-        return (const char*) data_;
+#ifndef MAP_POPULATE
+        volatile char sum = 0;
+        size_t page = sysconf(_SC_PAGESIZE);
+
+        for (size_t i = 0; i < base_len_; i += page)
+        {
+            sum += ((const char*) base_)[i];
+        }
+#endif
     }
 
-    size_t size() const
+    // replace the file mapping with a private copy. anonymous memory is the
+    // only kind that can be backed by huge pages.
+    void copy_to_huge_pages()
     {
-        return len_;
+        size_t rounded = (len_ + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+                         HUGE_PAGE_SIZE;
+
+        void* p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+        p = mmap(0, rounded, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (p != MAP_FAILED)
+        {
+            backing_ = "hugetlb";
+        }
+#endif
+
+        if (p == MAP_FAILED)
+        {
+            // over allocate, so that the copy can start on a huge page.
+
+            char* raw = (char*) mmap(0, rounded + HUGE_PAGE_SIZE,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+            if (raw == MAP_FAILED)
+            {
+                LOG_CONTEXT("could not allocate %zu bytes for huge pages",
+                            rounded);
+                return;
+            }
+
+            uintptr_t head = (uintptr_t) raw % HUGE_PAGE_SIZE;
+            size_t skip = head ? HUGE_PAGE_SIZE - head : 0;
+
+            if (skip)
+            {
+                munmap(raw, skip);
+            }
+
+            if (HUGE_PAGE_SIZE - skip)
+            {
+                munmap(raw + skip + rounded, HUGE_PAGE_SIZE - skip);
+            }
+
+            p = raw + skip;
+            backing_ = "anon";
+
+#ifdef MADV_HUGEPAGE
+            if (madvise(p, rounded, MADV_HUGEPAGE) == 0)
+            {
+                backing_ = "thp";
+            }
+#endif
+        }
+
+        memcpy(p, data_, len_);
+        mprotect(p, rounded, PROT_READ);
+
+        munmap(base_, base_len_);
+
+        base_ = p;
+        base_len_ = rounded;
+        data_ = p;
     }
 
-  private:
-    DISALLOW_COPY_AND_ASSIGN(MemoryMap);
+    void *base_;
+    size_t base_len_;
 
     const void *data_;
     size_t len_;
+
+    const char* backing_;
+    bool locked_;
+};
+
+// fnv-1a, used to checksum file sections.
+inline unsigned checksum(const void* p, size_t n, unsigned h = 2166136261U)
+{
+    const unsigned char* iter = (const unsigned char*) p;
+    const unsigned char* end = iter + n;
+
+    while (iter != end)
+    {
+        h ^= *iter++;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+// the v002 file format is a 32 byte text header, then a 16 byte SDIR record
+// pointing at the section directory, which is written after the sections.
+// each section starts on a SECTION_ALIGN boundary, so that it can be mapped
+// by itself without touching the pages of its neighbours.
+
+#define SECTION_ALIGN 4096U
+#define SECTION_NAME_LEN 24
+
+struct SectionEntry
+{
+    char name[SECTION_NAME_LEN];
+    uint64_t offset;
+    uint64_t length;
+    unsigned align;
+    unsigned checksum;
 };
 
 class BinaryFile
@@ -170,7 +398,12 @@ class BinaryFile
   public:
     BinaryFile()
         :
-        file_(0)
+        file_(0),
+        in_memory_(false),
+        mem_(),
+        mem_pos_(0),
+        dir_offset_(-1),
+        open_section_(false)
     {
     }
 
@@ -184,19 +417,31 @@ class BinaryFile
 
     bool open(const char* fn)
     {
-        file_ = fopen(fn, "w");
+        file_ = fopen(fn, "w+");
         return file_;
     }
 
+    // write into a memory buffer instead of a file. sections saved into it
+    // can later be appended to a real file, see append.
+    void open_memory()
+    {
+        in_memory_ = true;
+    }
+
+    const std::vector<char> &memory() const
+    {
+        return mem_;
+    }
+
     off_t offset()
     {
-        return ftello(file_);
+        return in_memory_ ? mem_pos_ : ftello(file_);
     }
 
     void save_type(const char* x)
     {
         assert(strlen(x) == 4);
-        size_t rn = fwrite(x, 1, 4, file_);
+        size_t rn = write(x, 4);
 
         if (rn != 4)
         {
@@ -206,7 +451,7 @@ class BinaryFile
 
     void save_unsigned(unsigned x)
     {
-        size_t rn = fwrite(&x, 1, 4, file_);
+        size_t rn = write(&x, 4);
 
         if (rn != 4)
         {
@@ -216,7 +461,7 @@ class BinaryFile
 
     void save_bytes_padded(const void* b, size_t n)
     {
-        size_t rn = fwrite(b, 1, n, file_);
+        size_t rn = write(b, n);
 
         if (rn != n)
         {
@@ -228,7 +473,7 @@ class BinaryFile
 
     void save_bytes_raw(const void* b, size_t n)
     {
-        size_t rn = fwrite(b, 1, n, file_);
+        size_t rn = write(b, n);
 
         if (rn != n)
         {
@@ -238,6 +483,13 @@ class BinaryFile
 
     void seek(off_t where)
     {
+        if (in_memory_)
+        {
+            REL_ASSERT(where <= (off_t) mem_.size());
+            mem_pos_ = where;
+            return;
+        }
+
         int rc = fseeko(file_, where, SEEK_SET);
 
         if (rc != 0)
@@ -247,14 +499,20 @@ class BinaryFile
     }
 
     void pad()
+    {
+        pad_to(4);
+    }
+
+    void pad_to(unsigned align)
     {
         // given the current offset, emit some padding bytes.
 
-        unsigned padded = ((unsigned) (offset()) + 3) & ~0x3U;
-        unsigned pad_bytes = padded - offset();
-        char padding[] = {0,0,0,0};
+        static const char padding[SECTION_ALIGN] = {0};
+        REL_ASSERT(align <= SECTION_ALIGN);
+
+        off_t padded = (offset() + align - 1) / align * align;
 
-        return save_bytes_raw(padding, pad_bytes);
+        return save_bytes_raw(padding, padded - offset());
     }
 
     template <typename T>
@@ -275,11 +533,274 @@ class BinaryFile
         seek(bottom);
     }
 
+    // leave room for the SDIR record, filled in by finish.
+    void reserve_section_directory()
+    {
+        dir_offset_ = offset();
+
+        save_type("SDIR");
+        save_unsigned(0);
+
+        uint64_t zero = 0;
+        save_bytes_raw(&zero, sizeof(zero));
+    }
+
+    // start a named section, ending any open one.
+    void begin_section(const char* name)
+    {
+        REL_ASSERT(dir_offset_ != -1 || in_memory_);
+        REL_ASSERT(strlen(name) < SECTION_NAME_LEN);
+
+        end_section();
+        pad_to(SECTION_ALIGN);
+
+        SectionEntry entry;
+        memset(&entry, 0, sizeof(entry));
+
+        strcpy(entry.name, name);
+        entry.offset = offset();
+        entry.align = SECTION_ALIGN;
+
+        sections_.push_back(entry);
+        open_section_ = true;
+    }
+
+    void end_section()
+    {
+        if (!open_section_)
+        {
+            return;
+        }
+
+        SectionEntry &entry = sections_.back();
+        entry.length = offset() - entry.offset;
+
+        open_section_ = false;
+    }
+
+    // copy the sections of an in memory file onto the end of this one.
+    void append(BinaryFile &other)
+    {
+        REL_ASSERT(other.in_memory_);
+        REL_ASSERT(dir_offset_ != -1);
+
+        other.end_section();
+        end_section();
+        pad_to(SECTION_ALIGN);
+
+        off_t base = offset();
+
+        if (!other.mem_.empty())
+        {
+            save_bytes_raw(&other.mem_[0], other.mem_.size());
+        }
+
+        for (size_t i = 0; i < other.sections_.size(); ++i)
+        {
+            SectionEntry entry = other.sections_[i];
+            entry.offset += base;
+
+            sections_.push_back(entry);
+        }
+    }
+
+    // flush the file through to disk, so that it can be renamed into place.
+    bool sync()
+    {
+        return fflush(file_) == 0 && fsync(fileno(file_)) == 0;
+    }
+
+    // write the section directory, with checksums read back from the file.
+    void finish()
+    {
+        if (dir_offset_ == -1)
+        {
+            return;
+        }
+
+        end_section();
+
+        if (fflush(file_) != 0)
+        {
+            FATAL_ERROR("failed to flush before checksums");
+        }
+
+        for (size_t i = 0; i < sections_.size(); ++i)
+        {
+            sections_[i].checksum = checksum_range(sections_[i].offset,
+                                                   sections_[i].length);
+        }
+
+        fseeko(file_, 0, SEEK_END);
+        pad_to(8);
+
+        uint64_t dir = offset();
+
+        for (size_t i = 0; i < sections_.size(); ++i)
+        {
+            save_bytes_raw(&sections_[i], sizeof(SectionEntry));
+        }
+
+        seek(dir_offset_ + 4);
+        save_unsigned(sections_.size());
+        save_bytes_raw(&dir, sizeof(dir));
+
+        fseeko(file_, 0, SEEK_END);
+        fflush(file_);
+    }
+
   private:
     DISALLOW_COPY_AND_ASSIGN(BinaryFile);
 
+    size_t write(const void* b, size_t n)
+    {
+        if (!in_memory_)
+        {
+            return fwrite(b, 1, n, file_);
+        }
+
+        if (mem_pos_ + n > mem_.size())
+        {
+            mem_.resize(mem_pos_ + n);
+        }
+
+        if (n)
+        {
+            memcpy(&mem_[mem_pos_], b, n);
+        }
+
+        mem_pos_ += n;
+
+        return n;
+    }
+
+    unsigned checksum_range(off_t where, size_t n)
+    {
+        seek(where);
+
+        unsigned h = checksum(0, 0);
+        char buf[65536];
+
+        while (n)
+        {
+            size_t want = std::min(n, sizeof(buf));
+            size_t rn = fread(buf, 1, want, file_);
+
+            if (rn != want)
+            {
+                FATAL_ERROR("failed to read back %zu bytes", want);
+            }
+
+            h = checksum(buf, rn, h);
+            n -= rn;
+        }
+
+        return h;
+    }
+
     FILE* file_;
-    std::vector<off_t> offsets_;
+
+    bool in_memory_;
+    std::vector<char> mem_;
+    size_t mem_pos_;
+
+    off_t dir_offset_;
+    bool open_section_;
+    std::vector<SectionEntry> sections_;
+};
+
+// reads the section directory of a v002 file, without mapping anything.
+class SectionDirectory
+{
+  public:
+    SectionDirectory() {}
+
+    bool open(const char* fn)
+    {
+        int fd = ::open(fn, O_RDONLY);
+
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        bool ok = read_entries(fd);
+        ::close(fd);
+
+        return ok;
+    }
+
+    const SectionEntry* find(const char* name) const
+    {
+        for (size_t i = 0; i < entries_.size(); ++i)
+        {
+            if (strncmp(entries_[i].name, name, SECTION_NAME_LEN) == 0)
+            {
+                return &entries_[i];
+            }
+        }
+
+        return 0;
+    }
+
+    const std::vector<SectionEntry> &entries() const { return entries_; }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(SectionDirectory);
+
+    bool read_entries(int fd)
+    {
+        char sdir[16];
+
+        if (pread(fd, sdir, sizeof(sdir), 32) != (ssize_t) sizeof(sdir) ||
+            memcmp(sdir, "SDIR", 4) != 0)
+        {
+            LOG_CONTEXT("missing section directory");
+            return false;
+        }
+
+        unsigned count;
+        uint64_t dir;
+
+        memcpy(&count, sdir + 4, sizeof(count));
+        memcpy(&dir, sdir + 8, sizeof(dir));
+
+        // check the count against the file before trusting it with an
+        // allocation.
+
+        off_t size = lseek(fd, 0, SEEK_END);
+
+        if (size < 0 || dir > (uint64_t) size ||
+            count > ((uint64_t) size - dir) / sizeof(SectionEntry))
+        {
+            LOG_CONTEXT("section directory is truncated");
+            return false;
+        }
+
+        entries_.resize(count);
+
+        if (count == 0)
+        {
+            return true;
+        }
+
+        ssize_t want = count * sizeof(SectionEntry);
+
+        if (pread(fd, &entries_[0], want, dir) != want)
+        {
+            LOG_CONTEXT("section directory is truncated");
+            return false;
+        }
+
+        for (size_t i = 0; i < entries_.size(); ++i)
+        {
+            entries_[i].name[SECTION_NAME_LEN - 1] = '\0';
+        }
+
+        return true;
+    }
+
+    std::vector<SectionEntry> entries_;
 };
 
 inline bool isaligned(void* ptr)
@@ -336,9 +857,32 @@ class MemoryFile
         return file_.size() - offset_;
     }
 
-    bool open(const char* fn)
+    size_t size() const
+    {
+        return file_.size();
+    }
+
+    const char* begin() const
+    {
+        return file_.begin();
+    }
+
+    bool open(const char* fn, const MapOptions &options = MapOptions())
     {
-        return file_.open(fn);
+        return file_.open(fn, options);
+    }
+
+    // map just one section of a v002 file.
+    bool open(const char* fn,
+              const SectionEntry &section,
+              const MapOptions &options = MapOptions())
+    {
+        return file_.open(fn, section.offset, section.length, options);
+    }
+
+    const MemoryMap &map() const
+    {
+        return file_;
     }
 
     void* iter()
@@ -359,6 +903,17 @@ class MemoryFile
         return out;
     }
 
+    // the next type tag, without moving past it.
+    const char* peek_type()
+    {
+        if (avail() < 4)
+        {
+            return 0;
+        }
+
+        return (const char*) iter();
+    }
+
     const char* load_type()
     {
         return (const char*) get_mem(4);
@@ -408,8 +963,29 @@ class MemoryFile
         out.init(foo);
     }
 
-    void load_mapped_string_vector(MappedStringVector &out)
+    // a string vector is either stored inline, as indices and chars, or as
+    // SREF offsets into the shared string pool.
+    void load_mapped_string_vector(MappedStringVector &out,
+                                   const char* pool = 0)
     {
+        const char* type = peek_type();
+
+        if (type && memcmp(type, "SREF", 4) == 0)
+        {
+            load_type();
+
+            const RawMappedVector<unsigned>* refs = 
+                load_raw_mapped_vector<unsigned>();
+
+            if (!refs || !pool)
+            {
+                FATAL_ERROR("could not load_mapped_string_vector refs");
+            }
+
+            out.init(pool, refs);
+            return;
+        }
+
         const RawMappedVector<unsigned>* foo = 
             load_raw_mapped_vector<unsigned>();
 
@@ -0,0 +1,661 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module lets a co-located client query a running geoloc through shared
+ * memory, with no syscalls on the fast path.
+ *
+ * The server creates a ring file (e.g. under /dev/shm) that holds a request
+ * ring of quads and a response ring of fixed size ShmResult records. The
+ * client writes a batch of quads and bumps req_head, the server answers each
+ * slot in place and bumps resp_head. Both sides busy-poll for a while before
+ * sleeping on a futex (linux) or a short usleep (elsewhere).
+ *
+ * Only one client may hold the ring at a time.
+*/
+
+#ifndef SHM_RING_HPP_3F1C29B0
+#define SHM_RING_HPP_3F1C29B0
+
+#include "query.hpp"
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#ifdef __linux
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define SHM_RING_MAGIC "geoshm02"
+#define SHM_RING_SLOTS 4096U
+#define SHM_RING_SPIN 20000U
+
+// one answer, fixed size so that any language can read it straight out of
+// the ring. loc and asn index the location and asn tables of the data file
+// the server has open, for clients that want the longer strings.
+struct ShmResult
+{
+    unsigned quad;
+    unsigned loc;
+    unsigned asn;
+    unsigned as_num;
+
+    float lat;
+    float lon;
+
+    char country[4];
+    char region[4];
+};
+
+// each counter has its own cache line, so the two sides do not fight.
+struct ShmRingHeader
+{
+    char magic[8];
+    unsigned slots;
+    unsigned result_size;
+    unsigned data_id;
+    volatile unsigned client_pid;
+    char pad0[40];
+
+    volatile unsigned req_head;
+    char pad1[60];
+
+    volatile unsigned resp_head;
+    char pad2[60];
+
+    volatile unsigned server_sleeping;
+    char pad3[60];
+
+    volatile unsigned client_sleeping;
+    char pad4[60];
+};
+
+inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#endif
+}
+
+#ifdef __linux
+
+inline void shm_sleep(volatile unsigned* word, unsigned seen)
+{
+    // not FUTEX_PRIVATE_FLAG, the word is shared across processes.
+    syscall(SYS_futex, word, FUTEX_WAIT, seen, 0, 0, 0);
+}
+
+inline void shm_wake(volatile unsigned* word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
+
+#else
+
+inline void shm_sleep(volatile unsigned* word, unsigned seen)
+{
+    UNUSED(word);
+    UNUSED(seen);
+    usleep(50);
+}
+
+inline void shm_wake(volatile unsigned* word)
+{
+    UNUSED(word);
+}
+
+#endif
+
+// publish a new counter value, and wake the other side if it went to sleep.
+inline void shm_publish(volatile unsigned* word,
+                        unsigned value,
+                        volatile unsigned* sleeping)
+{
+    __sync_synchronize();
+    *word = value;
+    __sync_synchronize();
+
+    if (*sleeping)
+    {
+        shm_wake(word);
+    }
+}
+
+// wait for word to move past seen. spin first, then sleep.
+inline void shm_wait(volatile unsigned* word,
+                     unsigned seen,
+                     volatile unsigned* sleeping)
+{
+    for (unsigned i = 0; i < SHM_RING_SPIN; ++i)
+    {
+        if (*word != seen)
+        {
+            __sync_synchronize();
+            return;
+        }
+
+        cpu_relax();
+    }
+
+    while (true)
+    {
+        *sleeping = 1;
+        __sync_synchronize();
+
+        if (*word != seen)
+        {
+            break;
+        }
+
+        shm_sleep(word, seen);
+    }
+
+    *sleeping = 0;
+    __sync_synchronize();
+}
+
+class ShmRing
+{
+  public:
+    ShmRing()
+        :
+        data_(0),
+        len_(0)
+    {
+    }
+
+    ~ShmRing()
+    {
+        if (data_)
+        {
+            int rc = munmap(data_, len_);
+            UNUSED(rc);
+        }
+    }
+
+    static size_t byte_size(unsigned slots)
+    {
+        return sizeof(ShmRingHeader) +
+               slots * sizeof(unsigned) +
+               slots * sizeof(ShmResult);
+    }
+
+    // data_id is the fingerprint of the server's data file.
+    bool create(const char* fn, unsigned slots, unsigned data_id)
+    {
+        REL_ASSERT((slots & (slots - 1)) == 0);
+
+        int fd = ::open(fn, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+        if (fd < 0)
+        {
+            LOG_CONTEXT("could not create %s", fn);
+            return false;
+        }
+
+        len_ = byte_size(slots);
+
+        if (ftruncate(fd, len_) != 0)
+        {
+            LOG_CONTEXT("could not size %s to %zu", fn, len_);
+            ::close(fd);
+            return false;
+        }
+
+        bool ok = map(fd);
+        ::close(fd);
+
+        if (!ok)
+        {
+            LOG_CONTEXT("could not mmap %s", fn);
+            return false;
+        }
+
+        memset(data_, 0, len_);
+
+        ShmRingHeader* h = header();
+
+        h->slots = slots;
+        h->result_size = sizeof(ShmResult);
+        h->data_id = data_id;
+
+        // magic goes last, clients ignore the ring until it is there.
+        __sync_synchronize();
+        memcpy(h->magic, SHM_RING_MAGIC, 8);
+
+        return true;
+    }
+
+    bool attach(const char* fn)
+    {
+        int fd = ::open(fn, O_RDWR);
+
+        if (fd < 0)
+        {
+            LOG_CONTEXT("could not open %s", fn);
+            return false;
+        }
+
+        struct stat st;
+
+        if (fstat(fd, &st) != 0 ||
+            (size_t) st.st_size < sizeof(ShmRingHeader))
+        {
+            LOG_CONTEXT("%s is too small to be a ring", fn);
+            ::close(fd);
+            return false;
+        }
+
+        len_ = st.st_size;
+
+        bool ok = map(fd);
+        ::close(fd);
+
+        if (!ok)
+        {
+            LOG_CONTEXT("could not mmap %s", fn);
+            return false;
+        }
+
+        const ShmRingHeader* h = header();
+
+        if (memcmp(h->magic, SHM_RING_MAGIC, 8) != 0 ||
+            h->result_size != sizeof(ShmResult) ||
+            byte_size(h->slots) != len_)
+        {
+            LOG_CONTEXT("%s is not a geoloc ring", fn);
+            return false;
+        }
+
+        return true;
+    }
+
+    ShmRingHeader* header()
+    {
+        return (ShmRingHeader*) data_;
+    }
+
+    unsigned slots()
+    {
+        return header()->slots;
+    }
+
+    unsigned* requests()
+    {
+        return (unsigned*)((char*) data_ + sizeof(ShmRingHeader));
+    }
+
+    ShmResult* responses()
+    {
+        return (ShmResult*)(requests() + slots());
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(ShmRing);
+
+    bool map(int fd)
+    {
+        void* p = mmap(0, len_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (p == MAP_FAILED)
+        {
+            return false;
+        }
+
+        data_ = p;
+        return true;
+    }
+
+    void* data_;
+    size_t len_;
+};
+
+inline void copy_code(char* out, const char* s)
+{
+    strncpy(out, s ? s : "", 4);
+    out[3] = '\0';
+}
+
+class ShmServer
+{
+  public:
+    explicit ShmServer(const GeoData &geo_data)
+        :
+        geo_data_(geo_data),
+        ring_()
+    {
+    }
+
+    bool create(const char* fn)
+    {
+        return ring_.create(fn, SHM_RING_SLOTS, geo_data_.fingerprint());
+    }
+
+    void answer(unsigned quad, ShmResult &out) const
+    {
+        unsigned loc_idx;
+        unsigned asn_idx;
+
+        geo_data_.lookup(quad, loc_idx, asn_idx);
+
+        IPResult result;
+        geo_data_.resolve(quad, loc_idx, asn_idx, result);
+
+        out.quad = quad;
+        out.loc = loc_idx;
+        out.asn = asn_idx;
+        out.as_num = result.asn ? *result.asn : 0;
+        out.lat = result.lat;
+        out.lon = result.lon;
+
+        copy_code(out.country, result.country);
+        copy_code(out.region, result.region);
+    }
+
+    // never returns, the server lives until it is killed.
+    void serve()
+    {
+        ShmRingHeader* h = ring_.header();
+        const unsigned* requests = ring_.requests();
+        ShmResult* responses = ring_.responses();
+        unsigned mask = ring_.slots() - 1;
+
+        unsigned done = h->resp_head;
+
+        while (true)
+        {
+            unsigned head = h->req_head;
+
+            if (head == done)
+            {
+                shm_wait(&h->req_head, done, &h->server_sleeping);
+                continue;
+            }
+
+            __sync_synchronize();
+
+            while (done != head)
+            {
+                unsigned slot = done & mask;
+                answer(requests[slot], responses[slot]);
+                ++done;
+
+                // let the client start reading long batches early.
+
+                if ((done & 255) == 0)
+                {
+                    shm_publish(&h->resp_head, done, &h->client_sleeping);
+                }
+            }
+
+            shm_publish(&h->resp_head, done, &h->client_sleeping);
+        }
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(ShmServer);
+
+    const GeoData &geo_data_;
+    ShmRing ring_;
+};
+
+class ShmClient
+{
+  public:
+    ShmClient()
+        :
+        ring_(),
+        attached_(false)
+    {
+    }
+
+    ~ShmClient()
+    {
+        if (attached_)
+        {
+            __sync_bool_compare_and_swap(&ring_.header()->client_pid,
+                                         (unsigned) getpid(), 0);
+        }
+    }
+
+    bool open(const char* fn)
+    {
+        if (!ring_.attach(fn))
+        {
+            return false;
+        }
+
+        ShmRingHeader* h = ring_.header();
+        unsigned self = getpid();
+
+        while (!__sync_bool_compare_and_swap(&h->client_pid, 0, self))
+        {
+            // steal the ring from a client that died holding it.
+
+            unsigned owner = h->client_pid;
+
+            if (owner && kill(owner, 0) != 0 && errno == ESRCH)
+            {
+                __sync_bool_compare_and_swap(&h->client_pid, owner, 0);
+                continue;
+            }
+
+            LOG_CONTEXT("ring %s is in use by pid %u", fn, owner);
+            return false;
+        }
+
+        attached_ = true;
+
+        // a dead client may have left a batch in flight.
+
+        while (h->resp_head != h->req_head)
+        {
+            shm_wait(&h->resp_head, h->resp_head, &h->client_sleeping);
+        }
+
+        return true;
+    }
+
+    unsigned slots()
+    {
+        return ring_.slots();
+    }
+
+    unsigned data_id()
+    {
+        return ring_.header()->data_id;
+    }
+
+    // answer n quads, n must be no more than slots().
+    void lookup(const unsigned* quads, size_t n, ShmResult* out)
+    {
+        REL_ASSERT(n <= slots());
+
+        ShmRingHeader* h = ring_.header();
+        unsigned* requests = ring_.requests();
+        const ShmResult* responses = ring_.responses();
+        unsigned mask = slots() - 1;
+
+        unsigned base = h->req_head;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            requests[(base + i) & mask] = quads[i];
+        }
+
+        unsigned target = base + n;
+        shm_publish(&h->req_head, target, &h->server_sleeping);
+
+        unsigned got = 0;
+
+        while (got != n)
+        {
+            unsigned head = h->resp_head;
+
+            if (head - base == got)
+            {
+                shm_wait(&h->resp_head, head, &h->client_sleeping);
+                continue;
+            }
+
+            __sync_synchronize();
+
+            for (; got != head - base; ++got)
+            {
+                out[got] = responses[(base + got) & mask];
+            }
+        }
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(ShmClient);
+
+    ShmRing ring_;
+    bool attached_;
+};
+
+// batches quads through the ring, then resolves the long strings against
+// the local mapping of the same data file. v6 addresses, and addresses
+// with a timestamp, are looked up locally.
+class ShmScanner : public Connector
+{
+  public:
+    ShmScanner(const GeoData &geo_data, ShmClient &client)
+        :
+        geo_data_(geo_data),
+        client_(client)
+    {
+    }
+
+    void consume(const Buffer &b)
+    {
+        const IPAddress* address = (const IPAddress*)(b.data());
+
+        // the ring only carries quads, so v6 addresses, and addresses with
+        // a timestamp, are answered from the local mapping, after the quads
+        // ahead of them to keep the order.
+
+        if (address->family == IP_V6 || address->month)
+        {
+            drain();
+
+            IPResult result;
+            geo_data_.query(*address, result);
+
+            emit(Buffer(&result, sizeof(result)));
+            return;
+        }
+
+        addresses_.push_back(*address);
+        quads_.push_back(address->quad);
+
+        if (quads_.size() == client_.slots())
+        {
+            drain();
+        }
+    }
+
+    void flush()
+    {
+        drain();
+        emit_flush();
+    }
+
+  private:
+    void drain()
+    {
+        if (quads_.empty())
+        {
+            return;
+        }
+
+        results_.resize(quads_.size());
+        client_.lookup(&quads_[0], quads_.size(), &results_[0]);
+
+        for (size_t i = 0; i < results_.size(); ++i)
+        {
+            const ShmResult &r = results_[i];
+
+            IPResult result;
+            geo_data_.resolve(r.quad, r.loc, r.asn, result);
+
+            result.family = addresses_[i].family;
+            result.ip6 = addresses_[i].ip6;
+
+            emit(Buffer(&result, sizeof(result)));
+        }
+
+        quads_.clear();
+        addresses_.clear();
+    }
+
+    const GeoData &geo_data_;
+    ShmClient &client_;
+
+    std::vector<IPAddress> addresses_;
+    std::vector<unsigned> quads_;
+    std::vector<ShmResult> results_;
+};
+
+inline void shm_serve(const char* data_file_name,
+                      const char* ring_file_name,
+                      const QueryOptions &options)
+{
+    LOG_CONTEXT("shm serve data %s on %s", data_file_name, ring_file_name);
+
+    GeoData data;
+    open_data(data, data_file_name, options);
+
+    ShmServer server(data);
+
+    if (!server.create(ring_file_name))
+    {
+        FATAL_ERROR("could not create ring %s", ring_file_name);
+    }
+
+    server.serve();
+}
+
+inline void shm_query(const char* data_file_name,
+                      const char* ring_file_name,
+                      const std::vector<std::string> &data_sources,
+                      const QueryOptions &options)
+{
+    LOG_CONTEXT("shm query data %s through %s", data_file_name,
+                ring_file_name);
+
+    GeoData data;
+    open_data(data, data_file_name, options);
+
+    ShmClient client;
+
+    if (!client.open(ring_file_name))
+    {
+        FATAL_ERROR("could not attach to ring %s", ring_file_name);
+    }
+
+    if (client.data_id() != data.fingerprint())
+    {
+        FATAL_ERROR("ring %s serves a different data file", ring_file_name);
+    }
+
+    if (options.show_headers)
+    {
+        IPResultEmitter::show_headers();
+    }
+
+    ShmScanner scanner(data, client);
+
+    for (size_t i = 0; i < data_sources.size(); ++i)
+    {
+        query(scanner, data_sources[i]);
+    }
+}
+
+#endif
@@ -0,0 +1,775 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module summarizes unbounded query streams in constant memory, for
+ * geoloc --sketch, as in
+ *
+ * tail -F access.log | geoloc -f - --sketch --top 20 --dump-every 1000000
+ *
+ * It reports the top asns, cities and source ips, and an estimate of the
+ * distinct ips of each country.
+ *
+ * asns and cities are counted exactly, by the same group keys as
+ * --count-by, as their key spaces are bounded by the database. Source ips
+ * are not, so the top ips are kept by Space-Saving, which holds a fixed
+ * number of counters and, when a new ip arrives with all of them taken,
+ * gives it the counter of the least frequent ip, whose count becomes the
+ * new ip's error bound. Distinct ips are estimated with a HyperLogLog of
+ * 2^HLL_BITS one byte registers per country, about 1.6% standard error.
+ *
+ * Each worker summarizes its own lines, and every SKETCH_BATCH lines merges
+ * its summary into a shared total and starts a new one. Exact counts merge
+ * by adding, HyperLogLogs by taking the larger register, and Space-Saving
+ * summaries by adding counts, where an ip missing from a full summary is
+ * taken to have that summary's smallest count. The total is printed once
+ * at least --dump-every more lines have been merged into it, and at the
+ * end.
+*/
+
+#ifndef SKETCH_HPP_2D6F1A85
+#define SKETCH_HPP_2D6F1A85
+
+#include "count.hpp"
+
+#include <math.h>
+
+// log2 of the registers of each HyperLogLog.
+#define HLL_BITS 12
+
+// lines a worker summarizes before merging into the total.
+#define SKETCH_BATCH (1U << 16)
+
+struct SketchOptions
+{
+    SketchOptions()
+        :
+        enabled(false),
+        top(10),
+        dump_every(0),
+        threads(cpu_count())
+    {
+    }
+
+    bool enabled;
+
+    // the length of each top list.
+    unsigned top;
+
+    // lines between dumps of the total, 0 to dump only at the end.
+    uint64_t dump_every;
+
+    unsigned threads;
+};
+
+// a 64 bit finalizer, from splitmix64, so that ips that differ in a few
+// bits hash far apart.
+inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+
+    return x;
+}
+
+inline uint64_t hash_ip6(const IP6 &ip)
+{
+    return mix64(ip.hi * 0x9E3779B97F4A7C15ULL ^ ip.lo);
+}
+
+struct IP6Hash
+{
+    size_t operator()(const IP6 &ip) const
+    {
+        return hash_ip6(ip);
+    }
+};
+
+class HyperLogLog
+{
+  public:
+    HyperLogLog()
+        :
+        registers_(1U << HLL_BITS, 0)
+    {
+    }
+
+    void add(uint64_t hash)
+    {
+        unsigned i = hash >> (64 - HLL_BITS);
+        uint64_t rest = hash << HLL_BITS;
+
+        // the position of the first set bit of the rest, from 1.
+
+        unsigned char rank = rest ? __builtin_clzll(rest) + 1 :
+                                    64 - HLL_BITS + 1;
+
+        if (rank > registers_[i])
+        {
+            registers_[i] = rank;
+        }
+    }
+
+    void merge(const HyperLogLog &other)
+    {
+        for (size_t i = 0; i < registers_.size(); ++i)
+        {
+            registers_[i] = std::max(registers_[i], other.registers_[i]);
+        }
+    }
+
+    uint64_t estimate() const
+    {
+        double m = registers_.size();
+        double sum = 0;
+        size_t zeros = 0;
+
+        for (size_t i = 0; i < registers_.size(); ++i)
+        {
+            sum += ldexp(1.0, -registers_[i]);
+            zeros += registers_[i] == 0;
+        }
+
+        double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+        // small cardinalities are better counted by the empty registers.
+
+        if (e <= 2.5 * m && zeros)
+        {
+            e = m * log(m / zeros);
+        }
+
+        return (uint64_t)(e + 0.5);
+    }
+
+  private:
+    std::vector<unsigned char> registers_;
+};
+
+// the approximate top keys of a stream, in capacity counters. counts are
+// never under the truth, and over it by at most error.
+template <typename Key, typename Hash>
+class SpaceSaving
+{
+  public:
+    struct Counter
+    {
+        Key key;
+        uint64_t count;
+        uint64_t error;
+    };
+
+    explicit SpaceSaving(size_t capacity)
+        :
+        capacity_(capacity),
+        heap_(),
+        index_()
+    {
+        heap_.reserve(capacity);
+    }
+
+    void add(const Key &key, uint64_t n = 1)
+    {
+        typename Index::iterator iter = index_.find(key);
+
+        if (iter != index_.end())
+        {
+            heap_[iter->second].count += n;
+            sift_down(iter->second);
+            return;
+        }
+
+        if (heap_.size() < capacity_)
+        {
+            Counter c = { key, n, 0 };
+
+            heap_.push_back(c);
+            index_[key] = heap_.size() - 1;
+            sift_up(heap_.size() - 1);
+            return;
+        }
+
+        // take over the smallest counter, at the root.
+
+        Counter &root = heap_[0];
+
+        index_.erase(root.key);
+
+        root.key = key;
+        root.error = root.count;
+        root.count += n;
+
+        index_[key] = 0;
+        sift_down(0);
+    }
+
+    void merge(const SpaceSaving &other)
+    {
+        // a key missing from a full summary may have had up to its
+        // smallest count there.
+
+        uint64_t floor_a = full() ? heap_[0].count : 0;
+        uint64_t floor_b = other.full() ? other.heap_[0].count : 0;
+
+        std::vector<Counter> all(heap_);
+
+        for (size_t i = 0; i < all.size(); ++i)
+        {
+            typename Index::const_iterator iter =
+                other.index_.find(all[i].key);
+
+            if (iter != other.index_.end())
+            {
+                all[i].count += other.heap_[iter->second].count;
+                all[i].error += other.heap_[iter->second].error;
+            }
+            else
+            {
+                all[i].count += floor_b;
+                all[i].error += floor_b;
+            }
+        }
+
+        for (size_t i = 0; i < other.heap_.size(); ++i)
+        {
+            if (index_.count(other.heap_[i].key))
+            {
+                continue;
+            }
+
+            Counter c = other.heap_[i];
+            c.count += floor_a;
+            c.error += floor_a;
+
+            all.push_back(c);
+        }
+
+        std::sort(all.begin(), all.end(), CounterMore());
+
+        if (all.size() > capacity_)
+        {
+            all.resize(capacity_);
+        }
+
+        clear();
+
+        for (size_t i = 0; i < all.size(); ++i)
+        {
+            heap_.push_back(all[i]);
+            index_[all[i].key] = heap_.size() - 1;
+            sift_up(heap_.size() - 1);
+        }
+    }
+
+    // the k largest counters, largest first.
+    void top(size_t k, std::vector<Counter> &out) const
+    {
+        out = heap_;
+
+        std::sort(out.begin(), out.end(), CounterMore());
+
+        if (out.size() > k)
+        {
+            out.resize(k);
+        }
+    }
+
+    void clear()
+    {
+        heap_.clear();
+        index_.clear();
+    }
+
+    bool full() const
+    {
+        return heap_.size() == capacity_;
+    }
+
+  private:
+    typedef hash_map<Key, size_t, Hash> Index;
+
+    struct CounterMore
+    {
+        bool operator()(const Counter &a, const Counter &b) const
+        {
+            if (a.count != b.count) return a.count > b.count;
+
+            return a.key < b.key;
+        }
+    };
+
+    void swap_counters(size_t i, size_t j)
+    {
+        std::swap(heap_[i], heap_[j]);
+
+        index_[heap_[i].key] = i;
+        index_[heap_[j].key] = j;
+    }
+
+    void sift_up(size_t i)
+    {
+        while (i && heap_[i].count < heap_[(i - 1) / 2].count)
+        {
+            swap_counters(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void sift_down(size_t i)
+    {
+        while (true)
+        {
+            size_t least = i;
+            size_t l = 2 * i + 1;
+            size_t r = l + 1;
+
+            if (l < heap_.size() && heap_[l].count < heap_[least].count)
+            {
+                least = l;
+            }
+
+            if (r < heap_.size() && heap_[r].count < heap_[least].count)
+            {
+                least = r;
+            }
+
+            if (least == i)
+            {
+                return;
+            }
+
+            swap_counters(i, least);
+            i = least;
+        }
+    }
+
+    size_t capacity_;
+    std::vector<Counter> heap_;
+    Index index_;
+};
+
+// the group keys a sketch counts by, shared by every worker.
+class SketchKeys
+{
+  public:
+    explicit SketchKeys(const GeoData &data)
+        :
+        asn(data, std::vector<unsigned>(1, COUNT_ASN)),
+        city(data, city_fields()),
+        country(data, std::vector<unsigned>(1, COUNT_COUNTRY))
+    {
+    }
+
+    CountKeys asn;
+    CountKeys city;
+    CountKeys country;
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(SketchKeys);
+
+    static std::vector<unsigned> city_fields()
+    {
+        std::vector<unsigned> fields;
+
+        fields.push_back(COUNT_COUNTRY);
+        fields.push_back(COUNT_REGION);
+        fields.push_back(COUNT_CITY);
+
+        return fields;
+    }
+};
+
+typedef SpaceSaving<IP6, IP6Hash> IPTop;
+
+// the summary of some lines. its size depends on the database and the
+// options, not on the lines.
+class Sketch
+{
+  public:
+    Sketch(const SketchKeys &keys, size_t top)
+        :
+        lines(0),
+        asns(keys.asn.size()),
+        cities(keys.city.size()),
+        ips(top * 32),
+        countries(keys.country.size())
+    {
+    }
+
+    void add(unsigned loc_idx,
+             unsigned asn_idx,
+             const IP6 &ip,
+             const SketchKeys &keys)
+    {
+        lines++;
+
+        asns[keys.asn.key(loc_idx, asn_idx)]++;
+        cities[keys.city.key(loc_idx, asn_idx)]++;
+
+        ips.add(ip);
+        countries[keys.country.key(loc_idx, asn_idx)].add(hash_ip6(ip));
+    }
+
+    void merge(const Sketch &other)
+    {
+        lines += other.lines;
+
+        for (size_t i = 0; i < asns.size(); ++i)
+        {
+            asns[i] += other.asns[i];
+        }
+
+        for (size_t i = 0; i < cities.size(); ++i)
+        {
+            cities[i] += other.cities[i];
+        }
+
+        ips.merge(other.ips);
+
+        for (size_t i = 0; i < countries.size(); ++i)
+        {
+            countries[i].merge(other.countries[i]);
+        }
+    }
+
+    uint64_t lines;
+
+    std::vector<uint64_t> asns;
+    std::vector<uint64_t> cities;
+    IPTop ips;
+    std::vector<HyperLogLog> countries;
+};
+
+// the k largest exact counts, as (count, key), largest first.
+inline void top_counts(const std::vector<uint64_t> &counts,
+                       size_t k,
+                       std::vector<std::pair<uint64_t, uint64_t> > &out)
+{
+    out.clear();
+
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        if (counts[i])
+        {
+            out.push_back(std::make_pair(counts[i], (uint64_t) i));
+        }
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t> >::iterator mid =
+        out.begin() + std::min(k, out.size());
+
+    std::partial_sort(out.begin(), mid, out.end(), CountOrder());
+    out.erase(mid, out.end());
+}
+
+// print a sketch as lines of
+//
+// asn count as_num as_text
+// city count country region city
+// ip count error ip
+// country distinct_ips country
+//
+// after a line giving the lines summarized so far.
+inline void print_sketch(const Sketch &sketch,
+                         const SketchKeys &keys,
+                         size_t top,
+                         FILE* out)
+{
+    std::string text;
+    char buf[64];
+
+    sprintf(buf, "# lines %llu\n", (unsigned long long) sketch.lines);
+    text = buf;
+
+    std::vector<std::pair<uint64_t, uint64_t> > counts;
+
+    top_counts(sketch.asns, top, counts);
+
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        sprintf(buf, "asn %llu ", (unsigned long long) counts[i].first);
+        text += buf;
+        keys.asn.print(counts[i].second, text);
+        text += '\n';
+    }
+
+    top_counts(sketch.cities, top, counts);
+
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        sprintf(buf, "city %llu ", (unsigned long long) counts[i].first);
+        text += buf;
+        keys.city.print(counts[i].second, text);
+        text += '\n';
+    }
+
+    std::vector<IPTop::Counter> ips;
+    sketch.ips.top(top, ips);
+
+    for (size_t i = 0; i < ips.size(); ++i)
+    {
+        sprintf(buf, "ip %llu %llu ", (unsigned long long) ips[i].count,
+                (unsigned long long) ips[i].error);
+        text += buf;
+
+        unsigned quad;
+
+        if (ip6_v4_mapped(ips[i].key, quad))
+        {
+            text.append(buf, ip_to_s(buf, quad));
+        }
+        else
+        {
+            text.append(buf, ip6_to_s(buf, ips[i].key));
+        }
+
+        text += '\n';
+    }
+
+    std::vector<uint64_t> distinct;
+
+    for (size_t i = 0; i < sketch.countries.size(); ++i)
+    {
+        distinct.push_back(sketch.countries[i].estimate());
+    }
+
+    top_counts(distinct, distinct.size(), counts);
+
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        sprintf(buf, "country %llu ", (unsigned long long) counts[i].first);
+        text += buf;
+        keys.country.print(counts[i].second, text);
+        text += '\n';
+    }
+
+    size_t n = fwrite(text.data(), text.size(), 1, out);
+    REL_ASSERT(n == 1);
+
+    fflush(out);
+}
+
+// the shared total, which workers merge their batches into.
+class SketchTotal
+{
+  public:
+    SketchTotal(const SketchKeys &keys,
+                const SketchOptions &options,
+                FILE* out)
+        :
+        keys_(keys),
+        options_(options),
+        out_(out),
+        total_(keys, options.top),
+        next_dump_(options.dump_every),
+        mutex_()
+    {
+    }
+
+    void merge(const Sketch &batch)
+    {
+        MutexLock lock(mutex_);
+
+        total_.merge(batch);
+
+        if (next_dump_ && total_.lines >= next_dump_)
+        {
+            print_sketch(total_, keys_, options_.top, out_);
+
+            while (next_dump_ <= total_.lines)
+            {
+                next_dump_ += options_.dump_every;
+            }
+        }
+    }
+
+    void finish()
+    {
+        print_sketch(total_, keys_, options_.top, out_);
+    }
+
+    const Sketch &total() const
+    {
+        return total_;
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(SketchTotal);
+
+    const SketchKeys &keys_;
+    const SketchOptions &options_;
+    FILE* out_;
+
+    Sketch total_;
+    uint64_t next_dump_;
+    Mutex mutex_;
+};
+
+// a worker's stage, after the parser. it summarizes a batch of lines, then
+// merges it into the total.
+class SketchStage : public Connector
+{
+  public:
+    SketchStage(const GeoData &data,
+                const SketchKeys &keys,
+                const SketchOptions &options,
+                const WhereFilter* filter,
+                SketchTotal &total)
+        :
+        data_(data),
+        keys_(keys),
+        filter_(filter),
+        total_(total),
+        batch_(keys, options.top),
+        batch_lines_(std::min<uint64_t>(SKETCH_BATCH,
+                     options.dump_every ? options.dump_every : SKETCH_BATCH))
+    {
+    }
+
+    virtual ~SketchStage()
+    {
+    }
+
+    void consume(const Buffer &b)
+    {
+        const IPAddress* address = (const IPAddress*)(b.data());
+
+        unsigned loc_idx;
+        unsigned asn_idx;
+
+        data_.lookup(*address, loc_idx, asn_idx);
+
+        if (filter_ && !filter_->pass(loc_idx, asn_idx))
+        {
+            return;
+        }
+
+        IP6 ip = address->ip6;
+
+        if (address->family == IP_V4)
+        {
+            ip.hi = 0;
+            ip.lo = 0xFFFF00000000ULL | address->quad;
+        }
+
+        batch_.add(loc_idx, asn_idx, ip, keys_);
+
+        if (batch_.lines == batch_lines_)
+        {
+            flush_batch();
+        }
+    }
+
+    void flush_batch()
+    {
+        if (!batch_.lines)
+        {
+            return;
+        }
+
+        total_.merge(batch_);
+
+        batch_.lines = 0;
+        std::fill(batch_.asns.begin(), batch_.asns.end(), 0);
+        std::fill(batch_.cities.begin(), batch_.cities.end(), 0);
+        batch_.ips.clear();
+        std::fill(batch_.countries.begin(), batch_.countries.end(),
+                  HyperLogLog());
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(SketchStage);
+
+    const GeoData &data_;
+    const SketchKeys &keys_;
+    const WhereFilter* filter_;
+    SketchTotal &total_;
+
+    Sketch batch_;
+    uint64_t batch_lines_;
+};
+
+class SketchFactory
+{
+  public:
+    typedef SketchStage Sink;
+
+    SketchFactory(const GeoData &data,
+                  const SketchKeys &keys,
+                  const SketchOptions &options,
+                  const WhereFilter* filter,
+                  SketchTotal &total)
+        :
+        data_(data),
+        keys_(keys),
+        options_(options),
+        filter_(filter),
+        total_(total)
+    {
+    }
+
+    SketchStage* make()
+    {
+        return new SketchStage(data_, keys_, options_, filter_, total_);
+    }
+
+    void done(SketchStage* stage)
+    {
+        stage->flush_batch();
+        delete stage;
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(SketchFactory);
+
+    const GeoData &data_;
+    const SketchKeys &keys_;
+    const SketchOptions &options_;
+    const WhereFilter* filter_;
+    SketchTotal &total_;
+};
+
+inline void sketch(const GeoData &data,
+                   const std::vector<std::string> &sources,
+                   const SketchOptions &options,
+                   FILE* out,
+                   const WhereFilter* filter = 0)
+{
+    SketchKeys keys(data);
+    SketchTotal total(keys, options, out);
+    SketchFactory factory(data, keys, options, filter, total);
+
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        LOG_CONTEXT("sketch data with source %s", sources[i].c_str());
+
+        scan_source(factory, sources[i], options.threads);
+    }
+
+    total.finish();
+}
+
+inline void sketch(const char* data_file_name,
+                   const std::vector<std::string> &sources,
+                   const QueryOptions &query_options,
+                   const SketchOptions &options)
+{
+    LOG_CONTEXT("sketch data %s with %zu sources", data_file_name,
+                sources.size());
+
+    GeoData data;
+    open_data(data, data_file_name, query_options);
+
+    WhereFilter where;
+    const WhereFilter* filter = open_filter(data, query_options, where);
+
+    sketch(data, sources, options, stdout, filter);
+}
+
+#endif
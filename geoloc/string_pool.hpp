@@ -0,0 +1,184 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module builds the shared string pool (the str.pool section).
+ *
+ * The country, region, city and asn text tables are merged into one pool of
+ * NUL terminated strings, and each table is saved as a vector of byte offsets
+ * into it (SREF). Strings repeated across tables are stored once, and a
+ * string that is the tail of another ("Inc." in "Google Inc.") points into
+ * it, rather than being stored again.
+ *
+ * Tail merging was chosen over front coding, since it keeps every entry a
+ * plain C string in the mapped file. Decoding a string is one add.
+*/
+
+#ifndef STRING_POOL_HPP_4C1A9E37
+#define STRING_POOL_HPP_4C1A9E37
+
+#include "string_table.hpp"
+#include "serialization.hpp"
+
+#include <algorithm>
+
+class StringPool
+{
+  public:
+    StringPool() {}
+
+    ~StringPool()
+    {
+        for (size_t i = 0; i < refs_.size(); ++i)
+        {
+            delete refs_[i];
+        }
+    }
+
+    // add every string of a table. the table must outlive the pool.
+    void add(const StringTable &table)
+    {
+        tables_.push_back(&table);
+        refs_.push_back(new std::vector<unsigned>(table.size()));
+
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            (*refs_.back())[i] = unique_.intern(table[i], table.length(i));
+        }
+    }
+
+    // lay out the pool, then point each table's refs at its strings.
+    void build()
+    {
+        std::vector<unsigned> order(unique_.size());
+
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            order[i] = i;
+        }
+
+        // sorted by reversed string, a string that is the tail of others
+        // comes just before the first of them.
+
+        std::sort(order.begin(), order.end(), ReverseLess(unique_));
+
+        std::vector<unsigned> offsets(unique_.size());
+        chars_.clear();
+
+        for (size_t k = order.size(); k-- > 0;)
+        {
+            unsigned id = order[k];
+            size_t n = unique_.length(id);
+
+            if (k + 1 < order.size() && is_tail(id, order[k + 1]))
+            {
+                unsigned next = order[k + 1];
+                offsets[id] = offsets[next] + unique_.length(next) - n;
+
+                continue;
+            }
+
+            offsets[id] = chars_.size();
+            chars_.insert(chars_.end(), unique_[id], unique_[id] + n + 1);
+        }
+
+        for (size_t t = 0; t < refs_.size(); ++t)
+        {
+            std::vector<unsigned> &refs = *refs_[t];
+
+            for (size_t i = 0; i < refs.size(); ++i)
+            {
+                refs[i] = offsets[refs[i]];
+            }
+        }
+    }
+
+    const std::vector<char> &chars() const { return chars_; }
+
+    // the offsets of a table that was added, after build.
+    const std::vector<unsigned> &refs(const StringTable &table) const
+    {
+        size_t i = 0;
+
+        while (i < tables_.size() && tables_[i] != &table)
+        {
+            ++i;
+        }
+
+        REL_ASSERT(i < tables_.size());
+        return *refs_[i];
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(StringPool);
+
+    struct ReverseLess
+    {
+        explicit ReverseLess(const StringTable &table) : table_(&table) {}
+
+        bool operator()(unsigned a, unsigned b) const
+        {
+            const char* x = (*table_)[a];
+            const char* y = (*table_)[b];
+
+            size_t i = table_->length(a);
+            size_t j = table_->length(b);
+
+            while (i && j)
+            {
+                --i;
+                --j;
+
+                if (x[i] != y[j])
+                {
+                    return (unsigned char) x[i] < (unsigned char) y[j];
+                }
+            }
+
+            return i < j;
+        }
+
+        const StringTable* table_;
+    };
+
+    // is string a the tail of string b.
+    bool is_tail(unsigned a, unsigned b) const
+    {
+        size_t n = unique_.length(a);
+        size_t m = unique_.length(b);
+
+        return n <= m && memcmp(unique_[a], unique_[b] + m - n, n) == 0;
+    }
+
+    std::vector<const StringTable*> tables_;
+    std::vector<std::vector<unsigned>*> refs_;
+
+    StringTable unique_;
+    std::vector<char> chars_;
+};
+
+// save a table as refs into the pool, or inline if there is no pool.
+inline void save_strings(BinaryFile &bf,
+                         const StringTable &st,
+                         const StringPool* pool)
+{
+    if (!pool)
+    {
+        save_string_table(bf, st);
+        return;
+    }
+
+    bf.save_type("SREF");
+    bf.save_pod_vector(pool->refs(st));
+}
+
+inline void save_string_pool(BinaryFile &bf, const StringPool &pool)
+{
+    bf.begin_section("str.pool");
+    bf.save_pod_vector(pool.chars());
+}
+
+#endif
@@ -5,21 +5,51 @@
  * author: Jason McSweeney
  * created: 2015-03-11
  *
- * This class is used for interning strings. It uses a hash map to track the 
- * string to id mapping. The layout of indices and the char vector makes it 
- * easier to serialize later.
+ * This class is used for interning strings. The strings live back to back in
+ * one char arena, and a flat open addressing table of (hash, id) slots maps
+ * them to ids, so there is no allocation per string. The layout of indices
+ * and the char vector makes it easier to serialize later.
+ *
+ * ShardedStringTable splits the strings over several locked tables by hash, so
+ * that concurrent workers can intern into it.
 */
 
 #ifndef STRING_TABLE_HPP_A3ADA5DC
 #define STRING_TABLE_HPP_A3ADA5DC
 
 #include "macros.hpp"
-#include "hash_map.hpp"
+#include "thread.hpp"
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// fnv-1a.
+inline unsigned string_hash(const char* s, size_t n)
+{
+    unsigned h = 2166136261U;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        h ^= (unsigned char) s[i];
+        h *= 16777619U;
+    }
+
+    return h;
+}
 
 class StringTable
 {
   public:
-    StringTable() {}
+    StringTable()
+        :
+        slots_(),
+        indices_(),
+        strings_()
+    {
+    }
+
     ~StringTable() {}
 
     size_t size() const
@@ -32,33 +62,63 @@ class StringTable
         return strings_.size();
     }
 
-    void insert(const std::string &s)
+    // returns the id of s, adding it if it is new. ids are dense, in the
+    // order strings were first seen.
+    unsigned intern(const char* s, size_t n)
+    {
+        return intern(s, n, string_hash(s, n));
+    }
+
+    unsigned intern(const std::string &s)
     {
-        if (string_to_id_.count(s))
+        return intern(s.data(), s.size());
+    }
+
+    // as above, with the hash already computed.
+    unsigned intern(const char* s, size_t n, unsigned hash)
+    {
+        if ((indices_.size() + 1) * 2 > slots_.size())
+        {
+            grow();
+        }
+
+        Slot &slot = slots_[find_slot(s, n, hash)];
+
+        if (slot.id)
         {
-            return;
+            return slot.id - 1;
         }
 
         unsigned index = indices_.size();
-        string_to_id_[s] = index;
+
+        slot.hash = hash;
+        slot.id = index + 1;
 
         indices_.push_back(strings_.size());
 
-        strings_.insert(strings_.end(), s.begin(), s.end());
+        strings_.insert(strings_.end(), s, s + n);
         strings_.push_back('\0');
+
+        return index;
     }
 
-    unsigned index_of(const std::string &s) const
+    void insert(const std::string &s)
     {
-        hash_map<std::string, unsigned>::const_iterator iter = 
-            string_to_id_.find(s);
+        intern(s);
+    }
 
-        if (iter == string_to_id_.end())
+    unsigned index_of(const std::string &s) const
+    {
+        if (slots_.empty())
         {
             return 0xFFFFFFFF;
         }
 
-        return iter->second;
+        const Slot &slot =
+            slots_[find_slot(s.data(), s.size(),
+                             string_hash(s.data(), s.size()))];
+
+        return slot.id ? slot.id - 1 : 0xFFFFFFFF;
     }
 
     const char* operator[](size_t i) const
@@ -66,6 +126,21 @@ class StringTable
         return &strings_[indices_[i]];
     }
 
+    size_t length(size_t i) const
+    {
+        size_t end = i + 1 < indices_.size() ? indices_[i + 1] :
+                                               strings_.size();
+
+        return end - indices_[i] - 1;
+    }
+
+    void swap(StringTable &other)
+    {
+        slots_.swap(other.slots_);
+        indices_.swap(other.indices_);
+        strings_.swap(other.strings_);
+    }
+
     const std::vector<unsigned> &indices() const { return indices_; }
     const std::vector<char> &strings() const { return strings_; }
 
@@ -76,16 +151,143 @@ class StringTable
 
     DISALLOW_COPY_AND_ASSIGN(StringTable);
 
-    hash_map<std::string, unsigned> string_to_id_;
+    // id is one more than the string id, zero marks an empty slot.
+    struct Slot
+    {
+        unsigned hash;
+        unsigned id;
+    };
+
+    // linear probe for s, stopping at its slot or the first empty one.
+    size_t find_slot(const char* s, size_t n, unsigned hash) const
+    {
+        size_t mask = slots_.size() - 1;
+        size_t i = hash & mask;
+
+        while (true)
+        {
+            const Slot &slot = slots_[i];
+
+            if (!slot.id)
+            {
+                return i;
+            }
+
+            if (slot.hash == hash && length(slot.id - 1) == n &&
+                memcmp(&strings_[indices_[slot.id - 1]], s, n) == 0)
+            {
+                return i;
+            }
+
+            i = (i + 1) & mask;
+        }
+    }
+
+    // double the table, keeping it at most half full.
+    void grow()
+    {
+        std::vector<Slot> old;
+        old.swap(slots_);
+
+        Slot empty = {0, 0};
+        slots_.resize(std::max(old.size() * 2, (size_t) 16), empty);
+
+        size_t mask = slots_.size() - 1;
+
+        for (size_t j = 0; j < old.size(); ++j)
+        {
+            if (!old[j].id)
+            {
+                continue;
+            }
+
+            size_t i = old[j].hash & mask;
+
+            while (slots_[i].id)
+            {
+                i = (i + 1) & mask;
+            }
+
+            slots_[i] = old[j];
+        }
+    }
+
+    std::vector<Slot> slots_;
 
     std::vector<unsigned> indices_;
     std::vector<char> strings_;
 };
 
+#define STRING_SHARD_BITS 4
+#define STRING_SHARDS (1U << STRING_SHARD_BITS)
+
+// a StringTable that can be interned into from several threads. each shard
+// has its own lock, and is chosen by the top bits of the hash. ids are
+// (shard local id << STRING_SHARD_BITS | shard), so they are not dense, and
+// depend on the order the threads got there. callers that save strings
+// re-intern them into a StringTable in an order of their own.
+class ShardedStringTable
+{
+  public:
+    ShardedStringTable() {}
+
+    unsigned intern(const char* s, size_t n)
+    {
+        unsigned hash = string_hash(s, n);
+        unsigned shard = hash >> (32 - STRING_SHARD_BITS);
+
+        Shard &sh = shards_[shard];
+        MutexLock lock(sh.mutex);
+
+        return (sh.table.intern(s, n, hash) << STRING_SHARD_BITS) | shard;
+    }
+
+    // the string with a sharded id. not safe against concurrent interns,
+    // which may move it.
+    const char* operator[](unsigned id) const
+    {
+        return shard(id)[id >> STRING_SHARD_BITS];
+    }
+
+    size_t length(unsigned id) const
+    {
+        return shard(id).length(id >> STRING_SHARD_BITS);
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(ShardedStringTable);
+
+    const StringTable &shard(unsigned id) const
+    {
+        return shards_[id & (STRING_SHARDS - 1)].table;
+    }
+
+    struct Shard
+    {
+        Mutex mutex;
+        StringTable table;
+    };
+
+    Shard shards_[STRING_SHARDS];
+};
+
 inline void save_string_table(BinaryFile &bf, const StringTable &st)
 {
     bf.save_pod_vector(st.indices());
     bf.save_pod_vector(st.strings());
 }
 
+// intern the strings of a mapped table into an empty table, in order, so
+// that they keep their ids.
+inline void load_string_table(const MappedStringVector &in, StringTable &st)
+{
+    REL_ASSERT(st.size() == 0);
+
+    for (size_t i = 0; i < in.size(); ++i)
+    {
+        unsigned id = st.intern(in[i], strlen(in[i]));
+        REL_ASSERT(id == i);
+    }
+}
+
 #endif
@@ -10,9 +10,23 @@
 
 #include "serialization.hpp"
 #include "string_table.hpp"
+#include "etl.hpp"
+#include "query.hpp"
+#include "bench.hpp"
+#include "delta.hpp"
+#include "mmdb.hpp"
+#include "history.hpp"
+#include "diff.hpp"
+#include "count.hpp"
+#include "sketch.hpp"
+#include "where.hpp"
+#include "ranges.hpp"
+#include "shm_ring.hpp"
 
 #include <string.h>
 #include <stdarg.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 struct Poddable
 {
@@ -28,6 +42,31 @@ struct Poddable
 
 static int test_poddable_roundtrip();
 static int test_string_table_roundtrip();
+static int test_geo_data_sections();
+static int test_compressed_blocks();
+static int test_compact_geo_data();
+static int test_split_lines();
+static int test_csv_scanner();
+static int test_string_interning();
+static int test_string_pool();
+static int test_coalesce_blocks();
+static int test_slim_geo_data();
+static int test_profile_reorder();
+static int test_apply_delta();
+static int test_block_sort();
+static int test_overlay();
+static int test_import_mmdb();
+static int test_ip6();
+static int test_import_mmdb6();
+static int test_history();
+static int test_diff();
+static int test_count();
+static int test_sketch();
+static int test_where();
+static int test_ranges();
+static int test_range_query();
+static int test_shm_ring();
+static int test_map_options();
 
 int main(int argc, char** argv)
 {
@@ -35,6 +74,192 @@ int main(int argc, char** argv)
 
     test_poddable_roundtrip();
     test_string_table_roundtrip();
+
+    test_compressed_blocks();
+    test_ip6();
+
+    // etl tests
+
+    test_split_lines();
+    test_csv_scanner();
+    test_string_interning();
+    test_block_sort();
+
+    // query tests
+
+    test_geo_data_sections();
+    test_compact_geo_data();
+    test_string_pool();
+    test_coalesce_blocks();
+    test_slim_geo_data();
+    test_profile_reorder();
+    test_apply_delta();
+    test_overlay();
+    test_import_mmdb();
+    test_import_mmdb6();
+    test_history();
+    test_diff();
+    test_count();
+    test_sketch();
+    test_where();
+    test_ranges();
+    test_range_query();
+    test_shm_ring();
+    test_map_options();
+}
+
+static void write_file(const char* fn, const char* contents)
+{
+    FILE* f = fopen(fn, "w");
+    assert(f);
+
+    fputs(contents, f);
+    fclose(f);
+}
+
+// as write_file, for contents that may hold nuls.
+static void write_file(const char* fn, const std::string &contents)
+{
+    FILE* f = fopen(fn, "wb");
+    assert(f);
+
+    assert(fwrite(contents.data(), 1, contents.size(), f) ==
+           contents.size());
+    fclose(f);
+}
+
+static std::string read_file(const char* fn)
+{
+    MemoryMap map;
+    assert(map.open(fn));
+
+    return std::string(map.begin(), map.size());
+}
+
+// true if fn stops with a fatal error, which exits, so it runs in a child.
+static bool fails(void (*fn)())
+{
+    fflush(0);
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+
+    if (pid == 0)
+    {
+        freopen("/dev/null", "w", stderr);
+        fn();
+        _exit(0);
+    }
+
+    int status = 0;
+    assert(waitpid(pid, &status, 0) == pid);
+
+    return WIFEXITED(status) && WEXITSTATUS(status) != 0;
+}
+
+// a tiny csv dataset, in the MaxMind legacy layout.
+static void write_test_csvs()
+{
+    write_file("tmp/blocks.csv",
+               "Copyright (c) 2011 MaxMind Inc.  All Rights Reserved.\n"
+               "startIpNum,endIpNum,locId\n"
+               "\"16777216\",\"16777471\",\"2\"\n"
+               "\"16777472\",\"16777727\",\"2\"\n"
+               "\"134744064\",\"134744319\",\"1\"\n");
+
+    write_file("tmp/location.csv",
+               "Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n"
+               "locId,country,region,city,postalCode,latitude,longitude,"
+               "metroCode,areaCode\n"
+               "1,\"US\",\"CA\",\"Mountain View\",\"\",37.3860,"
+               "-122.0838,,\n"
+               "2,\"AU\",\"07\",\"Melbourne\",\"\",-37.8266,144.7834,,\n");
+
+    write_file("tmp/asnum.csv",
+               "16777216,16777471,\"AS15169 Google Inc.\"\n"
+               "134744064,134744319,\"AS36459 GitHub, Inc.\"\n");
+}
+
+static void build_test_data(const char* fn,
+                            const ImportOptions &options = ImportOptions())
+{
+    write_test_csvs();
+    etl("tmp/blocks.csv", "tmp/location.csv", "tmp/asnum.csv", fn, options);
+}
+
+static int test_geo_data_sections()
+{
+    build_test_data("tmp/geo.bin");
+
+    {
+        SectionDirectory dir;
+        assert(dir.open("tmp/geo.bin"));
+
+        assert(dir.entries().size() == 4);
+        assert(dir.find("loc.blocks"));
+        assert(dir.find("asn.data"));
+        assert(!dir.find("no.such.section"));
+    }
+
+    {
+        // a corrupt count is refused before it is allocated.
+
+        std::string file = read_file("tmp/geo.bin");
+
+        unsigned count = 0xFFFFFFFF;
+        memcpy(&file[36], &count, sizeof(count));
+
+        write_file("tmp/geo_corrupt.bin", file);
+
+        SectionDirectory dir;
+        assert(!dir.open("tmp/geo_corrupt.bin"));
+
+        // as is a directory past the end of the file.
+
+        count = 4;
+        uint64_t offset = file.size();
+
+        memcpy(&file[36], &count, sizeof(count));
+        memcpy(&file[40], &offset, sizeof(offset));
+
+        write_file("tmp/geo_corrupt.bin", file);
+
+        assert(!dir.open("tmp/geo_corrupt.bin"));
+    }
+
+    {
+        GeoData data;
+        data.open("tmp/geo.bin");
+
+        assert(data.loaded() == GEO_ALL);
+        assert(data.verify());
+
+        IPResult result;
+        data.query(134744072, result);
+
+        assert(strcmp(result.country, "US") == 0);
+        assert(strcmp(result.city, "Mountain View") == 0);
+        assert(*result.asn == 36459);
+        assert(strcmp(result.asn_text, "GitHub, Inc.") == 0);
+    }
+
+    {
+        // an asn only open must not need the location sections.
+
+        GeoData data;
+        data.open("tmp/geo.bin", GEO_ASNS);
+
+        assert(data.loaded() == GEO_ASNS);
+
+        IPResult result;
+        data.query(16777300, result);
+
+        assert(result.country == 0);
+        assert(*result.asn == 15169);
+        assert(strcmp(result.asn_text, "Google Inc.") == 0);
+    }
+
+    return 0;
 }
 
 static int test_poddable_roundtrip()
@@ -134,3 +359,2563 @@ static int test_string_table_roundtrip()
 
     return 0;
 }
+
+static int test_compressed_blocks()
+{
+    // not a multiple of PACK_GROUP, so the last group is padded.
+
+    std::vector<Block> blocks;
+    unsigned ip = 1;
+
+    srand(1234);
+
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        Block b;
+
+        b.start_ip = ip;
+        b.end_ip = ip + (rand() % 5000);
+        b.loc = i % 7 ? rand() % 300 : 1000000 + rand();
+
+        blocks.push_back(b);
+
+        ip = b.end_ip + 1 + (rand() % 3 ? 0 : rand() % 100000);
+    }
+
+    {
+        BinaryFile raw;
+        raw.open("tmp/raw_blocks.bin");
+        save_blocks(raw, blocks, false);
+
+        BinaryFile packed;
+        packed.open("tmp/zblk_blocks.bin");
+        save_blocks(packed, blocks, true);
+    }
+
+    MemoryFile raw_file;
+    raw_file.open("tmp/raw_blocks.bin");
+
+    MemoryFile packed_file;
+    packed_file.open("tmp/zblk_blocks.bin");
+
+    BlockTable raw;
+    raw.load(raw_file);
+
+    BlockTable packed;
+    packed.load(packed_file);
+
+    assert(!raw.compressed());
+    assert(packed.compressed());
+    assert(packed.size() == blocks.size());
+
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        const Block &b = blocks[i];
+
+        unsigned mid = b.start_ip + (b.end_ip - b.start_ip) / 2;
+        unsigned probes[] = {b.start_ip - 1, b.start_ip, mid, b.end_ip,
+                             b.end_ip + 1};
+
+        for (size_t j = 0; j < sizeof(probes) / sizeof(probes[0]); ++j)
+        {
+            unsigned r = raw.find(probes[j]);
+            unsigned p = packed.find(probes[j]);
+
+            assert(r == p);
+
+            if (r != -1U)
+            {
+                assert(raw.payload(r) == packed.payload(p));
+            }
+        }
+
+        assert(packed.find(b.start_ip) == i);
+        assert(packed.payload(i) == b.loc);
+    }
+
+    assert(packed.find(0) == -1U);
+    assert(packed.find(0xFFFFFFFF) == -1U);
+
+    BlockIterator iter(packed);
+    Block b;
+
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        assert(iter.next(b));
+
+        assert(b.start_ip == blocks[i].start_ip);
+        assert(b.end_ip == blocks[i].end_ip);
+        assert(b.loc == blocks[i].loc);
+    }
+
+    assert(!iter.next(b));
+
+    return 0;
+}
+
+static int test_compact_geo_data()
+{
+    ImportOptions options;
+    options.compress_blocks = true;
+    options.compact_locations = true;
+
+    build_test_data("tmp/geo_compact.bin", options);
+
+    GeoData data;
+    data.open("tmp/geo_compact.bin");
+
+    IPResult result;
+    data.query(16777600, result);
+
+    assert(strcmp(result.country, "AU") == 0);
+    assert(strcmp(result.region, "07") == 0);
+    assert(strcmp(result.city, "Melbourne") == 0);
+    assert(fabs(result.lat - -37.8266) < 0.00005);
+    assert(fabs(result.lon - 144.7834) < 0.00005);
+
+    IPResult missing;
+    data.query(16777728, missing);
+
+    assert(missing.country == 0);
+
+    return 0;
+}
+
+class LineCollector : public Connector
+{
+  public:
+    explicit LineCollector(std::vector<std::string> &out)
+        :
+        out_(out)
+    {
+    }
+
+    void consume(const Buffer &b)
+    {
+        out_.push_back(std::string((const char*) b.data(), b.size()));
+    }
+
+  private:
+    std::vector<std::string> &out_;
+};
+
+static int test_split_lines()
+{
+    std::string text;
+
+    for (size_t i = 0; i < 100; ++i)
+    {
+        char buf[64];
+        sprintf(buf, "line %d %s\n", (int) i, std::string(i % 13, 'x').c_str());
+        text += buf;
+    }
+
+    // no trailing newline on the last line.
+    text += "last";
+
+    const char* begin = text.c_str();
+    const char* end = begin + text.size();
+
+    for (size_t n = 1; n < 9; ++n)
+    {
+        std::vector<const char*> bounds = split_lines(begin, end, n);
+        std::vector<std::string> lines;
+
+        assert(bounds.size() == n + 1);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            MemoryReader reader(bounds[i], bounds[i+1]);
+            LineCollector collector(lines);
+
+            reader | collector;
+            reader.produce();
+        }
+
+        assert(lines.size() == 101);
+        assert(lines[7] == "line 7 xxxxxxx");
+        assert(lines[100] == "last");
+    }
+
+    // chunks are no smaller than the minimum, however many threads.
+
+    assert(chunk_count(0, 100, 8) == 1);
+    assert(chunk_count(99, 100, 8) == 1);
+    assert(chunk_count(250, 100, 8) == 2);
+    assert(chunk_count(250, 100, 1) == 1);
+    assert(chunk_count(100000, 100, 100000) == 1000);
+
+    return 0;
+}
+
+class RecordCollector : public Connector
+{
+  public:
+    explicit RecordCollector(std::vector<std::vector<std::string> > &out)
+        :
+        out_(out)
+    {
+    }
+
+    void consume(const Buffer &b)
+    {
+        const CsvRecord* record = (const CsvRecord*) b.data();
+
+        out_.push_back(std::vector<std::string>());
+
+        for (size_t i = 0; i < record->count; ++i)
+        {
+            out_.back().push_back(to_s(record->fields[i]));
+        }
+    }
+
+  private:
+    std::vector<std::vector<std::string> > &out_;
+};
+
+static std::vector<std::vector<std::string> > scan_csv(const std::string &s)
+{
+    std::vector<std::vector<std::string> > out;
+
+    CsvScanner scanner(s.data(), s.data() + s.size());
+    RecordCollector collector(out);
+
+    scanner | collector;
+    scanner.produce();
+
+    return out;
+}
+
+static void check_record(const std::vector<std::string> &record,
+                         size_t n, ...)
+{
+    assert(record.size() == n);
+
+    va_list ap;
+    va_start(ap, n);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        const char* expected = va_arg(ap, const char*);
+        assert(record[i] == expected);
+    }
+
+    va_end(ap);
+}
+
+static int test_csv_scanner()
+{
+    {
+        std::vector<std::vector<std::string> > r = 
+            scan_csv("1,2,3\n\"a\",\"b\",\"c\"\n");
+
+        assert(r.size() == 2);
+        check_record(r[0], 3, "1", "2", "3");
+        check_record(r[1], 3, "a", "b", "c");
+    }
+
+    {
+        // quoted fields containing commas
+
+        std::vector<std::vector<std::string> > r = 
+            scan_csv("1,2,\"AS36459 GitHub, Inc.\"\n"
+                     "\"Washington, D.C.\",\",\",\",,,\"\n");
+
+        assert(r.size() == 2);
+        check_record(r[0], 3, "1", "2", "AS36459 GitHub, Inc.");
+        check_record(r[1], 3, "Washington, D.C.", ",", ",,,");
+    }
+
+    {
+        // empty fields, crlf, and no trailing newline
+
+        std::vector<std::vector<std::string> > r = 
+            scan_csv("a,,\"\"\r\n,x\r\nlast,\"q\"");
+
+        assert(r.size() == 3);
+        check_record(r[0], 3, "a", "", "");
+        check_record(r[1], 2, "", "x");
+        check_record(r[2], 2, "last", "q");
+    }
+
+    {
+        // quotes that cross 64 byte blocks
+
+        std::string a(70, 'a');
+        std::string b(130, 'b');
+
+        std::string text = "\"" + a + ",\"," + b + "\n\"," + b + "\"\n";
+        std::vector<std::vector<std::string> > r = scan_csv(text);
+
+        assert(r.size() == 2);
+        check_record(r[0], 2, (a + ",").c_str(), b.c_str());
+        check_record(r[1], 1, ("," + b).c_str());
+    }
+
+    {
+        assert(scan_csv("").empty());
+        assert(scan_csv("\n").size() == 1);
+    }
+
+    // agrees with csv_split on random MaxMind style lines.
+
+    srand(99);
+
+    const char* words[] = {"AS15169", "Google Inc.", "GitHub, Inc.", "",
+                           "12345", "-37.8266", "Big, Flare, Inc", "x"};
+
+    for (size_t iter = 0; iter < 200; ++iter)
+    {
+        std::string text;
+        std::vector<std::string> lines;
+
+        for (size_t i = 0; i < (size_t) (rand() % 20); ++i)
+        {
+            std::string line;
+            size_t fields = 1 + rand() % 9;
+
+            for (size_t f = 0; f < fields; ++f)
+            {
+                std::string w = words[rand() % 8];
+                bool quote = rand() % 2 || w.find(',') != std::string::npos;
+
+                line += f ? "," : "";
+                line += quote ? "\"" + w + "\"" : w;
+            }
+
+            // csv_split has no fields for an empty line.
+            line = line.empty() ? "\"\"" : line;
+
+            lines.push_back(line);
+            text += line + "\n";
+        }
+
+        std::vector<std::vector<std::string> > r = scan_csv(text);
+        assert(r.size() == lines.size());
+
+        for (size_t i = 0; i < lines.size(); ++i)
+        {
+            std::string scratch;
+            std::vector<char*> toks;
+
+            csv_split(lines[i].c_str(), lines[i].size(), scratch, toks);
+
+            assert(r[i].size() == toks.size());
+
+            for (size_t t = 0; t < toks.size(); ++t)
+            {
+                assert(r[i][t] == toks[t]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+class InternTask : public Thread
+{
+  public:
+    InternTask(ShardedStringTable &table, unsigned seed)
+        :
+        ids(),
+        table_(table),
+        seed_(seed)
+    {
+    }
+
+    std::vector<unsigned> ids;
+
+  protected:
+    void run()
+    {
+        for (unsigned i = 0; i < 5000; ++i)
+        {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "city %u", (i * 7 + seed_) % 3000);
+
+            ids.push_back(table_.intern(buf, strlen(buf)));
+        }
+    }
+
+  private:
+    ShardedStringTable &table_;
+    unsigned seed_;
+};
+
+static int test_string_interning()
+{
+    {
+        StringTable st;
+
+        assert(st.index_of("x") == 0xFFFFFFFF);
+
+        assert(st.intern("", 0) == 0);
+        assert(st.intern("ab", 2) == 1);
+        assert(st.intern("abc", 2) == 1);
+        assert(st.intern("abc", 3) == 2);
+        assert(st.index_of("") == 0);
+        assert(st.length(2) == 3);
+
+        for (unsigned i = 0; i < 10000; ++i)
+        {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%u", i % 5000);
+
+            unsigned id = st.intern(buf, strlen(buf));
+
+            assert(strcmp(st[id], buf) == 0);
+            assert(id == (i % 5000) + 3);
+        }
+
+        assert(st.size() == 5003);
+    }
+
+    {
+        ShardedStringTable sharded;
+
+        std::vector<InternTask*> tasks;
+
+        for (unsigned t = 0; t < 4; ++t)
+        {
+            tasks.push_back(new InternTask(sharded, t));
+            tasks.back()->start();
+        }
+
+        for (size_t t = 0; t < tasks.size(); ++t)
+        {
+            tasks[t]->join();
+        }
+
+        // each string has one id, whichever thread got there first.
+
+        std::map<std::string, unsigned> ids;
+
+        for (size_t t = 0; t < tasks.size(); ++t)
+        {
+            for (unsigned i = 0; i < tasks[t]->ids.size(); ++i)
+            {
+                char buf[32];
+                snprintf(buf, sizeof(buf), "city %u",
+                         (unsigned) (i * 7 + t) % 3000);
+
+                unsigned id = tasks[t]->ids[i];
+
+                assert(strcmp(sharded[id], buf) == 0);
+                assert(sharded.length(id) == strlen(buf));
+
+                assert(ids.insert(std::make_pair(buf, id)).first->second ==
+                       id);
+            }
+
+            delete tasks[t];
+        }
+
+        assert(ids.size() == 3000);
+    }
+
+    {
+        // the asn csv is read in chunks over threads, to the same tables.
+        // asn 5 comes back later with other text, which it does not take.
+
+        std::string csv;
+
+        for (unsigned i = 0; i < 80000; ++i)
+        {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%u,%u,\"AS%u Org %u\"\n",
+                     i * 16, i * 16 + 15, i % 7000, (i % 7000) * 3);
+            csv += buf;
+        }
+
+        csv += "2000000,2000015,\"AS5 Renamed\"\n";
+
+        write_file("tmp/asnum_big.csv", csv.c_str());
+
+        ASNBuilder one;
+        read_asns("tmp/asnum_big.csv", one, 1);
+
+        ASNBuilder four;
+        read_asns("tmp/asnum_big.csv", four, 4);
+
+        assert(one.blocks().size() == 80001);
+        assert(one.asns().size() == 7000);
+        assert(one.text().size() == 7000);
+
+        assert(one.blocks().size() == four.blocks().size());
+        assert(one.asns().size() == four.asns().size());
+        assert(one.text().size() == four.text().size());
+
+        for (size_t i = 0; i < one.blocks().size(); ++i)
+        {
+            assert(one.blocks()[i].start_ip == four.blocks()[i].start_ip);
+            assert(one.blocks()[i].loc == four.blocks()[i].loc);
+        }
+
+        for (size_t i = 0; i < one.asns().size(); ++i)
+        {
+            assert(one.asns()[i].number == four.asns()[i].number);
+            assert(one.asns()[i].text == four.asns()[i].text);
+        }
+
+        for (size_t i = 0; i < one.text().size(); ++i)
+        {
+            assert(strcmp(one.text()[i], four.text()[i]) == 0);
+        }
+
+        const PackedASN &asn5 = one.asns()[one.blocks().back().loc];
+
+        assert(asn5.number == 5);
+        assert(strcmp(one.text()[asn5.text], "Org 15") == 0);
+    }
+
+    return 0;
+}
+
+static int test_string_pool()
+{
+    {
+        StringTable country;
+        StringTable region;
+        StringTable text;
+
+        country.intern("US");
+        country.intern("CA");
+        region.intern("CA");
+        region.intern("07");
+        text.intern("Google Inc.");
+        text.intern("Inc.");
+        text.intern("GitHub, Inc.");
+        text.intern("");
+
+        StringPool pool;
+
+        pool.add(country);
+        pool.add(region);
+        pool.add(text);
+        pool.build();
+
+        // CA and the tails are stored once.
+
+        assert(pool.chars().size() == 3 + 3 + 3 + 12 + 13);
+
+        const StringTable* tables[] = {&country, &region, &text};
+
+        for (size_t t = 0; t < 3; ++t)
+        {
+            const std::vector<unsigned> &refs = pool.refs(*tables[t]);
+
+            assert(refs.size() == tables[t]->size());
+
+            for (size_t i = 0; i < refs.size(); ++i)
+            {
+                assert(strcmp(&pool.chars()[refs[i]], (*tables[t])[i]) == 0);
+            }
+        }
+
+        assert(pool.refs(country)[1] == pool.refs(region)[0]);
+    }
+
+    {
+        ImportOptions options;
+        options.string_pool = true;
+
+        build_test_data("tmp/geo_pool.bin", options);
+
+        SectionDirectory dir;
+        assert(dir.open("tmp/geo_pool.bin"));
+        assert(dir.find("str.pool"));
+
+        GeoData data;
+        data.open("tmp/geo_pool.bin");
+
+        assert(data.verify());
+
+        IPResult result;
+        data.query(134744072, result);
+
+        assert(strcmp(result.country, "US") == 0);
+        assert(strcmp(result.region, "CA") == 0);
+        assert(strcmp(result.city, "Mountain View") == 0);
+        assert(strcmp(result.asn_text, "GitHub, Inc.") == 0);
+
+        data.query(16777216, result);
+
+        assert(strcmp(result.country, "AU") == 0);
+        assert(strcmp(result.city, "Melbourne") == 0);
+        assert(strcmp(result.asn_text, "Google Inc.") == 0);
+    }
+
+    return 0;
+}
+
+static int test_coalesce_blocks()
+{
+    {
+        Block raw[] = {{10, 19, 1}, {20, 29, 1}, {30, 39, 2}, {41, 49, 2},
+                       {50, 59, 2}, {60, 0xFFFFFFFF, 2}};
+
+        std::vector<Block> v(raw, raw + 6);
+
+        assert(coalesce_blocks(v) == 3);
+        assert(v.size() == 3);
+
+        assert(v[0].start_ip == 10 && v[0].end_ip == 29 && v[0].loc == 1);
+        assert(v[1].start_ip == 30 && v[1].end_ip == 39 && v[1].loc == 2);
+        assert(v[2].start_ip == 41 && v[2].end_ip == 0xFFFFFFFF);
+
+        std::vector<Block> empty;
+        assert(coalesce_blocks(empty) == 0);
+    }
+
+    {
+        // the coalesced build must answer exactly as the plain one.
+
+        build_test_data("tmp/geo.bin");
+
+        ImportOptions options;
+        options.coalesce = true;
+
+        write_test_csvs();
+
+        ImportStats stats;
+        etl("tmp/blocks.csv", "tmp/location.csv", "tmp/asnum.csv",
+            "tmp/geo_coalesced.bin", options, &stats);
+
+        assert(stats.loc_blocks == 3);
+        assert(stats.loc_coalesced == 1);
+        assert(stats.asn_coalesced == 0);
+
+        GeoData plain;
+        plain.open("tmp/geo.bin");
+
+        GeoData coalesced;
+        coalesced.open("tmp/geo_coalesced.bin");
+
+        assert(coalesced.location_blocks().size() == 2);
+        assert(compare_results(plain, coalesced, 0) == 0);
+
+        GeoData asns_only;
+        asns_only.open("tmp/geo.bin", GEO_ASNS);
+
+        assert(compare_results(plain, asns_only, 0) != 0);
+    }
+
+    return 0;
+}
+
+static int test_slim_geo_data()
+{
+    {
+        ImportOptions options;
+        options.granularity = GRANULARITY_COUNTRY;
+        options.no_asn = true;
+
+        build_test_data("tmp/geo_country.bin", options);
+
+        SectionDirectory dir;
+        assert(dir.open("tmp/geo_country.bin"));
+        assert(dir.entries().size() == 2);
+        assert(!dir.find("asn.blocks"));
+
+        GeoData data;
+        data.open("tmp/geo_country.bin");
+
+        assert(data.loaded() == GEO_LOCATIONS);
+        assert(data.verify());
+
+        IPResult result;
+        data.query(134744072, result);
+
+        assert(strcmp(result.country, "US") == 0);
+        assert(strcmp(result.region, "") == 0);
+        assert(strcmp(result.city, "") == 0);
+        assert(result.asn == 0);
+
+        data.query(16777472, result);
+        assert(strcmp(result.country, "AU") == 0);
+    }
+
+    {
+        ImportOptions options;
+        options.granularity = GRANULARITY_REGION;
+        options.compact_locations = true;
+
+        build_test_data("tmp/geo_region.bin", options);
+
+        GeoData data;
+        data.open("tmp/geo_region.bin");
+
+        assert(data.loaded() == GEO_ALL);
+
+        IPResult result;
+        data.query(134744072, result);
+
+        assert(strcmp(result.country, "US") == 0);
+        assert(strcmp(result.region, "CA") == 0);
+        assert(strcmp(result.city, "") == 0);
+        assert(*result.asn == 36459);
+    }
+
+    return 0;
+}
+
+static int test_profile_reorder()
+{
+    {
+        unsigned quad = 0;
+
+        assert(parse_quad("8.8.8.8\n", 8, quad) && quad == 134744072);
+        assert(parse_quad("255.0.0.1", 9, quad) && quad == 0xFF000001);
+        assert(!parse_quad("256.0.0.1", 9, quad));
+        assert(!parse_quad("1.2.3", 5, quad));
+        assert(!parse_quad("1.2.3.4x", 8, quad));
+    }
+
+    // the sample only hits the last location and asn of the csvs, so the
+    // reordered build must number them first.
+
+    write_file("tmp/profile.txt", "8.8.8.8\n8.8.8.9\nnot an ip\n");
+
+    ImportOptions options;
+    options.profile = "tmp/profile.txt";
+
+    build_test_data("tmp/geo_profile.bin", options);
+    build_test_data("tmp/geo.bin");
+
+    GeoData plain;
+    plain.open("tmp/geo.bin");
+
+    GeoData profiled;
+    profiled.open("tmp/geo_profile.bin");
+
+    unsigned loc_idx;
+    unsigned asn_idx;
+
+    profiled.lookup(134744072, loc_idx, asn_idx);
+
+    assert(loc_idx == 0);
+    assert(asn_idx == 0);
+
+    assert(compare_results(plain, profiled, 0) == 0);
+
+    {
+        CacheModel model(1024, 2);
+
+        char buf[4096];
+
+        model.touch(buf);
+        model.touch(buf);
+        model.touch(buf + 64);
+
+        assert(model.accesses() == 3);
+        assert(model.misses() == 2);
+    }
+
+    return 0;
+}
+
+static int test_apply_delta()
+{
+    {
+        unsigned ip = 0;
+
+        assert(parse_ip("16777216", 8, ip) && ip == 16777216);
+        assert(parse_ip("1.0.0.0", 7, ip) && ip == 16777216);
+        assert(parse_ip("4294967295\r", 11, ip) && ip == 0xFFFFFFFF);
+        assert(!parse_ip("4294967296", 10, ip));
+        assert(!parse_ip("12a", 3, ip));
+        assert(!parse_ip("", 0, ip));
+    }
+
+    build_test_data("tmp/geo.bin");
+
+    // an empty delta copies every section, so the file is unchanged.
+
+    write_file("tmp/empty.csv", "# nothing\n\n");
+
+    DeltaStats stats;
+    apply_delta("tmp/geo.bin", "tmp/empty.csv", "tmp/geo_delta.bin", &stats);
+
+    assert(stats.sections_copied == 4);
+    assert(read_file("tmp/geo.bin") == read_file("tmp/geo_delta.bin"));
+
+    write_file("tmp/delta.csv",
+               "loc,update,1.0.0.128,1.0.1.127,\"US\",\"CA\","
+               "\"Mountain View\",37.3860,-122.0838\n"
+               "loc,delete,1.0.1.200,16777727\n"
+               "loc,insert,9.9.9.0,9.9.9.255,\"CH\",\"ZH\",\"Zurich\","
+               "47.3667,8.5500\n"
+               "asn,insert,9.9.9.0,9.9.9.255,AS19281,\"Quad9\"\n");
+
+    apply_delta("tmp/geo.bin", "tmp/delta.csv", "tmp/geo_delta.bin", &stats);
+
+    assert(stats.loc_changes == 3);
+    assert(stats.asn_changes == 1);
+    assert(stats.loc_added == 1);
+    assert(stats.asn_added == 1);
+
+    GeoData data;
+    data.open("tmp/geo_delta.bin");
+
+    assert(data.verify());
+    assert(data.location_blocks().size() == 5);
+
+    IPResult result;
+
+    data.query(16777221, result);
+    assert(strcmp(result.country, "AU") == 0);
+
+    data.query(16777416, result);
+    assert(strcmp(result.city, "Mountain View") == 0);
+    assert(*result.asn == 15169);
+
+    data.query(16777599, result);
+    assert(strcmp(result.country, "US") == 0);
+
+    data.query(16777600, result);
+    assert(strcmp(result.country, "AU") == 0);
+
+    IPResult deleted;
+    data.query(16777672, deleted);
+    assert(deleted.country == 0);
+
+    data.query(151587081, result);
+    assert(strcmp(result.city, "Zurich") == 0);
+    assert(*result.asn == 19281);
+    assert(strcmp(result.asn_text, "Quad9") == 0);
+
+    // a compact, pooled database takes the same delta to the same answers.
+
+    ImportOptions options;
+    options.compact_locations = true;
+    options.compress_blocks = true;
+    options.string_pool = true;
+
+    build_test_data("tmp/geo_compact.bin", options);
+    apply_delta("tmp/geo_compact.bin", "tmp/delta.csv",
+                "tmp/geo_compact.bin");
+
+    GeoData compact;
+    compact.open("tmp/geo_compact.bin");
+
+    assert(compact.verify());
+    assert(compare_results(data, compact, 0) == 0);
+
+    return 0;
+}
+
+// the winner at quad by brute force: the narrowest covering range, then the
+// latest.
+static unsigned covering_range(const std::vector<Block> &v, unsigned quad)
+{
+    unsigned best = -1U;
+
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        if (v[i].start_ip > quad || v[i].end_ip < quad)
+        {
+            continue;
+        }
+
+        if (best == -1U ||
+            v[i].end_ip - v[i].start_ip <= v[best].end_ip - v[best].start_ip)
+        {
+            best = i;
+        }
+    }
+
+    return best == -1U ? -1U : v[best].loc;
+}
+
+static int test_block_sort()
+{
+    srand(7);
+
+    {
+        // enough ranges to split the sort over threads.
+
+        std::vector<RankedBlock> v(MIN_PARALLEL_SORT + 1000);
+
+        for (size_t i = 0; i < v.size(); ++i)
+        {
+            v[i].block.start_ip = (unsigned) rand() % 5000 * 0x10001;
+            v[i].block.end_ip = v[i].block.start_ip;
+            v[i].block.loc = 0;
+            v[i].seq = i;
+        }
+
+        radix_sort_blocks(v, 4);
+
+        for (size_t i = 1; i < v.size(); ++i)
+        {
+            assert(v[i - 1].block.start_ip <= v[i].block.start_ip);
+
+            if (v[i - 1].block.start_ip == v[i].block.start_ip)
+            {
+                assert(v[i - 1].seq < v[i].seq);
+            }
+        }
+    }
+
+    for (unsigned round = 0; round < 20; ++round)
+    {
+        std::vector<Block> source;
+
+        for (unsigned i = 0; i < 100; ++i)
+        {
+            Block b;
+
+            b.start_ip = rand() % 1000;
+            b.end_ip = b.start_ip + rand() % (round < 10 ? 20 : 300);
+            b.loc = i;
+
+            source.push_back(b);
+        }
+
+        std::vector<Block> v = source;
+        size_t conflicts = normalize_blocks(v, 2, "test", 0);
+
+        assert(conflicts > 0);
+        assert(blocks_ordered(v));
+
+        for (unsigned quad = 0; quad < 1400; ++quad)
+        {
+            size_t idx = find_block(v, quad);
+            unsigned loc = idx == (size_t) -1 ? -1U : v[idx].loc;
+
+            assert(loc == covering_range(source, quad));
+        }
+    }
+
+    {
+        Block raw[] = {{0x80000000, 0xFFFFFFFF, 1}, {0, 0x8000000F, 2},
+                       {5, 4, 3}, {0xFFFFFFF0, 0xFFFFFFFF, 4}};
+
+        std::vector<Block> v(raw, raw + 4);
+
+        assert(normalize_blocks(v, 1, "test", 0) == 3);
+        assert(v.size() == 3);
+
+        assert(v[0].start_ip == 0 && v[0].end_ip == 0x7FFFFFFF);
+        assert(v[1].end_ip == 0xFFFFFFEF && v[1].loc == 1);
+        assert(v[2].start_ip == 0xFFFFFFF0 && v[2].end_ip == 0xFFFFFFFF);
+        assert(v[2].loc == 4);
+    }
+
+    {
+        // an unsorted csv with an overlap imports, and the narrower
+        // range wins.
+
+        write_test_csvs();
+
+        write_file("tmp/blocks.csv",
+                   "Copyright (c) 2011 MaxMind Inc.  All Rights Reserved.\n"
+                   "startIpNum,endIpNum,locId\n"
+                   "\"134744064\",\"134744319\",\"1\"\n"
+                   "\"16777216\",\"16777727\",\"2\"\n"
+                   "\"16777472\",\"16777479\",\"1\"\n");
+
+        ImportStats stats;
+        etl("tmp/blocks.csv", "tmp/location.csv", "tmp/asnum.csv",
+            "tmp/geo_unsorted.bin", ImportOptions(), &stats);
+
+        assert(stats.loc_conflicts == 1);
+        assert(stats.asn_conflicts == 0);
+
+        GeoData data;
+        data.open("tmp/geo_unsorted.bin");
+
+        assert(data.location_blocks().size() == 4);
+
+        IPResult result;
+
+        data.query(16777475, result);
+        assert(strcmp(result.country, "US") == 0);
+
+        data.query(16777480, result);
+        assert(strcmp(result.country, "AU") == 0);
+
+        data.query(134744072, result);
+        assert(strcmp(result.country, "US") == 0);
+    }
+
+    return 0;
+}
+
+static int test_overlay()
+{
+    {
+        unsigned start = 0;
+        unsigned end = 0;
+
+        assert(parse_cidr("10.0.0.0/8", 10, start, end));
+        assert(start == 0x0A000000 && end == 0x0AFFFFFF);
+
+        assert(parse_cidr("10.1.2.3/24", 11, start, end));
+        assert(start == 0x0A010200 && end == 0x0A0102FF);
+
+        assert(parse_cidr("0.0.0.0/0", 9, start, end));
+        assert(start == 0 && end == 0xFFFFFFFF);
+
+        assert(!parse_cidr("10.0.0.0/33", 11, start, end));
+        assert(!parse_cidr("10.0.0.0", 8, start, end));
+        assert(!parse_cidr("10.0.0.0/", 9, start, end));
+    }
+
+    // the /23 covers both source blocks of 1.0.0.0, and the /25 inside it
+    // is narrower, so it wins there.
+
+    write_file("tmp/overlay.csv",
+               "# ours\n"
+               "1.0.0.0/23,,JP,40,Tokyo,35.6850,139.7514,,\n"
+               "1.0.0.0/25,,NZ,E7,Auckland,-36.8667,174.7667,AS64512,Lab\n"
+               "134744064,134744079,US,CA,Lab,37.0000,-122.0000,,\n");
+
+    ImportOptions options;
+    options.overlay = "tmp/overlay.csv";
+
+    ImportStats stats;
+
+    write_test_csvs();
+    etl("tmp/blocks.csv", "tmp/location.csv", "tmp/asnum.csv",
+        "tmp/geo_overlay.bin", options, &stats);
+
+    assert(stats.overlay_ranges == 3);
+    assert(stats.overlay_conflicts == 1);
+
+    {
+        SectionDirectory dir;
+        assert(dir.open("tmp/geo_overlay.bin"));
+        assert(dir.find("overlay"));
+    }
+
+    {
+        GeoData data;
+        data.open("tmp/geo_overlay.bin");
+
+        assert(data.verify());
+
+        IPResult nz;
+        data.query(16777221, nz);
+        assert(strcmp(nz.city, "Auckland") == 0);
+        assert(*nz.asn == 64512);
+        assert(strcmp(nz.asn_text, "Lab") == 0);
+
+        // with no asn of its own, the overlay leaves the source's.
+
+        IPResult jp;
+        data.query(16777400, jp);
+        assert(strcmp(jp.city, "Tokyo") == 0);
+        assert(*jp.asn == 15169);
+
+        IPResult lab;
+        data.query(134744072, lab);
+        assert(strcmp(lab.city, "Lab") == 0);
+        assert(*lab.asn == 36459);
+
+        IPResult source;
+        data.query(134744100, source);
+        assert(strcmp(source.city, "Mountain View") == 0);
+    }
+
+    // a delta under the overlay changes only what the overlay leaves
+    // uncovered.
+
+    write_file("tmp/delta.csv",
+               "loc,update,1.0.0.0,1.0.3.255,CH,ZH,Zurich,47.3667,8.5500\n"
+               "asn,update,1.0.0.0,1.0.0.255,AS19281,Quad9\n");
+
+    DeltaStats delta_stats;
+    apply_delta("tmp/geo_overlay.bin", "tmp/delta.csv",
+                "tmp/geo_overlay.bin", &delta_stats);
+
+    assert(delta_stats.loc_added == 1);
+
+    GeoData data;
+    data.open("tmp/geo_overlay.bin");
+
+    assert(data.verify());
+
+    IPResult nz;
+    data.query(16777221, nz);
+    assert(strcmp(nz.city, "Auckland") == 0);
+    assert(*nz.asn == 64512);
+
+    IPResult jp;
+    data.query(16777400, jp);
+    assert(strcmp(jp.city, "Tokyo") == 0);
+    assert(*jp.asn == 19281);
+
+    IPResult zurich;
+    data.query(16777800, zurich);
+    assert(strcmp(zurich.city, "Zurich") == 0);
+
+    SectionDirectory dir;
+    assert(dir.open("tmp/geo_overlay.bin"));
+    assert(dir.find("overlay"));
+
+    return 0;
+}
+
+// mmdb values, for small hand made databases. sizes are under 285.
+static std::string mmdb_value(unsigned type, const std::string &payload,
+                              size_t size)
+{
+    std::string out;
+
+    unsigned low = size < 29 ? size : 29;
+
+    if (type <= MMDB_MAP)
+    {
+        out += (char) (type << 5 | low);
+    }
+    else
+    {
+        out += (char) low;
+        out += (char) (type - 7);
+    }
+
+    if (size >= 29)
+    {
+        out += (char) (size - 29);
+    }
+
+    return out + payload;
+}
+
+static std::string mmdb_string(const char* s)
+{
+    return mmdb_value(MMDB_STRING, s, strlen(s));
+}
+
+static std::string mmdb_uint32(unsigned x)
+{
+    char b[4] = { (char) (x >> 24), (char) (x >> 16), (char) (x >> 8),
+                  (char) x };
+
+    return mmdb_value(MMDB_UINT32, std::string(b, 4), 4);
+}
+
+static std::string mmdb_double(double d)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+
+    std::string b;
+
+    for (int i = 7; i >= 0; --i)
+    {
+        b += (char) (bits >> (i * 8));
+    }
+
+    return mmdb_value(MMDB_DOUBLE, b, 8);
+}
+
+static std::string mmdb_pointer(unsigned offset)
+{
+    return std::string(1, (char) (MMDB_POINTER << 5 | offset >> 8)) +
+           (char) offset;
+}
+
+// a string inside depth arrays of one entry each.
+static std::string mmdb_nested(size_t depth)
+{
+    std::string s = mmdb_string("x");
+
+    for (size_t i = 0; i < depth; ++i)
+    {
+        s = mmdb_value(MMDB_ARRAY, s, 1);
+    }
+
+    return s;
+}
+
+static void skip_too_deep()
+{
+    std::string s = mmdb_nested(MMDB_MAX_DEPTH + 10);
+
+    MMDBDecoder decoder((const unsigned char*) s.data(), s.size());
+    decoder.skip(0);
+}
+
+static int test_import_mmdb()
+{
+    // values nest up to a limit, past which the file is refused rather
+    // than the stack exhausted.
+
+    {
+        std::string s = mmdb_nested(MMDB_MAX_DEPTH);
+
+        MMDBDecoder decoder((const unsigned char*) s.data(), s.size());
+        assert(decoder.skip(0) == s.size());
+
+        assert(fails(skip_too_deep));
+    }
+
+    // an ipv4 tree of 3 nodes, with 24 bit records. 0.0.0.0/3 is a city
+    // with an asn, 32.0.0.0/3 only has a registered country, 64.0.0.0/2
+    // only an asn, and 128.0.0.0/1 is empty.
+
+    std::string city_country =
+        mmdb_value(MMDB_MAP, mmdb_string("iso_code") + mmdb_string("NZ"), 1);
+
+    std::string a = mmdb_value(MMDB_MAP, "", 6) + mmdb_string("country");
+    size_t country_offset = a.size();
+
+    a += city_country +
+         mmdb_string("city") +
+         mmdb_value(MMDB_MAP, mmdb_string("names") +
+                    mmdb_value(MMDB_MAP, mmdb_string("en") +
+                               mmdb_string("Auckland"), 1), 1) +
+         mmdb_string("location") +
+         mmdb_value(MMDB_MAP, mmdb_string("latitude") +
+                    mmdb_double(-36.8667) + mmdb_string("longitude") +
+                    mmdb_double(174.7667), 2) +
+         mmdb_string("subdivisions") +
+         mmdb_value(MMDB_ARRAY, mmdb_value(MMDB_MAP,
+                    mmdb_string("iso_code") + mmdb_string("E7"), 1), 1) +
+         mmdb_string("autonomous_system_number") + mmdb_uint32(64512) +
+         mmdb_string("autonomous_system_organization") +
+         mmdb_string("Lab");
+
+    std::string c = mmdb_value(MMDB_MAP, mmdb_string("registered_country") +
+                               mmdb_pointer(country_offset), 1);
+
+    std::string b = mmdb_value(MMDB_MAP,
+                               mmdb_string("autonomous_system_number") +
+                               mmdb_uint32(15169) +
+                               mmdb_string("autonomous_system_organization") +
+                               mmdb_string("Google Inc."), 2);
+
+    std::string section = a + c + b;
+
+    unsigned nodes = 3;
+    unsigned empty = nodes;
+    unsigned ra = nodes + MMDB_DATA_SEPARATOR;
+    unsigned rc = ra + a.size();
+    unsigned rb = rc + c.size();
+
+    unsigned records[6] = { 1, empty, 2, rb, ra, rc };
+
+    std::string file;
+
+    for (int i = 0; i < 6; ++i)
+    {
+        file += (char) (records[i] >> 16);
+        file += (char) (records[i] >> 8);
+        file += (char) records[i];
+    }
+
+    file += std::string(MMDB_DATA_SEPARATOR, '\0') + section;
+    file += MMDB_METADATA_MARKER;
+    file += mmdb_value(MMDB_MAP,
+                       mmdb_string("node_count") + mmdb_uint32(nodes) +
+                       mmdb_string("record_size") + mmdb_uint32(24) +
+                       mmdb_string("ip_version") + mmdb_uint32(4) +
+                       mmdb_string("binary_format_major_version") +
+                       mmdb_uint32(2) +
+                       mmdb_string("database_type") + mmdb_string("Test"),
+                       5);
+
+    FILE* f = fopen("tmp/test.mmdb", "wb");
+    assert(f);
+    assert(fwrite(file.data(), 1, file.size(), f) == file.size());
+    fclose(f);
+
+    std::vector<std::string> sources(1, "tmp/test.mmdb");
+
+    ImportOptions options;
+    options.threads = 1;
+
+    etl_mmdb(sources, "tmp/geo_mmdb.bin", options);
+
+    // the walk splits into subtrees with more threads, to the same result.
+
+    options.threads = 4;
+    etl_mmdb(sources, "tmp/geo_mmdb4.bin", options);
+
+    assert(read_file("tmp/geo_mmdb.bin") == read_file("tmp/geo_mmdb4.bin"));
+
+    GeoData data;
+    data.open("tmp/geo_mmdb.bin");
+
+    assert(data.loaded() == GEO_ALL);
+    assert(data.verify());
+    assert(data.location_blocks().size() == 2);
+    assert(data.asn_blocks().size() == 2);
+
+    IPResult city;
+    data.query(0x1FFFFFFF, city);
+    assert(strcmp(city.country, "NZ") == 0);
+    assert(strcmp(city.region, "E7") == 0);
+    assert(strcmp(city.city, "Auckland") == 0);
+    assert(*city.asn == 64512);
+    assert(strcmp(city.asn_text, "Lab") == 0);
+
+    IPResult registered;
+    data.query(0x20000000, registered);
+    assert(strcmp(registered.country, "NZ") == 0);
+    assert(strcmp(registered.city, "") == 0);
+
+    IPResult asn;
+    data.query(0x7FFFFFFF, asn);
+    assert(asn.country == 0);
+    assert(*asn.asn == 15169);
+
+    IPResult none;
+    data.query(0x80000000, none);
+    assert(none.country == 0 && none.asn == 0);
+
+    return 0;
+}
+
+static bool ip6_roundtrip(const char* in, const char* expected)
+{
+    IP6 ip;
+
+    if (!parse_ip6(in, strlen(in), ip))
+    {
+        return false;
+    }
+
+    char buf[64];
+    ip6_to_s(buf, ip);
+
+    return strcmp(buf, expected) == 0;
+}
+
+static int test_ip6()
+{
+    assert(ip6_roundtrip("2001:DB8:0:0:0:0:0:1", "2001:db8::1"));
+    assert(ip6_roundtrip("::", "::"));
+    assert(ip6_roundtrip("::1", "::1"));
+    assert(ip6_roundtrip("1:0:0:2:0:0:0:3\n", "1:0:0:2::3"));
+    assert(ip6_roundtrip("1:0:2:3:4:5:6:7", "1:0:2:3:4:5:6:7"));
+    assert(ip6_roundtrip("::ffff:1.2.3.4", "::ffff:1.2.3.4"));
+    assert(ip6_roundtrip("64:ff9b::192.0.2.1", "64:ff9b::c000:201"));
+
+    const char* bad[] = { "1::2::3", "12345::", "1:2:3:4:5:6:7:8:9",
+                          ":1", "1:", "1:2:3:4:5:6:7", "::g", "::1.2.3",
+                          "" };
+
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+    {
+        IP6 ip;
+        assert(!parse_ip6(bad[i], strlen(bad[i]), ip));
+    }
+
+    IP6 mapped;
+    unsigned quad;
+
+    assert(parse_ip6("::ffff:8.8.4.4", 14, mapped));
+    assert(ip6_v4_mapped(mapped, quad) && quad == 0x08080404);
+
+    // runs of blocks share a high word, so lookups search the low words.
+
+    std::vector<Block6> blocks;
+
+    srand(4321);
+
+    for (unsigned i = 0; i < 500; ++i)
+    {
+        Block6 b;
+
+        b.start.hi = 0x20010DB800000000ULL + (i / 5) * 0x10000;
+        b.start.lo = (uint64_t) (i % 5) << 60 | rand();
+        b.end.hi = b.start.hi;
+        b.end.lo = b.start.lo + rand() % 100000;
+        b.loc = i;
+
+        blocks.push_back(b);
+    }
+
+    {
+        BinaryFile file;
+        file.open("tmp/blocks6.bin");
+        save_blocks6(file, blocks);
+    }
+
+    MemoryFile file;
+    file.open("tmp/blocks6.bin");
+
+    Block6Table table;
+    table.load(file);
+
+    assert(table.size() == blocks.size());
+
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        const Block6 &b = blocks[i];
+
+        IP6 before = b.start;
+        before.lo--;
+
+        assert(table.find(b.start) == i);
+        assert(table.find(b.end) == i);
+        assert(table.find(before) == -1U);
+        assert(table.payload(i) == b.loc);
+
+        Block6 out;
+        table.get(i, out);
+        assert(out.start == b.start && out.end == b.end);
+    }
+
+    IP6 low = { 0, 1 };
+    IP6 high = { ~0ULL, ~0ULL };
+
+    assert(table.find(low) == -1U);
+    assert(table.find(high) == -1U);
+
+    // overlaps resolve as they do for v4 ranges. the narrower range wins,
+    // and of two as wide, the later one.
+
+    {
+        unsigned ranges[][3] = { { 0, 255, 1 }, { 16, 31, 2 },
+                                 { 150, 249, 4 }, { 100, 199, 3 } };
+
+        std::vector<Block> v4;
+        std::vector<Block6> v6;
+
+        for (size_t i = 0; i < 4; ++i)
+        {
+            Block b = { ranges[i][0], ranges[i][1], ranges[i][2] };
+            Block6 b6 = { { 0, ranges[i][0] }, { 0, ranges[i][1] },
+                          ranges[i][2] };
+
+            v4.push_back(b);
+            v6.push_back(b6);
+        }
+
+        size_t conflicts = normalize_blocks(v4, 1, "test", 0);
+        assert(normalize_blocks6(v6) == conflicts && conflicts == 3);
+
+        unsigned expected[][3] = { { 0, 15, 1 }, { 16, 31, 2 },
+                                   { 32, 99, 1 }, { 100, 199, 3 },
+                                   { 200, 249, 4 }, { 250, 255, 1 } };
+
+        assert(v4.size() == 6 && v6.size() == 6);
+
+        for (size_t i = 0; i < 6; ++i)
+        {
+            assert(v4[i].start_ip == expected[i][0] &&
+                   v4[i].end_ip == expected[i][1] &&
+                   v4[i].loc == expected[i][2]);
+
+            assert(v6[i].start.lo == v4[i].start_ip &&
+                   v6[i].end.lo == v4[i].end_ip &&
+                   v6[i].loc == v4[i].loc);
+        }
+    }
+
+    // only the first word of a line is the address, so colons in the text
+    // after it do not make a v4 line look like v6.
+
+    {
+        std::vector<std::string> lines;
+        lines.push_back("8.8.8.8 12:00:01");
+        lines.push_back("8.8.8.8 http://x/");
+        lines.push_back("2001:db8::1 GET /x");
+        lines.push_back("::ffff:8.8.4.4\t12:00:01");
+        lines.push_back("2001:db8::g 12:00:01");
+
+        std::vector<IPAddress> addresses;
+
+        StringInjector reader(lines);
+        IPParser parser;
+        Collector<IPAddress> collector(addresses);
+
+        reader | parser | collector;
+        reader.produce();
+
+        assert(addresses.size() == 4);
+
+        assert(addresses[0].family == IP_V4 &&
+               addresses[0].quad == 0x08080808);
+        assert(addresses[1].family == IP_V4 &&
+               addresses[1].quad == 0x08080808);
+
+        IP6 ip;
+        assert(parse_ip6("2001:db8::1", 11, ip));
+
+        assert(addresses[2].family == IP_V6 && addresses[2].ip6 == ip);
+        assert(addresses[3].family == IP_V4_MAPPED &&
+               addresses[3].quad == 0x08080404);
+    }
+
+    return 0;
+}
+
+static int test_import_mmdb6()
+{
+    // an ipv6 tree with 24 bit records. nodes 0 to 95 run down ::/96 to the
+    // ipv4 subtree at node 96, which has 0.0.0.0/1. node 97 splits 2000::/3,
+    // and 2000::/4 has the same record. nodes 98 to 112 run down the rest of
+    // ::ffff:0:0/96, which aliases the ipv4 subtree, as in MaxMind's files.
+
+    std::string a = mmdb_value(MMDB_MAP, mmdb_string("country") +
+                               mmdb_value(MMDB_MAP, mmdb_string("iso_code") +
+                                          mmdb_string("NZ"), 1) +
+                               mmdb_string("autonomous_system_number") +
+                               mmdb_uint32(64512), 2);
+
+    unsigned nodes = 113;
+    unsigned empty = nodes;
+    unsigned ra = nodes + MMDB_DATA_SEPARATOR;
+
+    std::vector<unsigned> records(nodes * 2, empty);
+
+    for (unsigned i = 0; i < 96; ++i)
+    {
+        records[i * 2] = i + 1;
+    }
+
+    records[96 * 2] = ra;
+    records[2 * 2 + 1] = 97;
+    records[97 * 2] = ra;
+
+    // ::ffff:0:0 has ones in bits 80 to 95.
+
+    records[80 * 2 + 1] = 98;
+
+    for (unsigned i = 98; i < 112; ++i)
+    {
+        records[i * 2 + 1] = i + 1;
+    }
+
+    records[112 * 2 + 1] = 96;
+
+    std::string file;
+
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        file += (char) (records[i] >> 16);
+        file += (char) (records[i] >> 8);
+        file += (char) records[i];
+    }
+
+    file += std::string(MMDB_DATA_SEPARATOR, '\0') + a;
+    file += MMDB_METADATA_MARKER;
+    file += mmdb_value(MMDB_MAP,
+                       mmdb_string("node_count") + mmdb_uint32(nodes) +
+                       mmdb_string("record_size") + mmdb_uint32(24) +
+                       mmdb_string("ip_version") + mmdb_uint32(6) +
+                       mmdb_string("binary_format_major_version") +
+                       mmdb_uint32(2), 4);
+
+    FILE* f = fopen("tmp/test6.mmdb", "wb");
+    assert(f);
+    assert(fwrite(file.data(), 1, file.size(), f) == file.size());
+    fclose(f);
+
+    std::vector<std::string> sources(1, "tmp/test6.mmdb");
+
+    ImportOptions options;
+    options.threads = 1;
+
+    etl_mmdb(sources, "tmp/geo_mmdb6.bin", options);
+
+    options.threads = 4;
+    etl_mmdb(sources, "tmp/geo_mmdb6_4.bin", options);
+
+    assert(read_file("tmp/geo_mmdb6.bin") ==
+           read_file("tmp/geo_mmdb6_4.bin"));
+
+    GeoData data;
+    data.open("tmp/geo_mmdb6.bin");
+
+    assert(data.loaded6() == GEO_ALL);
+    assert(data.location_blocks().size() == 1);
+
+    // the alias is left out of the v6 table.
+
+    assert(data.location_blocks6().size() == 1);
+    assert(data.asn_blocks6().size() == 1);
+
+    IPAddress address;
+    IPResult v6;
+
+    assert(parse_ip6("2fff::1", 7, address.ip6));
+    address.family = IP_V6;
+    data.query(address, v6);
+    assert(strcmp(v6.country, "NZ") == 0 && *v6.asn == 64512);
+
+    IPResult outside;
+    assert(parse_ip6("3000::", 6, address.ip6));
+    data.query(address, outside);
+    assert(outside.country == 0 && outside.asn == 0);
+
+    // a mapped address is answered by the v4 table, and keeps its form.
+
+    IPResult mapped;
+    address.family = IP_V4_MAPPED;
+    address.quad = 0x7F000001;
+    assert(parse_ip6("::ffff:127.0.0.1", 16, address.ip6));
+    data.query(address, mapped);
+    assert(strcmp(mapped.country, "NZ") == 0);
+    assert(mapped.family == IP_V4_MAPPED);
+
+    return 0;
+}
+
+static void apply_delta_to_history()
+{
+    apply_delta("tmp/history.bin", "tmp/delta.csv", "tmp/history_delta.bin");
+}
+
+static void select_before_history()
+{
+    GeoData history;
+    history.open("tmp/history.bin");
+
+    history.select_month(make_month(2025, 12));
+}
+
+static int test_history()
+{
+    {
+        unsigned month = 0;
+
+        assert(parse_month("2026-03", 7, month) &&
+               month == make_month(2026, 3));
+        assert(parse_month("2026-03-15T10:00:00Z", 20, month) &&
+               month == make_month(2026, 3));
+        assert(parse_month("1772323200", 10, month) &&
+               month == make_month(2026, 3));
+        assert(!parse_month("2026-13", 7, month));
+        assert(!parse_month("2026-031", 8, month));
+        assert(!parse_month("26-03", 5, month));
+        assert(!parse_month("", 0, month));
+
+        char s[16];
+        month_to_s(s, make_month(2026, 3));
+        assert(strcmp(s, "2026-03") == 0);
+    }
+
+    {
+        // a line that does not start with a timestamp is an address, and
+        // text after it is ignored.
+
+        std::vector<std::string> lines;
+        lines.push_back("2026-03 1.0.0.1");
+        lines.push_back("1.0.0.1 GET /x");
+        lines.push_back("hello world");
+
+        std::vector<IPAddress> addresses;
+
+        StringInjector reader(lines);
+        IPParser parser;
+        Collector<IPAddress> collector(addresses);
+
+        reader | parser | collector;
+        reader.produce();
+
+        assert(addresses.size() == 2);
+        assert(addresses[0].quad == 16777217 &&
+               addresses[0].month == make_month(2026, 3));
+        assert(addresses[1].quad == 16777217 && addresses[1].month == 0);
+    }
+
+    // three snapshots, where the last two are the same.
+
+    build_test_data("tmp/geo.bin");
+
+    write_file("tmp/delta.csv",
+               "loc,update,1.0.0.128,1.0.1.127,\"US\",\"CA\","
+               "\"Mountain View\",37.3860,-122.0838\n"
+               "loc,insert,9.9.9.0,9.9.9.255,\"CH\",\"ZH\",\"Zurich\","
+               "47.3667,8.5500\n"
+               "asn,insert,9.9.9.0,9.9.9.255,AS19281,\"Quad9\"\n");
+
+    apply_delta("tmp/geo.bin", "tmp/delta.csv", "tmp/geo_delta.bin");
+
+    std::vector<HistorySource> sources(3);
+
+    sources[0].month = make_month(2026, 5);
+    sources[0].file = "tmp/geo_delta.bin";
+    sources[1].month = make_month(2026, 1);
+    sources[1].file = "tmp/geo.bin";
+    sources[2].month = make_month(2026, 3);
+    sources[2].file = "tmp/geo_delta.bin";
+
+    HistoryStats stats;
+    build_history(sources, "tmp/history.bin", ImportOptions(), &stats);
+
+    assert(stats.snapshots == 3);
+    assert(stats.tables == 6 && stats.tables_shared == 2);
+    // the locations are the three cities and the filler before id 1, each
+    // stored once.
+
+    assert(stats.locations == 4 && stats.asns == 3);
+
+    GeoData history;
+    history.open("tmp/history.bin");
+
+    assert(history.verify());
+    assert(history.snapshot_count() == 3);
+    assert(history.snapshot_month(0) == make_month(2026, 1));
+
+    // the latest snapshot is selected by default, and matches its source.
+
+    GeoData latest;
+    latest.open("tmp/geo_delta.bin");
+
+    assert(compare_results(history, latest, 0) == 0);
+
+    IPResult result;
+
+    history.query(16777416, result);
+    assert(strcmp(result.country, "US") == 0);
+
+    // there is no answer for a month before the first snapshot.
+
+    assert(fails(select_before_history));
+
+    history.select_month(make_month(2026, 1));
+    history.query(16777416, result);
+    assert(strcmp(result.country, "AU") == 0);
+
+    IPResult missing;
+    history.query(151587081, missing);
+    assert(missing.country == 0 && missing.asn == 0);
+
+    history.select_month(make_month(2026, 4));
+    history.query(151587081, result);
+    assert(strcmp(result.city, "Zurich") == 0);
+    assert(strcmp(result.asn_text, "Quad9") == 0);
+
+    // a line's own month overrides the selected one.
+
+    IPAddress address;
+    address.quad = 16777416;
+    address.month = make_month(2026, 2);
+
+    history.query(address, result);
+    assert(strcmp(result.country, "AU") == 0);
+
+    // a delta would lose the older snapshots, so it is refused.
+
+    assert(fails(apply_delta_to_history));
+
+    return 0;
+}
+
+static int test_diff()
+{
+    build_test_data("tmp/geo.bin");
+
+    write_file("tmp/delta.csv",
+               "loc,update,1.0.0.128,1.0.1.127,\"US\",\"CA\","
+               "\"Mountain View\",37.3860,-122.0838\n"
+               "loc,delete,1.0.1.200,16777727\n"
+               "loc,insert,9.9.9.0,9.9.9.255,\"CH\",\"ZH\",\"Zurich\","
+               "47.3667,8.5500\n"
+               "asn,insert,9.9.9.0,9.9.9.255,AS19281,\"Quad9\"\n");
+
+    apply_delta("tmp/geo.bin", "tmp/delta.csv", "tmp/geo_delta.bin");
+
+    GeoData a;
+    a.open("tmp/geo.bin");
+
+    GeoData b;
+    b.open("tmp/geo_delta.bin");
+
+    DiffStats same;
+    diff_results(a, a, 0, same);
+
+    assert(same.ranges == 0 && same.ranges6 == 0 && same.by_ids);
+
+    // the update spans two old blocks with the same location, but only the
+    // first half has an asn, so it is two ranges.
+
+    FILE* out = tmpfile();
+    assert(out);
+
+    DiffStats stats;
+    diff_results(a, b, out, stats);
+
+    assert(stats.by_ids);
+    assert(stats.ranges == 4 && stats.ranges6 == 0);
+    assert(stats.location_ranges == 4 && stats.asn_ranges == 1);
+    assert(stats.addresses == 128 + 128 + 56 + 256);
+
+    rewind(out);
+
+    char line[512];
+
+    assert(fgets(line, sizeof(line), out));
+    assert(strcmp(line, "1.0.0.128 1.0.0.255 loc AU 07 Melbourne -37.8266 "
+                  "144.7834 AS15169 Google+Inc. US CA Mountain+View 37.3860 "
+                  "-122.0838 AS15169 Google+Inc.\n") == 0);
+
+    assert(fgets(line, sizeof(line), out));
+    assert(strncmp(line, "1.0.1.0 1.0.1.127 loc AU", 24) == 0);
+
+    assert(fgets(line, sizeof(line), out));
+    assert(strncmp(line, "1.0.1.200 1.0.1.255 loc AU", 26) == 0);
+
+    assert(fgets(line, sizeof(line), out));
+    assert(strcmp(line, "9.9.9.0 9.9.9.255 loc+asn % % % 0.0000 0.0000 % % "
+                  "CH ZH Zurich 47.3667 8.5500 AS19281 Quad9\n") == 0);
+
+    assert(!fgets(line, sizeof(line), out));
+    fclose(out);
+
+    // with the locations listed the other way round, the strings are
+    // interned in another order, and are compared as strings.
+
+    write_file("tmp/location.csv",
+               "Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n"
+               "locId,country,region,city,postalCode,latitude,longitude,"
+               "metroCode,areaCode\n"
+               "2,\"AU\",\"07\",\"Melbourne\",\"\",-37.8266,144.7834,,\n"
+               "1,\"US\",\"CA\",\"Mountain View\",\"\",37.3860,"
+               "-122.0838,,\n");
+
+    etl("tmp/blocks.csv", "tmp/location.csv", "tmp/asnum.csv",
+        "tmp/geo_swapped.bin");
+
+    GeoData swapped;
+    swapped.open("tmp/geo_swapped.bin");
+
+    DiffStats by_strings;
+    diff_results(a, swapped, 0, by_strings);
+
+    assert(by_strings.ranges == 0 && !by_strings.by_ids);
+
+    diff_results(swapped, b, 0, by_strings);
+
+    assert(by_strings.ranges == 4 && !by_strings.by_ids);
+
+    return 0;
+}
+
+static int test_count()
+{
+    {
+        std::vector<unsigned> fields;
+
+        assert(parse_count_fields("asn,country", fields));
+        assert(fields.size() == 2 && fields[0] == COUNT_ASN &&
+               fields[1] == COUNT_COUNTRY);
+
+        assert(!parse_count_fields("country,country", fields));
+        assert(!parse_count_fields("planet", fields));
+        assert(!parse_count_fields("", fields));
+    }
+
+    build_test_data("tmp/geo.bin");
+
+    GeoData data;
+    data.open("tmp/geo.bin");
+
+    // 1.0.0.x is AU and Google, 8.8.8.x is US and GitHub, 9.9.9.9 has
+    // neither.
+
+    write_file("tmp/ips.txt",
+               "1.0.0.1\n1.0.0.1\n1.0.0.2\n8.8.8.8\n9.9.9.9\n"
+               "::ffff:1.0.0.1\nbad\n");
+
+    std::vector<std::string> sources;
+    sources.push_back("file:tmp/ips.txt");
+    sources.push_back("query:1.0.1.5,");
+
+    CountOptions options;
+    options.distinct = true;
+    assert(parse_count_fields("country,asn", options.fields));
+
+    FILE* out = tmpfile();
+    assert(out);
+
+    count(data, sources, options, true, out);
+    rewind(out);
+
+    char line[256];
+
+    assert(fgets(line, sizeof(line), out));
+    assert(strcmp(line, "count country as_num as_text distinct_ips\n") == 0);
+
+    // the mapped address is the same ip as 1.0.0.1.
+
+    assert(fgets(line, sizeof(line), out));
+    assert(strcmp(line, "4 AU AS15169 Google+Inc. 2\n") == 0);
+
+    // ties keep the order of their keys, where ips with no answer come
+    // first.
+
+    assert(fgets(line, sizeof(line), out));
+    assert(strcmp(line, "1 % % % 1\n") == 0);
+
+    assert(fgets(line, sizeof(line), out));
+    assert(strcmp(line, "1 US AS36459 GitHub,+Inc. 1\n") == 0);
+
+    assert(fgets(line, sizeof(line), out));
+    assert(strcmp(line, "1 AU % % 1\n") == 0);
+
+    assert(!fgets(line, sizeof(line), out));
+    fclose(out);
+
+    // split over threads, the counts are the same.
+
+    std::string many;
+
+    for (unsigned i = 0; i < 150000; ++i)
+    {
+        many += i % 3 ? "1.0.0.7\n" : "8.8.8.8\n";
+    }
+
+    write_file("tmp/many.txt", many.c_str());
+
+    sources.assign(1, "file:tmp/many.txt");
+    options.distinct = false;
+    options.threads = 4;
+    assert(parse_count_fields("country", options.fields));
+
+    out = tmpfile();
+    assert(out);
+
+    count(data, sources, options, false, out);
+    rewind(out);
+
+    assert(fgets(line, sizeof(line), out));
+    assert(strcmp(line, "100000 AU\n") == 0);
+
+    assert(fgets(line, sizeof(line), out));
+    assert(strcmp(line, "50000 US\n") == 0);
+
+    assert(!fgets(line, sizeof(line), out));
+    fclose(out);
+
+
+    // the same region code in two countries makes two groups, and cities
+    // bring their country and region along.
+
+    write_file("tmp/location.csv",
+               "Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n"
+               "locId,country,region,city,postalCode,latitude,longitude,"
+               "metroCode,areaCode\n"
+               "1,\"US\",\"07\",\"Paris\",\"\",33.6609,-95.5555,,\n"
+               "2,\"FR\",\"07\",\"Paris\",\"\",48.8534,2.3488,,\n");
+
+    etl("tmp/blocks.csv", "tmp/location.csv", "tmp/asnum.csv",
+        "tmp/geo_paris.bin");
+
+    GeoData paris;
+    paris.open("tmp/geo_paris.bin");
+
+    const char* expected[][2] = {
+        { "region", "count country region\n2 FR 07\n1 US 07\n" },
+        { "city", "count country region city\n"
+                  "2 FR 07 Paris\n1 US 07 Paris\n" },
+        { "city,country", "count region city country\n"
+                          "2 07 Paris FR\n1 07 Paris US\n" },
+    };
+
+    std::vector<std::string> paris_sources(1,
+        "query:1.0.0.1,1.0.1.1,8.8.8.8,");
+
+    for (size_t i = 0; i < 3; ++i)
+    {
+        CountOptions paris_options;
+        assert(parse_count_fields(expected[i][0], paris_options.fields));
+
+        FILE* paris_out = tmpfile();
+        assert(paris_out);
+
+        count(paris, paris_sources, paris_options, true, paris_out);
+        rewind(paris_out);
+
+        std::string lines;
+
+        while (fgets(line, sizeof(line), paris_out))
+        {
+            lines += line;
+        }
+
+        fclose(paris_out);
+
+        assert(lines == expected[i][1]);
+    }
+    return 0;
+}
+
+static int test_sketch()
+{
+    // a HyperLogLog is within a few standard errors, and merging two
+    // halves gives the same registers as adding both.
+
+    HyperLogLog a;
+    HyperLogLog b;
+    HyperLogLog both;
+
+    for (uint64_t i = 0; i < 100000; ++i)
+    {
+        (i % 2 ? a : b).add(mix64(i));
+        both.add(mix64(i));
+    }
+
+    a.merge(b);
+
+    uint64_t e = a.estimate();
+
+    assert(e > 95000 && e < 105000);
+    assert(e == both.estimate());
+
+    HyperLogLog few;
+    few.add(mix64(1));
+    few.add(mix64(2));
+    few.add(mix64(2));
+
+    assert(few.estimate() == 2);
+
+    // Space-Saving never undercounts, and over by at most the error.
+
+    IPTop top(4);
+    IP6 ip = { 0, 0 };
+
+    for (unsigned i = 0; i < 1000; ++i)
+    {
+        ip.lo = i % 10 < 6 ? 1 : i;
+        top.add(ip);
+    }
+
+    std::vector<IPTop::Counter> counters;
+    top.top(1, counters);
+
+    assert(counters.size() == 1 && counters[0].key.lo == 1);
+    assert(counters[0].count >= 600 &&
+           counters[0].count - counters[0].error <= 600);
+
+    IPTop other(4);
+    ip.lo = 1;
+    other.add(ip, 50);
+    ip.lo = 2;
+    other.add(ip, 700);
+
+    top.merge(other);
+    top.top(2, counters);
+
+    assert(counters.size() == 2);
+
+    for (size_t i = 0; i < counters.size(); ++i)
+    {
+        uint64_t truth = counters[i].key.lo == 1 ? 650 : 700;
+
+        assert(counters[i].key.lo == 1 || counters[i].key.lo == 2);
+        assert(counters[i].count >= truth &&
+               counters[i].count - counters[i].error <= truth);
+    }
+
+    // end to end, split over threads.
+
+    build_test_data("tmp/geo.bin");
+
+    GeoData data;
+    data.open("tmp/geo.bin");
+
+    std::string lines;
+
+    for (unsigned i = 0; i < 150000; ++i)
+    {
+        char line[32];
+        sprintf(line, "%s\n", i % 3 ? "8.8.8.8" : i % 2 ? "1.0.0.1" :
+                                                           "1.0.1.9");
+        lines += line;
+    }
+
+    write_file("tmp/many.txt", lines.c_str());
+
+    SketchOptions options;
+    options.top = 2;
+    options.threads = 3;
+
+    FILE* out = tmpfile();
+    assert(out);
+
+    sketch(data, std::vector<std::string>(1, "file:tmp/many.txt"), options,
+           out);
+    rewind(out);
+
+    const char* expected[] =
+    {
+        "# lines 150000\n",
+        "asn 100000 AS36459 GitHub,+Inc.\n",
+        "asn 25000 % %\n",
+        "city 100000 US CA Mountain+View\n",
+        "city 50000 AU 07 Melbourne\n",
+        "ip 100000 0 8.8.8.8\n",
+        "ip 25000 0 1.0.0.1\n",
+        "country 2 AU\n",
+        "country 1 US\n"
+    };
+
+    char line[256];
+
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i)
+    {
+        assert(fgets(line, sizeof(line), out));
+        assert(strcmp(line, expected[i]) == 0);
+    }
+
+    assert(!fgets(line, sizeof(line), out));
+    fclose(out);
+
+    return 0;
+}
+
+static int test_where()
+{
+    build_test_data("tmp/geo.bin");
+
+    GeoData data;
+    data.open("tmp/geo.bin");
+
+    IPAddress au;
+    IPAddress us;
+    IPAddress none;
+    // 1.0.0.1, 8.8.8.8 and 9.9.9.9.
+
+    au.quad = 16777217;
+    us.quad = 134744072;
+    none.quad = 151587081;
+
+    unsigned au_loc, au_asn, us_loc, us_asn, none_loc, none_asn;
+    data.lookup(au, au_loc, au_asn);
+    data.lookup(us, us_loc, us_asn);
+    data.lookup(none, none_loc, none_asn);
+
+    const LocationTable* locations = &data.location_data();
+    const ASNTable* asns = &data.asn_data();
+
+    std::vector<std::string> unmatched;
+
+    {
+        WhereFilter filter;
+        assert(filter.empty());
+
+        assert(filter.add("country=AU,ZZ", locations, asns, unmatched));
+        assert(!filter.empty());
+        assert(unmatched.size() == 1 && unmatched[0] == "country=ZZ");
+
+        assert(filter.pass(au_loc, au_asn));
+        assert(!filter.pass(us_loc, us_asn));
+        assert(!filter.pass(none_loc, none_asn));
+
+        // predicates are anded, so nothing is both AU and GitHub.
+
+        assert(filter.add("asn=AS36459", locations, asns, unmatched));
+        assert(!filter.pass(au_loc, au_asn));
+        assert(!filter.pass(us_loc, us_asn));
+    }
+
+    {
+        WhereFilter filter;
+
+        assert(filter.add("city=Mountain+View", locations, asns, unmatched));
+        assert(filter.add("asn=36459", locations, asns, unmatched));
+        assert(filter.pass(us_loc, us_asn));
+        assert(!filter.pass(au_loc, au_asn));
+    }
+
+    {
+        WhereFilter filter;
+
+        assert(!filter.add("planet=Mars", locations, asns, unmatched));
+        assert(!filter.add("country", locations, asns, unmatched));
+        assert(!filter.add("asn=GOOG", locations, asns, unmatched));
+    }
+
+    // queries that fail the filter are not counted.
+
+    QueryOptions query_options;
+    query_options.where.push_back("asn=15169");
+
+    WhereFilter where;
+    const WhereFilter* filter = open_filter(data, query_options, where);
+    assert(filter);
+
+    std::vector<std::string> sources;
+    sources.push_back("query:1.0.0.1,8.8.8.8,1.0.0.9,9.9.9.9,");
+
+    CountOptions options;
+    assert(parse_count_fields("country", options.fields));
+
+    FILE* out = tmpfile();
+    assert(out);
+
+    count(data, sources, options, false, out, filter);
+    rewind(out);
+
+    char line[256];
+
+    assert(fgets(line, sizeof(line), out));
+    assert(strcmp(line, "2 AU\n") == 0);
+
+    assert(!fgets(line, sizeof(line), out));
+    fclose(out);
+
+    return 0;
+}
+
+// the lines ranges_results prints for one predicate.
+static std::string ranges_output(const GeoData &data,
+                                 const char* fn,
+                                 const char* predicate,
+                                 bool cidr,
+                                 RangesStats &stats)
+{
+    std::vector<std::string> where(1, predicate);
+
+    WhereFilter filter;
+    assert(open_filter(data, where, filter));
+
+    FILE* out = tmpfile();
+    assert(out);
+
+    ranges_results(data, fn, filter, cidr, out, stats);
+    rewind(out);
+
+    std::string lines;
+    char line[256];
+
+    while (fgets(line, sizeof(line), out))
+    {
+        lines += line;
+    }
+
+    fclose(out);
+
+    return lines;
+}
+
+static int test_ranges()
+{
+    {
+        // an unaligned range takes several prefixes, and everything is
+        // one.
+
+        FILE* out = tmpfile();
+        assert(out);
+
+        RangeWriter<unsigned> writer(true, out);
+        writer.add(1, 3);
+        writer.add(4, 6);
+        writer.flush();
+
+        IP6 zero = { 0, 0 };
+        IP6 max = { ~0ULL, ~0ULL };
+
+        RangeWriter<IP6> writer6(true, out);
+        writer6.add(zero, max);
+        writer6.flush();
+
+        assert(writer.ranges() == 1 && writer6.ranges() == 1);
+
+        rewind(out);
+
+        char line[256];
+        const char* expected[] = { "0.0.0.1/32\n", "0.0.0.2/31\n",
+                                   "0.0.0.4/31\n", "0.0.0.6/32\n",
+                                   "::/0\n" };
+
+        for (size_t i = 0; i < 5; ++i)
+        {
+            assert(fgets(line, sizeof(line), out));
+            assert(strcmp(line, expected[i]) == 0);
+        }
+
+        assert(!fgets(line, sizeof(line), out));
+        fclose(out);
+    }
+
+    ImportOptions options;
+    options.ranges_index = true;
+
+    build_test_data("tmp/geo_index.bin", options);
+    build_test_data("tmp/geo.bin");
+
+    {
+        SectionDirectory dir;
+        assert(dir.open("tmp/geo_index.bin"));
+        assert(dir.find("loc.index") && dir.find("asn.index"));
+        assert(!dir.find("loc6.index"));
+    }
+
+    GeoData indexed;
+    indexed.open("tmp/geo_index.bin");
+
+    GeoData scanned;
+    scanned.open("tmp/geo.bin");
+
+    // both AU blocks, which are neighbours, make one range.
+
+    RangesStats stats;
+    std::string lines = ranges_output(indexed, "tmp/geo_index.bin",
+                                      "country=AU", false, stats);
+
+    assert(lines == "1.0.0.0 1.0.1.255\n");
+    assert(stats.indexed && stats.blocks == 2 && stats.ranges == 1);
+
+    RangesStats scan_stats;
+    assert(ranges_output(scanned, "tmp/geo.bin", "country=AU", false,
+                         scan_stats) == lines);
+    assert(!scan_stats.indexed && scan_stats.blocks == 2);
+
+    assert(ranges_output(indexed, "tmp/geo_index.bin", "asn=AS36459", true,
+                         stats) == "8.8.8.0/24\n");
+    assert(ranges_output(indexed, "tmp/geo_index.bin", "country=AU", true,
+                         stats) == "1.0.0.0/23\n");
+
+    return 0;
+}
+
+// the results of one line of -q, with range queries on.
+static std::vector<IPResult> range_query(const GeoData &data,
+                                         const char* line,
+                                         bool summary)
+{
+    std::vector<std::string> lines(1, line);
+    std::vector<IPResult> results;
+
+    StringInjector reader(lines);
+    IPParser parser(true);
+    IPScanner scanner(data, 0, summary);
+    Collector<IPResult> collector(results);
+
+    reader | parser | scanner | collector;
+    reader.produce();
+
+    return results;
+}
+
+static int test_range_query()
+{
+    build_test_data("tmp/geo.bin");
+
+    GeoData data;
+    data.open("tmp/geo.bin");
+
+    // 16777216 is 1.0.0.0, and 134744064 is 8.8.8.0.
+
+    const BlockTable &blocks = data.location_blocks();
+    assert(blocks.lower_bound(0) == 0);
+    assert(blocks.lower_bound(16777471) == 0);
+    assert(blocks.lower_bound(16777472) == 1);
+    assert(blocks.lower_bound(16777728) == 2);
+    assert(blocks.lower_bound(134744320) == 3);
+
+    // the range is cut wherever the location or asn changes, gaps
+    // included, so the pieces cover it exactly.
+
+    std::vector<IPResult> results =
+        range_query(data, "1.0.0.0-8.8.8.255", false);
+
+    assert(results.size() == 4);
+
+    unsigned starts[] = { 16777216, 16777472, 16777728, 134744064 };
+    unsigned ends[] = { 16777471, 16777727, 134744063, 134744319 };
+
+    for (size_t i = 0; i < 4; ++i)
+    {
+        assert(results[i].range);
+        assert(results[i].quad == starts[i]);
+        assert(results[i].end_quad == ends[i]);
+    }
+
+    assert(strcmp(results[0].country, "AU") == 0 && *results[0].asn == 15169);
+    assert(strcmp(results[1].country, "AU") == 0 && !results[1].asn);
+    assert(!results[2].country && !results[2].asn);
+    assert(strcmp(results[3].country, "US") == 0 && *results[3].asn == 36459);
+
+    // a prefix is clipped to its blocks, and its host bits are dropped.
+
+    results = range_query(data, "1.0.0.9/25", false);
+    assert(results.size() == 1);
+    assert(results[0].quad == 16777216 && results[0].end_quad == 16777343);
+
+    results = range_query(data, "::ffff:8.8.8.128/121", false);
+    assert(results.size() == 1 && results[0].family == IP_V4_MAPPED);
+    assert(results[0].quad == 134744192 && results[0].end_quad == 134744319);
+    assert(strcmp(results[0].city, "Mountain View") == 0);
+
+    // a v6 range that crosses ::ffff:0:0/96 takes that part from the v4
+    // tables, as single addresses do.
+
+    results = range_query(data, "::fffe:ffff:ffff-::ffff:1.0.0.255", false);
+    assert(results.size() == 3);
+    assert(results[0].family == IP_V6 && !results[0].country);
+    assert(results[1].family == IP_V4_MAPPED && !results[1].country);
+    assert(results[1].quad == 0 && results[1].end_quad == 16777215);
+    assert(results[2].family == IP_V4_MAPPED);
+    assert(results[2].quad == 16777216 && results[2].end_quad == 16777471);
+    assert(strcmp(results[2].country, "AU") == 0);
+
+    {
+        IP6 first;
+        IP6 last;
+
+        assert(parse_cidr6("::ffff:1.0.0.9/120", 18, first, last));
+        assert(first.hi == 0 && first.lo == 0xFFFF01000000ULL);
+        assert(last.hi == 0 && last.lo == 0xFFFF010000FFULL);
+        assert(!parse_cidr6("::/129", 6, first, last));
+        assert(!parse_cidr6("::/1.2", 6, first, last));
+    }
+
+    // text after the range is ignored.
+
+    results = range_query(data, "8.8.8.0/24 GET /x", false);
+    assert(results.size() == 1 && results[0].end_quad == 134744319);
+
+    // the summary takes the answer covering the most addresses, ignoring
+    // the ones with none.
+
+    results = range_query(data, "1.0.0.0/16", true);
+    assert(results.size() == 1);
+    assert(results[0].quad == 16777216 && results[0].end_quad == 16842751);
+    assert(strcmp(results[0].country, "AU") == 0 && *results[0].asn == 15169);
+    assert(!results[0].city);
+
+    results = range_query(data, "9.0.0.0/8", true);
+    assert(results.size() == 1 && !results[0].country && !results[0].asn);
+
+    assert(range_query(data, "1.0.0.0/33", false).empty());
+    assert(range_query(data, "1.0.0.9-1.0.0.1", false).empty());
+    assert(range_query(data, "1.0.0.0/", false).empty());
+
+    return 0;
+}
+
+static int test_shm_ring()
+{
+    build_test_data("tmp/geo.bin");
+
+    GeoData data;
+    data.open("tmp/geo.bin");
+
+    // the fingerprint follows the contents, not the name or the size.
+
+    {
+        GeoData again;
+        again.open("tmp/geo.bin");
+
+        assert(again.fingerprint() == data.fingerprint());
+
+        write_file("tmp/delta.csv",
+                   "loc,update,1.0.0.0,1.0.0.255,\"US\",\"CA\","
+                   "\"Mountain View\",37.3860,-122.0838\n");
+        apply_delta("tmp/geo.bin", "tmp/delta.csv", "tmp/geo_delta.bin");
+
+        GeoData changed;
+        changed.open("tmp/geo_delta.bin");
+
+        assert(changed.fingerprint() != data.fingerprint());
+    }
+
+    // the server answers from a child, over a ring it made first, and the
+    // client's results match local queries.
+
+    ShmServer server(data);
+    assert(server.create("tmp/ring.shm"));
+
+    fflush(0);
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+
+    if (pid == 0)
+    {
+        server.serve();
+    }
+
+    {
+        ShmClient client;
+        assert(client.open("tmp/ring.shm"));
+        assert(client.data_id() == data.fingerprint());
+
+        // a batch larger than the ring is split, and a v6 address is
+        // answered locally in between.
+
+        std::vector<std::string> lines;
+
+        for (unsigned i = 0; i < SHM_RING_SLOTS + 10; ++i)
+        {
+            lines.push_back(i % 3 ? "1.0.0.1" : "8.8.8.8");
+        }
+
+        lines.insert(lines.begin() + 7, "::ffff:8.8.8.8");
+
+        std::vector<IPResult> results;
+
+        StringInjector reader(lines);
+        IPParser parser;
+        ShmScanner scanner(data, client);
+        Collector<IPResult> collector(results);
+
+        reader | parser | scanner | collector;
+        reader.produce();
+
+        assert(results.size() == lines.size());
+
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            bool us = lines[i] != "1.0.0.1";
+
+            assert(strcmp(results[i].country, us ? "US" : "AU") == 0);
+            assert(*results[i].asn == (us ? 36459U : 15169U));
+        }
+
+        assert(results[7].family == IP_V4_MAPPED);
+
+        // only one client may hold the ring.
+
+        ShmClient second;
+        assert(!second.open("tmp/ring.shm"));
+    }
+
+    kill(pid, SIGKILL);
+
+    int status = 0;
+    assert(waitpid(pid, &status, 0) == pid);
+
+    return 0;
+}
+
+static int test_map_options()
+{
+    ImportOptions packed;
+    packed.compress_blocks = true;
+
+    build_test_data("tmp/geo.bin");
+    build_test_data("tmp/geo_packed.bin", packed);
+
+    MapOptions options;
+    options.prefault = true;
+    options.lock = true;
+    options.huge = true;
+
+    // prefaulted, locked and huge page copies give the same answers as a
+    // plain mapping. mlock may fail without the privilege, which is only a
+    // warning.
+
+    const char* files[] = { "tmp/geo.bin", "tmp/geo_packed.bin" };
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+        GeoData plain;
+        plain.open(files[i]);
+
+        GeoData loaded;
+        loaded.open(files[i], GEO_ALL, options);
+
+        assert(compare_results(plain, loaded, 0) == 0);
+
+        IPResult result;
+
+        loaded.query(16777217, result);
+        assert(strcmp(result.country, "AU") == 0 && *result.asn == 15169);
+
+        loaded.query(134744072, result);
+        assert(strcmp(result.city, "Mountain View") == 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This file contains a minimal pthread wrapper. Subclass Thread, implement 
+ * run, then start and join it. Mutex and MutexLock are a plain mutex and a 
+ * scoped lock on it.
+*/
+
+#ifndef THREAD_HPP_91D6C5E2
+#define THREAD_HPP_91D6C5E2
+
+#include "macros.hpp"
+#include "error.hpp"
+
+#include <pthread.h>
+#include <unistd.h>
+
+class Thread
+{
+  public:
+    Thread()
+        :
+        thread_(),
+        started_(false)
+    {
+    }
+
+    // a thread must be joined before it is destroyed.
+    virtual ~Thread()
+    {
+    }
+
+    void start()
+    {
+        int rc = pthread_create(&thread_, 0, &Thread::entry, this);
+
+        if (rc != 0)
+        {
+            FATAL_ERROR("could not start thread rc %d", rc);
+        }
+
+        started_ = true;
+    }
+
+    void join()
+    {
+        if (!started_)
+        {
+            return;
+        }
+
+        int rc = pthread_join(thread_, 0);
+        UNUSED(rc);
+
+        started_ = false;
+    }
+
+  protected:
+    virtual void run() = 0;
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(Thread);
+
+    static void* entry(void* self)
+    {
+        ((Thread*) self)->run();
+        return 0;
+    }
+
+    pthread_t thread_;
+    bool started_;
+};
+
+class Mutex
+{
+  public:
+    Mutex()
+    {
+        pthread_mutex_init(&mutex_, 0);
+    }
+
+    ~Mutex()
+    {
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    void lock() { pthread_mutex_lock(&mutex_); }
+    void unlock() { pthread_mutex_unlock(&mutex_); }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(Mutex);
+
+    pthread_mutex_t mutex_;
+};
+
+class MutexLock
+{
+  public:
+    explicit MutexLock(Mutex &mutex)
+        :
+        mutex_(mutex)
+    {
+        mutex_.lock();
+    }
+
+    ~MutexLock()
+    {
+        mutex_.unlock();
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(MutexLock);
+
+    Mutex &mutex_;
+};
+
+inline unsigned cpu_count()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+#endif
@@ -0,0 +1,305 @@
+/*
+ * Copyright 2015 Jason McSweeney
+ * Licensed under BSD 3 Clause - see LICENSE
+ *
+ * author: Jason McSweeney
+ * created: 2026-10-18
+ *
+ * This module filters query results, for geoloc --where, as in
+ *
+ * geoloc -f access.log --where country=US,CN --where asn=15169
+ *
+ * A predicate is field=value[,value...], where field is country, region,
+ * city or asn, and a row passes if its field has any of the values. Rows
+ * must pass every predicate. Values match the strings of the output, so a
+ * + stands for a space, and asns may be given with or without AS.
+ *
+ * Predicates are compiled once, after the database is opened, into one bit
+ * per location and one bit per asn. The names are resolved to string ids
+ * by scanning the interned string tables, and each location's bit is set
+ * from its ids. Filtering a row is then two bit tests on the numbers that
+ * lookup found, before the row is resolved or formatted.
+*/
+
+#ifndef WHERE_HPP_71C3A5E9
+#define WHERE_HPP_71C3A5E9
+
+#include "locations.hpp"
+#include "asns.hpp"
+#include "csv.hpp"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// a set of small integer ids, one bit each.
+class IdSet
+{
+  public:
+    IdSet()
+        :
+        words_()
+    {
+    }
+
+    void resize(size_t n, bool value)
+    {
+        words_.assign((n + 31) / 32, value ? ~0U : 0);
+    }
+
+    size_t size() const
+    {
+        return words_.size() * 32;
+    }
+
+    bool test(size_t i) const
+    {
+        return i < size() && (words_[i / 32] >> (i % 32) & 1);
+    }
+
+    // the first id at or after i in the set, -1 if there is none.
+    size_t next(size_t i) const
+    {
+        for (size_t w = i / 32; w < words_.size(); ++w)
+        {
+            unsigned bits = words_[w];
+
+            if (w == i / 32)
+            {
+                bits &= ~0U << (i % 32);
+            }
+
+            if (bits)
+            {
+                return w * 32 + __builtin_ctz(bits);
+            }
+        }
+
+        return -1;
+    }
+
+    void set(size_t i)
+    {
+        words_[i / 32] |= 1U << (i % 32);
+    }
+
+    void intersect(const IdSet &other)
+    {
+        for (size_t i = 0; i < words_.size(); ++i)
+        {
+            words_[i] &= other.words_[i];
+        }
+    }
+
+  private:
+    std::vector<unsigned> words_;
+};
+
+class WhereFilter
+{
+  public:
+    WhereFilter()
+        :
+        locations_(),
+        asns_(),
+        on_locations_(false),
+        on_asns_(false)
+    {
+    }
+
+    bool empty() const
+    {
+        return !on_locations_ && !on_asns_;
+    }
+
+    // add a predicate, against the tables of the database, which are 0 if
+    // it does not have them. values that match nothing are appended to
+    // unmatched. false if the predicate cannot be parsed.
+    bool add(const char* predicate,
+             const LocationTable* locations,
+             const ASNTable* asns,
+             std::vector<std::string> &unmatched)
+    {
+        LOG_CONTEXT("where %s", predicate);
+
+        const char* eq = strchr(predicate, '=');
+
+        if (!eq || eq[1] == 0)
+        {
+            return false;
+        }
+
+        std::string field(predicate, eq);
+
+        std::vector<char*> values;
+        std::string scratch;
+        csv_split(eq + 1, strlen(eq + 1), scratch, values);
+
+        if (field == "asn")
+        {
+            if (!asns)
+            {
+                FATAL_ERROR("the database has no asns to filter on");
+                return false;
+            }
+
+            return add_asns(values, *asns, unmatched);
+        }
+
+        if (field != "country" && field != "region" && field != "city")
+        {
+            return false;
+        }
+
+        if (!locations)
+        {
+            FATAL_ERROR("the database has no locations to filter on");
+            return false;
+        }
+
+        const MappedStringVector &strings =
+            field == "country" ? locations->country :
+            field == "region" ? locations->region : locations->city;
+
+        // the ids of the values in their string table, which is interned,
+        // so each value has at most one.
+
+        IdSet ids;
+        ids.resize(strings.size(), false);
+
+        for (size_t i = 0; i < values.size(); ++i)
+        {
+            std::string value = unescape(values[i]);
+            bool found = false;
+
+            for (size_t j = 0; j < strings.size(); ++j)
+            {
+                if (value == strings[j])
+                {
+                    ids.set(j);
+                    found = true;
+                }
+            }
+
+            if (!found)
+            {
+                unmatched.push_back(field + "=" + values[i]);
+            }
+        }
+
+        IdSet pass;
+        pass.resize(locations->size(), false);
+
+        for (size_t i = 0; i < locations->size(); ++i)
+        {
+            PackedLocation loc;
+            locations->unpack(i, loc);
+
+            unsigned id = field == "country" ? loc.country :
+                          field == "region" ? loc.region : loc.city;
+
+            if (ids.test(id))
+            {
+                pass.set(i);
+            }
+        }
+
+        restrict(locations_, on_locations_, pass);
+
+        return true;
+    }
+
+    // true if the row with these numbers, -1 for none, passes.
+    bool pass(unsigned loc_idx, unsigned asn_idx) const
+    {
+        return (!on_locations_ || locations_.test(loc_idx)) &&
+               (!on_asns_ || asns_.test(asn_idx));
+    }
+
+    // the locations or asns that pass, 0 if no predicate is on them.
+    const IdSet* locations() const
+    {
+        return on_locations_ ? &locations_ : 0;
+    }
+
+    const IdSet* asns() const
+    {
+        return on_asns_ ? &asns_ : 0;
+    }
+
+  private:
+    bool add_asns(const std::vector<char*> &values,
+                  const ASNTable &asns,
+                  std::vector<std::string> &unmatched)
+    {
+        IdSet pass;
+        pass.resize(asns.asns.size(), false);
+
+        for (size_t i = 0; i < values.size(); ++i)
+        {
+            const char* s = values[i];
+
+            if ((s[0] == 'A' || s[0] == 'a') && (s[1] == 'S' || s[1] == 's'))
+            {
+                s += 2;
+            }
+
+            size_t n = strlen(s);
+
+            if (n == 0 || strspn(s, "0123456789") != n)
+            {
+                return false;
+            }
+
+            unsigned number = to_u(s, n);
+            bool found = false;
+
+            for (size_t j = 0; j < asns.asns.size(); ++j)
+            {
+                if (asns.asns[j].number == number)
+                {
+                    pass.set(j);
+                    found = true;
+                }
+            }
+
+            if (!found)
+            {
+                unmatched.push_back(std::string("asn=") + values[i]);
+            }
+        }
+
+        restrict(asns_, on_asns_, pass);
+
+        return true;
+    }
+
+    static void restrict(IdSet &set, bool &on, const IdSet &pass)
+    {
+        if (on)
+        {
+            set.intersect(pass);
+        }
+        else
+        {
+            set = pass;
+            on = true;
+        }
+    }
+
+    static std::string unescape(const char* s)
+    {
+        std::string out(s);
+        std::replace(out.begin(), out.end(), '+', ' ');
+
+        return out;
+    }
+
+    IdSet locations_;
+    IdSet asns_;
+
+    bool on_locations_;
+    bool on_asns_;
+};
+
+#endif